@@ -202,15 +202,17 @@ void TFJsonSerializer::write(const char *c) {
                 write('t');
                 break;
             default:
-                if (*c < 0x1F) {
+                // Cast to unsigned: UTF-8 continuation bytes are negative if char is signed.
+                if ((unsigned char)*c < 0x20) {
                     write('\\');
                     write('u');
                     write('0');
                     write('0');
-                    if (*c > 10)
-                        write('A' + (*c - 10));
+                    write('0' + (*c >> 4));
+                    if ((*c & 0x0F) >= 10)
+                        write('A' + ((*c & 0x0F) - 10));
                     else
-                        write('0' + (*c));
+                        write('0' + (*c & 0x0F));
                 }
                 else
                     write(*c);
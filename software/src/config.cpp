@@ -1072,6 +1072,22 @@ String ConfigRoot::update(Config::ConfUpdate *val)
     return err;
 }
 
+String ConfigRoot::to_string_except(std::initializer_list<String> keys_to_censor) const
+{
+    if (this->custom_serializer != nullptr)
+        return this->custom_serializer();
+
+    return Config::to_string_except(keys_to_censor);
+}
+
+String ConfigRoot::to_string_except(const std::vector<String> &keys_to_censor) const
+{
+    if (this->custom_serializer != nullptr)
+        return this->custom_serializer();
+
+    return Config::to_string_except(keys_to_censor);
+}
+
 String ConfigRoot::validate()
 {
     if (this->validator != nullptr) {
@@ -451,6 +451,13 @@ public:
     std::function<String(Config &)> validator;
     bool permit_null_updates = true;
 
+    // Used instead of the Config value to serialize states that keep their data in a more compact form.
+    // Set updated to 0xFF after the data was changed, to push the state to the API backends.
+    std::function<String(void)> custom_serializer;
+
+    String to_string_except(std::initializer_list<String> keys_to_censor) const;
+    String to_string_except(const std::vector<String> &keys_to_censor) const;
+
     String update_from_file(File file);
 
     String update_from_cstr(char *c, size_t payload_len);
@@ -19,13 +19,39 @@
 
 #include "event_log.h"
 
+#include "api.h"
 #include "web_server.h"
+#include "task_scheduler.h"
+#include "TFJson.h"
 
 #include "time.h"
 
 #include "tools.h"
 
+#include "modules.h"
+
 extern WebServer server;
+extern TaskScheduler task_scheduler;
+extern API api;
+
+// Constant-initialized, so this is valid before any EventLogTag constructor runs.
+static EventLogTag *first_tag = nullptr;
+
+static ConfigRoot levels;
+static ConfigRoot levels_update;
+
+EventLogTag::EventLogTag(const char *name, uint8_t burst, uint32_t refill_interval_ms) :
+    name(name),
+    level(EVENT_LOG_LEVEL_INFO),
+    burst(burst),
+    tokens(burst),
+    refill_interval_ms(refill_interval_ms),
+    last_refill(0),
+    suppressed(0),
+    next(first_tag)
+{
+    first_tag = this;
+}
 
 void EventLog::setup()
 {
@@ -87,23 +113,35 @@ void EventLog::write(const char *buf, size_t len)
     }
     if (buf[len - 1] != '\n') {
         event_buf.push('\n');
+        ++next_cursor;
     }
+
+    next_cursor += TIMESTAMP_LEN + len;
 }
 
-void EventLog::printfln(const char *fmt, va_list args) {
+void EventLog::vprintfln_prefixed(const char *prefix, const char *fmt, va_list args)
+{
     char buf[256];
     auto buf_size = sizeof(buf) / sizeof(buf[0]);
     memset(buf, 0, buf_size);
 
-    auto written = vsnprintf(buf, buf_size, fmt, args);
+    size_t prefix_len = strlen(prefix);
+    memcpy(buf, prefix, prefix_len);
+
+    auto written = prefix_len + vsnprintf(buf + prefix_len, buf_size - prefix_len, fmt, args);
     if (written >= buf_size) {
         write("Next log message was truncated. Bump EventLog::printfln buffer size!", 69);
-        written = buf_size;
+        written = buf_size - 1;
     }
 
     write(buf, written);
 }
 
+void EventLog::printfln(const char *fmt, va_list args)
+{
+    vprintfln_prefixed("", fmt, args);
+}
+
 void EventLog::printfln(const char *fmt, ...)
 {
     va_list args;
@@ -112,6 +150,65 @@ void EventLog::printfln(const char *fmt, ...)
     va_end(args);
 }
 
+void EventLog::tagged_printfln(EventLogTag *tag, uint8_t level, const char *fmt, ...)
+{
+    uint32_t suppressed;
+
+    {
+        std::lock_guard<std::mutex> lock{tag_mutex};
+
+        uint32_t refills = (millis() - tag->last_refill) / tag->refill_interval_ms;
+        if (refills > 0) {
+            tag->tokens = MIN((uint32_t)tag->burst, tag->tokens + refills);
+            tag->last_refill += refills * tag->refill_interval_ms;
+        }
+
+        if (tag->tokens == 0) {
+            ++tag->suppressed;
+            return;
+        }
+
+        --tag->tokens;
+        suppressed = tag->suppressed;
+        tag->suppressed = 0;
+    }
+
+    if (suppressed > 0)
+        printfln("[%s] %u message%s suppressed", tag->name, suppressed, suppressed == 1 ? "" : "s");
+
+    char prefix[24];
+    snprintf(prefix, ARRAY_SIZE(prefix), "[%s] ", tag->name);
+
+    va_list args;
+    va_start(args, fmt);
+    vprintfln_prefixed(prefix, fmt, args);
+    va_end(args);
+}
+
+EventLogTag *EventLog::find_tag(const char *name)
+{
+    for (EventLogTag *tag = first_tag; tag != nullptr; tag = tag->next)
+        if (strcmp(tag->name, name) == 0)
+            return tag;
+
+    return nullptr;
+}
+
+void EventLog::print_suppressed_counts()
+{
+    for (EventLogTag *tag = first_tag; tag != nullptr; tag = tag->next) {
+        uint32_t suppressed;
+        {
+            std::lock_guard<std::mutex> lock{tag_mutex};
+            suppressed = tag->suppressed;
+            tag->suppressed = 0;
+        }
+
+        if (suppressed > 0)
+            printfln("[%s] %u message%s suppressed", tag->name, suppressed, suppressed == 1 ? "" : "s");
+    }
+}
+
 void EventLog::drop(size_t count)
 {
     char c = '\n';
@@ -122,18 +219,164 @@ void EventLog::drop(size_t count)
         event_buf.pop(&c);
 }
 
+uint32_t EventLog::first_cursor()
+{
+    return next_cursor - event_buf.used();
+}
+
 #define CHUNK_SIZE 1024
 char chunk_buf[CHUNK_SIZE] = {0};
 
+#if MODULE_WS_AVAILABLE()
+static char push_buf[CHUNK_SIZE + 1] = {0};
+
+void EventLog::push_new_lines()
+{
+    if (!ws.web_sockets.haveActiveClient()) {
+        // New clients fetch the current log via /event_log first, so there is no backlog to push.
+        std::lock_guard<std::mutex> lock{event_buf_mutex};
+        last_pushed_cursor = next_cursor;
+        return;
+    }
+
+    while (true) {
+        uint32_t start;
+        uint32_t next;
+
+        {
+            std::lock_guard<std::mutex> lock{event_buf_mutex};
+            auto used = event_buf.used();
+            uint32_t first = first_cursor();
+
+            // The lines were dropped before we could push them. Continue with the oldest line still in the buffer.
+            if (last_pushed_cursor - first > used)
+                last_pushed_cursor = first;
+
+            size_t offset = last_pushed_cursor - first;
+            size_t to_write = MIN(CHUNK_SIZE, used - offset);
+            if (to_write == 0)
+                return;
+
+            for (int i = 0; i < to_write; ++i) {
+                event_buf.peek_offset(push_buf + i, offset + i);
+            }
+            push_buf[to_write] = '\0';
+
+            start = last_pushed_cursor;
+            next = last_pushed_cursor + to_write;
+            last_pushed_cursor = next;
+        }
+
+        auto build = [start, next](char *buf, size_t len) {
+            TFJsonSerializer json{buf, len};
+            json.addObject();
+                json.add("start", start);
+                json.add("next", next);
+                json.add("text", push_buf);
+            json.endObject();
+            return json.end();
+        };
+
+        size_t payload_size = build(nullptr, 0);
+
+        StringWithSettableLength payload;
+        payload.reserve(payload_size);
+        build(payload.begin(), payload_size);
+        payload.setLength(payload_size);
+
+        ws.pushRawStateUpdate(payload, "event_log/message");
+    }
+}
+#else
+void EventLog::push_new_lines()
+{
+}
+#endif
+
+// Rebuilds the levels config from the registered tags. Tags that are unknown
+// (for example of modules not compiled in) are dropped, new tags are added.
+static void update_levels_config()
+{
+    auto &tags = levels.get("tags")->asArray();
+    tags.clear();
+
+    for (EventLogTag *tag = first_tag; tag != nullptr; tag = tag->next) {
+        levels.get("tags")->add();
+        tags.back().get("tag")->updateString(tag->name);
+        tags.back().get("level")->updateUint(tag->level);
+    }
+}
+
+static void apply_levels_config(Config *conf)
+{
+    for (int i = 0; i < conf->get("tags")->count(); ++i) {
+        EventLogTag *tag = logger.find_tag(conf->get("tags")->get(i)->get("tag")->asCStr());
+        if (tag == nullptr)
+            continue;
+
+        tag->level = conf->get("tags")->get(i)->get("level")->asUint();
+    }
+}
+
 void EventLog::register_urls()
 {
+    levels = Config::Object({
+        {"tags", Config::Array({},
+            new Config{Config::Object({
+                {"tag", Config::Str("", 0, 16)},
+                {"level", Config::Uint(EVENT_LOG_LEVEL_INFO, EVENT_LOG_LEVEL_ERROR, EVENT_LOG_LEVEL_DEBUG)}
+            })},
+            0, 32, Config::type_id<Config::ConfObject>()
+        )}
+    });
+
+    update_levels_config();
+    levels_update = levels;
+
+    if (api.restorePersistentConfig("event_log/levels", &levels_update))
+        apply_levels_config(&levels_update);
+
+    update_levels_config();
+
+    api.addState("event_log/levels", &levels, {}, 1000);
+    api.addCommand("event_log/levels_update", &levels_update, {}, [](){
+        apply_levels_config(&levels_update);
+        update_levels_config();
+        API::writeConfig("event_log/levels", &levels);
+    }, false);
+
+    task_scheduler.scheduleWithFixedDelay([this](){
+        print_suppressed_counts();
+    }, 10000, 10000);
+
+    // since is a byte cursor as returned in the X-Event-Log-Cursor header of a previous response.
+    // If it is older than the oldest buffered byte (or from before a reboot), the whole buffer is sent.
+    // X-Event-Log-Start contains the cursor of the first byte sent, so a client can detect whether it missed lines.
     server.on("/event_log", HTTP_GET, [this](WebServerRequest request) {
         std::lock_guard<std::mutex> lock{event_buf_mutex};
         auto used = event_buf.used();
+        uint32_t first = first_cursor();
+        size_t offset = 0;
+
+        String since = request.queryParam("since");
+        if (since.length() > 0) {
+            uint32_t since_cursor = strtoul(since.c_str(), nullptr, 10);
+            // Unsigned arithmetic: since_cursor < first wraps around and is larger than used.
+            if (since_cursor - first <= used)
+                offset = since_cursor - first;
+        }
+
+        // httpd_resp_set_hdr does not copy the values. They have to stay valid until the response is sent.
+        char start_buf[11];
+        char cursor_buf[11];
+        snprintf(start_buf, ARRAY_SIZE(start_buf), "%u", first + offset);
+        snprintf(cursor_buf, ARRAY_SIZE(cursor_buf), "%u", next_cursor);
+        request.addResponseHeader("X-Event-Log-Start", start_buf);
+        request.addResponseHeader("X-Event-Log-Cursor", cursor_buf);
 
         request.beginChunkedResponse(200, "text/plain");
 
-        for (int index = 0; index < used; index += CHUNK_SIZE) {
+        for (int index = offset; index < used; index += CHUNK_SIZE) {
             size_t to_write = MIN(CHUNK_SIZE, used - index);
 
             for (int i = 0; i < to_write; ++i) {
@@ -145,4 +388,10 @@ void EventLog::register_urls()
 
         return request.endChunkedResponse();
     });
+
+#if MODULE_WS_AVAILABLE()
+    task_scheduler.scheduleWithFixedDelay([this](){
+        push_new_lines();
+    }, 250, 250);
+#endif
 }
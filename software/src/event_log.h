@@ -32,6 +32,32 @@
 // Length of a timestamp with two spaces at the end. For example "2022-02-11 12:34:56,789"
 #define TIMESTAMP_LEN 25
 
+#define EVENT_LOG_LEVEL_ERROR 0
+#define EVENT_LOG_LEVEL_WARNING 1
+#define EVENT_LOG_LEVEL_INFO 2
+#define EVENT_LOG_LEVEL_DEBUG 3
+
+// A tag groups the messages of one module. Each tag has its own minimum level
+// (configurable via the event_log/levels API) and its own token bucket to rate limit
+// noisy messages. Tags have to be declared with static storage duration, they
+// register themselves in a global list on construction.
+struct EventLogTag {
+    EventLogTag(const char *name, uint8_t burst = 10, uint32_t refill_interval_ms = 1000);
+
+    const char *name;
+    // Messages with a level greater than this are discarded at the call site.
+    uint8_t level;
+
+    // Token bucket: Allows burst messages at once, then one message per refill_interval_ms.
+    uint8_t burst;
+    uint8_t tokens;
+    uint32_t refill_interval_ms;
+    uint32_t last_refill;
+    uint32_t suppressed;
+
+    EventLogTag *next;
+};
+
 class EventLog
 {
 public:
@@ -53,11 +79,47 @@ public:
     void printfln(const char *fmt, va_list args);
     void printfln(const char *fmt, ...) __attribute__((__format__(__printf__, 2, 3)));
 
+    // Use the log_* macros below instead. They check the level before evaluating any arguments.
+    void tagged_printfln(EventLogTag *tag, uint8_t level, const char *fmt, ...) __attribute__((__format__(__printf__, 4, 5)));
+
+    EventLogTag *find_tag(const char *name);
+    void print_suppressed_counts();
+
     void drop(size_t count);
 
     void register_urls();
 
     void get_timestamp(char buf[TIMESTAMP_LEN + 1]);
 
+    // Byte cursor of the oldest byte still in event_buf.
+    // Must be called with event_buf_mutex held.
+    uint32_t first_cursor();
+
     bool sending_response = false;
+
+    // Monotonically increasing count of all bytes ever written into event_buf.
+    // Clients can pass a cursor to /event_log?since= to only receive new lines.
+    uint32_t next_cursor = 0;
+
+    // Cursor up to which new lines were pushed to websocket clients.
+    uint32_t last_pushed_cursor = 0;
+
+private:
+    void push_new_lines();
+    void vprintfln_prefixed(const char *prefix, const char *fmt, va_list args);
+
+    std::mutex tag_mutex;
 };
+
+extern EventLog logger;
+
+#define log_at_level(tag, lvl, fmt, ...) \
+    do { \
+        if ((tag).level >= (lvl)) \
+            logger.tagged_printfln(&(tag), (lvl), fmt, ##__VA_ARGS__); \
+    } while (0)
+
+#define log_error(tag, fmt, ...) log_at_level(tag, EVENT_LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
+#define log_warning(tag, fmt, ...) log_at_level(tag, EVENT_LOG_LEVEL_WARNING, fmt, ##__VA_ARGS__)
+#define log_info(tag, fmt, ...) log_at_level(tag, EVENT_LOG_LEVEL_INFO, fmt, ##__VA_ARGS__)
+#define log_debug(tag, fmt, ...) log_at_level(tag, EVENT_LOG_LEVEL_DEBUG, fmt, ##__VA_ARGS__)
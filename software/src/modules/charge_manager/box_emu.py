@@ -28,12 +28,15 @@ struct response_packet {
     uint16_t allowed_charging_current;
     uint16_t supported_current;
     bool managed;
+
+    uint8_t request_seq_num;
+    uint16_t request_age_ms;
 } __attribute__ ((packed));
 """
 
 header_format = "<BBH"
 request_format = header_format + "H"
-response_format = header_format + "BBBIIHH?"
+response_format = header_format + "BBBIIHH?BH"
 
 request_len = struct.calcsize(request_format)
 response_len = struct.calcsize(response_format)
@@ -128,13 +131,17 @@ layout.addRow("Managed", resp_managed)
 
 
 next_seq_num = 0
-protocol_version = 3
+protocol_version = 4
+last_request_seq_num = 255
+last_request_at = None
 start = time.time()
 charging_time_start = 0
 
 def recieve():
     global addr
     global charging_time_start
+    global last_request_seq_num
+    global last_request_at
     try:
         data, addr = sock.recvfrom(request_len)
     except BlockingIOError:
@@ -143,6 +150,8 @@ def recieve():
         return
 
     seq_num, version, _, allocated_current = struct.unpack(request_format, data)
+    last_request_seq_num = seq_num
+    last_request_at = time.time()
 
     req_seq_num.setText(str(seq_num))
     req_version.setText(str(version))
@@ -190,7 +199,9 @@ def send():
                     charging_time,
                     resp_allowed_charging_current.value() * 1000,
                     resp_supported_current.value() * 1000,
-                    resp_managed.isChecked())
+                    resp_managed.isChecked(),
+                    last_request_seq_num,
+                    min(65535, int((time.time() - last_request_at) * 1000)))
 
     if not resp_block_seq_num.isChecked():
         next_seq_num += 1
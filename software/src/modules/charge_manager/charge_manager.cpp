@@ -25,6 +25,7 @@
 #include "api.h"
 #include "task_scheduler.h"
 #include "tools.h"
+#include "web_server.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -33,16 +34,18 @@
 #include "modules.h"
 #include "build.h"
 
+#include "current_allocator.h"
+
 #include "ArduinoJson.h"
 
 #include <algorithm>
 
 extern API api;
 extern TaskScheduler task_scheduler;
+extern WebServer server;
 extern char local_uid_str[7];
 
-// Keep in sync with cm_networing.h
-#define MAX_CLIENTS 10
+static EventLogTag charge_manager_log{"charge_manager"};
 
 #define CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE 128
 #define CHARGE_MANAGER_ERROR_EVSE_UNREACHABLE 129
@@ -55,13 +58,37 @@ extern char local_uid_str[7];
 // validator function, so lambda capture lists have to be empty.
 static uint32_t max_avail_current = 0;
 
+// A charger that did not respond for TIMEOUT_MS is unreachable. Its limit is lowered to 0 mA,
+// but its last limit stays reserved for another TIMEOUT_MS: If the new limit does not arrive,
+// the charger blocks by itself after 30 seconds without updates.
 #define TIMEOUT_MS 32000
 
-#define DISTRIBUTION_LOG_LEN 2048
-static char distribution_log[DISTRIBUTION_LOG_LEN] = {0};
+// A charger's link is degraded if it missed this many responses (plus its p99 round trip time)
+// or lost LINK_DEGRADED_LOSS_PERMILLE of its responses. It recovers below LINK_RECOVERED_LOSS_PERMILLE.
+// Chargers with a degraded link keep their limit instead of blocking all chargers.
+#define LINK_DEGRADED_MISSED_RESPONSES 5
+#define LINK_DEGRADED_LOSS_PERMILLE 200
+#define LINK_RECOVERED_LOSS_PERMILLE 100
+
+#define MAX_DISTRIBUTIONS 16
+static_assert(MAX_DISTRIBUTIONS < CURRENT_ALLOCATOR_NO_DISTRIBUTION, "MAX_DISTRIBUTIONS must fit into an uint8_t");
+
+// 16 bytes per entry. A distribution writes about three entries per charger.
+#define DISTRIBUTION_TRACE_LEN 512
 
 #define WATCHDOG_TIMEOUT_MS 30000
 
+// The current is redistributed when a charger's state or the available current changes,
+// but not more often than every DISTRIBUTION_MIN_INTERVAL_MS
+// and at least every DISTRIBUTION_SAFETY_INTERVAL_MS.
+#define DISTRIBUTION_MIN_INTERVAL_MS 1000
+#define DISTRIBUTION_SAFETY_INTERVAL_MS 10000
+// After a charger was throttled, no charger is unthrottled for this time,
+// so that the throttled vehicle can adapt first.
+#define THROTTLE_SETTLE_MS 10000
+// Smaller increases of the available current or of a charger's allocated current are ignored.
+#define DISTRIBUTION_HYSTERESIS_MA 500
+
 #if MODULE_ENERGY_MANAGER_AVAILABLE()
 static void apply_enegry_manager_config(Config &conf)
 {
@@ -107,6 +134,37 @@ ChargeManager::ChargeManager()
         return "";
     }};
 
+    // The chargers are matched with the chargers of charge_manager/config by their host,
+    // because both configs are saved separately. Entries without a host were written
+    // before the host was stored and are matched by their index.
+    // Chargers without an entry are connected to the site directly with all phases.
+    charge_manager_distribution_config = ConfigRoot{Config::Object({
+        {"distributions", Config::Array({},
+            new Config{Config::Object({
+                {"name", Config::Str("", 0, 32)},
+                {"max_current", Config::Uint32(0)} // per phase
+            })},
+            0, MAX_DISTRIBUTIONS, Config::type_id<Config::ConfObject>()
+        )},
+        {"chargers", Config::Array({},
+            new Config{Config::Object({
+                {"host", Config::Str("", 0, 64)},
+                {"phases", Config::Uint(CURRENT_ALLOCATOR_ALL_PHASES, 1, CURRENT_ALLOCATOR_ALL_PHASES)}, // bit mask of the site's phases, bit 0 is L1
+                {"distribution", Config::Int(-1, -1, MAX_DISTRIBUTIONS - 1)} // -1 - connected to the site directly
+            })},
+            0, MAX_CLIENTS, Config::type_id<Config::ConfObject>()
+        )}
+    }), [](Config &conf) -> String {
+        size_t distribution_count = conf.get("distributions")->asArray().size();
+        for (Config &charger : conf.get("chargers")->asArray()) {
+            int32_t distribution = charger.get("distribution")->asInt();
+            if (distribution >= 0 && (size_t)distribution >= distribution_count)
+                return String("Unknown distribution ") + distribution;
+        }
+
+        return "";
+    }};
+
     charge_manager_state = Config::Object({
         {"state", Config::Uint8(0)}, // 0 - not configured, 1 - active, 2 - shutdown
         {"uptime", Config::Uint32(0)},
@@ -126,7 +184,15 @@ ChargeManager::ChargeManager()
                 {"allocated_current", Config::Uint16(0)}, // last current limit send to the charger
 
                 {"state", Config::Uint8(0)}, // 0 - no vehicle, 1 - user blocked, 2 - manager blocked, 3 - car blocked, 4 - charging, 5 - error, 6 - charged
-                {"error", Config::Uint8(0)} // 0 - okay, 1 - unreachable, 2 - FW mismatch, 3 - not managed
+                {"error", Config::Uint8(0)}, // 0 - okay, 1 - unreachable, 2 - FW mismatch, 3 - not managed
+
+                // Round trip times in ms, 65535 if not measured yet
+                {"rtt_min", Config::Uint16(UINT16_MAX)},
+                {"rtt_avg", Config::Uint16(UINT16_MAX)},
+                {"rtt_p99", Config::Uint16(UINT16_MAX)},
+                {"jitter", Config::Uint16(UINT16_MAX)},
+                {"loss", Config::Uint16(0)}, // lost responses in per mille
+                {"link_degraded", Config::Bool(false)}
             })},
             0, MAX_CLIENTS, Config::type_id<Config::ConfObject>()
         )}
@@ -160,7 +226,7 @@ uint8_t get_charge_state(uint8_t charger_state, uint16_t supported_current, uint
     if (charger_state == 2)
         return 3; // Waiting for the car to start charging
 
-    logger.printfln("Unknown state! cs %u sc %u ct %u tac %u", charger_state, supported_current, charging_time, target_allocated_current);
+    log_error(charge_manager_log, "Unknown state! cs %u sc %u ct %u tac %u", charger_state, supported_current, charging_time, target_allocated_current);
     return 5;
 }
 
@@ -175,7 +241,7 @@ void ChargeManager::start_manager_task()
         names.push_back(chargers[i].get("name")->asString());
     }
 
-    cm_networking.register_manager(std::move(hosts), names, [this, chargers](
+    cm_networking.register_manager(std::move(hosts), names, [this](
             uint8_t client_id,
             uint8_t iec61851_state,
             uint8_t charger_state,
@@ -191,8 +257,8 @@ void ChargeManager::start_manager_task()
             // is not working. As last_update will now hang too,
             // the management will stop all charging after some time.
             if (target.get("uptime")->asUint() == uptime) {
-                logger.printfln("Received stale charger state from %s (%s). Reported EVSE uptime (%u) is the same as in the last state. Is the EVSE still reachable?",
-                    chargers[client_id].get("name")->asString().c_str(), chargers[client_id].get("host")->asString().c_str(),
+                log_warning(charge_manager_log, "Received stale charger state from %s (%s). Reported EVSE uptime (%u) is the same as in the last state. Is the EVSE still reachable?",
+                    charger_names[client_id], charger_hosts[client_id],
                     uptime);
                 if (deadline_elapsed(target.get("last_update")->asUint() + 10000)) {
                     target.get("state")->updateUint(5);
@@ -204,61 +270,54 @@ void ChargeManager::start_manager_task()
 
             target.get("uptime")->updateUint(uptime);
 
+            bool changed = false;
+
             // A charger wants to charge if:
             // - the charging time is 0 (it has not charged this vehicle yet), no other slot blocks and we are still in charger state 1 (i.e. blocked by a slot, so the charge management slot)
             // - OR the charger waits for the vehicle to start charging
             // - OR the charger is already charging
             bool wants_to_charge = (charging_time == 0 && supported_current != 0 && charger_state == 1) || charger_state == 2 || charger_state == 3;
-            target.get("wants_to_charge")->updateBool(wants_to_charge);
+            changed |= target.get("wants_to_charge")->updateBool(wants_to_charge);
 
             // A charger wants to charge and has low priority if it has already charged this vehicle and only the charge manager slot blocks.
             bool low_prio = charging_time != 0 && supported_current != 0 && charger_state == 1;
-            target.get("wants_to_charge_low_priority")->updateBool(low_prio);
+            changed |= target.get("wants_to_charge_low_priority")->updateBool(low_prio);
 
-            target.get("is_charging")->updateBool(charger_state == 3);
+            changed |= target.get("is_charging")->updateBool(charger_state == 3);
             target.get("allowed_current")->updateUint(allowed_charging_current);
-            target.get("supported_current")->updateUint(supported_current);
+            changed |= target.get("supported_current")->updateUint(supported_current);
             target.get("last_update")->updateUint(millis());
 
             if (error_state != 0) {
-                target.get("error")->updateUint(CHARGE_MANAGER_CLIENT_ERROR_START + error_state);
+                changed |= target.get("error")->updateUint(CHARGE_MANAGER_CLIENT_ERROR_START + error_state);
             }
 
             auto current_error = target.get("error")->asUint();
             if (current_error < 128 || current_error == CHARGE_MANAGER_ERROR_EVSE_UNREACHABLE) {
-                target.get("error")->updateUint(0);
+                changed |= target.get("error")->updateUint(0);
             }
 
             current_error = target.get("error")->asUint();
             if (current_error == 0 || current_error >= CHARGE_MANAGER_CLIENT_ERROR_START)
-                target.get("state")->updateUint(get_charge_state(charger_state,
-                                                                 supported_current,
-                                                                 charging_time,
-                                                                 target.get("allocated_current")->asUint()));
+                changed |= target.get("state")->updateUint(get_charge_state(charger_state,
+                                                                            supported_current,
+                                                                            charging_time,
+                                                                            target.get("allocated_current")->asUint()));
             charge_manager_state.get("uptime")->updateUint(millis());
+
+            // For example a vehicle was plugged in or started charging.
+            if (changed)
+                request_distribution();
     }, [this](uint8_t client_id, uint8_t error){
         Config &target = charge_manager_state.get("chargers")->asArray()[client_id];
-        target.get("state")->updateUint(5);
-        target.get("error")->updateUint(error);
-    });
-
-    uint32_t cm_send_delay = 1000 / chargers.size();
-
-    task_scheduler.scheduleWithFixedDelay([this, chargers](){
-        static int i = 0;
-
-        if (i >= chargers.size())
-            i = 0;
+        bool changed = target.get("state")->updateUint(5);
+        changed |= target.get("error")->updateUint(error);
 
-        Config &state = charge_manager_state.get("chargers")->asArray()[i];
-        if(cm_networking.send_manager_update(i, state.get("allocated_current")->asUint()))
-            ++i;
-
-    }, cm_send_delay, cm_send_delay);
+        if (changed)
+            request_distribution();
+    });
 }
 
-int idx_array[MAX_CLIENTS] = {0};
-
 void ChargeManager::setup()
 {
     if (!api.restorePersistentConfig("charge_manager/config", &charge_manager_config)) {
@@ -271,6 +330,9 @@ void ChargeManager::setup()
 
     charge_manager_config_in_use = charge_manager_config;
 
+    api.restorePersistentConfig("charge_manager/distribution_config", &charge_manager_distribution_config);
+    charge_manager_distribution_config_in_use = charge_manager_distribution_config;
+
     max_avail_current = charge_manager_config_in_use.get("maximum_available_current")->asUint();
 
     if(!charge_manager_config_in_use.get("enable_charge_manager")->asBool() || charge_manager_config_in_use.get("chargers")->asArray().size() == 0) {
@@ -280,18 +342,88 @@ void ChargeManager::setup()
     charge_manager_state.get("state")->updateUint(1);
 
     charge_manager_available_current.get("current")->updateUint(charge_manager_config_in_use.get("default_available_current")->asUint());
-    for (int i = 0; i < charge_manager_config_in_use.get("chargers")->asArray().size(); ++i) {
+
+    auto &configs = charge_manager_config_in_use.get("chargers")->asArray();
+    for (int i = 0; i < configs.size(); ++i) {
         charge_manager_state.get("chargers")->add();
-        charge_manager_state.get("chargers")->get(i)->get("name")->updateString(charge_manager_config_in_use.get("chargers")->get(i)->get("name")->asString());
-        idx_array[i] = i;
+        charge_manager_state.get("chargers")->get(i)->get("name")->updateString(configs[i].get("name")->asString());
+
+        // charge_manager_config_in_use is not modified anymore, so the strings stay valid.
+        charger_names.push_back(configs[i].get("name")->asCStr());
+        charger_hosts.push_back(configs[i].get("host")->asCStr());
     }
 
-    for (int i = charge_manager_config_in_use.get("chargers")->asArray().size(); i < MAX_CLIENTS; ++i)
-        idx_array[i] = -1;
+    auto &distributions = charge_manager_distribution_config_in_use.get("distributions")->asArray();
+    for (int i = 0; i < distributions.size(); ++i) {
+        distribution_names.push_back(distributions[i].get("name")->asCStr());
+        distribution_max_current.push_back(distributions[i].get("max_current")->asUint());
+    }
+
+    auto &charger_distributions = charge_manager_distribution_config_in_use.get("chargers")->asArray();
+    std::vector<bool> charger_distribution_used(charger_distributions.size(), false);
+    for (int i = 0; i < configs.size(); ++i) {
+        int entry = -1;
+        for (int j = 0; j < charger_distributions.size(); ++j) {
+            if (!charger_distribution_used[j] && charger_distributions[j].get("host")->asString() == configs[i].get("host")->asString()) {
+                entry = j;
+                break;
+            }
+        }
+
+        if (entry < 0 && i < charger_distributions.size() && !charger_distribution_used[i] && charger_distributions[i].get("host")->asString().length() == 0)
+            entry = i;
+
+        if (entry < 0) {
+            if (charger_distributions.size() > 0)
+                logger.printfln("No distribution config for %s (%s). Connecting it to the site with all phases.", charger_names[i], charger_hosts[i]);
+            charger_phases.push_back(CURRENT_ALLOCATOR_ALL_PHASES);
+            charger_distribution.push_back(CURRENT_ALLOCATOR_NO_DISTRIBUTION);
+            continue;
+        }
+
+        charger_distribution_used[entry] = true;
+        int32_t distribution = charger_distributions[entry].get("distribution")->asInt();
+        charger_phases.push_back(charger_distributions[entry].get("phases")->asUint());
+        charger_distribution.push_back(distribution < 0 ? CURRENT_ALLOCATOR_NO_DISTRIBUTION : distribution);
+    }
+
+    for (int j = 0; j < charger_distributions.size(); ++j)
+        if (!charger_distribution_used[j])
+            logger.printfln("Ignoring distribution config entry %d (%s): It matches no configured charger.", j, charger_distributions[j].get("host")->asCStr());
+
+    current_allocator_init(&allocator_state, configs.size(), distributions.size());
+    reserved_until.assign(configs.size(), 0);
+
+    allocator_cfg = CurrentAllocatorConfig{
+        (uint16_t)charge_manager_config_in_use.get("minimum_current")->asUint(),
+        DISTRIBUTION_HYSTERESIS_MA,
+        configs.size(),
+        charger_phases.data(),
+        charger_distribution.data(),
+        distribution_max_current.size(),
+        distribution_max_current.data(),
+        charger_names.data(),
+        charger_hosts.data(),
+        distribution_names.data()
+    };
+
+    // Tracing is cheap, but the buffer is only worth its RAM if someone looks at it.
+    if (charge_manager_config_in_use.get("verbose")->asBool()) {
+        trace_entries.resize(DISTRIBUTION_TRACE_LEN);
+        distribution_trace = CurrentAllocatorTrace{trace_entries.data(), trace_entries.size(), 0, true};
+    }
 
     start_manager_task();
 
-    task_scheduler.scheduleWithFixedDelay([this](){this->distribute_current();}, 10000, 10000);
+    // Safety tick: Also redistribute if nothing changed, for example to detect unreachable chargers.
+    task_scheduler.scheduleWithFixedDelay([this](){
+        bool link_changed = false;
+        for (size_t i = 0; i < charger_names.size(); ++i)
+            link_changed |= this->update_link_state(i);
+
+        if (link_changed || deadline_elapsed(last_distribution + DISTRIBUTION_SAFETY_INTERVAL_MS))
+            this->request_distribution();
+    }, 1000, 1000);
 
     if (charge_manager_config_in_use.get("enable_watchdog")->asBool()) {
         task_scheduler.scheduleWithFixedDelay([this](){this->check_watchdog();}, 1000, 1000);
@@ -312,36 +444,88 @@ void ChargeManager::check_watchdog()
     this->charge_manager_available_current.get("current")->updateUint(default_available_current);
 
     last_available_current_update = millis();
+
+    request_distribution();
+}
+
+// Returns whether the charger's link became degraded or recovered.
+bool ChargeManager::update_link_state(size_t idx)
+{
+    Config &charger = charge_manager_state.get("chargers")->asArray()[idx];
+
+    cm_link_stats link;
+    cm_networking.get_link_stats(idx, &link);
+
+    charger.get("rtt_min")->updateUint(link.rtt_min);
+    charger.get("rtt_avg")->updateUint(link.rtt_avg);
+    charger.get("rtt_p99")->updateUint(link.rtt_p99);
+    charger.get("jitter")->updateUint(link.jitter);
+    charger.get("loss")->updateUint(link.loss);
+
+    bool was_degraded = allocator_state.link_degraded[idx];
+
+    uint32_t missed_responses_timeout = LINK_DEGRADED_MISSED_RESPONSES * CM_SEND_PERIOD_MS;
+    if (link.rtt_p99 != UINT16_MAX)
+        missed_responses_timeout += link.rtt_p99;
+
+    bool degraded = deadline_elapsed(charger.get("last_update")->asUint() + missed_responses_timeout) ||
+                    link.loss >= (was_degraded ? LINK_RECOVERED_LOSS_PERMILLE : LINK_DEGRADED_LOSS_PERMILLE);
+
+    if (degraded == was_degraded)
+        return false;
+
+    allocator_state.link_degraded[idx] = degraded;
+    charger.get("link_degraded")->updateBool(degraded);
+
+    if (degraded)
+        logger.printfln("Link to %s (%s) degraded: %u ms since the last response, %u.%u %% loss. Keeping its current limit.",
+                        charger_names[idx], charger_hosts[idx],
+                        (unsigned)(millis() - charger.get("last_update")->asUint()),
+                        link.loss / 10u, link.loss % 10u);
+    else
+        logger.printfln("Link to %s (%s) recovered.", charger_names[idx], charger_hosts[idx]);
+
+    return true;
 }
 
-#define LOCAL_LOG(fmt, ...) if(verbose) local_log += snprintf(local_log, DISTRIBUTION_LOG_LEN - (local_log - distribution_log), "    " fmt "%c", __VA_ARGS__, '\0');
+void ChargeManager::request_distribution()
+{
+    if (distribution_scheduled)
+        return;
+
+    distribution_scheduled = true;
+
+    uint32_t since_last_distribution = millis() - last_distribution;
+    uint32_t delay = since_last_distribution >= DISTRIBUTION_MIN_INTERVAL_MS ? 0 : DISTRIBUTION_MIN_INTERVAL_MS - since_last_distribution;
+
+    task_scheduler.scheduleOnce([this](){
+        distribution_scheduled = false;
+        this->distribute_current();
+    }, delay);
+}
 
 void ChargeManager::distribute_current()
 {
     uint32_t available_current = charge_manager_available_current.get("current")->asUint();
 
-    static bool verbose = charge_manager_config_in_use.get("verbose")->asBool();
+    last_distribution = millis();
+    last_distributed_available_current = available_current;
 
-    bool print_local_log = false;
-    char *local_log = distribution_log;
-    if (verbose)
-        local_log += snprintf(local_log, DISTRIBUTION_LOG_LEN - (local_log - distribution_log), "Redistributing current%c", '\0');
+    // Readers of the trace only hold the lock while copying a few entries.
+    std::lock_guard<std::mutex> lock{trace_mutex};
+    CurrentAllocatorTrace *trace = &distribution_trace;
+    CA_TRACE(CurrentAllocatorTraceEvent::DistributionStarted, CURRENT_ALLOCATOR_NO_CHARGER, last_distribution, available_current);
 
     auto &chargers = charge_manager_state.get("chargers")->asArray();
-    auto &configs = charge_manager_config_in_use.get("chargers")->asArray();
-
-    uint32_t current_array[MAX_CLIENTS] = {0};
 
     // Handle unreachable EVSEs
     {
-        static bool last_print_local_log_was_error = false;
-
-        // If any EVSE is unreachable or in another error state, we set the available current to 0.
+        // If any EVSE is unreactive or in another error state, we set the available current to 0.
         // The distribution algorithm can then run normally and will block all chargers.
+        // Unreachable chargers only lose their own current, see TIMEOUT_MS.
         bool unreachable_evse_found = false;
         for (int i = 0; i < chargers.size(); ++i) {
             auto &charger = chargers[i];
-            auto &charger_cfg = configs[i];
 
             auto charger_error = charger.get("error")->asUint();
             if (charger_error != CM_NETWORKING_ERROR_NO_ERROR &&
@@ -349,36 +533,47 @@ void ChargeManager::distribute_current()
                 charger_error != CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE &&
                 charger_error < CHARGE_MANAGER_CLIENT_ERROR_START) {
                 unreachable_evse_found = true;
-                LOCAL_LOG("stage 0: %s (%s) reports error %u.", charger_cfg.get("name")->asString().c_str(), charger_cfg.get("host")->asString().c_str(), charger.get("error")->asUint());
-
-                print_local_log = !last_print_local_log_was_error;
-                last_print_local_log_was_error = true;
+                CA_TRACE(CurrentAllocatorTraceEvent::ChargerError, i, charger_error);
             }
 
+            update_link_state(i);
+
             // Charger does not respond anymore
             if (deadline_elapsed(charger.get("last_update")->asUint() + TIMEOUT_MS)) {
-                unreachable_evse_found = true;
-                LOCAL_LOG("stage 0: Can't reach EVSE of %s (%s): last_update too old.",charger_cfg.get("name")->asString().c_str(), charger_cfg.get("host")->asString().c_str());
+                CA_TRACE(CurrentAllocatorTraceEvent::ChargerUnreachable, i);
 
-                if (chargers[i].get("state")->updateUint(5) || charger_error < CHARGE_MANAGER_CLIENT_ERROR_START) {
+                if (chargers[i].get("state")->updateUint(5) || charger_error < CHARGE_MANAGER_CLIENT_ERROR_START)
                     chargers[i].get("error")->updateUint(CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE);
-                    print_local_log = !last_print_local_log_was_error;
-                    last_print_local_log_was_error = true;
+
+                // Lower the limit to 0 mA once. The allocation does not change it while the link is degraded.
+                if (reserved_until[i] == 0) {
+                    allocator_state.reserved_current[i] = charger.get("allocated_current")->asUint();
+                    reserved_until[i] = millis() + TIMEOUT_MS;
+                    charger.get("allocated_current")->updateUint(0);
+                    charger.get("last_sent_config")->updateUint(millis());
+                    cm_networking.send_manager_update(i, 0);
+                } else if (deadline_elapsed(reserved_until[i])) {
+                    allocator_state.reserved_current[i] = 0;
                 }
-            } else if (chargers[i].get("error")->asUint() == CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE) {
+
+                // The reported allowed current is outdated.
+                continue;
+            }
+
+            reserved_until[i] = 0;
+            allocator_state.reserved_current[i] = 0;
+
+            if (chargers[i].get("error")->asUint() == CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE) {
                 chargers[i].get("error")->updateUint(CM_NETWORKING_ERROR_NO_ERROR);
             }
 
             // Charger did not update the charging current in time
             if(charger.get("allocated_current")->asUint() < charger.get("allowed_current")->asUint() && deadline_elapsed(charger.get("last_sent_config")->asUint() + TIMEOUT_MS)) {
                 unreachable_evse_found = true;
-                LOCAL_LOG("stage 0: EVSE of %s (%s) did not react in time.", charger_cfg.get("name")->asString().c_str(), charger_cfg.get("host")->asString().c_str());
+                CA_TRACE(CurrentAllocatorTraceEvent::EVSENonreactive, i);
 
-                if (chargers[i].get("state")->updateUint(5) || charger_error < CHARGE_MANAGER_CLIENT_ERROR_START) {
+                if (chargers[i].get("state")->updateUint(5) || charger_error < CHARGE_MANAGER_CLIENT_ERROR_START)
                     chargers[i].get("error")->updateUint(CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE);
-                    print_local_log = !last_print_local_log_was_error;
-                    last_print_local_log_was_error = true;
-                }
             } else if (chargers[i].get("error")->asUint() == CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE) {
                 chargers[i].get("error")->updateUint(CM_NETWORKING_ERROR_NO_ERROR);
             }
@@ -387,267 +582,132 @@ void ChargeManager::distribute_current()
         if (unreachable_evse_found) {
             // Shut down everything.
             available_current = 0;
-            LOCAL_LOG("%s", "stage 0: Unreachable, unreactive or misconfigured EVSE(s) found. Setting available current to 0 mA.");
+            CA_TRACE(CurrentAllocatorTraceEvent::Shutdown, CURRENT_ALLOCATOR_NO_CHARGER);
             charge_manager_state.get("state")->updateUint(2);
         } else {
             charge_manager_state.get("state")->updateUint(1);
-            if (last_print_local_log_was_error) {
-                last_print_local_log_was_error = false;
-                print_local_log = true;
-            }
         }
     }
 
-    // Sort chargers.
-    {
-        // Sort the chargers by their minimum supported current,
-        // then sort chargers that are already charging before those that
-        // want to charge but are not charging yet.
-        // Sorting by the minimum current allows us to distribute the current "perfectly"
-        // with a single pass over the chargers.
-        int chargers_requesting_current = 0;
-        for (auto &charger : chargers) {
-            if (!charger.get("is_charging")->asBool() && !charger.get("wants_to_charge")->asBool()) {
-                continue;
-            }
-            ++chargers_requesting_current;
-        }
-
-        LOCAL_LOG("%d charger%s request%s current. %u mA available.",
-                  chargers_requesting_current,
-                  chargers_requesting_current == 1 ? "" : "s",
-                  chargers_requesting_current == 1 ? "s" : "",
-                  available_current);
-
-        std::stable_sort(idx_array, idx_array + chargers.size(), [&chargers](int left, int right) {
-            return chargers[left].get("supported_current")->asUint() < chargers[right].get("supported_current")->asUint();
-        });
-
-        std::stable_sort(idx_array, idx_array + chargers.size(), [&chargers](int left, int right) {
-            bool left_charging = chargers[left].get("is_charging")->asBool();
-            bool right_charging = chargers[right].get("is_charging")->asBool();
-            return left_charging && !right_charging;
-        });
+    // Copy the charger states, so that the allocation does not have to look up every value in the config.
+    for (int i = 0; i < chargers.size(); ++i) {
+        auto &charger = chargers[i];
+
+        allocator_state.supported_current[i] = charger.get("supported_current")->asUint();
+        allocator_state.allowed_current[i] = charger.get("allowed_current")->asUint();
+        allocator_state.is_charging[i] = charger.get("is_charging")->asBool();
+        allocator_state.wants_to_charge[i] = charger.get("wants_to_charge")->asBool();
+        allocator_state.wants_to_charge_low_priority[i] = charger.get("wants_to_charge_low_priority")->asBool();
+        allocator_state.allocated_current[i] = charger.get("allocated_current")->asUint();
     }
 
-    // Allocate current to chargers.
-    {
-        // First allocate the minimum supported current to each charger.
-        // Then distribute the rest of the available current to those
-        // that received the minimum.
-        int chargers_allocated_current_to = 0;
-
-        uint16_t current_to_set = charge_manager_config_in_use.get("minimum_current")->asUint();
-        for (int i = 0; i < chargers.size(); ++i) {
-            auto &charger = chargers[idx_array[i]];
-
-            if (!charger.get("is_charging")->asBool() && !charger.get("wants_to_charge")->asBool()) {
-                continue;
-            }
-
-            auto &charger_cfg = configs[idx_array[i]];
-
-            uint16_t supported_current = charger.get("supported_current")->asUint();
-            if (supported_current < current_to_set) {
-                LOCAL_LOG("stage 0: Can't unblock %s (%s): It only supports %u mA, but %u mA is the configured minimum current.",
-                          charger_cfg.get("name")->asString().c_str(),
-                          charger_cfg.get("host")->asString().c_str(),
-                          supported_current,
-                          current_to_set);
-                continue;
-            }
-
-            if (available_current < current_to_set) {
-                LOCAL_LOG("stage 0: %u mA left, but %u mA required to unblock another charger. Blocking all following chargers.",available_current, current_to_set);
-                current_to_set = 0;
-            }
+    if (throttled_recently && deadline_elapsed(last_throttle + THROTTLE_SETTLE_MS))
+        throttled_recently = false;
 
-            if (current_to_set > 0) {
-                ++chargers_allocated_current_to;
-            }
-
-            current_array[idx_array[i]] = current_to_set;
-            available_current -= current_to_set;
-
-            LOCAL_LOG("stage 0: Calculated target for %s (%s) of %u mA. %u mA left.",
-                      charger_cfg.get("name")->asString().c_str(),
-                      charger_cfg.get("host")->asString().c_str(),
-                      current_to_set,
-                      available_current);
-        }
-
-        if (available_current > 0) {
-            LOCAL_LOG("stage 0: %u mA still available. Recalculating targets.", available_current);
-
-            int chargers_reallocated = 0;
-            for (int i = 0; i < chargers.size(); ++i) {
-                if (current_array[idx_array[i]] == 0)
-                    continue;
-
-                auto &charger = chargers[idx_array[i]];
-                uint16_t current_per_charger = MIN(32000, available_current / (chargers_allocated_current_to - chargers_reallocated));
-
-                uint16_t supported_current = charger.get("supported_current")->asUint();
-                // Protect against overflow.
-                if (supported_current < current_array[idx_array[i]])
-                    continue;
-
-                uint16_t current_to_add = MIN(supported_current - current_array[idx_array[i]], current_per_charger);
-
-                ++chargers_reallocated;
-
-                current_array[idx_array[i]] += current_to_add;
-                available_current -= current_to_add;
-
-                auto &charger_cfg = configs[idx_array[i]];
-                LOCAL_LOG("stage 0: Recalculated target for %s (%s) of %u mA. %u mA left.",
-                          charger_cfg.get("name")->asString().c_str(),
-                          charger_cfg.get("host")->asString().c_str(),
-                          current_array[idx_array[i]],
-                          available_current);
-            }
-        }
+    CurrentAllocatorResult result = allocate_current(&allocator_cfg, available_current, !throttled_recently, &allocator_state, trace);
+    if (result == CurrentAllocatorResult::ThrottledCharging) {
+        throttled_recently = true;
+        last_throttle = millis();
     }
 
-    // Wake up chargers that already charged once.
-    {
-        if (available_current > 0) {
-            LOCAL_LOG("stage 0: %u mA still available. Attempting to wake up chargers that already charged their vehicle once.", available_current);
-
-            uint16_t current_to_set = charge_manager_config_in_use.get("minimum_current")->asUint();
-            for (int i = 0; i < chargers.size(); ++i) {
-                auto &charger = chargers[idx_array[i]];
-
-                if (!charger.get("wants_to_charge_low_priority")->asBool()) {
-                    continue;
-                }
-
-                auto &charger_cfg = configs[idx_array[i]];
-
-                uint16_t supported_current = charger.get("supported_current")->asUint();
-                if (supported_current < current_to_set) {
-                    LOCAL_LOG("stage 0: Can't unblock %s (%s): It only supports %u mA, but %u mA is the configured minimum current.",
-                              charger_cfg.get("name")->asString().c_str(),
-                              charger_cfg.get("host")->asString().c_str(),
-                              supported_current,
-                              current_to_set);
-                    continue;
-                }
-
-                if (available_current < current_to_set) {
-                    LOCAL_LOG("stage 0: %u mA left, but %u mA required to unblock another charger. Blocking all following chargers.",available_current, current_to_set);
-                    current_to_set = 0;
-                }
+    // Write back the currents that changed.
+    for (int i = 0; i < chargers.size(); ++i) {
+        if (!allocator_state.allocated_current_changed[i])
+            continue;
 
-                /*if (current_to_set > 0) {
-                    ++chargers_allocated_current_to;
-                }*/
+        auto &charger = chargers[i];
 
-                current_array[idx_array[i]] = current_to_set;
-                available_current -= current_to_set;
+        charger.get("allocated_current")->updateUint(allocator_state.allocated_current[i]);
+        if (charger.get("error")->asUint() != CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE)
+            charger.get("last_sent_config")->updateUint(millis());
 
-                LOCAL_LOG("stage 0: Calculated target for %s (%s) of %u mA. %u mA left.",
-                          charger_cfg.get("name")->asString().c_str(),
-                          charger_cfg.get("host")->asString().c_str(),
-                          current_to_set,
-                          available_current);
-            }
-        }
+        // Sends the new current now. cm_networking repeats it every CM_SEND_PERIOD_MS.
+        cm_networking.send_manager_update(i, allocator_state.allocated_current[i]);
     }
 
-    // Apply current limits.
-    {
-        // First, throttle chargers that have a higher current limit than the calculated one.
-        // If no charger has to be throttled, then also unthrottle other chargers. Skip this
-        // stage if even one charger needs to be throttled to be sure that the available current
-        // is never exceeded.
-        bool skip_stage_2 = false;
-        for (int i = 0; i < chargers.size(); ++i) {
-            auto &charger = chargers[i];
-
-            auto &charger_cfg = configs[i];
-            uint16_t current_to_set = current_array[i];
-
-            bool will_throttle = current_to_set < charger.get("allocated_current")->asUint() || current_to_set < charger.get("allowed_current")->asUint();
-
-            if (!will_throttle) {
-                continue;
-            }
+    // A throttled charger that doesn't charge only has to report its lower limit.
+    // The allowed current does not trigger a distribution, so retry as soon as possible.
+    if (result == CurrentAllocatorResult::ThrottledIdle)
+        request_distribution();
+}
 
-            LOCAL_LOG("stage 1: Throttled %s (%s) to %d mA.",
-                      charger_cfg.get("name")->asString().c_str(),
-                      charger_cfg.get("host")->asString().c_str(),
-                      current_to_set);
+WebServerRequestReturnProtect ChargeManager::send_distribution_trace(WebServerRequest &request)
+{
+    String since_param = request.queryParam("since");
+    uint32_t since = since_param.length() == 0 ? 0 : strtoul(since_param.c_str(), nullptr, 10);
 
-            if (charger.get("allocated_current")->updateUint(current_to_set)) {
-                print_local_log = true;
-                if (charger.get("error")->asUint() != CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE)
-                    charger.get("last_sent_config")->updateUint(millis());
-            }
+    uint32_t first;
+    uint32_t next;
+    {
+        std::lock_guard<std::mutex> lock{trace_mutex};
+        next = distribution_trace.written;
+        first = next > distribution_trace.capacity ? next - distribution_trace.capacity : 0;
+    }
 
-            // Skip stage 2 to wait for the charger to adapt to the now smaller limit.
-            // Some cars are slow to adapt to a new limit. The standard requires them to
-            // react in 5 seconds.
-            // More correct would be to detect whether the throttled current limit
-            // was accepted by the box more than 5 seconds ago (so that we can be sure the timing fits)
-            // However this is complicated and waiting a complete cycle (i.e. 10 seconds)
-            // works good enough.
-            if (!skip_stage_2) {
-                LOCAL_LOG("%s", "stage 1: Throttled a charger. Skipping stage 2");
-                skip_stage_2 = true;
-            }
+    // Entries older than the ring are lost. Restart at the oldest entry like the charge log does.
+    uint32_t start = (since < first || since > next) ? first : since;
+
+    char next_buf[11];
+    snprintf(next_buf, ARRAY_SIZE(next_buf), "%u", next);
+    request.addResponseHeader("X-Distribution-Trace-Next", next_buf);
+
+    // Don't do a chunked response without any chunk. The webserver does strange things in this case
+    if (start == next)
+        return request.send(200, "text/plain; charset=utf-8", "", 0);
+
+    BufferedChunkWriter writer(request);
+    request.beginChunkedResponse(200, "text/plain; charset=utf-8");
+
+    // Copy a few entries at a time, so that a slow client does not block the distribution.
+    CurrentAllocatorTraceEntry entries[16];
+    char line[192];
+    uint32_t n = start;
+    while (n < next) {
+        size_t count = 0;
+        {
+            std::lock_guard<std::mutex> lock{trace_mutex};
+            // The distribution could have overwritten the entries in the meantime.
+            if (distribution_trace.written - n > distribution_trace.capacity)
+                n = distribution_trace.written - distribution_trace.capacity;
+            for (; count < ARRAY_SIZE(entries) && n + count < next; ++count)
+                entries[count] = distribution_trace.entries[(n + count) % distribution_trace.capacity];
         }
 
-        if (!skip_stage_2) {
-            for (int i = 0; i < chargers.size(); ++i) {
-                auto &charger = chargers[i];
-
-                auto &charger_cfg = configs[i];
-                uint16_t current_to_set = current_array[i];
-
-                // > instead of >= to only catch chargers that were not already modified in stage 1.
-                bool will_not_throttle = current_to_set > charger.get("allocated_current")->asUint() || current_to_set > charger.get("allowed_current")->asUint();
-
-                if (!will_not_throttle) {
-                    continue;
-                }
-
-                LOCAL_LOG("stage 2: Unthrottled %s (%s) to %d mA.",
-                          charger_cfg.get("name")->asString().c_str(),
-                          charger_cfg.get("host")->asString().c_str(),
-                          current_to_set);
-
-                if (charger.get("allocated_current")->updateUint(current_to_set)) {
-                    print_local_log = true;
-                    if (charger.get("error")->asUint() != CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE)
-                        charger.get("last_sent_config")->updateUint(millis());
-                }
-            }
-        } else {
-            LOCAL_LOG("%s", "Skipping stage 2");
+        for (size_t i = 0; i < count; ++i) {
+            int len = current_allocator_render_trace_entry(&allocator_cfg, &entries[i], line, sizeof(line) - 1);
+            if (len < 0)
+                continue;
+            len = std::min(len, (int)sizeof(line) - 2);
+            line[len] = '\n';
+            writer.write(line, len + 1);
         }
+        n += count;
     }
 
-    if (print_local_log) {
-        local_log = distribution_log;
-        size_t len = strlen(local_log);
-        while (len > 0) {
-            logger.write(local_log, len);
-            local_log += len + 1;
-            if ((local_log - distribution_log) >= DISTRIBUTION_LOG_LEN)
-                break;
-            len = strlen(local_log);
-        }
-    }
+    writer.flush();
+    return request.endChunkedResponse();
 }
 
 void ChargeManager::register_urls()
 {
     api.addPersistentConfig("charge_manager/config", &charge_manager_config, {}, 1000);
+    api.addPersistentConfig("charge_manager/distribution_config", &charge_manager_distribution_config, {}, 1000);
     api.addState("charge_manager/state", &charge_manager_state, {}, 1000);
     api.addState("charge_manager/available_current", &charge_manager_available_current, {}, 1000);
+
+    // Renders the distribution trace as text. since is the X-Distribution-Trace-Next header of a previous
+    // response. Only entries starting with this number are sent. The trace is only recorded in verbose mode.
+    server.on("/charge_manager/distribution_trace", HTTP_GET, [this](WebServerRequest request) {
+        return this->send_distribution_trace(request);
+    });
     api.addCommand("charge_manager/available_current_update", &charge_manager_available_current, {}, [this](){
         this->last_available_current_update = millis();
+
+        // Always react to less available current. More available current is only distributed
+        // immediately if it's enough to make a difference, otherwise with the next safety tick.
+        uint32_t current = charge_manager_available_current.get("current")->asUint();
+        if (current < last_distributed_available_current || current - last_distributed_available_current >= DISTRIBUTION_HYSTERESIS_MA)
+            this->request_distribution();
     }, false);
 
 }
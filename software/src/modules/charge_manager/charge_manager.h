@@ -19,7 +19,12 @@
 
 #pragma once
 
+#include <mutex>
+
 #include "config.h"
+#include "web_server.h"
+
+#include "current_allocator.h"
 
 class ChargeManager
 {
@@ -35,11 +40,15 @@ public:
     void start_evse_state_update();
     void send_current();
     void distribute_current();
+    // Schedules distribute_current, rate limited to DISTRIBUTION_MIN_INTERVAL_MS.
+    void request_distribution();
     void start_manager_task();
     void check_watchdog();
 
     ConfigRoot charge_manager_config;
     ConfigRoot charge_manager_config_in_use;
+    ConfigRoot charge_manager_distribution_config;
+    ConfigRoot charge_manager_distribution_config_in_use;
 
     ConfigRoot charge_manager_state;
 
@@ -50,4 +59,31 @@ public:
     String buf;
 
     uint32_t last_available_current_update = 0;
+
+private:
+    uint32_t last_distribution = 0;
+    uint32_t last_distributed_available_current = 0;
+    bool distribution_scheduled = false;
+
+    uint32_t last_throttle = 0;
+    bool throttled_recently = false;
+
+    WebServerRequestReturnProtect send_distribution_trace(WebServerRequest &request);
+    bool update_link_state(size_t idx);
+
+    CurrentAllocatorConfig allocator_cfg = {};
+    CurrentAllocatorState allocator_state;
+    // When the last limit of an unreachable charger is not reserved anymore. 0 while the charger is reachable.
+    std::vector<uint32_t> reserved_until;
+
+    std::vector<CurrentAllocatorTraceEntry> trace_entries;
+    CurrentAllocatorTrace distribution_trace = {nullptr, 0, 0, false};
+    std::mutex trace_mutex;
+
+    std::vector<const char *> charger_names;
+    std::vector<const char *> charger_hosts;
+    std::vector<uint8_t> charger_phases;
+    std::vector<uint8_t> charger_distribution;
+    std::vector<const char *> distribution_names;
+    std::vector<uint32_t> distribution_max_current;
 };
@@ -0,0 +1,800 @@
+#!/usr/bin/env python3
+
+# Simulates a charge manager and N chargers on one Linux host.
+#
+# The chargers speak protocol version 4 (see cm_networking/cm_protocol.h) or, with --v3-probability, version 3 over loopback UDP.
+# Charger i listens on 127.0.1.(i+1):34128, the manager on 127.0.0.1:34127,
+# so every charger has its own address like on a real network.
+#
+# The firmware's current_allocator.cpp and cm_networking/cm_protocol.cpp are built with g++ and loaded with ctypes:
+# The allocation, the packet checks (size, version, stale sequence numbers) and the link quality
+# (response loss and round trip time) are the firmware's code.
+#
+# Everything else is reimplemented in Python and only mirrors the firmware:
+# The socket handling, sending and resolving of cm_networking.cpp, and the parts of charge_manager.cpp
+# around the allocation (charger state derivation, degraded links, unreachable and unreactive EVSE detection).
+# Regressions in that C++ code are NOT covered by this simulation.
+#
+# Example:
+#   ./cm_sim.py --chargers 64 --duration 300 --speedup 10 --step 120:64000 --step 200:200000
+#   ./cm_sim.py --chargers 30 --single-phase-probability 0.5 --distribution 100000 --distribution 63000
+#   ./cm_sim.py --chargers 20 --loss 0.3 --unreachable-probability 0.5
+#
+# All times on the command line are in simulated seconds.
+#
+# --record FILE writes the inputs and results of every allocation to FILE.
+# test/current_allocator/current_allocator_test replays the files in test/current_allocator/recordings.
+
+import argparse
+import ctypes
+import os
+import random
+import select
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+PROTOCOL_VERSION = 4
+CHARGE_MANAGER_PORT = 34127
+CHARGE_MANAGEMENT_PORT = CHARGE_MANAGER_PORT + 1
+
+header_format = "<BBH"
+request_format = header_format + "H"
+response_format = header_format + "BBBIIHH?BH"
+# Version 3 responses don't echo the request.
+response_format_v3 = header_format + "BBBIIHH?"
+
+request_len = struct.calcsize(request_format)
+response_len = struct.calcsize(response_format)
+
+# Keep in sync with cm_protocol.h
+CM_SEND_PERIOD_MS = 1000
+CM_NETWORK_TASK_MAX_SLEEP_MS = 100
+CM_PACKET_OK = 0
+
+# Keep in sync with current_allocator.h
+ALL_PHASES = 0x07
+NO_DISTRIBUTION = 255
+# CurrentAllocatorResult
+ALLOCATOR_THROTTLED_IDLE = 1
+ALLOCATOR_THROTTLED_CHARGING = 2
+
+# Keep in sync with charge_manager.cpp
+TIMEOUT_MS = 32000
+LINK_DEGRADED_MISSED_RESPONSES = 5
+LINK_DEGRADED_LOSS_PERMILLE = 200
+LINK_RECOVERED_LOSS_PERMILLE = 100
+DISTRIBUTION_MIN_INTERVAL_MS = 1000
+DISTRIBUTION_SAFETY_INTERVAL_MS = 10000
+THROTTLE_SETTLE_MS = 10000
+DISTRIBUTION_HYSTERESIS_MA = 500
+CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE = 128
+CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE = 130
+
+# Keep in sync with evse.cpp and evse_v2.cpp
+EVSE_MANAGED_CURRENT_TIMEOUT_MS = 30000
+
+SHIM_SOURCE = r"""
+#include "current_allocator.h"
+#include "cm_protocol.h"
+
+#include <string.h>
+
+extern "C" {
+
+uint8_t sim_protocol_version()
+{
+    return PROTOCOL_VERSION;
+}
+
+size_t sim_packet_size(bool response, uint8_t version)
+{
+    return cm_packet_size(response, version);
+}
+
+uint8_t sim_check_packet(const uint8_t *buf, size_t len, bool response, uint8_t last_seen_seq_num)
+{
+    packet_header header = {};
+    memcpy(&header, buf, len < sizeof(header) ? len : sizeof(header));
+    return cm_check_packet(&header, len, response, last_seen_seq_num);
+}
+
+void *sim_link_quality_new()
+{
+    cm_link_quality *q = new cm_link_quality;
+    cm_link_quality_init(q);
+    return q;
+}
+
+void sim_link_quality_request_sent(void *q, uint8_t seq_num, uint32_t sent_at)
+{
+    cm_link_quality_request_sent((cm_link_quality *)q, seq_num, sent_at);
+}
+
+// buf must hold sizeof(response_packet) bytes, also for the shorter responses of older versions.
+void sim_link_quality_response_received(void *q, const uint8_t *buf, uint32_t received_at)
+{
+    response_packet response;
+    memcpy(&response, buf, sizeof(response));
+    cm_link_quality_response_received((cm_link_quality *)q, &response, received_at);
+}
+
+void sim_link_quality_get_stats(void *q, cm_link_stats *stats)
+{
+    cm_link_quality_get_stats((cm_link_quality *)q, stats);
+}
+
+void *sim_allocator_new(size_t charger_count, size_t distribution_count)
+{
+    CurrentAllocatorState *state = new CurrentAllocatorState;
+    current_allocator_init(state, charger_count, distribution_count);
+    return state;
+}
+
+size_t sim_allocate(void *p, uint16_t minimum_current, uint16_t unthrottle_hysteresis, uint32_t available_current, bool may_unthrottle,
+                    uint8_t *result, size_t charger_count,
+                    const uint8_t *charger_phases, const uint8_t *charger_distribution,
+                    size_t distribution_count, const uint32_t *distribution_max_current,
+                    const char *const *names, const char *const *hosts, const char *const *distribution_names,
+                    const uint16_t *supported_current, const uint16_t *allowed_current,
+                    const uint8_t *is_charging, const uint8_t *wants_to_charge, const uint8_t *wants_to_charge_low_priority,
+                    const uint8_t *link_degraded, const uint16_t *reserved_current,
+                    uint16_t *allocated_current, uint16_t *target_current, uint8_t *allocated_current_changed,
+                    char *log_buf, size_t log_len, bool verbose)
+{
+    CurrentAllocatorState *state = (CurrentAllocatorState *)p;
+
+    for (size_t i = 0; i < charger_count; ++i) {
+        state->supported_current[i] = supported_current[i];
+        state->allowed_current[i] = allowed_current[i];
+        state->is_charging[i] = is_charging[i];
+        state->wants_to_charge[i] = wants_to_charge[i];
+        state->wants_to_charge_low_priority[i] = wants_to_charge_low_priority[i];
+        state->link_degraded[i] = link_degraded[i];
+        state->reserved_current[i] = reserved_current[i];
+        state->allocated_current[i] = allocated_current[i];
+    }
+
+    CurrentAllocatorConfig cfg{minimum_current, unthrottle_hysteresis, charger_count,
+                               charger_phases, charger_distribution,
+                               distribution_count, distribution_max_current,
+                               names, hosts, distribution_names};
+    static CurrentAllocatorTraceEntry entries[4096];
+    CurrentAllocatorTrace trace{entries, sizeof(entries) / sizeof(entries[0]), 0, verbose};
+    *result = (uint8_t)allocate_current(&cfg, available_current, may_unthrottle, state, &trace);
+
+    // Render the trace like the charge_manager/distribution_trace endpoint does, but null-terminated.
+    size_t log_used = 0;
+    for (uint32_t i = 0; i < trace.written && i < trace.capacity; ++i) {
+        int len = current_allocator_render_trace_entry(&cfg, &entries[i], log_buf + log_used, log_len - log_used);
+        if (len < 0 || (size_t)len >= log_len - log_used)
+            break;
+        log_used += len + 1;
+    }
+
+    for (size_t i = 0; i < charger_count; ++i) {
+        allocated_current[i] = state->allocated_current[i];
+        target_current[i] = state->target_current[i];
+        allocated_current_changed[i] = state->allocated_current_changed[i];
+    }
+
+    return log_used;
+}
+
+}
+"""
+
+
+class LinkStats(ctypes.Structure):
+    _fields_ = [("rtt_min", ctypes.c_uint16),
+                ("rtt_avg", ctypes.c_uint16),
+                ("rtt_p99", ctypes.c_uint16),
+                ("jitter", ctypes.c_uint16),
+                ("loss", ctypes.c_uint16)]
+
+
+def build_firmware_lib():
+    src_dir = os.path.dirname(os.path.abspath(__file__))
+    networking_dir = os.path.join(os.path.dirname(src_dir), "cm_networking")
+    build_dir = tempfile.mkdtemp(prefix="cm_sim_")
+    shim_path = os.path.join(build_dir, "shim.cpp")
+    lib_path = os.path.join(build_dir, "libcm_sim.so")
+
+    with open(shim_path, "w") as f:
+        f.write(SHIM_SOURCE)
+
+    subprocess.check_call(["g++", "-std=gnu++17", "-O2", "-shared", "-fPIC", "-I" + src_dir, "-I" + networking_dir,
+                           "-o", lib_path, shim_path, os.path.join(src_dir, "current_allocator.cpp"),
+                           os.path.join(networking_dir, "cm_protocol.cpp")])
+
+    lib = ctypes.CDLL(lib_path)
+    lib.sim_protocol_version.restype = ctypes.c_uint8
+    lib.sim_packet_size.restype = ctypes.c_size_t
+    lib.sim_packet_size.argtypes = [ctypes.c_bool, ctypes.c_uint8]
+    lib.sim_check_packet.restype = ctypes.c_uint8
+    lib.sim_check_packet.argtypes = [ctypes.c_char_p, ctypes.c_size_t, ctypes.c_bool, ctypes.c_uint8]
+    lib.sim_link_quality_new.restype = ctypes.c_void_p
+    lib.sim_link_quality_request_sent.argtypes = [ctypes.c_void_p, ctypes.c_uint8, ctypes.c_uint32]
+    lib.sim_link_quality_response_received.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_uint32]
+    lib.sim_link_quality_get_stats.argtypes = [ctypes.c_void_p, ctypes.POINTER(LinkStats)]
+
+    if (lib.sim_protocol_version() != PROTOCOL_VERSION or lib.sim_packet_size(False, PROTOCOL_VERSION) != request_len or
+            lib.sim_packet_size(True, PROTOCOL_VERSION) != response_len or lib.sim_packet_size(True, 3) != struct.calcsize(response_format_v3)):
+        sys.exit("The packet formats of cm_sim.py don't match cm_protocol.h")
+
+    lib.sim_allocator_new.restype = ctypes.c_void_p
+    lib.sim_allocator_new.argtypes = [ctypes.c_size_t, ctypes.c_size_t]
+    lib.sim_allocate.restype = ctypes.c_size_t
+    lib.sim_allocate.argtypes = [ctypes.c_void_p, ctypes.c_uint16, ctypes.c_uint16, ctypes.c_uint32, ctypes.c_bool,
+                                 ctypes.POINTER(ctypes.c_uint8), ctypes.c_size_t,
+                                 ctypes.POINTER(ctypes.c_uint8), ctypes.POINTER(ctypes.c_uint8),
+                                 ctypes.c_size_t, ctypes.POINTER(ctypes.c_uint32),
+                                 ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(ctypes.c_char_p), ctypes.POINTER(ctypes.c_char_p),
+                                 ctypes.POINTER(ctypes.c_uint16), ctypes.POINTER(ctypes.c_uint16),
+                                 ctypes.POINTER(ctypes.c_uint8), ctypes.POINTER(ctypes.c_uint8), ctypes.POINTER(ctypes.c_uint8),
+                                 ctypes.POINTER(ctypes.c_uint8), ctypes.POINTER(ctypes.c_uint16),
+                                 ctypes.POINTER(ctypes.c_uint16), ctypes.POINTER(ctypes.c_uint16), ctypes.POINTER(ctypes.c_uint8),
+                                 ctypes.c_char_p, ctypes.c_size_t, ctypes.c_bool]
+    return lib
+
+
+class Clock:
+    def __init__(self, speedup):
+        self.speedup = speedup
+        self.start = time.monotonic()
+
+    # Simulated milliseconds since the start
+    def ms(self):
+        return int((time.monotonic() - self.start) * 1000 * self.speedup)
+
+    def real_seconds(self, sim_ms):
+        return max(0, sim_ms) / 1000 / self.speedup
+
+
+class Charger:
+    """EVSE and vehicle. charger_state is the vehicle state of the EVSE API:
+    0 not connected, 1 waiting for release, 2 ready, 3 charging, 4 error."""
+
+    def __init__(self, idx, lib, rng, args):
+        self.idx = idx
+        self.lib = lib
+        self.addr = ("127.0.1.{}".format(idx + 1), CHARGE_MANAGEMENT_PORT)
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(self.addr)
+        self.sock.setblocking(False)
+
+        self.rng = rng
+        self.loss = args.loss
+        self.next_seq_num = 0
+        self.last_seen_seq_num = 255
+        self.last_request_at = 0
+        self.manager_addr = None
+        self.next_send = rng.randint(0, 1000)
+        # Chargers with older firmware
+        self.protocol_version = 3 if rng.random() < args.v3_probability else PROTOCOL_VERSION
+
+        self.supported_current = rng.choice([16000, 20000, 32000])
+
+        # Single phase chargers are connected to L1, L2 and L3 in turn.
+        self.phases = 1 << (idx % 3) if rng.random() < args.single_phase_probability else ALL_PHASES
+        self.distribution = idx % len(args.distribution) if len(args.distribution) > 0 else NO_DISTRIBUTION
+        self.allocated_current = 0
+        self.allowed_current = 0
+        self.charger_state = 0
+        self.charging_start = None
+
+        duration_ms = args.duration * 1000
+        # Vehicle behaviour, all in simulated ms
+        self.plug_in_at = rng.randint(0, duration_ms // 4)
+        self.start_delay = rng.randint(1000, 5000)
+        self.ready_since = None
+        self.unplug_at = self.plug_in_at + rng.randint(duration_ms // 2, duration_ms * 2)
+        self.pause = None
+        if rng.random() < args.pause_probability:
+            start = rng.randint(self.plug_in_at, self.plug_in_at + duration_ms // 2)
+            self.pause = (start, start + rng.randint(10000, 60000))
+        self.unreachable = None
+        if rng.random() < args.unreachable_probability:
+            start = rng.randint(0, duration_ms)
+            self.unreachable = (start, start + rng.randint(5000, 60000))
+
+    def is_unreachable(self, now):
+        return self.unreachable is not None and self.unreachable[0] <= now < self.unreachable[1]
+
+    def update(self, now):
+        # Without updates from the manager, the EVSE blocks by itself.
+        if now - self.last_request_at > EVSE_MANAGED_CURRENT_TIMEOUT_MS:
+            self.allocated_current = 0
+
+        # The EVSE applies the manager's limit immediately.
+        self.allowed_current = min(self.allocated_current, self.supported_current)
+
+        if now < self.plug_in_at or now >= self.unplug_at:
+            self.charger_state = 0
+            self.charging_start = None
+            self.ready_since = None
+            return
+
+        if self.allowed_current == 0:
+            self.charger_state = 1
+            self.ready_since = None
+            return
+
+        if self.ready_since is None:
+            self.ready_since = now
+
+        paused = self.pause is not None and self.pause[0] <= now < self.pause[1]
+        if paused or now - self.ready_since < self.start_delay:
+            self.charger_state = 2
+            return
+
+        self.charger_state = 3
+        if self.charging_start is None:
+            self.charging_start = now
+
+    def receive(self, now, stats):
+        try:
+            data, addr = self.sock.recvfrom(request_len + 1)
+        except BlockingIOError:
+            return
+        if self.is_unreachable(now) or self.rng.random() < self.loss:
+            return
+        if self.lib.sim_check_packet(data, len(data), False, self.last_seen_seq_num) != CM_PACKET_OK:
+            return
+
+        seq_num, version, _, allocated_current = struct.unpack(request_format, data)
+
+        self.last_seen_seq_num = seq_num
+        self.last_request_at = now
+        self.manager_addr = addr
+
+        # Time from plugging in until the charger was allowed to charge
+        if self.allocated_current == 0 and allocated_current != 0 and self.plug_in_at <= now < self.unplug_at and self.charging_start is None:
+            stats.unblock_ms.append(now - self.plug_in_at)
+
+        self.allocated_current = allocated_current
+
+    def send(self, now, stats):
+        if now < self.next_send:
+            return
+        self.next_send += 1000
+
+        self.update(now)
+
+        if self.manager_addr is None or self.is_unreachable(now):
+            return
+
+        charging_time = 0 if self.charging_start is None else now - self.charging_start
+        iec61851_state = {0: 0, 1: 1, 2: 1, 3: 2, 4: 4}[self.charger_state]
+        values = [self.next_seq_num, self.protocol_version, 0,
+                  iec61851_state, self.charger_state, 0, now + 1, charging_time,
+                  self.allowed_current, self.supported_current, True]
+        if self.protocol_version >= 4:
+            b = struct.pack(response_format, *values, self.last_seen_seq_num, min(now - self.last_request_at, 65535))
+        else:
+            b = struct.pack(response_format_v3, *values)
+        self.next_seq_num = (self.next_seq_num + 1) % 256
+        stats.responses_sent += 1
+        if self.rng.random() < self.loss:
+            return
+        self.sock.sendto(b, self.manager_addr)
+
+
+class ChargerState:
+    def __init__(self):
+        self.last_update = 0
+        self.uptime = 0
+        self.supported_current = 0
+        self.allowed_current = 0
+        self.wants_to_charge = False
+        self.wants_to_charge_low_priority = False
+        self.is_charging = False
+        self.last_sent_config = 0
+        self.allocated_current = 0
+        self.target_current = 0
+        self.error = 0
+        self.link_degraded = False
+        self.reserved_current = 0
+        self.reserved_until = None
+
+
+class Manager:
+    def __init__(self, chargers, lib, args):
+        self.lib = lib
+        self.args = args
+        self.charger_count = len(chargers)
+        self.charger_addrs = [c.addr for c in chargers]
+        self.addr_to_idx = {addr: i for i, addr in enumerate(self.charger_addrs)}
+
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(("127.0.0.1", CHARGE_MANAGER_PORT))
+        self.sock.setblocking(False)
+
+        self.states = [ChargerState() for _ in range(self.charger_count)]
+        self.link_qualities = [lib.sim_link_quality_new() for _ in range(self.charger_count)]
+        self.next_seq_num = [1] * self.charger_count
+        self.last_seen_seq_num = [255] * self.charger_count
+        # Spread over the send period like cm_networking does.
+        self.next_send = [CM_NETWORK_TASK_MAX_SLEEP_MS + i * CM_SEND_PERIOD_MS // self.charger_count for i in range(self.charger_count)]
+        self.available_current = args.available_current
+
+        self.last_distribution = 0
+        self.last_distributed_available_current = 0
+        # Time of the requested distribution or None
+        self.distribution_due = None
+        self.last_throttle = 0
+        self.throttled_recently = False
+
+        distribution_count = len(args.distribution)
+        self.allocator = lib.sim_allocator_new(self.charger_count, distribution_count)
+        self.names = (ctypes.c_char_p * self.charger_count)(*["charger {}".format(i).encode() for i in range(self.charger_count)])
+        self.hosts = (ctypes.c_char_p * self.charger_count)(*["{}".format(a[0]).encode() for a in self.charger_addrs])
+        self.phases = (ctypes.c_uint8 * self.charger_count)(*[c.phases for c in chargers])
+        self.distribution = (ctypes.c_uint8 * self.charger_count)(*[c.distribution for c in chargers])
+        self.distribution_count = distribution_count
+        self.distribution_max_current = (ctypes.c_uint32 * max(1, distribution_count))(*args.distribution)
+        self.distribution_names = (ctypes.c_char_p * max(1, distribution_count))(*["distribution {}".format(d).encode() for d in range(distribution_count)])
+
+        # See run_recording in test/current_allocator/current_allocator_test.cpp for the format.
+        self.record = None
+        if args.record is not None:
+            self.record = open(args.record, "w")
+            self.record.write("# cm_sim.py {}\n".format(" ".join(sys.argv[1:])))
+            self.record.write("{} {} {} {}\n".format(self.charger_count, args.minimum_current, DISTRIBUTION_HYSTERESIS_MA,
+                                                   " ".join(str(d) for d in [distribution_count] + args.distribution)))
+            for c in chargers:
+                self.record.write("{} {}\n".format(c.phases, c.distribution))
+
+    def receive(self, now, stats):
+        # Drain the socket like the network task of cm_networking does when select reports it readable.
+        for _ in range(2 * self.charger_count):
+            try:
+                data, addr = self.sock.recvfrom(response_len + 1)
+            except BlockingIOError:
+                return
+            stats.responses_received += 1
+            if addr not in self.addr_to_idx:
+                continue
+
+            idx = self.addr_to_idx[addr]
+            if self.lib.sim_check_packet(data, len(data), True, self.last_seen_seq_num[idx]) != CM_PACKET_OK:
+                continue
+
+            data = data.ljust(response_len, b"\0")
+            (seq_num, version, _, iec61851_state, charger_state, error_state, uptime, charging_time,
+             allowed_charging_current, supported_current, managed, _, _) = struct.unpack(response_format, data)
+
+            self.last_seen_seq_num[idx] = seq_num
+            self.lib.sim_link_quality_response_received(self.link_qualities[idx], data, now)
+            if not managed:
+                continue
+
+            s = self.states[idx]
+            if s.uptime == uptime:
+                continue
+            s.uptime = uptime
+
+            old = (s.wants_to_charge, s.wants_to_charge_low_priority, s.is_charging, s.supported_current, s.error)
+            s.wants_to_charge = (charging_time == 0 and supported_current != 0 and charger_state == 1) or charger_state in (2, 3)
+            s.wants_to_charge_low_priority = charging_time != 0 and supported_current != 0 and charger_state == 1
+            s.is_charging = charger_state == 3
+            s.allowed_current = allowed_charging_current
+            s.supported_current = supported_current
+            s.last_update = now
+            if s.error < 128:
+                s.error = 0
+
+            if old != (s.wants_to_charge, s.wants_to_charge_low_priority, s.is_charging, s.supported_current, s.error):
+                self.request_distribution(now)
+
+    def link_stats(self, idx):
+        link = LinkStats()
+        self.lib.sim_link_quality_get_stats(self.link_qualities[idx], ctypes.byref(link))
+        return link
+
+    # Returns whether a charger's link became degraded or recovered.
+    def update_links(self, now, stats):
+        changed = False
+        for idx, s in enumerate(self.states):
+            link = self.link_stats(idx)
+            missed_responses_timeout = LINK_DEGRADED_MISSED_RESPONSES * CM_SEND_PERIOD_MS
+            if link.rtt_p99 != 0xFFFF:
+                missed_responses_timeout += link.rtt_p99
+            degraded = (now - s.last_update > missed_responses_timeout or
+                        link.loss >= (LINK_RECOVERED_LOSS_PERMILLE if s.link_degraded else LINK_DEGRADED_LOSS_PERMILLE))
+            if degraded != s.link_degraded:
+                s.link_degraded = degraded
+                changed = True
+                if degraded:
+                    stats.degraded_links += 1
+        return changed
+
+    def request_distribution(self, now):
+        if self.distribution_due is None:
+            self.distribution_due = max(now, self.last_distribution + DISTRIBUTION_MIN_INTERVAL_MS)
+
+    def set_available_current(self, now, current):
+        self.available_current = current
+        if current < self.last_distributed_available_current or current - self.last_distributed_available_current >= DISTRIBUTION_HYSTERESIS_MA:
+            self.request_distribution(now)
+
+    def send_update(self, now, idx, stats):
+        b = struct.pack(request_format, self.next_seq_num[idx], PROTOCOL_VERSION, 0, self.states[idx].allocated_current)
+        self.sock.sendto(b, self.charger_addrs[idx])
+        self.lib.sim_link_quality_request_sent(self.link_qualities[idx], self.next_seq_num[idx], now)
+        self.next_seq_num[idx] = (self.next_seq_num[idx] + 1) % 256
+        self.next_send[idx] = now + CM_SEND_PERIOD_MS
+        stats.requests_sent += 1
+
+    def send_due(self, now, stats):
+        for idx in range(self.charger_count):
+            if now >= self.next_send[idx]:
+                self.send_update(now, idx, stats)
+
+    # Returns whether any allocated current changed.
+    def distribute(self, now, stats):
+        available_current = self.available_current
+        self.distribution_due = None
+        self.last_distribution = now
+        self.last_distributed_available_current = available_current
+
+        # Stage 0 of distribute_current: Unreactive EVSEs block everything. Unreachable chargers lose their own current.
+        self.update_links(now, stats)
+        unreachable_evse_found = False
+        for i, s in enumerate(self.states):
+            if now - s.last_update > TIMEOUT_MS:
+                s.error = CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE
+                if s.reserved_until is None:
+                    s.reserved_current = s.allocated_current
+                    s.reserved_until = now + TIMEOUT_MS
+                    s.allocated_current = 0
+                    s.last_sent_config = now
+                    self.send_update(now, i, stats)
+                elif now >= s.reserved_until:
+                    s.reserved_current = 0
+                continue
+
+            s.reserved_until = None
+            s.reserved_current = 0
+            if s.error == CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE:
+                s.error = 0
+
+            if s.allocated_current < s.allowed_current and now - s.last_sent_config > TIMEOUT_MS:
+                unreachable_evse_found = True
+                s.error = CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE
+            elif s.error == CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE:
+                s.error = 0
+
+        if unreachable_evse_found:
+            available_current = 0
+            stats.blocked_distributions += 1
+
+        n = self.charger_count
+        u16 = ctypes.c_uint16 * n
+        u8 = ctypes.c_uint8 * n
+        supported = u16(*[s.supported_current for s in self.states])
+        allowed = u16(*[s.allowed_current for s in self.states])
+        is_charging = u8(*[s.is_charging for s in self.states])
+        wants = u8(*[s.wants_to_charge for s in self.states])
+        low_prio = u8(*[s.wants_to_charge_low_priority for s in self.states])
+        degraded = u8(*[s.link_degraded for s in self.states])
+        reserved = u16(*[s.reserved_current for s in self.states])
+        allocated = u16(*[s.allocated_current for s in self.states])
+        target = u16()
+        changed = u8()
+        log_buf = ctypes.create_string_buffer(16384)
+
+        if self.throttled_recently and now >= self.last_throttle + THROTTLE_SETTLE_MS:
+            self.throttled_recently = False
+        may_unthrottle = not self.throttled_recently
+        result = ctypes.c_uint8()
+
+        allocated_before = list(allocated)
+
+        start = time.perf_counter()
+        log_used = self.lib.sim_allocate(self.allocator, self.args.minimum_current, DISTRIBUTION_HYSTERESIS_MA,
+                                         available_current, may_unthrottle, ctypes.byref(result), n,
+                                         self.phases, self.distribution, self.distribution_count, self.distribution_max_current,
+                                         self.names, self.hosts, self.distribution_names, supported, allowed, is_charging, wants, low_prio,
+                                         degraded, reserved, allocated, target, changed, log_buf, len(log_buf), self.args.verbose)
+        stats.allocation_us.append((time.perf_counter() - start) * 1e6)
+
+        if result.value == ALLOCATOR_THROTTLED_CHARGING:
+            self.throttled_recently = True
+            self.last_throttle = now
+
+        if self.args.verbose:
+            for line in log_buf.raw[:log_used].split(b"\0"):
+                if line:
+                    print("{:8.1f} s: {}".format(now / 1000, line.decode()))
+
+        if self.record is not None:
+            self.record.write("# {:.1f} s\n{} {:d} {:d}\n".format(now / 1000, available_current, may_unthrottle, result.value))
+            for i in range(n):
+                self.record.write("{} {} {:d} {:d} {:d} {:d} {} {} {} {}\n".format(supported[i], allowed[i], is_charging[i], wants[i], low_prio[i],
+                                                                           degraded[i], reserved[i], allocated_before[i], target[i], allocated[i]))
+
+        any_changed = False
+        for i, s in enumerate(self.states):
+            s.target_current = target[i]
+            if changed[i]:
+                any_changed = True
+                s.allocated_current = allocated[i]
+                if s.error != CHARGE_MANAGER_ERROR_EVSE_NONREACTIVE:
+                    s.last_sent_config = now
+                self.send_update(now, i, stats)
+
+        if result.value == ALLOCATOR_THROTTLED_IDLE:
+            self.request_distribution(now)
+        return any_changed
+
+    # Converged means that the targets (up to the hysteresis) were sent and all reachable chargers applied them.
+    def converged(self):
+        return all((s.allocated_current == s.target_current or
+                    (s.allocated_current != 0 and 0 < s.target_current - s.allocated_current < DISTRIBUTION_HYSTERESIS_MA)) and
+                   (s.allowed_current == min(s.allocated_current, s.supported_current) or
+                    s.error == CHARGE_MANAGER_ERROR_CHARGER_UNREACHABLE) or
+                   s.link_degraded
+                   for s in self.states)
+
+
+class Stats:
+    def __init__(self):
+        self.requests_sent = 0
+        self.responses_sent = 0
+        self.responses_received = 0
+        self.blocked_distributions = 0
+        self.degraded_links = 0
+        self.unblock_ms = []
+        self.allocation_us = []
+        self.convergence_ms = []
+        self.max_overshoot = 0
+        self.overshoot_ms = 0
+        self.max_sessions = 0
+        self.session_ms = 0
+
+
+def percentile(values, p):
+    if len(values) == 0:
+        return 0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Charge management simulator over loopback UDP")
+    parser.add_argument("--chargers", type=int, default=10)
+    parser.add_argument("--duration", type=int, default=600, help="simulated seconds")
+    parser.add_argument("--speedup", type=float, default=1, help="run the simulated time this much faster than real time")
+    parser.add_argument("--available-current", type=int, default=64000, help="mA")
+    parser.add_argument("--minimum-current", type=int, default=6000, help="mA")
+    parser.add_argument("--step", action="append", default=[], metavar="SECONDS:MILLIAMPS",
+                        help="change the available current at this simulated time. Can be repeated.")
+    parser.add_argument("--pause-probability", type=float, default=0.2, help="probability that a vehicle pauses charging once")
+    parser.add_argument("--unreachable-probability", type=float, default=0.0, help="probability that a charger stops responding once")
+    parser.add_argument("--loss", type=float, default=0.0, help="probability that a request or response is lost")
+    parser.add_argument("--v3-probability", type=float, default=0.0, help="probability that a charger has firmware with protocol version 3")
+    parser.add_argument("--single-phase-probability", type=float, default=0.0, help="probability that a charger is connected to one phase only")
+    parser.add_argument("--distribution", type=int, action="append", default=[], metavar="MILLIAMPS",
+                        help="add a sub-distribution with this limit per phase; the chargers are spread evenly over all sub-distributions")
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--verbose", action="store_true", help="print the distribution log")
+    parser.add_argument("--record", metavar="FILE", help="write the inputs and results of every allocation to FILE for current_allocator_test")
+    args = parser.parse_args()
+
+    if not 1 <= args.chargers <= 254:
+        parser.error("--chargers must be between 1 and 254")
+
+    steps = sorted((int(float(t) * 1000), int(c)) for t, c in (s.split(":") for s in args.step))
+
+    lib = build_firmware_lib()
+    clock = Clock(args.speedup)
+    rng = random.Random(args.seed)
+    chargers = [Charger(i, lib, rng, args) for i in range(args.chargers)]
+    manager = Manager(chargers, lib, args)
+    stats = Stats()
+
+    # Convergence is measured from every change of the available current.
+    # The first distribution counts as a change from 0.
+    pending_change = 0
+    distributed_since_change = False
+    last_sample = 0
+    next_tick = 1000
+    sockets = [manager.sock] + [c.sock for c in chargers]
+
+    while True:
+        now = clock.ms()
+        if now >= args.duration * 1000:
+            break
+
+        while len(steps) > 0 and steps[0][0] <= now:
+            manager.set_available_current(now, steps.pop(0)[1])
+            pending_change = now
+            distributed_since_change = False
+            print("{:8.1f} s: available current set to {} mA".format(now / 1000, manager.available_current))
+
+        for c in chargers:
+            c.receive(now, stats)
+            c.send(now, stats)
+
+        manager.receive(now, stats)
+        manager.send_due(now, stats)
+
+        # Safety tick
+        if now >= next_tick:
+            next_tick += 1000
+            if manager.update_links(now, stats) or now >= manager.last_distribution + DISTRIBUTION_SAFETY_INTERVAL_MS:
+                manager.request_distribution(now)
+
+        if manager.distribution_due is not None and now >= manager.distribution_due:
+            manager.distribute(now, stats)
+            distributed_since_change = True
+
+        # The targets are only valid after a distribution.
+        if pending_change is not None and distributed_since_change and manager.converged():
+            stats.convergence_ms.append(now - pending_change)
+            print("{:8.1f} s: converged after {:.1f} s".format(now / 1000, (now - pending_change) / 1000))
+            pending_change = None
+
+        # The EVSEs must never allow more than is available on any phase of the site or a sub-distribution,
+        # except until they were throttled.
+        overshoot = 0
+        for phase in range(3):
+            load = [0] * (1 + len(args.distribution))
+            for c in chargers:
+                if c.charger_state == 3 and c.phases & (1 << phase):
+                    load[0] += c.allowed_current
+                    if c.distribution != NO_DISTRIBUTION:
+                        load[1 + c.distribution] += c.allowed_current
+            overshoot = max(overshoot, load[0] - manager.available_current,
+                            *(load[1 + d] - limit for d, limit in enumerate(args.distribution)))
+        if overshoot > 0:
+            stats.max_overshoot = max(stats.max_overshoot, overshoot)
+            stats.overshoot_ms += now - last_sample
+
+        sessions = sum(1 for c in chargers if c.charger_state == 3)
+        stats.max_sessions = max(stats.max_sessions, sessions)
+        stats.session_ms += sessions * (now - last_sample)
+        last_sample = now
+
+        next_distribution = manager.distribution_due if manager.distribution_due is not None else manager.last_distribution + DISTRIBUTION_SAFETY_INTERVAL_MS
+        timeout = min(min(manager.next_send), next_distribution, next_tick, min(c.next_send for c in chargers)) - clock.ms()
+        select.select(sockets, [], [], clock.real_seconds(min(timeout, 10)))
+
+    if manager.record is not None:
+        manager.record.close()
+
+    seconds = args.duration
+    print()
+    print("Chargers:                 {}".format(args.chargers))
+    print("Simulated time:           {} s".format(seconds))
+    print("Requests sent:            {:.1f} / s".format(stats.requests_sent / seconds))
+    print("Responses sent:           {:.1f} / s".format(stats.responses_sent / seconds))
+    print("Responses received:       {:.1f} / s".format(stats.responses_received / seconds))
+    print("Distributions:            {} ({} blocked by unreactive EVSEs)".format(len(stats.allocation_us), stats.blocked_distributions))
+    links = [manager.link_stats(idx) for idx in range(args.chargers)]
+    print("Degraded links:           {}, {:.1f} % response loss in the last window".format(
+        stats.degraded_links, sum(link.loss for link in links) / 10 / len(links)))
+    print("Allocation latency:       min {:.1f} us, avg {:.1f} us, p99 {:.1f} us, max {:.1f} us".format(
+        min(stats.allocation_us, default=0),
+        sum(stats.allocation_us) / max(1, len(stats.allocation_us)),
+        percentile(stats.allocation_us, 99),
+        max(stats.allocation_us, default=0)))
+    if len(stats.unblock_ms) > 0:
+        print("Plug-in to current:       avg {:.1f} s, max {:.1f} s".format(
+            sum(stats.unblock_ms) / len(stats.unblock_ms) / 1000, max(stats.unblock_ms) / 1000))
+    if len(stats.convergence_ms) > 0:
+        print("Convergence time:         min {:.1f} s, max {:.1f} s".format(min(stats.convergence_ms) / 1000, max(stats.convergence_ms) / 1000))
+    if pending_change is not None:
+        print("Not converged since:      {:.1f} s".format(pending_change / 1000))
+    print("Charging vehicles:        avg {:.1f}, max {}".format(stats.session_ms / (seconds * 1000), stats.max_sessions))
+    print("Max. overshoot:           {} mA for {:.1f} s in total".format(stats.max_overshoot, stats.overshoot_ms / 1000))
+
+    return 0 if pending_change is None else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
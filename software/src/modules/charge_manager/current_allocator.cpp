@@ -0,0 +1,447 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "current_allocator.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+void current_allocator_trace(CurrentAllocatorTrace *trace, CurrentAllocatorTraceEvent event, uint8_t charger, uint32_t value0, uint32_t value1, uint32_t value2)
+{
+    if (!trace->enabled || trace->capacity == 0)
+        return;
+
+    CurrentAllocatorTraceEntry *entry = &trace->entries[trace->written % trace->capacity];
+    entry->event = event;
+    entry->charger = charger;
+    entry->values[0] = value0;
+    entry->values[1] = value1;
+    entry->values[2] = value2;
+
+    ++trace->written;
+}
+
+void current_allocator_init(CurrentAllocatorState *state, size_t charger_count, size_t distribution_count)
+{
+    state->supported_current.assign(charger_count, 0);
+    state->allowed_current.assign(charger_count, 0);
+    state->is_charging.assign(charger_count, false);
+    state->wants_to_charge.assign(charger_count, false);
+    state->wants_to_charge_low_priority.assign(charger_count, false);
+    state->link_degraded.assign(charger_count, false);
+    state->reserved_current.assign(charger_count, 0);
+    state->allocated_current.assign(charger_count, 0);
+    state->target_current.assign(charger_count, 0);
+    state->allocated_current_changed.assign(charger_count, false);
+
+    state->idx_array.resize(charger_count);
+    for (size_t i = 0; i < charger_count; ++i)
+        state->idx_array[i] = i;
+
+    state->limit_left.assign((1 + distribution_count) * CURRENT_ALLOCATOR_PHASE_COUNT, 0);
+    state->limit_users.assign((1 + distribution_count) * CURRENT_ALLOCATOR_PHASE_COUNT, 0);
+}
+
+// Calls fn with the index of every limit the charger's current counts against:
+// The site's phases the charger is connected to and the same phases of its sub-distribution.
+template<typename F>
+static void for_each_limit(const CurrentAllocatorConfig *cfg, int idx, F fn)
+{
+    uint8_t phases = cfg->charger_phases[idx];
+    if (phases == 0)
+        phases = CURRENT_ALLOCATOR_ALL_PHASES;
+
+    uint8_t distribution = cfg->charger_distribution[idx];
+    size_t distribution_base = distribution == CURRENT_ALLOCATOR_NO_DISTRIBUTION ? 0 : (1 + distribution) * CURRENT_ALLOCATOR_PHASE_COUNT;
+
+    for (size_t phase = 0; phase < CURRENT_ALLOCATOR_PHASE_COUNT; ++phase) {
+        if ((phases & (1 << phase)) == 0)
+            continue;
+
+        fn(phase);
+        if (distribution_base != 0)
+            fn(distribution_base + phase);
+    }
+}
+
+// Returns the current that can be added to the charger without exceeding any of its limits.
+// *limit is set to the limit with the least current left.
+static uint32_t current_left(const CurrentAllocatorConfig *cfg, const CurrentAllocatorState *state, int idx, size_t *limit)
+{
+    uint32_t result = UINT32_MAX;
+    for_each_limit(cfg, idx, [&](size_t l) {
+        if (state->limit_left[l] < result) {
+            result = state->limit_left[l];
+            *limit = l;
+        }
+    });
+    return result;
+}
+
+static void consume_current(const CurrentAllocatorConfig *cfg, CurrentAllocatorState *state, int idx, uint32_t current)
+{
+    for_each_limit(cfg, idx, [&](size_t l) {
+        state->limit_left[l] -= current;
+    });
+}
+
+static bool site_current_left(const CurrentAllocatorState *state)
+{
+    for (size_t phase = 0; phase < CURRENT_ALLOCATOR_PHASE_COUNT; ++phase)
+        if (state->limit_left[phase] > 0)
+            return true;
+    return false;
+}
+
+// Allocates the minimum current to the charger if it fits into all of its limits.
+// Chargers that don't fit are blocked, but the following chargers may still fit
+// if they are connected to other phases or another sub-distribution.
+static void allocate_minimum_current(const CurrentAllocatorConfig *cfg, CurrentAllocatorState *state, int idx, CurrentAllocatorTrace *trace)
+{
+    uint16_t current_to_set = cfg->minimum_current;
+
+    uint16_t supported_current = state->supported_current[idx];
+    if (supported_current < current_to_set) {
+        CA_TRACE(CurrentAllocatorTraceEvent::MinimumCurrentNotSupported, idx, supported_current, current_to_set);
+        return;
+    }
+
+    size_t limit = 0;
+    uint32_t left = current_left(cfg, state, idx, &limit);
+    if (left < current_to_set) {
+        CA_TRACE(CurrentAllocatorTraceEvent::LimitExceeded, idx, left, limit, current_to_set);
+        current_to_set = 0;
+    }
+
+    state->target_current[idx] = current_to_set;
+    consume_current(cfg, state, idx, current_to_set);
+
+    CA_TRACE(CurrentAllocatorTraceEvent::TargetCalculated, idx, current_to_set, current_left(cfg, state, idx, &limit));
+}
+
+CurrentAllocatorResult allocate_current(const CurrentAllocatorConfig *cfg, uint32_t available_current, bool may_unthrottle, CurrentAllocatorState *state, CurrentAllocatorTrace *trace)
+{
+    const size_t charger_count = cfg->charger_count;
+    int *idx_array = state->idx_array.data();
+    uint16_t *current_array = state->target_current.data();
+    uint32_t *limit_left = state->limit_left.data();
+    uint16_t *limit_users = state->limit_users.data();
+
+    std::fill(state->target_current.begin(), state->target_current.end(), 0);
+    std::fill(state->allocated_current_changed.begin(), state->allocated_current_changed.end(), false);
+
+    for (size_t phase = 0; phase < CURRENT_ALLOCATOR_PHASE_COUNT; ++phase) {
+        limit_left[phase] = available_current;
+        for (size_t d = 0; d < cfg->distribution_count; ++d)
+            limit_left[(1 + d) * CURRENT_ALLOCATOR_PHASE_COUNT + phase] = cfg->distribution_max_current[d];
+    }
+
+    // Reserve the current of chargers with a degraded link.
+    bool keep_degraded = true;
+    {
+        for (size_t i = 0; i < charger_count; ++i) {
+            if (!state->link_degraded[i])
+                continue;
+
+            uint16_t reserved = std::max(state->allocated_current[i], state->reserved_current[i]);
+            CA_TRACE(CurrentAllocatorTraceEvent::LinkDegraded, i, state->allocated_current[i], reserved);
+
+            size_t limit = 0;
+            uint32_t left = current_left(cfg, state, i, &limit);
+            if (left < reserved) {
+                CA_TRACE(CurrentAllocatorTraceEvent::ReservedCurrentExceedsLimit, i, left, limit, reserved);
+                keep_degraded = false;
+                break;
+            }
+
+            current_array[i] = state->allocated_current[i];
+            consume_current(cfg, state, i, reserved);
+        }
+
+        // Nothing can be allocated safely. Try to throttle the chargers with a degraded link too.
+        if (!keep_degraded) {
+            std::fill(state->target_current.begin(), state->target_current.end(), 0);
+            std::fill(state->limit_left.begin(), state->limit_left.end(), 0);
+        }
+    }
+
+    // Only these chargers take part in the allocation.
+    auto allocatable = [state, keep_degraded](size_t idx) {
+        return !keep_degraded || !state->link_degraded[idx];
+    };
+
+    // Sort chargers.
+    {
+        // Sort the chargers by their minimum supported current,
+        // then sort chargers that are already charging before those that
+        // want to charge but are not charging yet.
+        // Sorting by the minimum current allows us to distribute the current "perfectly"
+        // with a single pass over the chargers.
+        int chargers_requesting_current = 0;
+        for (size_t i = 0; i < charger_count; ++i) {
+            if (!allocatable(i) || (!state->is_charging[i] && !state->wants_to_charge[i])) {
+                continue;
+            }
+            ++chargers_requesting_current;
+        }
+
+        CA_TRACE(CurrentAllocatorTraceEvent::ChargersRequestingCurrent, CURRENT_ALLOCATOR_NO_CHARGER, chargers_requesting_current, available_current);
+
+        // One stable sort by both keys gives the same order as
+        // sorting by the supported current first and by is_charging second.
+        std::stable_sort(idx_array, idx_array + charger_count, [state](int left, int right) -> bool {
+            if (state->is_charging[left] != state->is_charging[right])
+                return state->is_charging[left];
+            return state->supported_current[left] < state->supported_current[right];
+        });
+    }
+
+    // Allocate current to chargers.
+    {
+        // First allocate the minimum supported current to each charger.
+        // Then distribute the rest of the available current to those
+        // that received the minimum.
+        for (size_t i = 0; i < charger_count; ++i) {
+            int idx = idx_array[i];
+
+            if (!allocatable(idx) || (!state->is_charging[idx] && !state->wants_to_charge[idx])) {
+                continue;
+            }
+
+            allocate_minimum_current(cfg, state, idx, trace);
+        }
+
+        if (site_current_left(state)) {
+            CA_TRACE(CurrentAllocatorTraceEvent::Recalculating, CURRENT_ALLOCATOR_NO_CHARGER, limit_left[0], limit_left[1], limit_left[2]);
+
+            // Each charger gets an equal share of the current left on each of its limits.
+            // As the chargers are sorted by their supported current, current that a charger
+            // can't use is left for the following chargers that share a limit with it.
+            std::fill(state->limit_users.begin(), state->limit_users.end(), 0);
+            for (size_t i = 0; i < charger_count; ++i) {
+                if (!allocatable(i) || current_array[i] == 0)
+                    continue;
+
+                for_each_limit(cfg, i, [limit_users](size_t l) {
+                    ++limit_users[l];
+                });
+            }
+
+            for (size_t i = 0; i < charger_count; ++i) {
+                int idx = idx_array[i];
+
+                if (!allocatable(idx) || current_array[idx] == 0)
+                    continue;
+
+                // The share includes this charger, so remove it from the users afterwards.
+                uint32_t share = UINT32_MAX;
+                for_each_limit(cfg, idx, [&](size_t l) {
+                    share = std::min(share, limit_left[l] / limit_users[l]);
+                    --limit_users[l];
+                });
+
+                uint16_t current_per_charger = std::min((uint32_t)32000, share);
+
+                uint16_t supported_current = state->supported_current[idx];
+                // Protect against overflow.
+                if (supported_current < current_array[idx])
+                    continue;
+
+                uint16_t current_to_add = std::min((uint16_t)(supported_current - current_array[idx]), current_per_charger);
+
+                current_array[idx] += current_to_add;
+                consume_current(cfg, state, idx, current_to_add);
+
+                size_t limit = 0;
+                CA_TRACE(CurrentAllocatorTraceEvent::TargetRecalculated, idx, current_array[idx], current_left(cfg, state, idx, &limit));
+            }
+        }
+    }
+
+    // Wake up chargers that already charged once.
+    {
+        if (site_current_left(state)) {
+            CA_TRACE(CurrentAllocatorTraceEvent::WakingUp, CURRENT_ALLOCATOR_NO_CHARGER, limit_left[0], limit_left[1], limit_left[2]);
+
+            for (size_t i = 0; i < charger_count; ++i) {
+                int idx = idx_array[i];
+
+                if (!allocatable(idx) || !state->wants_to_charge_low_priority[idx]) {
+                    continue;
+                }
+
+                allocate_minimum_current(cfg, state, idx, trace);
+            }
+        }
+    }
+
+    // Apply current limits.
+    {
+        // First, throttle chargers that have a higher current limit than the calculated one.
+        // If no charger has to be throttled, then also unthrottle other chargers. Skip this
+        // stage if even one charger needs to be throttled to be sure that the available current
+        // is never exceeded.
+        CurrentAllocatorResult result = CurrentAllocatorResult::NotThrottled;
+        for (size_t i = 0; i < charger_count; ++i) {
+            if (!allocatable(i))
+                continue;
+
+            uint16_t current_to_set = current_array[i];
+
+            bool will_throttle = current_to_set < state->allocated_current[i] || current_to_set < state->allowed_current[i];
+
+            if (!will_throttle) {
+                continue;
+            }
+
+            CA_TRACE(CurrentAllocatorTraceEvent::Throttled, i, current_to_set);
+
+            if (state->allocated_current[i] != current_to_set) {
+                state->allocated_current[i] = current_to_set;
+                state->allocated_current_changed[i] = true;
+            }
+
+            // Skip stage 2 to wait for the charger to adapt to the now smaller limit.
+            // Some cars are slow to adapt to a new limit. The standard requires them to
+            // react in 5 seconds.
+            // More correct would be to detect whether the throttled current limit
+            // was accepted by the box more than 5 seconds ago (so that we can be sure the timing fits)
+            // However this is complicated and waiting THROTTLE_SETTLE_MS (see charge_manager.cpp)
+            // before unthrottling works good enough.
+            // A charger that doesn't charge yet can start to draw its old limit at any time,
+            // and the lower limit may be delayed or lost. Stage 2 is also skipped for it,
+            // until it reports the lower limit, but there is no vehicle that has to adapt.
+            if (state->is_charging[i] && result != CurrentAllocatorResult::ThrottledCharging) {
+                CA_TRACE(CurrentAllocatorTraceEvent::ThrottledCharging, i);
+                result = CurrentAllocatorResult::ThrottledCharging;
+            } else if (result == CurrentAllocatorResult::NotThrottled) {
+                result = CurrentAllocatorResult::ThrottledIdle;
+            }
+        }
+
+        bool skip_stage_2 = result != CurrentAllocatorResult::NotThrottled;
+
+        if (!skip_stage_2 && !may_unthrottle) {
+            CA_TRACE(CurrentAllocatorTraceEvent::WaitingForThrottled, CURRENT_ALLOCATOR_NO_CHARGER);
+        } else if (!skip_stage_2) {
+            for (size_t i = 0; i < charger_count; ++i) {
+                if (!allocatable(i))
+                    continue;
+
+                uint16_t current_to_set = current_array[i];
+
+                // > instead of >= to only catch chargers that were not already modified in stage 1.
+                bool will_not_throttle = current_to_set > state->allocated_current[i] || current_to_set > state->allowed_current[i];
+
+                if (!will_not_throttle) {
+                    continue;
+                }
+
+                // Don't send small increases to chargers that are already charging or allowed to charge.
+                // Blocked chargers are always unblocked.
+                uint16_t allocated_current = state->allocated_current[i];
+                if (allocated_current != 0 && current_to_set > allocated_current && current_to_set - allocated_current < cfg->unthrottle_hysteresis) {
+                    continue;
+                }
+
+                CA_TRACE(CurrentAllocatorTraceEvent::Unthrottled, i, current_to_set);
+
+                if (state->allocated_current[i] != current_to_set) {
+                    state->allocated_current[i] = current_to_set;
+                    state->allocated_current_changed[i] = true;
+                }
+            }
+        } else {
+            CA_TRACE(CurrentAllocatorTraceEvent::Stage2Skipped, CURRENT_ALLOCATOR_NO_CHARGER);
+        }
+
+        return result;
+    }
+}
+
+static const char *get_limit_name(const CurrentAllocatorConfig *cfg, uint32_t limit)
+{
+    size_t distribution = limit / CURRENT_ALLOCATOR_PHASE_COUNT;
+    if (distribution > 0 && distribution <= cfg->distribution_count)
+        return cfg->distribution_names[distribution - 1];
+    return "site";
+}
+
+int current_allocator_render_trace_entry(const CurrentAllocatorConfig *cfg, const CurrentAllocatorTraceEntry *entry, char *buf, size_t len)
+{
+    const uint32_t *v = entry->values;
+
+    const char *name = "";
+    const char *host = "";
+    if (entry->charger < cfg->charger_count) {
+        name = cfg->charger_names[entry->charger];
+        host = cfg->charger_hosts[entry->charger];
+    }
+
+    switch (entry->event) {
+        case CurrentAllocatorTraceEvent::DistributionStarted:
+            return snprintf(buf, len, "[%10.3f] Redistributing current. %u mA available.", v[0] / 1000.0, v[1]);
+        case CurrentAllocatorTraceEvent::ChargerError:
+            return snprintf(buf, len, "    stage 0: %s (%s) reports error %u.", name, host, v[0]);
+        case CurrentAllocatorTraceEvent::ChargerUnreachable:
+            return snprintf(buf, len, "    stage 0: Can't reach EVSE of %s (%s): last_update too old.", name, host);
+        case CurrentAllocatorTraceEvent::EVSENonreactive:
+            return snprintf(buf, len, "    stage 0: EVSE of %s (%s) did not react in time.", name, host);
+        case CurrentAllocatorTraceEvent::Shutdown:
+            return snprintf(buf, len, "    stage 0: Unreactive or misconfigured EVSE(s) found. Setting available current to 0 mA.");
+        case CurrentAllocatorTraceEvent::LinkDegraded:
+            return snprintf(buf, len, "    stage 0: Link to %s (%s) is degraded. Keeping its %u mA, reserving %u mA.", name, host, v[0], v[1]);
+        case CurrentAllocatorTraceEvent::ReservedCurrentExceedsLimit:
+            return snprintf(buf, len, "    stage 0: %u mA reserved for %s (%s), but only %u mA left on L%u of %s. Blocking all chargers.",
+                            v[2], name, host, v[0], (unsigned)(v[1] % CURRENT_ALLOCATOR_PHASE_COUNT + 1), get_limit_name(cfg, v[1]));
+        case CurrentAllocatorTraceEvent::ChargersRequestingCurrent:
+            return snprintf(buf, len, "    %u charger%s request%s current. %u mA per phase available.",
+                            v[0],
+                            v[0] == 1 ? "" : "s",
+                            v[0] == 1 ? "s" : "",
+                            v[1]);
+        case CurrentAllocatorTraceEvent::MinimumCurrentNotSupported:
+            return snprintf(buf, len, "    stage 0: Can't unblock %s (%s): It only supports %u mA, but %u mA is the configured minimum current.", name, host, v[0], v[1]);
+        case CurrentAllocatorTraceEvent::LimitExceeded:
+            return snprintf(buf, len, "    stage 0: Can't unblock %s (%s): %u mA left on L%u of %s, but %u mA required. Blocking it.",
+                            name, host, v[0], (unsigned)(v[1] % CURRENT_ALLOCATOR_PHASE_COUNT + 1), get_limit_name(cfg, v[1]), v[2]);
+        case CurrentAllocatorTraceEvent::TargetCalculated:
+            return snprintf(buf, len, "    stage 0: Calculated target for %s (%s) of %u mA. %u mA left on its phases.", name, host, v[0], v[1]);
+        case CurrentAllocatorTraceEvent::Recalculating:
+            return snprintf(buf, len, "    stage 0: %u/%u/%u mA still available on L1/L2/L3. Recalculating targets.", v[0], v[1], v[2]);
+        case CurrentAllocatorTraceEvent::TargetRecalculated:
+            return snprintf(buf, len, "    stage 0: Recalculated target for %s (%s) of %u mA. %u mA left on its phases.", name, host, v[0], v[1]);
+        case CurrentAllocatorTraceEvent::WakingUp:
+            return snprintf(buf, len, "    stage 0: %u/%u/%u mA still available on L1/L2/L3. Attempting to wake up chargers that already charged their vehicle once.", v[0], v[1], v[2]);
+        case CurrentAllocatorTraceEvent::Throttled:
+            return snprintf(buf, len, "    stage 1: Throttled %s (%s) to %u mA.", name, host, v[0]);
+        case CurrentAllocatorTraceEvent::ThrottledCharging:
+            return snprintf(buf, len, "    stage 1: Throttled a charging charger. Skipping stage 2");
+        case CurrentAllocatorTraceEvent::WaitingForThrottled:
+            return snprintf(buf, len, "    Waiting for throttled chargers to adapt. Skipping stage 2");
+        case CurrentAllocatorTraceEvent::Unthrottled:
+            return snprintf(buf, len, "    stage 2: Unthrottled %s (%s) to %u mA.", name, host, v[0]);
+        case CurrentAllocatorTraceEvent::Stage2Skipped:
+            return snprintf(buf, len, "    Skipping stage 2");
+    }
+
+    return snprintf(buf, len, "    Unknown trace event %u", (unsigned)entry->event);
+}
@@ -0,0 +1,154 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+// This file must not depend on Arduino, the config or any other module,
+// so that the allocation can be built and run on a host.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#define CURRENT_ALLOCATOR_PHASE_COUNT 3
+#define CURRENT_ALLOCATOR_ALL_PHASES 0x07
+#define CURRENT_ALLOCATOR_NO_DISTRIBUTION 255
+#define CURRENT_ALLOCATOR_NO_CHARGER 255
+
+// Decisions of the distribution. The values of each event are listed in the comment.
+enum class CurrentAllocatorTraceEvent : uint8_t {
+    // Written by the charge manager
+    DistributionStarted, // uptime in ms, available current
+    ChargerError, // error
+    ChargerUnreachable,
+    EVSENonreactive,
+    Shutdown,
+
+    // Written by allocate_current
+    ChargersRequestingCurrent, // number of chargers, available current
+    LinkDegraded, // allocated current, reserved current
+    ReservedCurrentExceedsLimit, // current left, limit, reserved current
+    MinimumCurrentNotSupported, // supported current, minimum current
+    LimitExceeded, // current left, limit, minimum current
+    TargetCalculated, // target, current left on the charger's limits
+    Recalculating, // current left on L1, L2, L3
+    TargetRecalculated, // target, current left on the charger's limits
+    WakingUp, // current left on L1, L2, L3
+    Throttled, // allocated current
+    ThrottledCharging,
+    WaitingForThrottled,
+    Unthrottled, // allocated current
+    Stage2Skipped,
+};
+
+struct CurrentAllocatorTraceEntry {
+    CurrentAllocatorTraceEvent event;
+    uint8_t charger; // or CURRENT_ALLOCATOR_NO_CHARGER
+    uint32_t values[3];
+};
+
+// A ring buffer of trace entries. written counts all entries ever written,
+// the entry with the number n is stored at n % capacity.
+struct CurrentAllocatorTrace {
+    CurrentAllocatorTraceEntry *entries;
+    size_t capacity;
+    uint32_t written;
+    bool enabled;
+};
+
+void current_allocator_trace(CurrentAllocatorTrace *trace, CurrentAllocatorTraceEvent event, uint8_t charger, uint32_t value0 = 0, uint32_t value1 = 0, uint32_t value2 = 0);
+
+// Expects the trace in a variable called trace. The arguments are not evaluated while tracing is disabled.
+#define CA_TRACE(...) do { if (trace->enabled) current_allocator_trace(trace, __VA_ARGS__); } while (0)
+
+// The chargers are connected to the site either directly or via one of the sub-distributions.
+// The site and every sub-distribution limit the current on each phase.
+struct CurrentAllocatorConfig {
+    uint16_t minimum_current;
+    // Increases of the allocated current smaller than this are not sent to chargers that are not blocked.
+    uint16_t unthrottle_hysteresis;
+    size_t charger_count;
+
+    // Bit mask of the site's phases a charger draws current from. Bit 0 is L1.
+    const uint8_t *charger_phases;
+    // Index of the sub-distribution a charger is connected to or CURRENT_ALLOCATOR_NO_DISTRIBUTION.
+    const uint8_t *charger_distribution;
+
+    size_t distribution_count;
+    // Current limit per phase of each sub-distribution.
+    const uint32_t *distribution_max_current;
+
+    // Only used to render the trace.
+    const char *const *charger_names;
+    const char *const *charger_hosts;
+    const char *const *distribution_names;
+};
+
+// The state of all chargers as arrays indexed by the charger's position in the configuration.
+// All arrays are sized by current_allocator_init.
+struct CurrentAllocatorState {
+    // Inputs, copied from the charger states before every allocation.
+    std::vector<uint16_t> supported_current;
+    std::vector<uint16_t> allowed_current;
+    std::vector<bool> is_charging;
+    std::vector<bool> wants_to_charge;
+    std::vector<bool> wants_to_charge_low_priority;
+
+    // Chargers that can't be reached reliably keep their allocated current, because a new limit may not arrive.
+    // max(allocated_current, reserved_current) is reserved on their limits:
+    // reserved_current covers a limit that was lowered, but may not have been applied yet.
+    std::vector<bool> link_degraded;
+    std::vector<uint16_t> reserved_current;
+
+    // The current that was last sent to each charger. Updated by the allocation.
+    std::vector<uint16_t> allocated_current;
+
+    // Chargers ordered by priority. This has to persist between allocations:
+    // The sort is stable, so chargers with the same priority keep their order.
+    std::vector<int> idx_array;
+
+    // Outputs
+    std::vector<uint16_t> target_current;
+    std::vector<bool> allocated_current_changed;
+
+    // Scratch space for the current left on and the chargers sharing each phase of the site
+    // and of the sub-distributions. Indexed by (1 + distribution) * CURRENT_ALLOCATOR_PHASE_COUNT + phase.
+    std::vector<uint32_t> limit_left;
+    std::vector<uint16_t> limit_users;
+};
+
+void current_allocator_init(CurrentAllocatorState *state, size_t charger_count, size_t distribution_count);
+
+enum class CurrentAllocatorResult : uint8_t {
+    NotThrottled,
+    // Only chargers that don't charge had to be throttled. Nothing has to adapt, the distribution can be repeated soon.
+    ThrottledIdle,
+    // A charging charger had to be throttled. Its vehicle needs some time to adapt.
+    ThrottledCharging,
+};
+
+// Distributes available_current (the site's limit per phase) over the chargers and throttles or unthrottles them towards the calculated targets.
+// Chargers are only unthrottled if no charger has to be throttled and may_unthrottle is set.
+// If the current reserved for chargers with a degraded link exceeds a limit, all chargers are blocked.
+// Only reads and writes cfg, state and trace.
+CurrentAllocatorResult allocate_current(const CurrentAllocatorConfig *cfg, uint32_t available_current, bool may_unthrottle, CurrentAllocatorState *state, CurrentAllocatorTrace *trace);
+
+// Renders the entry as one line of text without a line break. Returns the length like snprintf.
+int current_allocator_render_trace_entry(const CurrentAllocatorConfig *cfg, const CurrentAllocatorTraceEntry *entry, char *buf, size_t len);
@@ -0,0 +1,392 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "charge_curve.h"
+
+#include <LittleFS.h>
+
+#include "modules.h"
+#include "modules/meter/value_history.h"
+
+#include "event_log.h"
+#include "task_scheduler.h"
+#include "tools.h"
+
+#include <functional>
+#include <vector>
+
+extern EventLog logger;
+extern TaskScheduler task_scheduler;
+
+static_assert(sizeof(ChargeCurveChunkHeader) == 8, "Unexpected size of ChargeCurveChunkHeader");
+
+// Calls cb for every complete chunk of f, starting at the current position.
+// Returns the number of bytes read up to the end of the last complete chunk.
+static size_t forEachChunk(File &f, std::function<void(const ChargeCurveChunkHeader &header, const uint8_t *tokens)> &&cb)
+{
+    size_t valid_size = 0;
+    ChargeCurveChunkHeader header;
+    uint8_t tokens[UINT8_MAX];
+
+    while (f.read((uint8_t *)&header, sizeof(header)) == sizeof(header)) {
+        if (f.read(tokens, header.length) != header.length)
+            break;
+
+        valid_size += sizeof(header) + header.length;
+        cb(header, tokens);
+    }
+
+    return valid_size;
+}
+
+static void writeEmptyRun(BufferedChunkWriter &writer, uint32_t minutes)
+{
+    if (minutes == 0)
+        return;
+
+    char varint[5];
+    writer.write(varint, varint_encode((minutes << 1) | 1, varint));
+}
+
+// Re-encodes the tokens of a chunk relative to the samples sent before.
+// Minutes between the previous chunk and this one are sent as empty run.
+static void sendChunk(BufferedChunkWriter &writer, const ChargeCurveChunkHeader &header, const uint8_t *tokens, uint32_t *position, int16_t *last_value)
+{
+    // Chunks of a charge are written in order, so this only happens if the file is damaged.
+    if (header.first_minute < *position)
+        return;
+
+    writeEmptyRun(writer, header.first_minute - *position);
+    *position = header.first_minute;
+
+    uint32_t end = header.first_minute + header.minutes;
+    int32_t value = 0;
+    size_t pos = 0;
+    uint32_t token;
+    char varint[5];
+
+    while (*position < end && varint_decode(tokens, header.length, &pos, &token)) {
+        if ((token & 1) != 0) {
+            uint32_t run = min(token >> 1, end - *position);
+            writeEmptyRun(writer, run);
+            *position += run;
+            continue;
+        }
+
+        value += zigzag_decode(token >> 1);
+        writer.write(varint, varint_encode(zigzag_encode(value - *last_value) << 1, varint));
+        *last_value = (int16_t)value;
+        ++*position;
+    }
+
+    writeEmptyRun(writer, end - *position);
+    *position = end;
+}
+
+String ChargeCurve::filename(uint32_t file)
+{
+    return String(CHARGE_CURVE_FOLDER) + "/charge-curve-" + file + ".bin";
+}
+
+void ChargeCurve::setup()
+{
+    if (!LittleFS.mkdir(CHARGE_CURVE_FOLDER)) {
+        logger.printfln("Failed to create charge curve folder!");
+        return;
+    }
+
+#if MODULE_METER_AVAILABLE()
+    // Reuse the meter's samples instead of querying the meter again.
+    meter.power_hist.register_sample_callback([this](int16_t power) {
+        this->addSample(power);
+    });
+#endif
+
+    task_scheduler.scheduleWithFixedDelay([this]() {
+        this->closeMinute();
+    }, 60 * 1000, 60 * 1000);
+}
+
+void ChargeCurve::start(uint32_t file, uint32_t record_number)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    repairFile(file, record_number);
+
+    this->active = true;
+    this->log_dropped_chunks = true;
+    this->file = file;
+    this->record_number = record_number;
+    this->sample_sum = 0;
+    this->sample_count = 0;
+    this->chunk_first_minute = 0;
+    this->chunk_minutes = 0;
+    this->chunk_length = 0;
+    this->chunk_empty_run = 0;
+    this->chunk_last_value = 0;
+}
+
+void ChargeCurve::resume(uint32_t file, uint32_t record_number, uint32_t charge_timestamp_minutes)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    // Continue after the last stored minute. If the clock is known,
+    // leave a gap for the time the ESP was not running.
+    uint32_t first_minute = repairFile(file, record_number);
+    uint32_t now = timestamp_minutes();
+    if (charge_timestamp_minutes != 0 && now > charge_timestamp_minutes)
+        first_minute = max(first_minute, now - charge_timestamp_minutes);
+
+    if (first_minute > UINT16_MAX - UINT8_MAX) {
+        logger.printfln("Charge is running for too long to record its curve.");
+        return;
+    }
+
+    this->active = true;
+    this->log_dropped_chunks = true;
+    this->file = file;
+    this->record_number = record_number;
+    this->sample_sum = 0;
+    this->sample_count = 0;
+    this->chunk_first_minute = first_minute;
+    this->chunk_minutes = 0;
+    this->chunk_length = 0;
+    this->chunk_empty_run = 0;
+    this->chunk_last_value = 0;
+}
+
+void ChargeCurve::end()
+{
+    if (!active)
+        return;
+
+    // Keep the partial last minute.
+    if (sample_count > 0)
+        closeMinute();
+
+    std::lock_guard<std::mutex> lock{mutex};
+    flushChunk();
+    active = false;
+}
+
+void ChargeCurve::addSample(int16_t power)
+{
+    if (!active)
+        return;
+
+    sample_sum += power;
+    ++sample_count;
+}
+
+void ChargeCurve::closeMinute()
+{
+    if (!active)
+        return;
+
+    std::lock_guard<std::mutex> lock{mutex};
+
+    if (sample_count == 0) {
+        ++chunk_empty_run;
+    } else {
+        int16_t value = (int16_t)(sample_sum / (int32_t)sample_count);
+
+        if (chunk_empty_run > 0) {
+            appendToken((chunk_empty_run << 1) | 1);
+            chunk_empty_run = 0;
+        }
+
+        appendToken(zigzag_encode((int32_t)value - chunk_last_value) << 1);
+        chunk_last_value = value;
+    }
+
+    sample_sum = 0;
+    sample_count = 0;
+    ++chunk_minutes;
+
+    // An empty run and a sample token take at most five bytes.
+    if (chunk_minutes >= CHARGE_CURVE_FLUSH_MINUTES || chunk_length + 5 > CHARGE_CURVE_CHUNK_MAX_LENGTH)
+        flushChunk();
+}
+
+void ChargeCurve::appendToken(uint32_t token)
+{
+    chunk_length += varint_encode(token, (char *)chunk + chunk_length);
+}
+
+// Requires mutex to be locked.
+void ChargeCurve::flushChunk()
+{
+    if (chunk_minutes == 0)
+        return;
+
+    if (chunk_empty_run > 0) {
+        appendToken((chunk_empty_run << 1) | 1);
+        chunk_empty_run = 0;
+    }
+
+    ChargeCurveChunkHeader header{record_number, chunk_first_minute, chunk_minutes, chunk_length};
+    String name = filename(file);
+
+    {
+        File f = LittleFS.open(name, "a", true);
+        if (f.size() + sizeof(header) + chunk_length > CHARGE_CURVE_MAX_FILE_SIZE
+         || LittleFS.totalBytes() - LittleFS.usedBytes() < CHARGE_CURVE_MIN_FREE_SPACE) {
+            if (log_dropped_chunks) {
+                logger.printfln("Not enough space left to record the charge curve in %s.", name.c_str());
+                log_dropped_chunks = false;
+            }
+        } else {
+            f.write((const uint8_t *)&header, sizeof(header));
+            f.write(chunk, chunk_length);
+        }
+    }
+
+    if (chunk_first_minute + chunk_minutes > UINT16_MAX - UINT8_MAX) {
+        logger.printfln("Charge is running for too long to record its curve.");
+        active = false;
+    }
+
+    chunk_first_minute += chunk_minutes;
+    chunk_minutes = 0;
+    chunk_length = 0;
+    chunk_last_value = 0;
+}
+
+// Removes a chunk that was torn by a reset while it was appended.
+// Returns the end of the last chunk of record_number in minutes since the start of the charge.
+// Requires mutex to be locked.
+size_t ChargeCurve::repairFile(uint32_t file, uint32_t record_number)
+{
+    String name = filename(file);
+    if (!LittleFS.exists(name))
+        return 0;
+
+    size_t end_minute = 0;
+    size_t file_size;
+    size_t valid_size;
+
+    {
+        File f = LittleFS.open(name);
+        file_size = f.size();
+        valid_size = forEachChunk(f, [record_number, &end_minute](const ChargeCurveChunkHeader &header, const uint8_t *tokens) {
+            if (header.record_number == record_number)
+                end_minute = max(end_minute, (size_t)(header.first_minute + header.minutes));
+        });
+    }
+
+    if (valid_size != file_size) {
+        logger.printfln("Charge curve file %s is damaged. Truncating it from %u to %u bytes.", name.c_str(), file_size, valid_size);
+        if (!truncate_file(name, valid_size))
+            logger.printfln("Failed to repair charge curve file %s", name.c_str());
+    }
+
+    return end_minute;
+}
+
+void ChargeCurve::removeFile(uint32_t file)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    String name = filename(file);
+    if (LittleFS.exists(name))
+        LittleFS.remove(name);
+}
+
+void ChargeCurve::removeFilesOutside(uint32_t first_file, uint32_t last_file)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    std::vector<String> to_remove;
+
+    File folder = LittleFS.open(CHARGE_CURVE_FOLDER);
+    File f;
+    while (f = folder.openNextFile()) {
+        String name = String(f.name());
+        f.close();
+
+        // Left over if the ESP was reset while repairing a file.
+        if (name.endsWith(".tmp")) {
+            to_remove.push_back(name);
+            continue;
+        }
+
+        if (!name.startsWith("charge-curve-") || !name.endsWith(".bin"))
+            continue;
+
+        long suffix = name.substring(13, name.length() - 4).toInt();
+        if (suffix < (long)first_file || suffix > (long)last_file)
+            to_remove.push_back(name);
+    }
+    folder.close();
+
+    for (const String &name : to_remove)
+        LittleFS.remove(String(CHARGE_CURVE_FOLDER) + "/" + name);
+}
+
+WebServerRequestReturnProtect ChargeCurve::send(WebServerRequest &request, uint32_t file, uint32_t record_number, uint32_t start_time)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+
+    String name = filename(file);
+    File f;
+    if (LittleFS.exists(name))
+        f = LittleFS.open(name);
+
+    // The header needs the number of samples. Reading the file twice is cheaper than buffering the curve.
+    uint32_t minutes = 0;
+    if (f) {
+        forEachChunk(f, [record_number, &minutes](const ChargeCurveChunkHeader &header, const uint8_t *tokens) {
+            if (header.record_number == record_number)
+                minutes = max(minutes, (uint32_t)(header.first_minute + header.minutes));
+        });
+    }
+
+    bool send_open_chunk = active && this->file == file && this->record_number == record_number;
+    if (send_open_chunk)
+        minutes = max(minutes, (uint32_t)(chunk_first_minute + chunk_minutes));
+
+    if (minutes == 0)
+        return request.send(404, "text/plain", "No charge curve was recorded for this charge");
+
+    BufferedChunkWriter writer(request);
+    request.beginChunkedResponse(200, "application/octet-stream");
+
+    ValueHistoryBinaryHeader header{VALUE_HISTORY_BINARY_VERSION, 0, (uint16_t)minutes, 60 * 1000, start_time};
+    writer.write((const char *)&header, sizeof(header));
+
+    uint32_t position = 0;
+    int16_t last_value = 0;
+
+    if (f) {
+        f.seek(0);
+        forEachChunk(f, [&writer, record_number, &position, &last_value](const ChargeCurveChunkHeader &chunk_header, const uint8_t *tokens) {
+            if (chunk_header.record_number == record_number)
+                sendChunk(writer, chunk_header, tokens, &position, &last_value);
+        });
+    }
+
+    if (send_open_chunk) {
+        // The open chunk's trailing empty run is not encoded yet. sendChunk fills it up.
+        ChargeCurveChunkHeader open_header{record_number, chunk_first_minute, chunk_minutes, chunk_length};
+        sendChunk(writer, open_header, chunk, &position, &last_value);
+    }
+
+    writer.flush();
+    return request.endChunkedResponse();
+}
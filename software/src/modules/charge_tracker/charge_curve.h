@@ -0,0 +1,99 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include <mutex>
+
+#include "web_server.h"
+
+#define CHARGE_CURVE_FOLDER "/charge-curves"
+// Closed minutes are buffered in RAM and appended to flash as one chunk.
+#define CHARGE_CURVE_FLUSH_MINUTES 15
+#define CHARGE_CURVE_CHUNK_MAX_LENGTH 64
+// Stop recording curves into a file once it reaches this size.
+#define CHARGE_CURVE_MAX_FILE_SIZE 65536
+// Leave this much space for charge records, user names and configuration.
+#define CHARGE_CURVE_MIN_FREE_SPACE 65536
+
+// The power of each charge is recorded with one sample per minute.
+// The curves of all charges of charge record file n are appended to the
+// curve file n, which is removed together with the record file.
+//
+// A curve file is a sequence of chunks. Every chunk is a ChargeCurveChunkHeader
+// followed by length bytes of tokens in the format of the meter's binary history:
+// Even tokens are zigzag(sample - previous sample) << 1, odd tokens (n << 1) | 1
+// stand for n minutes without samples. The previous sample starts at 0 in every chunk.
+struct ChargeCurveChunkHeader {
+    uint32_t record_number;
+    uint16_t first_minute; // since the start of the charge
+    uint8_t minutes; // covered by the tokens
+    uint8_t length; // of the tokens in bytes
+} __attribute__((packed));
+
+class ChargeCurve
+{
+public:
+    ChargeCurve()
+    {
+    }
+
+    void setup();
+
+    void start(uint32_t file, uint32_t record_number);
+    // Continues recording a charge that was started before a reboot.
+    void resume(uint32_t file, uint32_t record_number, uint32_t charge_timestamp_minutes);
+    void end();
+
+    void removeFile(uint32_t file);
+    void removeFilesOutside(uint32_t first_file, uint32_t last_file);
+
+    // Sends the curve in the meter's binary history format (ValueHistoryBinaryHeader followed by tokens)
+    // with one sample per minute. start_time is the start of the charge in seconds since the epoch or 0.
+    WebServerRequestReturnProtect send(WebServerRequest &request, uint32_t file, uint32_t record_number, uint32_t start_time);
+
+    static String filename(uint32_t file);
+
+private:
+    void addSample(int16_t power);
+    void closeMinute();
+    void appendToken(uint32_t token);
+    void flushChunk();
+    size_t repairFile(uint32_t file, uint32_t record_number);
+
+    std::mutex mutex;
+
+    bool active = false;
+    bool log_dropped_chunks = true;
+    uint32_t file = 0;
+    uint32_t record_number = 0;
+
+    // Samples of the current minute
+    int32_t sample_sum = 0;
+    uint32_t sample_count = 0;
+
+    // The chunk that is not written to flash yet
+    uint16_t chunk_first_minute = 0;
+    uint8_t chunk_minutes = 0;
+    uint8_t chunk_length = 0;
+    uint8_t chunk_empty_run = 0;
+    int16_t chunk_last_value = 0;
+    uint8_t chunk[CHARGE_CURVE_CHUNK_MAX_LENGTH];
+};
@@ -26,45 +26,150 @@
 #include "task_scheduler.h"
 #include "tools.h"
 
+#include <functional>
 #include <memory>
 
 extern TaskScheduler task_scheduler;
 
+// Version 1 of the record format. Files contained only the records.
+// Those files are converted to version 2 when booting.
+struct ChargeStartV1 {
+    uint32_t timestamp_minutes = 0;
+    float meter_start = 0.0f;
+    uint8_t user_id = 0;
+} __attribute__((packed));
+
+static_assert(sizeof(ChargeStartV1) == 9, "Unexpected size of ChargeStartV1");
+
+struct ChargeEndV1 {
+    uint32_t charge_duration : 24;
+    float meter_end = 0.0f;
+} __attribute__((packed));
+
+static_assert(sizeof(ChargeEndV1) == 7, "Unexpected size of ChargeEndV1");
+
+#define CHARGE_RECORD_V1_SIZE (sizeof(ChargeStartV1) + sizeof(ChargeEndV1))
+#define CHARGE_RECORDS_PER_FILE_V1 256
+#define CHARGE_RECORD_FILE_COUNT_V1 30
+
+static_assert(CHARGE_RECORD_V1_SIZE == 16, "Unexpected size of ChargeStartV1 + ChargeEndV1");
+
+#define CHARGE_RECORD_VERSION 2
+
+struct ChargeRecordFileHeader {
+    char magic[2];
+    uint8_t version;
+    uint8_t record_size;
+    uint32_t first_record_number;
+} __attribute__((packed));
+
+static_assert(sizeof(ChargeRecordFileHeader) == 8, "Unexpected size of ChargeRecordFileHeader");
+
+// Start and end of a charge are written separately. Both have their own checksum,
+// so that a torn write can be detected.
 struct ChargeStart {
+    uint32_t record_number = 0;
     uint32_t timestamp_minutes = 0;
     float meter_start = 0.0f;
     uint8_t user_id = 0;
+    uint8_t crc = 0; // of the preceding bytes
 } __attribute__((packed));
 
-static_assert(sizeof(ChargeStart) == 9, "Unexpected size of ChargeStart");
+static_assert(sizeof(ChargeStart) == 14, "Unexpected size of ChargeStart");
 
 struct ChargeEnd {
     uint32_t charge_duration : 24;
     float meter_end = 0.0f;
+    uint8_t crc = 0; // of the start's record number and the preceding bytes
 } __attribute__((packed));
 
-static_assert(sizeof(ChargeEnd) == 7, "Unexpected size of ChargeEnd");
+static_assert(sizeof(ChargeEnd) == 8, "Unexpected size of ChargeEnd");
 
 #define CHARGE_RECORD_SIZE (sizeof(ChargeStart) + sizeof(ChargeEnd))
 
-static_assert(CHARGE_RECORD_SIZE == 16, "Unexpected size of ChargeStart + ChargeEnd");
+static_assert(CHARGE_RECORD_SIZE == 22, "Unexpected size of ChargeStart + ChargeEnd");
 
 #define CHARGE_RECORD_FOLDER "/charge-records"
-// 30 files with 256 records each: 7680 records @ ~ max. 10 records per day = ~ 2 years and one month of records.
-#define CHARGE_RECORD_FILE_COUNT 30
+// Random ID of the charge log. Record numbers restart at 0 with a new ID.
+#define CHARGE_LOG_ID_FILE CHARGE_RECORD_FOLDER "/log-id"
 #define CHARGE_RECORD_MAX_FILE_SIZE 4096
+#define CHARGE_RECORDS_PER_FILE ((CHARGE_RECORD_MAX_FILE_SIZE - sizeof(ChargeRecordFileHeader)) / CHARGE_RECORD_SIZE)
+#define CHARGE_RECORD_FULL_FILE_SIZE (sizeof(ChargeRecordFileHeader) + CHARGE_RECORDS_PER_FILE * CHARGE_RECORD_SIZE)
 
-#define CHARGE_RECORD_LAST_CHARGES_SIZE 30
+static_assert(CHARGE_RECORD_FILE_COUNT * CHARGE_RECORDS_PER_FILE >= CHARGE_RECORD_FILE_COUNT_V1 * CHARGE_RECORDS_PER_FILE_V1,
+              "The records of all version 1 files have to fit into the version 2 files");
+
+// CRC-8 with polynomial 0x07
+static uint8_t crc8(const void *data, size_t len, uint8_t crc = 0)
+{
+    const uint8_t *bytes = (const uint8_t *)data;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc & 0x80) != 0 ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1);
+    }
+    return crc;
+}
+
+static uint8_t startCrc(const ChargeStart &cs)
+{
+    return crc8(&cs, sizeof(cs) - sizeof(cs.crc));
+}
+
+static uint8_t endCrc(const ChargeEnd &ce, uint32_t record_number)
+{
+    return crc8(&ce, sizeof(ce) - sizeof(ce.crc), crc8(&record_number, sizeof(record_number)));
+}
+
+static ChargeRecordFileHeader makeFileHeader(uint32_t first_record_number)
+{
+    return ChargeRecordFileHeader{{'C', 'R'}, CHARGE_RECORD_VERSION, CHARGE_RECORD_SIZE, first_record_number};
+}
+
+static bool readFileHeader(File &f, ChargeRecordFileHeader *header)
+{
+    return f.read((uint8_t *)header, sizeof(*header)) == sizeof(*header)
+        && header->magic[0] == 'C'
+        && header->magic[1] == 'R'
+        && header->version == CHARGE_RECORD_VERSION
+        && header->record_size == CHARGE_RECORD_SIZE;
+}
+
+// Calls cb for every record of f, starting at the current position, which has to be at a record boundary.
+// Records with a wrong checksum are skipped. ce is nullptr for a charge that was not ended yet.
+static void forEachRecord(File &f, std::function<void(const ChargeStart &cs, const ChargeEnd *ce)> &&cb)
+{
+    // Read whole records at once. LittleFS only returns less than requested at the end of the file.
+    uint8_t buf[CHARGE_RECORD_SIZE * 16];
+    int read;
+    while ((read = f.read(buf, sizeof(buf))) > 0) {
+        for (size_t offset = 0; offset + sizeof(ChargeStart) <= (size_t)read; offset += CHARGE_RECORD_SIZE) {
+            ChargeStart cs;
+            memcpy(&cs, buf + offset, sizeof(cs));
+            if (cs.crc != startCrc(cs))
+                continue;
+
+            if (offset + CHARGE_RECORD_SIZE > (size_t)read) {
+                cb(cs, nullptr);
+                continue;
+            }
+
+            ChargeEnd ce;
+            memcpy(&ce, buf + offset + sizeof(cs), sizeof(ce));
+            if (ce.crc != endCrc(ce, cs.record_number))
+                continue;
+
+            cb(cs, &ce);
+        }
+    }
+}
 
 ChargeTracker::ChargeTracker()
 {
-    last_charges = Config::Array({},
-        new Config{Config::Object({
-            {"timestamp_minutes", Config::Uint32(0)},
-            {"charge_duration", Config::Uint32(0)},
-            {"user_id", Config::Uint8(0)},
-            {"energy_charged", Config::Float(0)}
-        })}, 0, CHARGE_RECORD_LAST_CHARGES_SIZE, Config::type_id<Config::ConfObject>());
+    last_charges = Config::Null();
+    last_charges.custom_serializer = [this]() {
+        return this->serializeLastCharges();
+    };
 
     current_charge = Config::Object({
         {"user_id", Config::Int16(-1)},
@@ -86,32 +191,311 @@ String ChargeTracker::chargeRecordFilename(uint32_t i)
     return String(CHARGE_RECORD_FOLDER) + "/charge-record-" + i + ".bin";
 }
 
+// Records are numbered globally. Every record stores its number and every file the number of its first record,
+// so the numbers don't change when old files are removed. Records converted from version 1
+// have the number (n - 1) * CHARGE_RECORDS_PER_FILE_V1 + r for record r of file n.
+uint32_t ChargeTracker::firstRecordNumber()
+{
+    return fileIndex(this->first_charge_record)->first_record_number;
+}
+
+uint32_t ChargeTracker::nextRecordNumber()
+{
+    return fileIndex(this->last_charge_record)->first_record_number + fileIndex(this->last_charge_record)->record_count;
+}
+
+ChargeRecordFileIndex *ChargeTracker::fileIndex(uint32_t file)
+{
+    return &record_index[file % CHARGE_RECORD_INDEX_SIZE];
+}
+
+static void indexChargeStart(ChargeRecordFileIndex *index, const ChargeStart &cs)
+{
+    index->user_ids[cs.user_id / 32] |= (1 << (cs.user_id % 32));
+
+    // Charges started before the clock was synced have no timestamp.
+    if (cs.timestamp_minutes == 0)
+        return;
+
+    if (index->first_timestamp_minutes == 0)
+        index->first_timestamp_minutes = cs.timestamp_minutes;
+    index->last_timestamp_minutes = cs.timestamp_minutes;
+}
+
+// Validates the records and fills the index entry of the file in one pass.
+// Only the last file is appended to, so only it can contain a torn write.
+// It is cut after the last valid start or end of a charge.
+void ChargeTracker::indexRecordFile(uint32_t file, bool is_last_file)
+{
+    ChargeRecordFileIndex *index = fileIndex(file);
+    uint32_t expected_first_record_number = file > this->first_charge_record ? fileIndex(file - 1)->first_record_number + fileIndex(file - 1)->record_count : 0;
+
+    memset(index, 0, sizeof(*index));
+    index->first_record_number = expected_first_record_number;
+
+    String name = chargeRecordFilename(file);
+    File f = LittleFS.open(name);
+    size_t size = f.size();
+
+    ChargeRecordFileHeader header;
+    if (!readFileHeader(f, &header)) {
+        f.close();
+
+        if (!is_last_file || size > sizeof(header)) {
+            logger.printfln("Charge record file %s has an invalid header. Ignoring it.", name.c_str());
+            index->record_count = CHARGE_RECORDS_PER_FILE;
+            return;
+        }
+
+        // The file was created but the header was not written completely.
+        f = LittleFS.open(name, "w", true);
+        header = makeFileHeader(expected_first_record_number);
+        f.write((const uint8_t *)&header, sizeof(header));
+        return;
+    }
+
+    index->first_record_number = header.first_record_number;
+
+    size_t valid_size = sizeof(header);
+    bool damaged = false;
+
+    uint8_t buf[CHARGE_RECORD_SIZE * 16];
+    int read;
+    while (!damaged && (read = f.read(buf, sizeof(buf))) > 0) {
+        for (size_t offset = 0; offset < (size_t)read; offset += CHARGE_RECORD_SIZE) {
+            ChargeStart cs;
+            if (offset + sizeof(cs) > (size_t)read) {
+                damaged = true;
+                break;
+            }
+
+            memcpy(&cs, buf + offset, sizeof(cs));
+            if (cs.crc != startCrc(cs) || cs.record_number != header.first_record_number + index->record_count) {
+                damaged = true;
+                break;
+            }
+
+            indexChargeStart(index, cs);
+            valid_size += sizeof(cs);
+
+            // A charge that was not ended yet is only valid at the end of the file.
+            if (offset + CHARGE_RECORD_SIZE > (size_t)read) {
+                damaged = offset + sizeof(cs) != (size_t)read;
+                break;
+            }
+
+            ChargeEnd ce;
+            memcpy(&ce, buf + offset + sizeof(cs), sizeof(ce));
+            if (ce.crc != endCrc(ce, cs.record_number)) {
+                damaged = true;
+                break;
+            }
+
+            valid_size += sizeof(ce);
+            ++index->record_count;
+        }
+    }
+    f.close();
+
+    if (!damaged)
+        return;
+
+    if (!is_last_file) {
+        logger.printfln("Charge record file %s is damaged after %u bytes. Ignoring the damaged part.", name.c_str(), valid_size);
+        return;
+    }
+
+    logger.printfln("Charge record file %s is damaged after %u bytes. Removing the damaged part.", name.c_str(), valid_size);
+    if (!truncate_file(name, valid_size))
+        logger.printfln("Failed to repair charge record file %s", name.c_str());
+}
+
+// Converts the records of version 1 files to version 2. Version 1 files are always the oldest ones.
+// The converted records are appended to new files after the last file. A version 1 file is only removed
+// after all of its records are written, so an interrupted migration is continued after the next reboot.
+// Version 1 kept at most CHARGE_RECORD_FILE_COUNT_V1 files, which always fit into CHARGE_RECORD_FILE_COUNT version 2 files.
+// Files that would not fit anyway are dropped. Their users are added to removed_users.
+bool ChargeTracker::migrateRecordsFromV1(uint32_t *first, uint32_t *last, uint32_t *removed_users)
+{
+    uint32_t last_v1 = *first;
+    for (; last_v1 <= *last; ++last_v1) {
+        File f = LittleFS.open(chargeRecordFilename(last_v1));
+        ChargeRecordFileHeader header;
+        if (f.size() == 0 || readFileHeader(f, &header))
+            break;
+    }
+
+    if (last_v1 == *first)
+        return true;
+    --last_v1;
+
+    logger.printfln("Converting charge record files %u to %u to format version %u", *first, last_v1, CHARGE_RECORD_VERSION);
+
+    const uint32_t max_v1_files = CHARGE_RECORD_FILE_COUNT * CHARGE_RECORDS_PER_FILE / CHARGE_RECORDS_PER_FILE_V1;
+    while (last_v1 - *first + 1 > max_v1_files) {
+        String name = chargeRecordFilename(*first);
+        logger.printfln("Dropping charge record file %s, it does not fit into the new format", name.c_str());
+
+        File f = LittleFS.open(name);
+        uint8_t buf[CHARGE_RECORD_V1_SIZE * 16];
+        int read;
+        while ((read = f.read(buf, sizeof(buf))) > 0) {
+            for (size_t offset = 0; offset + sizeof(ChargeStartV1) <= (size_t)read; offset += CHARGE_RECORD_V1_SIZE) {
+                uint8_t user_id = buf[offset + offsetof(ChargeStartV1, user_id)];
+                removed_users[user_id / 32] |= (1 << (user_id % 32));
+            }
+        }
+        f.close();
+
+        LittleFS.remove(name);
+        ++*first;
+    }
+
+    uint32_t out_file = *last;
+    size_t out_records = CHARGE_RECORDS_PER_FILE;
+    uint32_t next_record_number = 0;
+    File out;
+
+    // Continue an interrupted migration.
+    if (last_v1 != *last) {
+        this->first_charge_record = last_v1 + 1;
+        for (uint32_t file = last_v1 + 1; file <= *last; ++file)
+            indexRecordFile(file, file == *last);
+
+        ChargeRecordFileIndex *index = fileIndex(*last);
+        out_records = index->record_count;
+        next_record_number = index->first_record_number + index->record_count;
+        out = LittleFS.open(chargeRecordFilename(out_file), "a");
+
+        // The start of a charge that was not ended yet is always the last record.
+        if (out.size() >= sizeof(ChargeRecordFileHeader) && ((out.size() - sizeof(ChargeRecordFileHeader)) % CHARGE_RECORD_SIZE) == sizeof(ChargeStart))
+            ++next_record_number;
+    }
+
+    bool success = true;
+
+    for (uint32_t file = *first; success && file <= last_v1; ++file) {
+        String name = chargeRecordFilename(file);
+        File in = LittleFS.open(name);
+        uint32_t record_number = (file - 1) * CHARGE_RECORDS_PER_FILE_V1;
+
+        uint8_t buf[CHARGE_RECORD_V1_SIZE * 16];
+        int read;
+        while (success && (read = in.read(buf, sizeof(buf))) > 0) {
+            for (size_t offset = 0; offset + sizeof(ChargeStartV1) <= (size_t)read; offset += CHARGE_RECORD_V1_SIZE, ++record_number) {
+                if (record_number < next_record_number)
+                    continue;
+
+                if (out_records == CHARGE_RECORDS_PER_FILE) {
+                    out.close();
+                    ++out_file;
+                    out = LittleFS.open(chargeRecordFilename(out_file), "w", true);
+
+                    ChargeRecordFileHeader header = makeFileHeader(record_number);
+                    if (out.write((const uint8_t *)&header, sizeof(header)) != sizeof(header)) {
+                        success = false;
+                        break;
+                    }
+                    out_records = 0;
+                }
+
+                ChargeStartV1 start_v1;
+                memcpy(&start_v1, buf + offset, sizeof(start_v1));
+
+                ChargeStart cs;
+                cs.record_number = record_number;
+                cs.timestamp_minutes = start_v1.timestamp_minutes;
+                cs.meter_start = start_v1.meter_start;
+                cs.user_id = start_v1.user_id;
+                cs.crc = startCrc(cs);
+
+                if (out.write((const uint8_t *)&cs, sizeof(cs)) != sizeof(cs)) {
+                    success = false;
+                    break;
+                }
+
+                // A charge that was not ended yet.
+                if (offset + CHARGE_RECORD_V1_SIZE > (size_t)read)
+                    continue;
+
+                ChargeEndV1 end_v1;
+                memcpy(&end_v1, buf + offset + sizeof(start_v1), sizeof(end_v1));
+
+                ChargeEnd ce;
+                ce.charge_duration = end_v1.charge_duration;
+                ce.meter_end = end_v1.meter_end;
+                ce.crc = endCrc(ce, record_number);
+
+                if (out.write((const uint8_t *)&ce, sizeof(ce)) != sizeof(ce)) {
+                    success = false;
+                    break;
+                }
+                ++out_records;
+            }
+        }
+        in.close();
+
+        if (!success)
+            break;
+
+        // Make sure the converted records are stored before removing the originals.
+        out.flush();
+        LittleFS.remove(name);
+    }
+    out.close();
+
+    if (!success) {
+        logger.printfln("Failed to convert charge records. Is the flash full?");
+        return false;
+    }
+
+    // Nothing was converted and there was no version 2 file yet.
+    if (out_file == last_v1)
+        ++out_file;
+
+    logger.printfln("Converted charge records to format version %u", CHARGE_RECORD_VERSION);
+    *first = last_v1 + 1;
+    *last = out_file;
+    return true;
+}
+
 void ChargeTracker::startCharge(uint32_t timestamp_minutes, float meter_start, uint8_t user_id, uint32_t evse_uptime, uint8_t auth_type, Config::ConfVariant auth_info) {
     std::lock_guard<std::mutex> lock{records_mutex};
     ChargeStart cs;
     File file = LittleFS.open(chargeRecordFilename(this->last_charge_record), "a", true);
 
-    if (file.size() == CHARGE_RECORD_MAX_FILE_SIZE) {
+    if (file.size() >= CHARGE_RECORD_FULL_FILE_SIZE) {
+        uint32_t first_record_number = nextRecordNumber();
+
         ++this->last_charge_record;
         String new_file_name = chargeRecordFilename(this->last_charge_record);
         logger.printfln("Last charge record file %s is full. Creating the new file %s", file.name(), new_file_name.c_str());
         file.close();
 
+        memset(fileIndex(this->last_charge_record), 0, sizeof(ChargeRecordFileIndex));
+        fileIndex(this->last_charge_record)->first_record_number = first_record_number;
         removeOldRecords();
         updateState();
 
         file = LittleFS.open(new_file_name, "w", true);
     }
 
-    if ((file.size() % CHARGE_RECORD_SIZE) != 0) {
-        logger.printfln("Can't track start of charge: Last charge end was not tracked or file is damaged! Offset is %u bytes. Expected 0", file.size() % CHARGE_RECORD_SIZE);
-        // TODO: for robustness we would have to write the last end here? Yes, but only if % == 9. Also write duration 0, so we know this is a "faked" end. Still write the correct meter state.
+    size_t file_size = file.size();
+    if (file_size == 0) {
+        ChargeRecordFileHeader header = makeFileHeader(fileIndex(this->last_charge_record)->first_record_number);
+        file_size = file.write((const uint8_t *)&header, sizeof(header));
+    }
+
+    if (file_size < sizeof(ChargeRecordFileHeader) || ((file_size - sizeof(ChargeRecordFileHeader)) % CHARGE_RECORD_SIZE) != 0) {
+        logger.printfln("Can't track start of charge: Last charge end was not tracked or file is damaged! File size is %u bytes.", file_size);
         return;
     }
 
+    cs.record_number = nextRecordNumber();
     cs.timestamp_minutes = timestamp_minutes;
     cs.meter_start = meter_start;
     cs.user_id = user_id;
+    cs.crc = startCrc(cs);
 
     uint8_t buf[sizeof(ChargeStart)] = {0};
     memcpy(buf, &cs, sizeof(cs));
@@ -119,6 +503,13 @@ void ChargeTracker::startCharge(uint32_t timestamp_minutes, float meter_start, u
     file.write(buf, sizeof(cs));
     logger.printfln("Tracked start of charge.");
 
+    indexChargeStart(fileIndex(this->last_charge_record), cs);
+    curve.start(this->last_charge_record, cs.record_number);
+
+    running_charge_timestamp_minutes = timestamp_minutes;
+    running_charge_meter_start = meter_start;
+    running_charge_user_id = user_id;
+
     current_charge.get("user_id")->updateInt(user_id);
     current_charge.get("meter_start")->updateFloat(meter_start);
     current_charge.get("evse_uptime_start")->updateUint(evse_uptime);
@@ -135,16 +526,15 @@ void ChargeTracker::endCharge(uint32_t charge_duration_seconds, float meter_end)
 
     {
         File file = LittleFS.open(chargeRecordFilename(this->last_charge_record), "a");
-        if ((file.size() % CHARGE_RECORD_SIZE) != sizeof(ChargeStart)) {
-            logger.printfln("Can't track end of charge: Last charge start was not tracked or file is damaged! Offset is %u bytes. Expected %u", file.size() % CHARGE_RECORD_SIZE, sizeof(ChargeStart));
-            // TODO: How to handle this case? Add a charge start with the same meter value as the last end?
-            // This would also mean that all the size checks of startCharge have to be duplicated!
+        if (file.size() < sizeof(ChargeRecordFileHeader) || ((file.size() - sizeof(ChargeRecordFileHeader)) % CHARGE_RECORD_SIZE) != sizeof(ChargeStart)) {
+            logger.printfln("Can't track end of charge: Last charge start was not tracked or file is damaged! File size is %u bytes.", file.size());
             // If we check in ::setup() whether a charge is running, this can never happen.
             return;
         }
 
         ce.charge_duration = charge_duration_seconds;
         ce.meter_end = meter_end;
+        ce.crc = endCrc(ce, nextRecordNumber());
 
         uint8_t buf[sizeof(ChargeEnd)] = {0};
         memcpy(buf, &ce, sizeof(ce));
@@ -153,13 +543,10 @@ void ChargeTracker::endCharge(uint32_t charge_duration_seconds, float meter_end)
     }
     logger.printfln("Tracked end of charge.");
 
-    // We've just written the charge record in the file. It is always safe to read it back again.
-    if (last_charges.count() == CHARGE_RECORD_LAST_CHARGES_SIZE)
-        last_charges.remove(0);
+    curve.end();
+    ++fileIndex(this->last_charge_record)->record_count;
 
-    File f = LittleFS.open(chargeRecordFilename(this->last_charge_record));
-    f.seek(-CHARGE_RECORD_SIZE, SeekMode::SeekEnd);
-    this->readNRecords(&f, 1);
+    addLastCharge(running_charge_timestamp_minutes, charge_duration_seconds, running_charge_user_id, meter_end - running_charge_meter_start);
 
     current_charge.get("user_id")->updateInt(-1);
     current_charge.get("meter_start")->updateFloat(0);
@@ -173,63 +560,39 @@ void ChargeTracker::endCharge(uint32_t charge_duration_seconds, float meter_end)
 
 bool ChargeTracker::is_user_tracked(uint8_t user_id)
 {
-    const size_t user_id_offset = offsetof(ChargeStart, user_id);
-
-    for (int file = this->first_charge_record; file <= this->last_charge_record; ++file) {
-        File f = LittleFS.open(chargeRecordFilename(file));
-        size_t size = f.size();
-        // LittleFS caches internally, so we can read single bytes without a huge performance loss.
-        for (size_t i = 0; i < size; i += CHARGE_RECORD_SIZE) {
-            f.seek(i + user_id_offset);
-            int read_user_id = f.read();
-            if (read_user_id < 0)
-                continue;
-            if (user_id == read_user_id)
-                return true;
-        }
+    for (uint32_t file = this->first_charge_record; file <= this->last_charge_record; ++file) {
+        if ((fileIndex(file)->user_ids[user_id / 32] & (1 << (user_id % 32))) != 0)
+            return true;
     }
     return false;
 }
 
-void ChargeTracker::removeOldRecords()
+void ChargeTracker::removeOldRecords(const uint32_t *removed_users)
 {
-    const size_t user_id_offset = offsetof(ChargeStart, user_id);
-
     uint32_t users_to_delete[8] = {0}; // one bit per user
 
-    while (this->last_charge_record - this->first_charge_record >= 30) {
+    if (removed_users != nullptr)
+        memcpy(users_to_delete, removed_users, sizeof(users_to_delete));
+
+    while (this->last_charge_record - this->first_charge_record >= CHARGE_RECORD_FILE_COUNT) {
         String name = chargeRecordFilename(this->first_charge_record);
         logger.printfln("Got %u charge records. Dropping the first one (%s)", this->last_charge_record - this->first_charge_record, name.c_str());
-        {
-            File f = LittleFS.open(name, "r");
-            size_t size = f.size();
-            for (size_t i = 0; i < size; i += CHARGE_RECORD_SIZE) {
-                f.seek(i + user_id_offset);
-                int x = f.read();
-                if (x < 0)
-                    continue;
-                uint8_t user_id = x;
-                users_to_delete[user_id / 32] |= (1 << (user_id % 32));
-            }
-        }
+
+        ChargeRecordFileIndex *index = fileIndex(this->first_charge_record);
+        for (size_t i = 0; i < ARRAY_SIZE(users_to_delete); ++i)
+            users_to_delete[i] |= index->user_ids[i];
+
         LittleFS.remove(name);
+        curve.removeFile(this->first_charge_record);
         ++this->first_charge_record;
     }
 
     //users_to_delete has now set a bit for every user_id that was used in the deleted charge records.
     //Clear this bit for every user that is still used in the current charge records.
-    for (int file = this->first_charge_record; file < this->last_charge_record; ++file) {
-        File f = LittleFS.open(chargeRecordFilename(file));
-        size_t size = f.size();
-        // LittleFS caches internally, so we can read single bytes without a huge performance loss.
-        for (size_t i = 0; i < size; i += CHARGE_RECORD_SIZE) {
-            f.seek(i + user_id_offset);
-            int x = f.read();
-            if (x < 0)
-                continue;
-            uint8_t user_id = x;
-            users_to_delete[user_id / 32] &= ~(1 << (user_id % 32));
-        }
+    for (uint32_t file = this->first_charge_record; file <= this->last_charge_record; ++file) {
+        ChargeRecordFileIndex *index = fileIndex(file);
+        for (size_t i = 0; i < ARRAY_SIZE(users_to_delete); ++i)
+            users_to_delete[i] &= ~index->user_ids[i];
     }
 
     // Now only users that are save to remove remain.
@@ -240,6 +603,23 @@ void ChargeTracker::removeOldRecords()
     }
 }
 
+void ChargeTracker::setupLogId(bool regenerate)
+{
+    if (!regenerate) {
+        File f = LittleFS.open(CHARGE_LOG_ID_FILE);
+        if (f && f.read((uint8_t *)&log_id, sizeof(log_id)) == sizeof(log_id) && log_id != 0)
+            return;
+    }
+
+    do {
+        log_id = esp_random();
+    } while (log_id == 0);
+
+    File f = LittleFS.open(CHARGE_LOG_ID_FILE, "w");
+    if (!f || f.write((const uint8_t *)&log_id, sizeof(log_id)) != sizeof(log_id))
+        logger.printfln("Failed to write charge log ID.");
+}
+
 bool ChargeTracker::setupRecords()
 {
     if (!LittleFS.mkdir(CHARGE_RECORD_FOLDER)) { // mkdir also returns true if the directory already exists and is a directory.
@@ -250,7 +630,8 @@ bool ChargeTracker::setupRecords()
     File folder = LittleFS.open(CHARGE_RECORD_FOLDER);
     File f;
 
-    uint32_t found_blobs[32] = {0};
+    // While converting from version 1, files of both versions exist.
+    uint32_t found_blobs[CHARGE_RECORD_FILE_COUNT_V1 + CHARGE_RECORD_INDEX_SIZE] = {0};
     size_t found_blobs_size = sizeof(found_blobs) / sizeof(found_blobs[0]);
     int found_blob_counter = 0;
 
@@ -261,6 +642,16 @@ bool ChargeTracker::setupRecords()
             continue;
         }
 
+        // Left over if the ESP was reset while repairing a file.
+        if (name.endsWith(".tmp")) {
+            f.close();
+            LittleFS.remove(String(CHARGE_RECORD_FOLDER) + "/" + name);
+            continue;
+        }
+
+        if (name == "log-id")
+            continue;
+
         if (!name.startsWith("charge-record-") || !name.endsWith(".bin")) {
             logger.printfln("Unexpected file %s in charge record folder", name.c_str());
             continue;
@@ -272,7 +663,7 @@ bool ChargeTracker::setupRecords()
             continue;
         }
 
-        if (found_blob_counter > found_blobs_size) {
+        if (found_blob_counter >= found_blobs_size) {
             logger.printfln("Too many charge records found!");
             return false;
         }
@@ -281,9 +672,13 @@ bool ChargeTracker::setupRecords()
         ++found_blob_counter;
     }
 
+    // Without any record file the record numbers start at 0 again.
+    setupLogId(found_blob_counter == 0);
+
     if (found_blob_counter == 0) {
         this->first_charge_record = 1;
         this->last_charge_record = 1;
+        memset(fileIndex(1), 0, sizeof(ChargeRecordFileIndex));
         return true;
     }
 
@@ -298,74 +693,134 @@ bool ChargeTracker::setupRecords()
             logger.printfln("Non-consecutive charge records found! (Next after %u is %u. Expected was %u", found_blobs[i], found_blobs[i+1], found_blobs[i] + 1);
             return false;
         }
-
-        f = LittleFS.open(chargeRecordFilename(found_blobs[i]));
-        if (f.size() != CHARGE_RECORD_MAX_FILE_SIZE) {
-            logger.printfln("Charge record %s is too long: %u bytes", f.name(), f.size());
-            return false;
-        }
     }
-
-    String last_file_name = chargeRecordFilename(found_blobs[found_blob_counter - 1]);
-    f = LittleFS.open(last_file_name, "a");
-    size_t last_file_size = f.size();
-    logger.printfln("Last charge record size is %u (%u, %u)", last_file_size, f.size(), (last_file_size % CHARGE_RECORD_SIZE));
     f.close();
-    if (last_file_size > CHARGE_RECORD_MAX_FILE_SIZE) {
-        logger.printfln("Last charge record %s is too long: %u bytes", f.name(), f.size());
+
+    uint32_t removed_users[8] = {0}; // one bit per user
+    if (!migrateRecordsFromV1(&first, &last, removed_users))
         return false;
-    }
 
     this->first_charge_record = first;
     this->last_charge_record = last;
 
-    removeOldRecords();
+    for (uint32_t file = first; file <= last; ++file)
+        indexRecordFile(file, file == last);
+
+    removeOldRecords(removed_users);
     return true;
 }
 
 size_t ChargeTracker::completeRecordsInLastFile()
 {
-    File file = LittleFS.open(chargeRecordFilename(this->last_charge_record));
-    return file.size() / CHARGE_RECORD_SIZE;
+    return fileIndex(this->last_charge_record)->record_count;
 }
 
 bool ChargeTracker::currentlyCharging()
 {
     File file = LittleFS.open(chargeRecordFilename(this->last_charge_record));
-    return (file.size() % CHARGE_RECORD_SIZE) == sizeof(ChargeStart);
+    return file.size() >= sizeof(ChargeRecordFileHeader) && ((file.size() - sizeof(ChargeRecordFileHeader)) % CHARGE_RECORD_SIZE) == sizeof(ChargeStart);
 }
 
-void ChargeTracker::readNRecords(File *f, size_t records_to_read)
+// Adds the last records_to_read complete records of the file to last_charges.
+// The position is taken from the index, so that a damaged part at the end of the file is skipped.
+// Records with a wrong checksum are skipped, for example those of a file with an invalid header.
+void ChargeTracker::readLastRecords(uint32_t file, size_t records_to_read)
 {
+    ChargeRecordFileIndex *index = fileIndex(file);
+    records_to_read = std::min(records_to_read, (size_t)index->record_count);
+
+    File f = LittleFS.open(chargeRecordFilename(file));
+    if (!f.seek(sizeof(ChargeRecordFileHeader) + (index->record_count - records_to_read) * CHARGE_RECORD_SIZE))
+        return;
+
     uint8_t buf[CHARGE_RECORD_SIZE];
     ChargeStart cs;
     ChargeEnd ce;
 
-    for (int i = 0; i < records_to_read; ++i) {
-        memset(buf, 0, sizeof(buf));
-        f->read(buf, CHARGE_RECORD_SIZE);
+    for (size_t i = 0; i < records_to_read; ++i) {
+        if (f.read(buf, CHARGE_RECORD_SIZE) != CHARGE_RECORD_SIZE)
+            break;
 
         memcpy(&cs, buf, sizeof(cs));
         memcpy(&ce, buf + sizeof(cs), sizeof(ce));
 
-        last_charges.add();
-        last_charges.get(last_charges.count() - 1)->get("timestamp_minutes")->updateUint(cs.timestamp_minutes);
-        last_charges.get(last_charges.count() - 1)->get("charge_duration")->updateUint(ce.charge_duration);
-        last_charges.get(last_charges.count() - 1)->get("user_id")->updateUint(cs.user_id);
-        last_charges.get(last_charges.count() - 1)->get("energy_charged")->updateFloat((cs.meter_start == NAN || ce.meter_end == NAN) ? NAN : ce.meter_end - cs.meter_start);
+        if (cs.crc != startCrc(cs) || ce.crc != endCrc(ce, cs.record_number))
+            continue;
+
+        addLastCharge(cs.timestamp_minutes, ce.charge_duration, cs.user_id, ce.meter_end - cs.meter_start);
+    }
+}
+
+// Overwrites the oldest charge if the ring is full.
+void ChargeTracker::addLastCharge(uint32_t timestamp_minutes, uint32_t charge_duration, uint8_t user_id, float energy_charged)
+{
+    std::lock_guard<std::mutex> lock{last_charges_mutex};
+
+    size_t idx = (last_charges_first + last_charges_count) % CHARGE_RECORD_LAST_CHARGES_SIZE;
+    if (last_charges_count == CHARGE_RECORD_LAST_CHARGES_SIZE)
+        last_charges_first = (last_charges_first + 1) % CHARGE_RECORD_LAST_CHARGES_SIZE;
+    else
+        ++last_charges_count;
+
+    LastCharge &charge = last_charges_ring[idx];
+    charge.timestamp_minutes = timestamp_minutes;
+    charge.charge_duration = charge_duration;
+    charge.user_id = user_id;
+    charge.energy_charged = energy_charged;
+
+    last_charges.updated = 0xFF;
+}
+
+// Same format as the Config array of objects that was used before.
+String ChargeTracker::serializeLastCharges()
+{
+    // Don't take records_mutex: The record handlers hold it while streaming a response to a possibly slow client.
+    LastCharge charges[CHARGE_RECORD_LAST_CHARGES_SIZE];
+    size_t count;
+    {
+        std::lock_guard<std::mutex> lock{last_charges_mutex};
+        count = last_charges_count;
+        for (size_t i = 0; i < count; ++i)
+            charges[i] = last_charges_ring[(last_charges_first + i) % CHARGE_RECORD_LAST_CHARGES_SIZE];
+    }
+
+    String result;
+    result.reserve(2 + count * 96);
+    result += "[";
+
+    for (size_t i = 0; i < count; ++i) {
+        const LastCharge &charge = charges[i];
+
+        char energy[16];
+        if (isnan(charge.energy_charged))
+            strcpy(energy, "null");
+        else
+            snprintf(energy, sizeof(energy), "%.3f", charge.energy_charged);
+
+        char buf[128];
+        snprintf(buf, sizeof(buf), "%s{\"timestamp_minutes\":%u,\"charge_duration\":%u,\"user_id\":%u,\"energy_charged\":%s}",
+                 i == 0 ? "" : ",",
+                 charge.timestamp_minutes,
+                 (uint32_t)charge.charge_duration,
+                 charge.user_id,
+                 energy);
+        result += buf;
     }
+
+    result += "]";
+    return result;
 }
 
 void ChargeTracker::updateState()
 {
-    auto records = this->last_charge_record - this->first_charge_record + 1;
-    state.get("tracked_charges")->updateUint((records - 1) * (CHARGE_RECORD_MAX_FILE_SIZE / CHARGE_RECORD_SIZE) + completeRecordsInLastFile());
+    state.get("tracked_charges")->updateUint(nextRecordNumber() - firstRecordNumber());
 
     File f = LittleFS.open(chargeRecordFilename(this->first_charge_record));
     ChargeStart cs;
-    if (f.size() >= sizeof(cs)) {
+    if (f.size() >= sizeof(ChargeRecordFileHeader) + sizeof(cs)) {
         uint8_t buf[sizeof(cs)];
 
+        f.seek(sizeof(ChargeRecordFileHeader));
         memset(buf, 0, sizeof(buf));
         f.read(buf, sizeof(cs));
 
@@ -381,57 +836,345 @@ void ChargeTracker::setup()
         return;
     }
 
+    curve.setup();
+    curve.removeFilesOutside(this->first_charge_record, this->last_charge_record);
+
     // Fill charge_tracker/last_charges
     bool charging = currentlyCharging();
+
+    if (charging) {
+        // The start of the running charge follows the complete records.
+        File f = LittleFS.open(chargeRecordFilename(this->last_charge_record));
+        f.seek(sizeof(ChargeRecordFileHeader) + completeRecordsInLastFile() * CHARGE_RECORD_SIZE);
+
+        ChargeStart cs;
+        if (f.read((uint8_t *)&cs, sizeof(cs)) == sizeof(cs) && cs.crc == startCrc(cs)) {
+            curve.resume(this->last_charge_record, cs.record_number, cs.timestamp_minutes);
+
+            running_charge_timestamp_minutes = cs.timestamp_minutes;
+            running_charge_meter_start = cs.meter_start;
+            running_charge_user_id = cs.user_id;
+        }
+    }
     size_t records_in_last_file = completeRecordsInLastFile();
 
-    if (records_in_last_file < CHARGE_RECORD_LAST_CHARGES_SIZE && LittleFS.exists(chargeRecordFilename(this->last_charge_record - 1))) {
-        size_t records_to_read = CHARGE_RECORD_LAST_CHARGES_SIZE - records_in_last_file;
-        File f = LittleFS.open(chargeRecordFilename(this->last_charge_record - 1));
-        f.seek(-(records_to_read * CHARGE_RECORD_SIZE), SeekMode::SeekEnd);
+    if (records_in_last_file < CHARGE_RECORD_LAST_CHARGES_SIZE && this->last_charge_record > this->first_charge_record)
+        this->readLastRecords(this->last_charge_record - 1, CHARGE_RECORD_LAST_CHARGES_SIZE - records_in_last_file);
+
+    this->readLastRecords(this->last_charge_record, CHARGE_RECORD_LAST_CHARGES_SIZE);
+
+    updateState();
+}
+
+#define QUERY_GROUP_BY_NONE 0
+#define QUERY_GROUP_BY_USER 1
+#define QUERY_GROUP_BY_DAY 2
+#define QUERY_GROUP_BY_MONTH 3
 
-        this->readNRecords(&f, records_to_read);
+struct ChargeQueryTotal {
+    uint32_t charges;
+    uint32_t charge_duration;
+    float energy_charged;
+};
+
+static void writeQueryTotal(BufferedChunkWriter &writer, bool csv, bool first, const char *key_name, const char *key, const ChargeQueryTotal &total)
+{
+    if (csv) {
+        writer.printf("%s,%u,%u,%.3f\r\n", key, total.charges, total.charge_duration, total.energy_charged);
+        return;
     }
 
-    size_t records_to_read = min(records_in_last_file, (size_t)CHARGE_RECORD_LAST_CHARGES_SIZE);
-    {
-        File f = LittleFS.open(chargeRecordFilename(this->last_charge_record));
-        f.seek(-(records_to_read * CHARGE_RECORD_SIZE) - (charging ? sizeof(ChargeStart) : 0), SeekMode::SeekEnd);
-        this->readNRecords(&f, records_to_read);
+    writer.printf("%s{\"%s\":%s,\"charges\":%u,\"charge_duration\":%u,\"energy_charged\":%.3f}",
+                  first ? "" : ",", key_name, key, total.charges, total.charge_duration, total.energy_charged);
+}
+
+// Query parameters:
+// from, to: Only records that started in this range (timestamps in minutes, inclusive).
+// users: Comma separated list of user IDs.
+// group_by: user, day or month. Returns the totals of each group instead of the records.
+//           Days and months are in local time. Records without timestamp are skipped when grouping by time.
+// format: json (default) or csv
+WebServerRequestReturnProtect ChargeTracker::queryRecords(WebServerRequest &request)
+{
+    String from_param = request.queryParam("from");
+    String to_param = request.queryParam("to");
+    String users_param = request.queryParam("users");
+    String group_by_param = request.queryParam("group_by");
+    String format_param = request.queryParam("format");
+
+    uint32_t from = from_param.length() == 0 ? 0 : strtoul(from_param.c_str(), nullptr, 10);
+    uint32_t to = to_param.length() == 0 ? UINT32_MAX : strtoul(to_param.c_str(), nullptr, 10);
+
+    uint32_t user_filter[8]; // one bit per user
+    memset(user_filter, users_param.length() == 0 ? 0xFF : 0, sizeof(user_filter));
+
+    for (int start = 0; start < (int)users_param.length();) {
+        int end = users_param.indexOf(',', start);
+        if (end < 0)
+            end = users_param.length();
+
+        // toInt would turn empty or non-numeric entries into the anonymous user 0.
+        String user_param = users_param.substring(start, end);
+        char *user_end = nullptr;
+        long user_id = strtol(user_param.c_str(), &user_end, 10);
+        if (user_param.length() == 0 || *user_end != '\0' || user_id < 0 || user_id > 255)
+            return request.send(400, "text/plain", "User IDs must be between 0 and 255");
+
+        user_filter[user_id / 32] |= (1 << (user_id % 32));
+        start = end + 1;
     }
 
-    updateState();
+    int group_by;
+    if (group_by_param.length() == 0)
+        group_by = QUERY_GROUP_BY_NONE;
+    else if (group_by_param == "user")
+        group_by = QUERY_GROUP_BY_USER;
+    else if (group_by_param == "day")
+        group_by = QUERY_GROUP_BY_DAY;
+    else if (group_by_param == "month")
+        group_by = QUERY_GROUP_BY_MONTH;
+    else
+        return request.send(400, "text/plain", "group_by must be user, day or month");
+
+    if (format_param.length() != 0 && format_param != "json" && format_param != "csv")
+        return request.send(400, "text/plain", "format must be json or csv");
+    bool csv = format_param == "csv";
+
+    // Totals per user are only known after the last record. Days and months are contiguous,
+    // because the records are stored in chronological order, so only the current group is kept.
+    std::unique_ptr<ChargeQueryTotal[]> user_totals;
+    if (group_by == QUERY_GROUP_BY_USER) {
+        user_totals = std::unique_ptr<ChargeQueryTotal[]>(new ChargeQueryTotal[256]());
+        if (user_totals == nullptr)
+            return request.send(507);
+    }
+
+    std::lock_guard<std::mutex> lock{records_mutex};
+
+    BufferedChunkWriter writer(request);
+    request.beginChunkedResponse(200, csv ? "text/csv; charset=utf-8" : "application/json; charset=utf-8");
+
+    const char *time_key_name = group_by == QUERY_GROUP_BY_DAY ? "day" : "month";
+    if (csv) {
+        if (group_by == QUERY_GROUP_BY_NONE)
+            writer.printf("timestamp_minutes,charge_duration,user_id,energy_charged\r\n");
+        else
+            writer.printf("%s,charges,charge_duration,energy_charged\r\n", group_by == QUERY_GROUP_BY_USER ? "user_id" : time_key_name);
+    } else {
+        writer.write("[", 1);
+    }
+
+    bool first_output = true;
+    char group_key[16] = {0};
+    ChargeQueryTotal group_total = {0, 0, 0};
+
+    for (uint32_t file = this->first_charge_record; file <= this->last_charge_record; ++file) {
+        ChargeRecordFileIndex *index = fileIndex(file);
+
+        // Skip files that can't contain matching records.
+        if (index->record_count == 0 || (from > 0 && index->last_timestamp_minutes < from) || index->first_timestamp_minutes > to)
+            continue;
+
+        bool user_in_file = false;
+        for (size_t i = 0; i < ARRAY_SIZE(user_filter); ++i)
+            user_in_file |= (index->user_ids[i] & user_filter[i]) != 0;
+        if (!user_in_file)
+            continue;
+
+        File f = LittleFS.open(chargeRecordFilename(file));
+        f.seek(sizeof(ChargeRecordFileHeader));
+
+        forEachRecord(f, [&](const ChargeStart &cs, const ChargeEnd *end) {
+            if (end == nullptr)
+                return;
+            const ChargeEnd &ce = *end;
+
+            if (cs.timestamp_minutes < from || cs.timestamp_minutes > to)
+                return;
+            if ((user_filter[cs.user_id / 32] & (1 << (cs.user_id % 32))) == 0)
+                return;
+
+            float energy_charged = (isnan(cs.meter_start) || isnan(ce.meter_end)) ? NAN : ce.meter_end - cs.meter_start;
+
+            if (group_by == QUERY_GROUP_BY_NONE) {
+                if (csv) {
+                    writer.printf("%u,%u,%u,", cs.timestamp_minutes, (uint32_t)ce.charge_duration, cs.user_id);
+                    if (!isnan(energy_charged))
+                        writer.printf("%.3f", energy_charged);
+                    writer.write("\r\n", 2);
+                } else {
+                    writer.printf("%s{\"timestamp_minutes\":%u,\"charge_duration\":%u,\"user_id\":%u,\"energy_charged\":",
+                                  first_output ? "" : ",", cs.timestamp_minutes, (uint32_t)ce.charge_duration, cs.user_id);
+                    if (isnan(energy_charged))
+                        writer.write("null}", 5);
+                    else
+                        writer.printf("%.3f}", energy_charged);
+                }
+                first_output = false;
+                return;
+            }
+
+            ChargeQueryTotal *total;
+            if (group_by == QUERY_GROUP_BY_USER) {
+                total = &user_totals[cs.user_id];
+            } else {
+                if (cs.timestamp_minutes == 0)
+                    return;
+
+                time_t t = (time_t)cs.timestamp_minutes * 60;
+                struct tm timeinfo;
+                localtime_r(&t, &timeinfo);
+
+                char key[16];
+                if (group_by == QUERY_GROUP_BY_DAY)
+                    snprintf(key, sizeof(key), "\"%04d-%02d-%02d\"", timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday);
+                else
+                    snprintf(key, sizeof(key), "\"%04d-%02d\"", timeinfo.tm_year + 1900, timeinfo.tm_mon + 1);
+
+                if (strcmp(key, group_key) != 0) {
+                    if (group_total.charges > 0) {
+                        writeQueryTotal(writer, csv, first_output, time_key_name, group_key, group_total);
+                        first_output = false;
+                    }
+                    memcpy(group_key, key, sizeof(key));
+                    group_total = {0, 0, 0};
+                }
+                total = &group_total;
+            }
+
+            ++total->charges;
+            total->charge_duration += ce.charge_duration;
+            if (!isnan(energy_charged))
+                total->energy_charged += energy_charged;
+        });
+    }
+
+    if (group_by == QUERY_GROUP_BY_USER) {
+        for (int user_id = 0; user_id < 256; ++user_id) {
+            if (user_totals[user_id].charges == 0)
+                continue;
+
+            char key[4];
+            snprintf(key, sizeof(key), "%d", user_id);
+            writeQueryTotal(writer, csv, first_output, "user_id", key, user_totals[user_id]);
+            first_output = false;
+        }
+    } else if (group_by != QUERY_GROUP_BY_NONE && group_total.charges > 0) {
+        writeQueryTotal(writer, csv, first_output, time_key_name, group_key, group_total);
+    }
+
+    if (!csv)
+        writer.write("]", 1);
+
+    writer.flush();
+    return request.endChunkedResponse();
 }
 
 void ChargeTracker::register_urls()
 {
+    // since is a record number as returned in the X-Charge-Log-Next header of a previous response.
+    // Only records starting with this number are sent. If it is older than the oldest record
+    // or newer than the newest one (because all charges were removed), all records are sent.
+    // log_id is the X-Charge-Log-Id of the same response. Record numbers restart at 0 after all
+    // charges were removed. The ID then changes and all records are sent.
+    // X-Charge-Log-Start contains the number of the first record sent.
     server.on("/charge_tracker/charge_log", HTTP_GET, [this](WebServerRequest request) {
         std::lock_guard<std::mutex> lock{records_mutex};
 
-        auto url_buf = std::unique_ptr<char[]>(new char[CHARGE_RECORD_MAX_FILE_SIZE]);
-        if (url_buf == nullptr) {
-            return request.send(507);
-        }
+        String since_param = request.queryParam("since");
+        uint32_t since = since_param.length() == 0 ? 0 : strtoul(since_param.c_str(), nullptr, 10);
+
+        String log_id_param = request.queryParam("log_id");
+        if (log_id_param.length() != 0 && strtoul(log_id_param.c_str(), nullptr, 16) != log_id)
+            since = 0;
 
-        File file = LittleFS.open(chargeRecordFilename(this->last_charge_record));
-        size_t file_size = (this->last_charge_record - this->first_charge_record) * CHARGE_RECORD_MAX_FILE_SIZE + file.size();
-        String file_size_string = String(file_size);
+        uint32_t first = firstRecordNumber();
+        uint32_t next = nextRecordNumber();
+        uint32_t start = (since < first || since > next) ? first : since;
+
+        char log_id_buf[9];
+        char start_buf[11];
+        char next_buf[11];
+        snprintf(log_id_buf, ARRAY_SIZE(log_id_buf), "%08x", log_id);
+        snprintf(start_buf, ARRAY_SIZE(start_buf), "%u", start);
+        snprintf(next_buf, ARRAY_SIZE(next_buf), "%u", next);
+        request.addResponseHeader("X-Charge-Log-Id", log_id_buf);
+        request.addResponseHeader("X-Charge-Log-Start", start_buf);
+        request.addResponseHeader("X-Charge-Log-Next", next_buf);
 
         // Don't do a chunked response without any chunk. The webserver does strange things in this case
-        if (file_size == 0) {
+        if (start == next) {
             return request.send(200, "application/octet-stream", "", 0);
         }
 
+        // The log is sent in the version 1 record format, that clients already understand.
+        BufferedChunkWriter writer(request);
         request.beginChunkedResponse(200, "application/octet-stream");
-        for (int i = this->first_charge_record; i <= this->last_charge_record; ++i) {
+        for (uint32_t i = this->first_charge_record; i <= this->last_charge_record; ++i) {
+            ChargeRecordFileIndex *index = fileIndex(i);
+            if (i != this->last_charge_record && start >= fileIndex(i + 1)->first_record_number)
+                continue;
+
             File f = LittleFS.open(chargeRecordFilename(i));
-            int read = f.read((uint8_t *)url_buf.get(), CHARGE_RECORD_MAX_FILE_SIZE);
-            int trunc = read - (read % CHARGE_RECORD_SIZE);
-            request.sendChunk(url_buf.get(), trunc);
+            uint32_t skip = start > index->first_record_number ? start - index->first_record_number : 0;
+            f.seek(sizeof(ChargeRecordFileHeader) + skip * CHARGE_RECORD_SIZE);
+
+            forEachRecord(f, [&writer](const ChargeStart &cs, const ChargeEnd *ce) {
+                if (ce == nullptr)
+                    return;
+
+                ChargeStartV1 start_v1;
+                start_v1.timestamp_minutes = cs.timestamp_minutes;
+                start_v1.meter_start = cs.meter_start;
+                start_v1.user_id = cs.user_id;
+
+                ChargeEndV1 end_v1;
+                end_v1.charge_duration = ce->charge_duration;
+                end_v1.meter_end = ce->meter_end;
+
+                writer.write((const char *)&start_v1, sizeof(start_v1));
+                writer.write((const char *)&end_v1, sizeof(end_v1));
+            });
         }
+        writer.flush();
         return request.endChunkedResponse();
     });
 
+    server.on("/charge_tracker/query", HTTP_GET, [this](WebServerRequest request) {
+        return queryRecords(request);
+    });
+
+    // Power curve of the charge with the given record number, as sent in the X-Charge-Log-* headers.
+    // The number of the running charge is X-Charge-Log-Next.
+    server.on("/charge_tracker/charge_curve", HTTP_GET, [this](WebServerRequest request) {
+        std::lock_guard<std::mutex> lock{records_mutex};
+
+        String record_param = request.queryParam("record");
+        if (record_param.length() == 0)
+            return request.send(400, "text/plain", "record is missing");
+
+        uint32_t record_number = strtoul(record_param.c_str(), nullptr, 10);
+        if (record_number < firstRecordNumber() || record_number > nextRecordNumber())
+            return request.send(404, "text/plain", "Unknown record");
+
+        uint32_t file = this->last_charge_record;
+        while (file > this->first_charge_record && fileIndex(file)->first_record_number > record_number)
+            --file;
+
+        // The curve starts with the charge.
+        uint32_t start_time = 0;
+        {
+            File f = LittleFS.open(chargeRecordFilename(file));
+            f.seek(sizeof(ChargeRecordFileHeader) + (record_number - fileIndex(file)->first_record_number) * CHARGE_RECORD_SIZE);
+
+            ChargeStart cs;
+            if (f.read((uint8_t *)&cs, sizeof(cs)) == sizeof(cs) && cs.crc == startCrc(cs) && cs.record_number == record_number)
+                start_time = cs.timestamp_minutes * 60;
+        }
+
+        return curve.send(request, file, record_number, start_time);
+    });
+
     api.addState("charge_tracker/last_charges", &last_charges, {}, 1000);
     api.addState("charge_tracker/current_charge", &current_charge, {}, 1000);
     api.addState("charge_tracker/state", &state, {}, 1000);
@@ -455,6 +1198,7 @@ void ChargeTracker::register_urls()
         task_scheduler.scheduleOnce([](){
             logger.printfln("Removing all tracked charges and rebooting.");
             remove_directory(CHARGE_RECORD_FOLDER);
+            remove_directory(CHARGE_CURVE_FOLDER);
             users.remove_username_file();
             ESP.restart();
         }, 3000);
@@ -22,12 +22,44 @@
 #include <LittleFS.h>
 
 #include "config.h"
+#include "web_server.h"
+
+#include "charge_curve.h"
 
 #define CHARGE_TRACKER_AUTH_TYPE_NONE 0
 #define CHARGE_TRACKER_AUTH_TYPE_LOST 1
 #define CHARGE_TRACKER_AUTH_TYPE_NFC 2
 #define CHARGE_TRACKER_AUTH_TYPE_NFC_INJECTION 3
 
+// 42 files with 185 records each: 7770 records @ ~ max. 10 records per day = ~ 2 years and one month of records.
+// At least as many as the 30 files with 256 records each of format version 1, so that the migration keeps all of them.
+#define CHARGE_RECORD_FILE_COUNT 42
+// A new file is created before the oldest one is removed.
+#define CHARGE_RECORD_INDEX_SIZE (CHARGE_RECORD_FILE_COUNT + 1)
+
+// Summary of a charge record file. Kept in RAM, so that the files
+// don't have to be read to find out which users are tracked.
+// A charge that was started but not ended yet is included in the users
+// and timestamps, but not in the record count. Timestamps are 0 if no
+// charge in the file has one.
+struct ChargeRecordFileIndex {
+    uint32_t user_ids[8]; // one bit per user
+    uint32_t first_timestamp_minutes;
+    uint32_t last_timestamp_minutes;
+    uint32_t first_record_number;
+    uint16_t record_count;
+};
+
+#define CHARGE_RECORD_LAST_CHARGES_SIZE 30
+
+// Entry of charge_tracker/last_charges
+struct LastCharge {
+    uint32_t timestamp_minutes;
+    uint32_t charge_duration : 24;
+    uint8_t user_id;
+    float energy_charged;
+} __attribute__((packed));
+
 class ChargeTracker
 {
 public:
@@ -40,21 +72,51 @@ public:
 
     uint32_t first_charge_record;
     uint32_t last_charge_record;
+    uint32_t log_id = 0;
 
     String chargeRecordFilename(uint32_t i);
     void startCharge(uint32_t timestamp_minutes, float meter_start, uint8_t user_id, uint32_t evse_uptime, uint8_t auth_type, Config::ConfVariant auth_info);
     void endCharge(uint32_t charge_duration_seconds, float meter_end);
-    void removeOldRecords();
+    // removed_users: one bit per user of records that were removed otherwise
+    void removeOldRecords(const uint32_t *removed_users = nullptr);
     bool setupRecords();
+    void setupLogId(bool regenerate);
     void updateState();
     bool is_user_tracked(uint8_t user_id);
 
     size_t completeRecordsInLastFile();
     bool currentlyCharging();
 
-    void readNRecords(File *f, size_t records_to_read);
+    void readLastRecords(uint32_t file, size_t records_to_read);
+    void addLastCharge(uint32_t timestamp_minutes, uint32_t charge_duration, uint8_t user_id, float energy_charged);
+    String serializeLastCharges();
 
+    WebServerRequestReturnProtect queryRecords(WebServerRequest &request);
+
+    uint32_t firstRecordNumber();
+    uint32_t nextRecordNumber();
+
+    ChargeRecordFileIndex *fileIndex(uint32_t file);
+    void indexRecordFile(uint32_t file, bool is_last_file);
+    bool migrateRecordsFromV1(uint32_t *first, uint32_t *last, uint32_t *removed_users);
+
+    ChargeRecordFileIndex record_index[CHARGE_RECORD_INDEX_SIZE];
+
+    ChargeCurve curve;
+
+    // Serialized from last_charges_ring. The Config value is not used.
     ConfigRoot last_charges;
+    // Ring buffer of the last charges. last_charges_first is the oldest one.
+    LastCharge last_charges_ring[CHARGE_RECORD_LAST_CHARGES_SIZE];
+    size_t last_charges_first = 0;
+    size_t last_charges_count = 0;
+    // Only protects the ring, so that serializing it never waits for the record handlers.
+    std::mutex last_charges_mutex;
+
+    // Start of the running charge. Restored from the last record after a reboot.
+    uint32_t running_charge_timestamp_minutes = 0;
+    float running_charge_meter_start = NAN;
+    uint8_t running_charge_user_id = 0;
     ConfigRoot current_charge;
     ConfigRoot state;
 
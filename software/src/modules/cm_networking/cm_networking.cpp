@@ -30,6 +30,7 @@
 #include "lwip/ip_addr.h"
 #include "lwip/opt.h"
 #include "lwip/dns.h"
+#include <algorithm>
 #include <cstring>
 
 #include "TFJson.h"
@@ -39,14 +40,34 @@ extern API api;
 extern EventLog logger;
 extern WebServer server;
 
+static EventLogTag cm_networking_log{"cm_networking"};
+
 CMNetworking::CMNetworking()
 {
     scan_cfg = Config::Null();
+
+    networking_state = Config::Object({
+        {"rx_packets", Config::Uint32(0)},
+        {"tx_packets", Config::Uint32(0)},
+        {"rx_per_second", Config::Uint32(0)},
+        {"tx_per_second", Config::Uint32(0)},
+        {"dropped", Config::Uint32(0)},
+        {"stale", Config::Uint32(0)}
+    });
 }
 
 void CMNetworking::setup()
 {
     mdns_init();
+
+    // Browsers that cached the scan result before a reboot must not get a 304 for a new table.
+    scan_result_boot_id = esp_random();
+    update_scan_result_json();
+
+    task_scheduler.scheduleWithFixedDelay([this](){
+        update_networking_state();
+    }, 1000, 1000);
+
     initialized = true;
 }
 
@@ -56,13 +77,25 @@ void CMNetworking::register_urls()
         start_scan();
     }, true);
 
+    api.addState("cm_networking/state", &networking_state, {}, 1000);
+
     server.on("/charge_manager/scan_result", HTTP_GET, [this](WebServerRequest request) {
-        String result = cm_networking.get_scan_results();
+        String result;
+        char etag[sizeof(scan_result_etag)];
+        {
+            std::lock_guard<std::mutex> lock{scan_results_mutex};
+            result = scan_result_json;
+            memcpy(etag, scan_result_etag, sizeof(etag));
+        }
 
-        if (result == "In progress or not started")
-            return request.send(200, "text/plain; charset=utf-8", result.c_str());
+        request.addResponseHeader("ETag", etag);
+        // Revalidate every time. Usually the table did not change and the response is a 304 without a body.
+        request.addResponseHeader("Cache-Control", "no-cache");
 
-        return request.send(200, "application/json; charset=utf-8", result.c_str());
+        if (request.header("If-None-Match") == etag)
+            return request.send(304);
+
+        return request.send(200, "application/json; charset=utf-8", result.c_str(), result.length());
     });
 
 // If we don't have the evse or evse_v2 module, but have cm_networking, this is probably an energy manager.
@@ -91,6 +124,92 @@ void CMNetworking::loop()
 {
 }
 
+void CMNetworking::update_networking_state()
+{
+    uint32_t rx_packets = counters.rx_packets.load();
+    uint32_t tx_packets = counters.tx_packets.load();
+
+    networking_state.get("rx_packets")->updateUint(rx_packets);
+    networking_state.get("tx_packets")->updateUint(tx_packets);
+    networking_state.get("rx_per_second")->updateUint(rx_packets - last_rx_packets);
+    networking_state.get("tx_per_second")->updateUint(tx_packets - last_tx_packets);
+    networking_state.get("dropped")->updateUint(counters.dropped.load());
+    networking_state.get("stale")->updateUint(counters.stale.load());
+
+    last_rx_packets = rx_packets;
+    last_tx_packets = tx_packets;
+}
+
+void CMNetworking::start_network_task()
+{
+    if (network_task_handle != nullptr)
+        return;
+
+    // Same priority as the loop task. The task blocks in select most of the time.
+    xTaskCreate(network_task,
+        "cm_networking",
+        4096,
+        this,
+        1,
+        &network_task_handle);
+}
+
+void CMNetworking::network_task(void *arg)
+{
+    CMNetworking *self = (CMNetworking *)arg;
+
+    for (;;) {
+        uint32_t next_deadline = millis() + CM_NETWORK_TASK_MAX_SLEEP_MS;
+
+        if (self->manager_sock >= 0) {
+            self->update_resolver();
+            self->send_due_manager_updates(&next_deadline);
+        }
+
+        if (self->client_sock >= 0) {
+            std::lock_guard<std::mutex> lock{self->client_mutex};
+            // If we have not received a valid packet for one minute, devalidate source_addr.
+            // Otherwise we would send response packets to this address forever.
+            if (self->source_addr_valid && deadline_elapsed(self->last_successful_recv + 60 * 1000))
+                self->source_addr_valid = false;
+        }
+
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        int max_fd = -1;
+        if (self->manager_sock >= 0) {
+            FD_SET(self->manager_sock, &read_fds);
+            max_fd = std::max(max_fd, self->manager_sock);
+        }
+        if (self->client_sock >= 0) {
+            FD_SET(self->client_sock, &read_fds);
+            max_fd = std::max(max_fd, self->client_sock);
+        }
+
+        uint32_t sleep_ms = deadline_elapsed(next_deadline) ? 0 : next_deadline - millis();
+        struct timeval timeout;
+        timeout.tv_sec = sleep_ms / 1000;
+        timeout.tv_usec = (sleep_ms % 1000) * 1000;
+
+        int ready = select(max_fd + 1, &read_fds, nullptr, nullptr, &timeout);
+        if (ready < 0) {
+            if (errno != EINTR)
+                log_error(cm_networking_log, "select failed: errno %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(CM_NETWORK_TASK_MAX_SLEEP_MS));
+            continue;
+        }
+
+        if (ready == 0)
+            continue;
+
+        if (self->manager_sock >= 0 && FD_ISSET(self->manager_sock, &read_fds))
+            self->receive_manager_updates();
+
+        if (self->client_sock >= 0 && FD_ISSET(self->client_sock, &read_fds))
+            self->receive_client_requests();
+    }
+}
+
 int CMNetworking::create_socket(uint16_t port)
 {
     int sock;
@@ -127,76 +246,248 @@ int CMNetworking::create_socket(uint16_t port)
     return sock;
 }
 
-static void dns_callback(const char *host, const ip_addr_t *ip, void *args)
+// Called from the lwIP task. Only hands the result to the network task:
+// Taking the manager_mutex here could deadlock with a sendto of the network task.
+void CMNetworking::dns_callback(const char *host, const ip_addr_t *ip, void *args)
 {
     std::lock_guard<std::mutex> lock{cm_networking.dns_resolve_mutex};
-    uint8_t *resolve_state = (uint8_t*)args;
-    if (ip == nullptr && *resolve_state != RESOLVE_STATE_NOT_RESOLVED) {
-        *resolve_state = RESOLVE_STATE_NOT_RESOLVED;
-        logger.printfln("Failed to resolve %s", host);
+    resolver_entry *entry = (resolver_entry *)args;
+
+    entry->dns_result = 0;
+    if (ip != nullptr && ip->type == IPADDR_TYPE_V4)
+        // using memcpy to guaranty alignment https://mail.gnu.org/archive/html/lwip-users/2008-08/msg00166.html
+        std::memcpy(&entry->dns_result, &ip->u_addr, sizeof(ip4_addr_t));
+
+    entry->dns_state = DNS_LOOKUP_DONE;
+}
+
+void CMNetworking::update_resolver()
+{
+    for (size_t i = 0; i < resolver_entries.size(); ++i) {
+        resolver_entry &entry = resolver_entries[i];
+        if (entry.is_ip)
+            continue;
+
+        uint8_t dns_state;
+        in_addr_t dns_result;
+        {
+            std::lock_guard<std::mutex> lock{dns_resolve_mutex};
+            dns_state = entry.dns_state;
+            dns_result = entry.dns_result;
+            if (dns_state == DNS_LOOKUP_DONE)
+                entry.dns_state = DNS_LOOKUP_IDLE;
+        }
+
+        if (dns_state == DNS_LOOKUP_DONE) {
+            if (dns_result != 0)
+                set_resolved(i, dns_result);
+            else
+                start_mdns_lookup(i);
+        }
+
+        if (entry.mdns_search != nullptr)
+            poll_mdns_lookup(i);
+
+        // All lookups that are due run in parallel.
+        if (dns_state == DNS_LOOKUP_IDLE && entry.mdns_search == nullptr && deadline_elapsed(entry.next_lookup))
+            start_dns_lookup(i);
     }
 }
 
-void CMNetworking::resolve_hostname(uint8_t charger_idx)
+void CMNetworking::start_dns_lookup(uint8_t charger_idx)
 {
+    resolver_entry &entry = resolver_entries[charger_idx];
+
+    // The callback can run before dns_gethostbyname returns.
+    {
+        std::lock_guard<std::mutex> lock{dns_resolve_mutex};
+        entry.dns_state = DNS_LOOKUP_PENDING;
+    }
+
     ip_addr_t ip;
-    int err = dns_gethostbyname(hostnames[charger_idx].c_str(), &ip, dns_callback, &resolve_state[charger_idx]);
+    int err = dns_gethostbyname(hostnames[charger_idx].c_str(), &ip, dns_callback, &entry);
+
+    if (err == ERR_INPROGRESS)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock{dns_resolve_mutex};
+        entry.dns_state = DNS_LOOKUP_IDLE;
+    }
+
+    // All of lwIP's DNS table entries are in use. Retry with the next wake up of the network task.
+    if (err == ERR_MEM)
+        return;
+
+    if (err == ERR_OK && ip.type == IPADDR_TYPE_V4) {
+        in_addr_t in;
+        std::memcpy(&in, &ip.u_addr, sizeof(ip4_addr_t));
+        set_resolved(charger_idx, in);
+        return;
+    }
 
-    if (err == ERR_VAL)
+    if (err == ERR_VAL && !entry.failure_logged)
         logger.printfln("Charge manager has charger configured with hostname %s, but no DNS server is configured!", hostnames[charger_idx].c_str());
 
-    if (err != ERR_OK || ip.type != IPADDR_TYPE_V4)
+    start_mdns_lookup(charger_idx);
+}
+
+void CMNetworking::start_mdns_lookup(uint8_t charger_idx)
+{
+    // mDNS queries the host name without the .local domain.
+    String name = hostnames[charger_idx];
+    if (name.endsWith(".local"))
+        name.remove(name.length() - strlen(".local"));
+
+    resolver_entries[charger_idx].mdns_search = mdns_query_async_new(name.c_str(), nullptr, nullptr, MDNS_TYPE_A, CM_RESOLVE_MDNS_TIMEOUT_MS, 1, nullptr);
+
+    if (resolver_entries[charger_idx].mdns_search == nullptr)
+        set_resolve_failed(charger_idx);
+}
+
+void CMNetworking::poll_mdns_lookup(uint8_t charger_idx)
+{
+    resolver_entry &entry = resolver_entries[charger_idx];
+
+    mdns_result_t *results = nullptr;
+    if (!mdns_query_async_get_results(entry.mdns_search, 0, &results))
         return;
 
-    in_addr_t in;
+    mdns_query_async_delete(entry.mdns_search);
+    entry.mdns_search = nullptr;
+
+    in_addr_t in = 0;
+    for (mdns_result_t *result = results; result != nullptr && in == 0; result = result->next) {
+        for (mdns_ip_addr_t *addr = result->addr; addr != nullptr; addr = addr->next) {
+            if (addr->addr.type == IPADDR_TYPE_V4) {
+                in = addr->addr.u_addr.ip4.addr;
+                break;
+            }
+        }
+    }
+
+    if (results != nullptr)
+        mdns_query_results_free(results);
+
+    if (in != 0)
+        set_resolved(charger_idx, in);
+    else
+        set_resolve_failed(charger_idx);
+}
+
+void CMNetworking::set_resolved(uint8_t charger_idx, in_addr_t addr)
+{
+    resolver_entry &entry = resolver_entries[charger_idx];
+
+    if (entry.addr != addr || entry.failure_logged) {
+        ip4_addr_t ip;
+        ip.addr = addr;
+        logger.printfln("Resolved %s to %s", hostnames[charger_idx].c_str(), ip4addr_ntoa(&ip));
+    }
+
+    bool first = entry.addr == 0;
+
+    entry.addr = addr;
+    entry.resolved_at = millis();
+    entry.next_lookup = entry.resolved_at + CM_RESOLVE_REFRESH_MS;
+    entry.failure_logged = false;
+
+    std::lock_guard<std::mutex> lock{manager_mutex};
+    dest_addrs[charger_idx].sin_addr.s_addr = addr;
+
+    // Don't wait for the next send period.
+    if (first)
+        next_send[charger_idx] = millis();
+}
+
+void CMNetworking::set_resolve_failed(uint8_t charger_idx)
+{
+    resolver_entry &entry = resolver_entries[charger_idx];
+    entry.next_lookup = millis() + CM_RESOLVE_RETRY_MS;
 
-    // using memcpy to guaranty alignment https://mail.gnu.org/archive/html/lwip-users/2008-08/msg00166.html
-    std::memcpy(&in, &ip.u_addr, sizeof(ip4_addr_t));
+    if (entry.failure_logged)
+        return;
 
-    std::lock_guard<std::mutex> lock{dns_resolve_mutex};
-    if (resolve_state[charger_idx] != RESOLVE_STATE_RESOLVED || dest_addrs[charger_idx].sin_addr.s_addr != in) {
-        logger.printfln("Resolved %s to %s", hostnames[charger_idx].c_str(), ipaddr_ntoa(&ip));
+    if (entry.addr == 0) {
+        logger.printfln("Failed to resolve %s", hostnames[charger_idx].c_str());
+        entry.failure_logged = true;
+        return;
     }
 
-    dest_addrs[charger_idx].sin_addr.s_addr = in;
-    resolve_state[charger_idx] = RESOLVE_STATE_RESOLVED;
+    // Log only once the address is older than the TTL. Failing refreshes are expected while the DNS server is unreachable.
+    if (!deadline_elapsed(entry.resolved_at + CM_RESOLVE_TTL_MS))
+        return;
+
+    ip4_addr_t ip;
+    ip.addr = entry.addr;
+    logger.printfln("Failed to resolve %s. Still using %s", hostnames[charger_idx].c_str(), ip4addr_ntoa(&ip));
+    entry.failure_logged = true;
 }
 
 void CMNetworking::register_manager(std::vector<String> &&hosts,
                                     const std::vector<String> &names,
-                                    std::function<void(uint8_t,  // client_id
-                                                       uint8_t,  // iec61851_state
-                                                       uint8_t,  // charger_state
-                                                       uint8_t,  // error_state
-                                                       uint32_t, // uptime
-                                                       uint32_t, // charging_time
-                                                       uint16_t, // allowed_charging_current
-                                                       uint16_t  // supported_current
-                                                       )> manager_callback,
+                                    manager_callback_t manager_callback,
                                     std::function<void(uint8_t, uint8_t)> manager_error_callback)
 {
     hostnames = hosts;
+    manager_names = names;
+    this->manager_callback = manager_callback;
+    this->manager_error_callback = manager_error_callback;
+
+    resolver_entries.resize(names.size());
+    dest_addrs.resize(names.size());
+    // 255 lets the first packet of a charger pass the stale packet check.
+    last_seen_seq_num.assign(names.size(), 255);
+    next_seq_num.assign(names.size(), 1);
+    allocated_currents.assign(names.size(), 0);
+
+    cm_link_quality initial_quality;
+    cm_link_quality_init(&initial_quality);
+    link_qualities.assign(names.size(), initial_quality);
+
+    // Spread the chargers over the send period, so that their updates are not sent in one burst.
+    uint32_t now = millis();
+    next_send.resize(names.size());
+    for (size_t i = 0; i < names.size(); ++i)
+        next_send[i] = now + CM_NETWORK_TASK_MAX_SLEEP_MS + i * CM_SEND_PERIOD_MS / names.size();
 
     for (int i = 0; i < names.size(); ++i) {
-        dest_addrs[i].sin_addr.s_addr = 0;
-        resolve_state[i] = RESOLVE_STATE_UNKNOWN;
-        resolve_hostname(i);
+        resolver_entry &entry = resolver_entries[i];
+        entry = resolver_entry{};
+
+        // The network task starts the lookups of all host names at once.
+        struct in_addr in;
+        if (inet_aton(hostnames[i].c_str(), &in) != 0) {
+            entry.addr = in.s_addr;
+            entry.is_ip = true;
+        } else {
+            entry.next_lookup = now;
+        }
+
+        dest_addrs[i].sin_addr.s_addr = entry.addr;
         dest_addrs[i].sin_family = AF_INET;
         dest_addrs[i].sin_port = htons(CHARGE_MANAGEMENT_PORT);
     }
 
-    manager_sock = create_socket(CHARGE_MANAGER_PORT);
-    if (manager_sock < 0)
+    int sock = create_socket(CHARGE_MANAGER_PORT);
+    if (sock < 0)
         return;
 
-    task_scheduler.scheduleWithFixedDelay([this, names, manager_callback, manager_error_callback](){
-        static uint8_t last_seen_seq_num[MAX_CLIENTS];
-        static bool initialized = false;
-        if (!initialized) {
-            memset(last_seen_seq_num, 255, MAX_CLIENTS);
-            initialized = true;
-        }
+    manager_sock = sock;
+    start_network_task();
+
+    task_scheduler.scheduleWithFixedDelay([this](){
+        this->start_scan();
+    }, 1000, CM_DISCOVERY_INTERVAL_MS);
+}
 
+void CMNetworking::receive_manager_updates()
+{
+    bool received = false;
+
+    // Every charger sends one response per second. Receive all that are queued,
+    // but not more than twice the number of chargers, to not starve the sending.
+    for (size_t i = 0; i < 2 * manager_names.size(); ++i) {
         response_packet recv_buf[2] = {};
         struct sockaddr_in source_addr;
         socklen_t socklen = sizeof(source_addr);
@@ -205,17 +496,16 @@ void CMNetworking::register_manager(std::vector<String> &&hosts,
 
         if (len < 0) {
             if (errno != EAGAIN && errno != EWOULDBLOCK)
-                logger.printfln("recvfrom failed: errno %d", errno);
-            return;
+                log_error(cm_networking_log, "recvfrom failed: errno %d", errno);
+            break;
         }
 
-        if (len != sizeof(response_packet)) {
-            logger.printfln("Received datagram of wrong size %d from %s", len, inet_ntoa(source_addr.sin_addr));
-            return;
-        }
+        counters.rx_packets++;
+
+        std::lock_guard<std::mutex> lock{manager_mutex};
 
         int charger_idx = -1;
-        for(int i = 0; i < names.size(); ++i)
+        for (int i = 0; i < manager_names.size(); ++i)
             if (source_addr.sin_family == dest_addrs[i].sin_family &&
                 source_addr.sin_port == dest_addrs[i].sin_port &&
                 source_addr.sin_addr.s_addr == dest_addrs[i].sin_addr.s_addr) {
@@ -225,44 +515,92 @@ void CMNetworking::register_manager(std::vector<String> &&hosts,
 
         // Don't log in the first 20 seconds after startup: We are probably still resolving hostnames.
         if (charger_idx == -1) {
+            counters.dropped++;
             if (deadline_elapsed(20000))
-                logger.printfln("Received packet from unknown %s. Is the config complete?", inet_ntoa(source_addr.sin_addr));
-            return;
+                log_warning(cm_networking_log, "Received packet from unknown %s. Is the config complete?", inet_ntoa(source_addr.sin_addr));
+            continue;
         }
 
-        response_packet response;
-        memcpy(&response, recv_buf, sizeof(response));
+        queued_response queued;
+        queued.client_id = charger_idx;
+        queued.error = CM_NETWORKING_ERROR_NO_ERROR;
+        memcpy(&queued.response, recv_buf, sizeof(queued.response));
+
+        const response_packet &response = queued.response;
+
+        uint8_t check = cm_check_packet(&response.header, len, true, last_seen_seq_num[charger_idx]);
+
+        if (check == CM_PACKET_TOO_SHORT || check == CM_PACKET_WRONG_SIZE) {
+            counters.dropped++;
+            log_warning(cm_networking_log, "Received datagram of wrong size %d from %s", len, inet_ntoa(source_addr.sin_addr));
+            continue;
+        }
 
-        if (response.header.seq_num <= last_seen_seq_num[charger_idx] && last_seen_seq_num[charger_idx] - response.header.seq_num < 5) {
-            logger.printfln("Received stale (out of order?) packet from %s (%s). Last seen seq_num is %u, Received seq_num is %u",
-                names[charger_idx].c_str(),
+        if (check == CM_PACKET_STALE) {
+            counters.stale++;
+            log_warning(cm_networking_log, "Received stale (out of order?) packet from %s (%s). Last seen seq_num is %u, Received seq_num is %u",
+                manager_names[charger_idx].c_str(),
                 inet_ntoa(source_addr.sin_addr),
                 last_seen_seq_num[charger_idx],
                 response.header.seq_num);
-            return;
+            continue;
         }
 
-        if (response.header.version != PROTOCOL_VERSION) {
-            manager_error_callback(charger_idx, CM_NETWORKING_ERROR_FW_MISMATCH);
-            logger.printfln("Received packet from %s (%s) with incompatible firmware. Our protocol version is %u, received packet had %u",
-                names[charger_idx].c_str(),
+        if (check == CM_PACKET_VERSION_MISMATCH) {
+            queued.error = CM_NETWORKING_ERROR_FW_MISMATCH;
+            logger.printfln("Received packet from %s (%s) with incompatible firmware. Our protocol versions are %u to %u, received packet had %u",
+                manager_names[charger_idx].c_str(),
                 inet_ntoa(source_addr.sin_addr),
+                PROTOCOL_VERSION_MIN,
                 PROTOCOL_VERSION,
                 response.header.version);
-            return;
+        } else {
+            last_seen_seq_num[charger_idx] = response.header.seq_num;
+            cm_link_quality_response_received(&link_qualities[charger_idx], &response, millis());
+
+            if (!response.managed) {
+                queued.error = CM_NETWORKING_ERROR_NOT_MANAGED;
+                logger.printfln("%s (%s) reports managed is not activated!",
+                    manager_names[charger_idx].c_str(),
+                    inet_ntoa(source_addr.sin_addr));
+            }
         }
 
-        last_seen_seq_num[charger_idx] = response.header.seq_num;
+        queued_responses.push_back(queued);
+        received = true;
+    }
 
-        if (!response.managed) {
-            manager_error_callback(charger_idx, CM_NETWORKING_ERROR_NOT_MANAGED);
-            logger.printfln("%s (%s) reports managed is not activated!",
-                names[charger_idx].c_str(),
-                inet_ntoa(source_addr.sin_addr));
-            return;
+    if (!received)
+        return;
+
+    // Hand all responses received in this round to the task scheduler at once.
+    std::lock_guard<std::mutex> lock{manager_mutex};
+    if (responses_scheduled)
+        return;
+
+    responses_scheduled = true;
+    task_scheduler.scheduleOnce([this](){
+        this->handle_manager_responses();
+    }, 0);
+}
+
+void CMNetworking::handle_manager_responses()
+{
+    std::vector<queued_response> responses;
+    {
+        std::lock_guard<std::mutex> lock{manager_mutex};
+        responses.swap(queued_responses);
+        responses_scheduled = false;
+    }
+
+    for (const queued_response &queued : responses) {
+        if (queued.error != CM_NETWORKING_ERROR_NO_ERROR) {
+            manager_error_callback(queued.client_id, queued.error);
+            continue;
         }
 
-        manager_callback(charger_idx,
+        const response_packet &response = queued.response;
+        manager_callback(queued.client_id,
                          response.iec61851_state,
                          response.charger_state,
                          response.error_state,
@@ -270,61 +608,99 @@ void CMNetworking::register_manager(std::vector<String> &&hosts,
                          response.charging_time,
                          response.allowed_charging_current,
                          response.supported_current);
-        }, 100, 100);
+    }
 }
 
-bool CMNetworking::send_manager_update(uint8_t client_id, uint16_t allocated_current)
+void CMNetworking::get_link_stats(uint8_t client_id, cm_link_stats *stats)
 {
-    static uint8_t next_seq_num = 1;
+    std::lock_guard<std::mutex> lock{manager_mutex};
+    cm_link_quality_get_stats(&link_qualities[client_id], stats);
+}
 
+void CMNetworking::send_manager_update(uint8_t client_id, uint16_t allocated_current)
+{
     if (manager_sock < 0)
-        return true;
+        return;
 
-    request_packet request;
-    request.header.version = PROTOCOL_VERSION;
-    request.header.seq_num = next_seq_num;
-    ++next_seq_num;
+    std::lock_guard<std::mutex> lock{manager_mutex};
+    allocated_currents[client_id] = allocated_current;
+    send_manager_update_locked(client_id);
+}
+
+void CMNetworking::send_due_manager_updates(uint32_t *next_deadline)
+{
+    std::lock_guard<std::mutex> lock{manager_mutex};
 
-    request.allocated_current = allocated_current;
+    for (size_t i = 0; i < next_send.size(); ++i) {
+        if (deadline_elapsed(next_send[i]))
+            send_manager_update_locked(i);
 
-    int err = -1;
+        if ((int32_t)(next_send[i] - *next_deadline) < 0)
+            *next_deadline = next_send[i];
+    }
+}
+
+// Call with manager_mutex held.
+void CMNetworking::send_manager_update_locked(uint8_t client_id)
+{
+    // Count per charger: A shared counter would advance by the number of chargers
+    // between two packets to the same charger and wrap around in the stale packet check.
+    request_packet request;
+    request.header.version = PROTOCOL_VERSION;
+    request.header.seq_num = next_seq_num[client_id];
+    request.allocated_current = allocated_currents[client_id];
 
+    if (dest_addrs[client_id].sin_addr.s_addr == 0) {
+        // Not resolved yet. set_resolved sends as soon as the address is known.
+        next_send[client_id] = millis() + CM_SEND_PERIOD_MS;
+        return;
+    }
 
-    resolve_hostname(client_id);
-    err = sendto(manager_sock, &request, sizeof(request), 0, (sockaddr *)&dest_addrs[client_id], sizeof(dest_addrs[client_id]));
+    int err = sendto(manager_sock, &request, sizeof(request), 0, (sockaddr *)&dest_addrs[client_id], sizeof(dest_addrs[client_id]));
 
     if (err < 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            // Intentionally don't increment here, we want to resend to this charger next.
-            return false;
-        if (errno == ENOMEM) {
-            // Ignore ENOMEM for now. Usually indicates that we don't have a network connection yet.
-            return true;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // The send buffer is full. Retry with the next wake up of the network task.
+            counters.dropped++;
+            next_send[client_id] = millis() + CM_NETWORK_TASK_MAX_SLEEP_MS;
+            return;
         }
 
-        logger.printfln("Failed to send: %s %d", strerror(errno), errno);
-        return true;
-    }
-    if (err != sizeof(request)) {
+        // Ignore ENOMEM for now. Usually indicates that we don't have a network connection yet.
+        if (errno != ENOMEM)
+            log_error(cm_networking_log, "Failed to send: %s %d", strerror(errno), errno);
+    } else if (err != sizeof(request)) {
         logger.printfln("Failed to send. sendto truncated request (of %u bytes) to %d bytes.", sizeof(request), err);
-        return true;
+    } else {
+        counters.tx_packets++;
+        cm_link_quality_request_sent(&link_qualities[client_id], request.header.seq_num, millis());
     }
-    return true;
+
+    ++next_seq_num[client_id];
+    next_send[client_id] = millis() + CM_SEND_PERIOD_MS;
 }
 
 void CMNetworking::register_client(std::function<void(uint16_t)> client_callback)
 {
-    client_sock = create_socket(CHARGE_MANAGEMENT_PORT);
+    int sock = create_socket(CHARGE_MANAGEMENT_PORT);
 
-    if (client_sock < 0)
+    if (sock < 0)
         return;
 
     memset(&source_addr, 0, sizeof(source_addr));
+    this->client_callback = client_callback;
+    last_successful_recv = millis();
+
+    client_sock = sock;
+    start_network_task();
+}
 
-    task_scheduler.scheduleWithFixedDelay([this, client_callback](){
-        static uint8_t last_seen_seq_num = 255;
-        static uint32_t last_successful_recv = millis();
+void CMNetworking::receive_client_requests()
+{
+    bool received = false;
 
+    // The manager sends one request per second. Receive everything that is queued.
+    for (;;) {
         request_packet recv_buf[2] = {};
 
         struct sockaddr_storage temp_addr;
@@ -333,45 +709,69 @@ void CMNetworking::register_client(std::function<void(uint16_t)> client_callback
 
         if (len < 0) {
             if (errno != EAGAIN && errno != EWOULDBLOCK)
-                logger.printfln("recvfrom failed: errno %d", errno);
-
-            // If we have not received a valid packet for one minute, devalidate source_addr.
-            // Otherwise we would send response packets to this address forever.
-            if (deadline_elapsed(last_successful_recv + 60 * 1000))
-                source_addr_valid = false;
-
-            return;
+                log_error(cm_networking_log, "recvfrom failed: errno %d", errno);
+            break;
         }
 
-        if (len != sizeof(request_packet)) {
-            logger.printfln("received datagram of wrong size %d", len);
-            return;
-        }
+        counters.rx_packets++;
 
         request_packet request;
         memcpy(&request, recv_buf, sizeof(request));
 
-        if (request.header.seq_num <= last_seen_seq_num && last_seen_seq_num - request.header.seq_num < 5) {
-            logger.printfln("received stale (out of order?) packet. last seen seq_num is %u, received seq_num is %u", last_seen_seq_num, request.header.seq_num);
-            return;
+        std::lock_guard<std::mutex> lock{client_mutex};
+
+        uint8_t check = cm_check_packet(&request.header, len, false, client_last_seen_seq_num);
+
+        if (check == CM_PACKET_TOO_SHORT || check == CM_PACKET_WRONG_SIZE) {
+            counters.dropped++;
+            log_warning(cm_networking_log, "received datagram of wrong size %d", len);
+            continue;
         }
 
-        if (request.header.version != PROTOCOL_VERSION) {
-            logger.printfln("received packet from box with incompatible firmware. Our protocol version is %u, received packet had %u",
+        if (check == CM_PACKET_STALE) {
+            counters.stale++;
+            log_warning(cm_networking_log, "received stale (out of order?) packet. last seen seq_num is %u, received seq_num is %u", client_last_seen_seq_num, request.header.seq_num);
+            continue;
+        }
+
+        if (check == CM_PACKET_VERSION_MISMATCH) {
+            counters.dropped++;
+            logger.printfln("received packet from box with incompatible firmware. Our protocol versions are %u to %u, received packet had %u",
+                PROTOCOL_VERSION_MIN,
                 PROTOCOL_VERSION,
                 request.header.version);
-            return;
+            continue;
         }
 
-        last_seen_seq_num = request.header.seq_num;
+        client_last_seen_seq_num = request.header.seq_num;
+        client_protocol_version = request.header.version;
 
         last_successful_recv = millis();
         source_addr = temp_addr;
-
         source_addr_valid = true;
-        client_callback(request.allocated_current);
-        //logger.printfln("Received request. Allocated current is %u", request.allocated_current);
-    }, 100, 100);
+
+        // Only the latest current matters.
+        received_allocated_current = request.allocated_current;
+        received = true;
+    }
+
+    if (!received)
+        return;
+
+    std::lock_guard<std::mutex> lock{client_mutex};
+    if (client_callback_scheduled)
+        return;
+
+    client_callback_scheduled = true;
+    task_scheduler.scheduleOnce([this](){
+        uint16_t allocated_current;
+        {
+            std::lock_guard<std::mutex> lock{client_mutex};
+            allocated_current = received_allocated_current;
+            client_callback_scheduled = false;
+        }
+        this->client_callback(allocated_current);
+    }, 0);
 }
 
 bool CMNetworking::send_client_update(uint8_t iec61851_state,
@@ -383,7 +783,7 @@ bool CMNetworking::send_client_update(uint8_t iec61851_state,
                                       uint16_t supported_current,
                                       bool managed)
 {
-    static uint8_t next_seq_num = 0;
+    std::lock_guard<std::mutex> lock{client_mutex};
 
     if (!source_addr_valid) {
         //logger.printfln("source addr not valid.");
@@ -392,9 +792,10 @@ bool CMNetworking::send_client_update(uint8_t iec61851_state,
     //logger.printfln("Sending response.");
 
     response_packet response;
-    response.header.seq_num = next_seq_num;
-    ++next_seq_num;
-    response.header.version = PROTOCOL_VERSION;
+    response.header.seq_num = client_next_seq_num;
+    ++client_next_seq_num;
+    // A manager with older firmware only understands responses of its own version.
+    response.header.version = client_protocol_version;
 
     response.iec61851_state = iec61851_state;
     response.charger_state = charger_state;
@@ -404,36 +805,56 @@ bool CMNetworking::send_client_update(uint8_t iec61851_state,
     response.allowed_charging_current = allowed_charging_current;
     response.supported_current = supported_current;
     response.managed = managed;
+    response.request_seq_num = client_last_seen_seq_num;
+    response.request_age_ms = std::min(millis() - last_successful_recv, (unsigned long)UINT16_MAX);
 
-    int err = sendto(client_sock, &response, sizeof(response), 0, (sockaddr *)&source_addr, sizeof(source_addr));
+    size_t response_len = cm_packet_size(true, response.header.version);
+    int err = sendto(client_sock, &response, response_len, 0, (sockaddr *)&source_addr, sizeof(source_addr));
     if (err < 0) {
+        counters.dropped++;
         if (errno != EAGAIN && errno != EWOULDBLOCK)
-            logger.printfln("sendto failed: errno %d", errno);
+            log_error(cm_networking_log, "sendto failed: errno %d", errno);
         return false;
     }
-    if (err != sizeof(response)) {
-        logger.printfln("sendto truncated the response (of size %u bytes) to %d bytes.", sizeof(response), err);
+    if (err != (int)response_len) {
+        logger.printfln("sendto truncated the response (of size %u bytes) to %d bytes.", response_len, err);
         return false;
     }
 
+    counters.tx_packets++;
     return true;
 }
 
 bool CMNetworking::check_results()
 {
-    {
-        std::lock_guard<std::mutex> lock{scan_results_mutex};
-        if (!mdns_query_async_get_results(scan, 0, &scan_results))
-            return false; // This should never happen as check_results is only called if we are notified the search has finished.
-    }
+    mdns_result_t *results = nullptr;
+    if (!mdns_query_async_get_results(scan, 0, &results))
+        return false; // This should never happen as check_results is only called if we are notified the search has finished.
 
     mdns_query_async_delete(scan);
 
     scanning = false;
 
+    bool changed;
+    {
+        std::lock_guard<std::mutex> lock{scan_results_mutex};
+        changed = merge_scan_results(results);
+        if (changed)
+            update_scan_result_json();
+    }
+
+    if (results != nullptr)
+        mdns_query_results_free(results);
+
 #if MODULE_WS_AVAILABLE()
-    String s = get_scan_results();
-    ws.pushRawStateUpdate(s, "charge_manager/scan_result");
+    if (changed) {
+        String s;
+        {
+            std::lock_guard<std::mutex> lock{scan_results_mutex};
+            s = scan_result_json;
+        }
+        ws.pushRawStateUpdate(s, "charge_manager/scan_result");
+    }
 #endif
     return true;
 }
@@ -442,30 +863,31 @@ void CMNetworking::start_scan()
 {
     if (scanning)
         return;
-    scanning = true;
 
-    {
-        std::lock_guard<std::mutex> lock{scan_results_mutex};
-        if (scan_results != nullptr)
-        {
-            mdns_query_results_free(scan_results);
-            scan_results = nullptr;
-        }
-    }
+    // The web interface requests a scan every few seconds while the charger list is open,
+    // possibly from many browsers. Answer those from the table.
+    if (last_scan_start != 0 && !deadline_elapsed(last_scan_start + CM_DISCOVERY_MIN_INTERVAL_MS))
+        return;
 
     scan = mdns_query_async_new(NULL, "_tf-warp-cm", "_udp", MDNS_TYPE_PTR, 1000, INT8_MAX, [](mdns_search_once_t *search) {
         task_scheduler.scheduleOnce([](){ cm_networking.check_results(); }, 0);
     });
+
+    if (scan == nullptr)
+        return;
+
+    scanning = true;
+    last_scan_start = std::max(millis(), (unsigned long)1);
 }
 
-void CMNetworking::add_scan_result_entry(mdns_result_t *entry, TFJsonSerializer &json)
+bool CMNetworking::parse_scan_result(mdns_result_t *entry, discovered_charger *charger)
 {
     const char *version = "0";
     const char *enabled = "false";
     const char *display_name = "[no_display_name]";
 
-    if (entry->txt_count < 3)
-        return;
+    if (entry->hostname == nullptr || entry->txt_count < 3)
+        return false;
 
     int found = 0;
     for(size_t i = 0; i < entry->txt_count; ++i) {
@@ -484,54 +906,122 @@ void CMNetworking::add_scan_result_entry(mdns_result_t *entry, TFJsonSerializer
     }
 
     if (found < 3)
-        return;
+        return false;
+
+    charger->hostname = entry->hostname;
+    charger->display_name = display_name;
+    charger->version = version;
+    charger->enabled = String(enabled) == "true";
+
+    charger->error = SCAN_RESULT_ERROR_OK;
+    long version = charger->version.toInt();
+    if (version < PROTOCOL_VERSION_MIN || version > PROTOCOL_VERSION)
+        charger->error = SCAN_RESULT_ERROR_FIRMWARE_MISMATCH;
+    else if (!charger->enabled)
+        charger->error = SCAN_RESULT_ERROR_MANAGEMENT_DISABLED;
+
+    charger->ip = 0;
+    for (mdns_ip_addr_t *addr = entry->addr; addr != nullptr; addr = addr->next) {
+        if (addr->addr.type == IPADDR_TYPE_V4) {
+            charger->ip = addr->addr.u_addr.ip4.addr;
+            break;
+        }
+    }
+
+    charger->last_seen = millis();
+    return true;
+}
+
+// Call with scan_results_mutex held.
+bool CMNetworking::merge_scan_results(mdns_result_t *results)
+{
+    bool changed = false;
+
+    for (mdns_result_t *entry = results; entry != nullptr; entry = entry->next) {
+        discovered_charger charger;
+        if (!parse_scan_result(entry, &charger))
+            continue;
+
+        auto it = std::find_if(discovered_chargers.begin(), discovered_chargers.end(), [&charger](const discovered_charger &c) {
+            return c.hostname == charger.hostname;
+        });
 
-    uint8_t error = SCAN_RESULT_ERROR_OK;
+        if (it == discovered_chargers.end()) {
+            if (discovered_chargers.size() >= CM_DISCOVERY_MAX_ENTRIES)
+                continue;
 
-    if (String(version) != String(PROTOCOL_VERSION))
-        error = SCAN_RESULT_ERROR_FIRMWARE_MISMATCH;
-    else if (String(enabled) != "true")
-        error = SCAN_RESULT_ERROR_MANAGEMENT_DISABLED;
+            discovered_chargers.push_back(charger);
+            changed = true;
+            continue;
+        }
+
+        // Answers don't always contain the address. Keep the last known one.
+        if (charger.ip == 0)
+            charger.ip = it->ip;
+
+        // last_seen is only used for the expiry and not part of the JSON: It would invalidate the ETag with every scan.
+        changed |= it->display_name != charger.display_name ||
+                   it->version != charger.version ||
+                   it->enabled != charger.enabled ||
+                   it->ip != charger.ip;
+        *it = charger;
+    }
+
+    auto expired = std::remove_if(discovered_chargers.begin(), discovered_chargers.end(), [](const discovered_charger &c) {
+        return deadline_elapsed(c.last_seen + CM_DISCOVERY_EXPIRY_MS);
+    });
+    if (expired != discovered_chargers.end()) {
+        discovered_chargers.erase(expired, discovered_chargers.end());
+        changed = true;
+    }
 
+    return changed;
+}
+
+void CMNetworking::add_discovered_charger(const discovered_charger &charger, TFJsonSerializer &json)
+{
     json.addObject();
-        json.add("hostname", entry->hostname);
+        json.add("hostname", charger.hostname.c_str());
 
         char buf[32] = "[no_address]";
-        if (entry->addr && entry->addr->addr.type == IPADDR_TYPE_V4)
-            esp_ip4addr_ntoa(&entry->addr->addr.u_addr.ip4, buf, ARRAY_SIZE(buf));
+        if (charger.ip != 0) {
+            esp_ip4_addr_t ip;
+            ip.addr = charger.ip;
+            esp_ip4addr_ntoa(&ip, buf, ARRAY_SIZE(buf));
+        }
         json.add("ip", buf);
 
-        json.add("display_name", display_name);
-        json.add("error", error);
+        json.add("display_name", charger.display_name.c_str());
+        json.add("version", charger.version.c_str());
+        json.add("enabled", charger.enabled);
+        json.add("error", (uint32_t)charger.error);
     json.endObject();
 }
 
-size_t CMNetworking::build_scan_result_json(mdns_result_t *list, char *buf, size_t len) {
+size_t CMNetworking::build_scan_result_json(char *buf, size_t len) {
     TFJsonSerializer json{buf, len};
     json.addArray();
 
-    while (list != nullptr) {
-        add_scan_result_entry(list, json);
-        list = list->next;
-    }
+    for (const discovered_charger &charger : discovered_chargers)
+        add_discovered_charger(charger, json);
 
     json.endArray();
     return json.end();
 }
 
-String CMNetworking::get_scan_results()
+// Call with scan_results_mutex held.
+void CMNetworking::update_scan_result_json()
 {
-    std::lock_guard<std::mutex> lock{scan_results_mutex};
-    if (scan_results == nullptr)
-        return "In progress or not started";
-
-    size_t payload_size = build_scan_result_json(scan_results, nullptr, 0);
+    size_t payload_size = build_scan_result_json(nullptr, 0);
 
     StringWithSettableLength result;
     result.reserve(payload_size);
 
-    build_scan_result_json(scan_results, result.begin(), payload_size);
+    build_scan_result_json(result.begin(), payload_size);
     result.setLength(payload_size);
 
-    return result;
+    scan_result_json = result;
+
+    ++scan_result_version;
+    snprintf(scan_result_etag, ARRAY_SIZE(scan_result_etag), "\"%08x-%u\"", scan_result_boot_id, scan_result_version);
 }
@@ -22,54 +22,61 @@
 #include "config.h"
 
 #include "lwip/err.h"
+#include "lwip/ip_addr.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
 #include "mdns.h"
 #include "TFJson.h"
 
+#include "cm_protocol.h"
+
+#include <atomic>
 #include <functional>
+#include <mutex>
+#include <vector>
 
 #define CHARGE_MANAGER_PORT 34127
 #define CHARGE_MANAGEMENT_PORT (CHARGE_MANAGER_PORT + 1)
 
-// Keep in sync with charge_manager.cpp
-#define MAX_CLIENTS 10
-
-// Increment when changing packet structs
-#define PROTOCOL_VERSION 3
+// Maximum number of chargers a charge manager can control.
+// Can be overridden with a build flag. Storage is only allocated for configured chargers.
+// Keep in sync with MAX_CONTROLLED_CHARGERS in web/src/modules/charge_manager/main.tsx
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 64
+#endif
+
+// Client IDs are passed around as uint8_t.
+static_assert(MAX_CLIENTS <= 255, "MAX_CLIENTS must fit into an uint8_t");
+
+// Resolved host names are looked up again in the background after CM_RESOLVE_REFRESH_MS.
+// lwIP does not report the TTL of DNS records, but its own cache honours them.
+// An address is kept until a lookup succeeds, also when it's older than CM_RESOLVE_TTL_MS:
+// While the DNS server is unreachable, for example during a router reboot, the chargers stay reachable.
+// A failed lookup is followed by an mDNS query and retried after CM_RESOLVE_RETRY_MS.
+#define CM_RESOLVE_TTL_MS (5 * 60 * 1000)
+#define CM_RESOLVE_REFRESH_MS (60 * 1000)
+#define CM_RESOLVE_RETRY_MS 2000
+#define CM_RESOLVE_MDNS_TIMEOUT_MS 1000
+
+// While this device is a charge manager, it looks for chargers every CM_DISCOVERY_INTERVAL_MS,
+// so that the discovered chargers are known when the configuration is opened.
+// Scans requested by the web interface are rate limited to one per CM_DISCOVERY_MIN_INTERVAL_MS.
+// Chargers that were not seen for CM_DISCOVERY_EXPIRY_MS are removed.
+#define CM_DISCOVERY_INTERVAL_MS (60 * 1000)
+#define CM_DISCOVERY_MIN_INTERVAL_MS (10 * 1000)
+#define CM_DISCOVERY_EXPIRY_MS (5 * 60 * 1000)
+#define CM_DISCOVERY_MAX_ENTRIES 128
 
 #define CM_NETWORKING_ERROR_NO_ERROR 0
 #define CM_NETWORKING_ERROR_UNREACHABLE 1
 #define CM_NETWORKING_ERROR_FW_MISMATCH 2
 #define CM_NETWORKING_ERROR_NOT_MANAGED 3
 
-struct packet_header {
-    uint8_t seq_num;
-    uint8_t version;
-    uint16_t padding;
-} __attribute__((packed));
-
-struct request_packet {
-    packet_header header;
-
-    uint16_t allocated_current;
-} __attribute__((packed));
-
-struct response_packet {
-    packet_header header;
-
-    uint8_t iec61851_state;
-    uint8_t charger_state;
-    uint8_t error_state;
-    uint32_t uptime;
-    uint32_t charging_time;
-    uint16_t allowed_charging_current;
-    uint16_t supported_current;
-    bool managed;
-} __attribute__((packed));
-
 class CMNetworking
 {
 public:
@@ -82,20 +89,26 @@ public:
 
     int create_socket(uint16_t port);
 
+    typedef std::function<void(uint8_t,  // client_id
+                               uint8_t,  // iec61851_state
+                               uint8_t,  // charger_state
+                               uint8_t,  // error_state
+                               uint32_t, // uptime
+                               uint32_t, // charging_time
+                               uint16_t, // allowed_charging_current
+                               uint16_t  // supported_current
+                               )> manager_callback_t;
+
     void register_manager(std::vector<String> &&hosts,
                           const std::vector<String> &names,
-                          std::function<void(uint8_t,  // client_id
-                                             uint8_t,  // iec61851_state
-                                             uint8_t,  // charger_state
-                                             uint8_t,  // error_state
-                                             uint32_t, // uptime
-                                             uint32_t, // charging_time
-                                             uint16_t, // allowed_charging_current
-                                             uint16_t  // supported_current
-                                             )> manager_callback,
+                          manager_callback_t manager_callback,
                           std::function<void(uint8_t, uint8_t)> manager_error_callback);
 
-    bool send_manager_update(uint8_t client_id, uint16_t allocated_current);
+    // Sends the allocated current to the charger now. The network task repeats it every CM_SEND_PERIOD_MS.
+    void send_manager_update(uint8_t client_id, uint16_t allocated_current);
+
+    // Copies the link quality of the charger. Can be called from any task.
+    void get_link_stats(uint8_t client_id, cm_link_stats *stats);
 
     void register_client(std::function<void(uint16_t)> client_callback);
     bool send_client_update(uint8_t iec61851_state,
@@ -107,42 +120,140 @@ public:
                             uint16_t supported_current,
                             bool managed);
 
-    String get_scan_results();
-
-    void resolve_hostname(uint8_t charger_idx);
-
     bool check_results();
 
     bool scanning = false;
 
     mdns_search_once_t *scan;
 
-    std::mutex scan_results_mutex;
     std::mutex dns_resolve_mutex;
-    mdns_result_t *scan_results = nullptr;
 
 private:
-    int manager_sock;
-
-    #define RESOLVE_STATE_UNKNOWN 0
-    #define RESOLVE_STATE_NOT_RESOLVED 1
-    #define RESOLVE_STATE_RESOLVED 2
-
-    uint8_t resolve_state[MAX_CLIENTS] = {};
-    struct sockaddr_in dest_addrs[MAX_CLIENTS] = {};
+    // Receiving and the periodic sending of both roles run in one task that waits on the sockets with select.
+    // The callbacks are called from the task scheduler, because they modify configs.
+    void start_network_task();
+    static void network_task(void *arg);
+    void receive_manager_updates();
+    // Sends all updates that are due and moves next_deadline to the next update that will be due.
+    void send_due_manager_updates(uint32_t *next_deadline);
+    void send_manager_update_locked(uint8_t client_id);
+    // Starts the lookups that are due and collects the results. Runs in the network task.
+    void update_resolver();
+    void start_dns_lookup(uint8_t charger_idx);
+    static void dns_callback(const char *host, const ip_addr_t *ip, void *args);
+    void start_mdns_lookup(uint8_t charger_idx);
+    void poll_mdns_lookup(uint8_t charger_idx);
+    void set_resolved(uint8_t charger_idx, in_addr_t addr);
+    void set_resolve_failed(uint8_t charger_idx);
+    void handle_manager_responses();
+    void receive_client_requests();
+    void update_networking_state();
+
+    TaskHandle_t network_task_handle = nullptr;
+
+    int manager_sock = -1;
+
+    // Guards everything the network task shares with the other tasks, except the resolver entries.
+    std::mutex manager_mutex;
+
+    struct queued_response {
+        uint8_t client_id;
+        uint8_t error; // CM_NETWORKING_ERROR_NO_ERROR if response is valid
+        response_packet response;
+    };
+    std::vector<queued_response> queued_responses;
+    bool responses_scheduled = false;
+
+    std::vector<String> manager_names;
+    manager_callback_t manager_callback;
+    std::function<void(uint8_t, uint8_t)> manager_error_callback;
+
+    #define DNS_LOOKUP_IDLE 0
+    #define DNS_LOOKUP_PENDING 1
+    #define DNS_LOOKUP_DONE 2
+
+    struct resolver_entry {
+        in_addr_t addr; // 0 until the host was resolved once
+        uint32_t resolved_at;
+        uint32_t next_lookup;
+        bool is_ip; // The host is an IP address, nothing to look up.
+        bool failure_logged;
+        mdns_search_once_t *mdns_search;
+
+        // Written by dns_callback in the lwIP task. Guarded by dns_resolve_mutex.
+        uint8_t dns_state;
+        in_addr_t dns_result; // 0 if the lookup failed
+    };
+
+    // Sized by register_manager. Must not be resized afterwards:
+    // dns_callback gets pointers into resolver_entries.
+    std::vector<resolver_entry> resolver_entries;
+    // The resolved addresses. Sending to a host that was not resolved yet is skipped.
+    std::vector<struct sockaddr_in> dest_addrs;
+    std::vector<uint8_t> last_seen_seq_num;
+    std::vector<uint8_t> next_seq_num;
     std::vector<String> hostnames;
+    std::vector<uint16_t> allocated_currents;
+    std::vector<uint32_t> next_send;
+
+    std::vector<cm_link_quality> link_qualities;
 
-    int client_sock;
+    int client_sock = -1;
+    std::function<void(uint16_t)> client_callback;
+    std::mutex client_mutex;
     bool source_addr_valid = false;
     struct sockaddr_storage source_addr;
+    uint8_t client_last_seen_seq_num = 255;
+    uint8_t client_protocol_version = PROTOCOL_VERSION; // of the last request
+    uint8_t client_next_seq_num = 0;
+    uint32_t last_successful_recv = 0;
+    uint16_t received_allocated_current = 0;
+    bool client_callback_scheduled = false;
+
+    // Written by the network task, read by update_networking_state.
+    struct {
+        std::atomic<uint32_t> rx_packets{0};
+        std::atomic<uint32_t> tx_packets{0};
+        std::atomic<uint32_t> dropped{0}; // wrong size, unknown sender or failed to send
+        std::atomic<uint32_t> stale{0}; // stale or out of order sequence numbers
+    } counters;
+    uint32_t last_rx_packets = 0;
+    uint32_t last_tx_packets = 0;
+
+    ConfigRoot networking_state;
 
     void start_scan();
+    uint32_t last_scan_start = 0;
 
     #define SCAN_RESULT_ERROR_OK 0
     #define SCAN_RESULT_ERROR_FIRMWARE_MISMATCH 1
     #define SCAN_RESULT_ERROR_MANAGEMENT_DISABLED 2
-    void add_scan_result_entry(mdns_result_t *entry, TFJsonSerializer &json);
-    size_t build_scan_result_json(mdns_result_t *list, char *buf, size_t len);
+
+    // Deduplicated by the host name.
+    struct discovered_charger {
+        String hostname;
+        String display_name;
+        String version;
+        bool enabled;
+        uint8_t error;
+        uint32_t ip; // 0 if the last answers had no address
+        uint32_t last_seen; // for the expiry only, not served: The JSON and its ETag only change with the table.
+    };
+
+    // Merges the results into discovered_chargers and removes expired chargers. Returns whether anything changed.
+    bool merge_scan_results(mdns_result_t *results);
+    bool parse_scan_result(mdns_result_t *entry, discovered_charger *charger);
+    void add_discovered_charger(const discovered_charger &charger, TFJsonSerializer &json);
+    size_t build_scan_result_json(char *buf, size_t len);
+
+    // The JSON is only rebuilt when the table changes. Requests with a matching If-None-Match header get a 304.
+    std::mutex scan_results_mutex;
+    std::vector<discovered_charger> discovered_chargers;
+    String scan_result_json = "[]";
+    uint32_t scan_result_boot_id = 0;
+    uint32_t scan_result_version = 0;
+    char scan_result_etag[24] = "";
+    void update_scan_result_json();
 
     ConfigRoot scan_cfg;
 };
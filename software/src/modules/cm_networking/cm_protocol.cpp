@@ -0,0 +1,165 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include "cm_protocol.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+size_t cm_packet_size(bool response, uint8_t version)
+{
+    if (!response)
+        return sizeof(request_packet);
+
+    if (version < 4)
+        return offsetof(response_packet, request_seq_num);
+
+    return sizeof(response_packet);
+}
+
+uint8_t cm_check_packet(const packet_header *header, size_t len, bool response, uint8_t last_seen_seq_num)
+{
+    if (len < sizeof(packet_header))
+        return CM_PACKET_TOO_SHORT;
+
+    if (header->seq_num <= last_seen_seq_num && last_seen_seq_num - header->seq_num < 5)
+        return CM_PACKET_STALE;
+
+    if (header->version < PROTOCOL_VERSION_MIN || header->version > PROTOCOL_VERSION)
+        return CM_PACKET_VERSION_MISMATCH;
+
+    if (len != cm_packet_size(response, header->version))
+        return CM_PACKET_WRONG_SIZE;
+
+    return CM_PACKET_OK;
+}
+
+// Upper bounds of the round trip time histogram buckets in ms.
+static const uint16_t rtt_histogram_bounds[CM_LINK_RTT_HISTOGRAM_LEN] = {1, 2, 3, 5, 7, 10, 15, 20, 30, 50, 70, 100, 200, 500, 1000, UINT16_MAX};
+
+void cm_link_quality_init(cm_link_quality *q)
+{
+    memset(q, 0, sizeof(*q));
+    q->rtt_min[0] = UINT16_MAX;
+    q->rtt_min[1] = UINT16_MAX;
+}
+
+void cm_link_quality_request_sent(cm_link_quality *q, uint8_t seq_num, uint32_t sent_at)
+{
+    size_t slot = seq_num % CM_LINK_REQUEST_HISTORY_LEN;
+    q->request_seq_num[slot] = seq_num;
+    // 0 marks an unused slot.
+    q->request_sent_at[slot] = std::max(sent_at, (uint32_t)1);
+}
+
+void cm_link_quality_response_received(cm_link_quality *q, const response_packet *response, uint32_t received_at)
+{
+    // Loss: Every gap in the charger's sequence numbers is a lost response.
+    // Larger gaps are a reboot of the charger or an outage that the charge manager detects by the missing updates.
+    uint8_t gap = response->header.seq_num - q->last_response_seq_num;
+    q->last_response_seq_num = response->header.seq_num;
+    if (q->response_seen && gap > 0 && gap <= 16) {
+        q->responses_expected += gap;
+        q->responses_lost += gap - 1;
+    } else {
+        q->responses_expected += 1;
+    }
+    q->response_seen = true;
+
+    if (q->responses_expected >= CM_LINK_LOSS_WINDOW) {
+        q->responses_expected /= 2;
+        q->responses_lost /= 2;
+    }
+
+    // Version 3 responses don't echo the request.
+    if (response->header.version < 4)
+        return;
+
+    // Round trip time: Only the last few requests are remembered.
+    size_t slot = response->request_seq_num % CM_LINK_REQUEST_HISTORY_LEN;
+    if (q->request_seq_num[slot] != response->request_seq_num || q->request_sent_at[slot] == 0)
+        return;
+
+    uint32_t elapsed = received_at - q->request_sent_at[slot];
+    // Clock resolution: The charger's age can be larger than the elapsed time by one ms.
+    uint32_t rtt32 = elapsed > response->request_age_ms ? elapsed - response->request_age_ms : 0;
+    // The sequence numbers wrap around: A request this old is from an earlier round.
+    if (rtt32 > 10 * CM_SEND_PERIOD_MS)
+        return;
+    uint16_t rtt = rtt32;
+
+    if (!q->rtt_measured) {
+        q->rtt_measured = true;
+        q->rtt_avg_8 = rtt << 3;
+        q->jitter_16 = 0;
+    } else {
+        q->rtt_avg_8 = q->rtt_avg_8 + rtt - (q->rtt_avg_8 >> 3);
+        uint32_t deviation = rtt > q->last_rtt ? rtt - q->last_rtt : q->last_rtt - rtt;
+        q->jitter_16 = q->jitter_16 + deviation - (q->jitter_16 >> 4);
+    }
+    q->last_rtt = rtt;
+
+    size_t bucket = 0;
+    while (rtt > rtt_histogram_bounds[bucket])
+        ++bucket;
+    ++q->rtt_histogram[bucket];
+    ++q->rtt_samples;
+
+    if (rtt < q->rtt_min[0])
+        q->rtt_min[0] = rtt;
+
+    if (q->rtt_samples >= CM_LINK_RTT_WINDOW) {
+        q->rtt_samples = 0;
+        for (size_t i = 0; i < CM_LINK_RTT_HISTOGRAM_LEN; ++i) {
+            q->rtt_histogram[i] /= 2;
+            q->rtt_samples += q->rtt_histogram[i];
+        }
+        q->rtt_min[1] = q->rtt_min[0];
+        q->rtt_min[0] = UINT16_MAX;
+    }
+}
+
+void cm_link_quality_get_stats(const cm_link_quality *q, cm_link_stats *stats)
+{
+    stats->loss = q->responses_expected < CM_LINK_LOSS_MIN_EXPECTED ? 0 : q->responses_lost * 1000 / q->responses_expected;
+
+    if (!q->rtt_measured) {
+        stats->rtt_min = UINT16_MAX;
+        stats->rtt_avg = UINT16_MAX;
+        stats->rtt_p99 = UINT16_MAX;
+        stats->jitter = UINT16_MAX;
+        return;
+    }
+
+    stats->rtt_min = std::min(q->rtt_min[0], q->rtt_min[1]);
+    stats->rtt_avg = q->rtt_avg_8 >> 3;
+    stats->jitter = q->jitter_16 >> 4;
+
+    // The upper bound of the bucket that contains the 99th percentile.
+    uint32_t rank = (q->rtt_samples * 99 + 99) / 100;
+    uint32_t seen = 0;
+    size_t bucket = 0;
+    for (; bucket < CM_LINK_RTT_HISTOGRAM_LEN - 1; ++bucket) {
+        seen += q->rtt_histogram[bucket];
+        if (seen >= rank)
+            break;
+    }
+    stats->rtt_p99 = rtt_histogram_bounds[bucket];
+}
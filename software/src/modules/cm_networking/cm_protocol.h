@@ -0,0 +1,131 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#pragma once
+
+// This file must not depend on Arduino, lwIP or any other module,
+// so that the packet checks and the link quality can be built and run on a host.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every charger receives one update per CM_SEND_PERIOD_MS.
+// The network task wakes up at least every CM_NETWORK_TASK_MAX_SLEEP_MS.
+#define CM_SEND_PERIOD_MS 1000
+#define CM_NETWORK_TASK_MAX_SLEEP_MS 100
+
+// Increment when changing packet structs
+#define PROTOCOL_VERSION 4
+// Oldest version that is still understood. Managers and chargers can be updated in any order:
+// Version 3 responses lack the request echo at the end of the response packet, the requests are the same.
+// A charger answers with the version of the last request it received.
+#define PROTOCOL_VERSION_MIN 3
+
+struct packet_header {
+    uint8_t seq_num;
+    uint8_t version;
+    uint16_t padding;
+} __attribute__((packed));
+
+struct request_packet {
+    packet_header header;
+
+    uint16_t allocated_current;
+} __attribute__((packed));
+
+struct response_packet {
+    packet_header header;
+
+    uint8_t iec61851_state;
+    uint8_t charger_state;
+    uint8_t error_state;
+    uint32_t uptime;
+    uint32_t charging_time;
+    uint16_t allowed_charging_current;
+    uint16_t supported_current;
+    bool managed;
+
+    // The last request the client received and how long it held it before sending this response.
+    // Lets the manager measure the round trip time independently of the response period.
+    uint8_t request_seq_num;
+    uint16_t request_age_ms;
+} __attribute__((packed));
+
+#define CM_PACKET_OK 0
+#define CM_PACKET_TOO_SHORT 1
+#define CM_PACKET_STALE 2
+#define CM_PACKET_VERSION_MISMATCH 3
+#define CM_PACKET_WRONG_SIZE 4
+
+// Size of a request or response packet of the given protocol version.
+size_t cm_packet_size(bool response, uint8_t version);
+
+// Checks a received request or response packet of len bytes.
+// The version is checked before the size: The size of the packets changes with the protocol version.
+// Sequence numbers up to four behind the last seen one are stale, larger steps back are a restart of the sender.
+uint8_t cm_check_packet(const packet_header *header, size_t len, bool response, uint8_t last_seen_seq_num);
+
+// Link quality of one charger as seen by the manager.
+// The round trip times are in ms and UINT16_MAX until the first round trip was measured.
+struct cm_link_stats {
+    uint16_t rtt_min;
+    uint16_t rtt_avg;
+    uint16_t rtt_p99;
+    uint16_t jitter; // mean deviation between consecutive round trip times in ms
+    uint16_t loss; // lost responses in per mille, 0 until CM_LINK_LOSS_MIN_EXPECTED responses were expected
+};
+
+// Requests are matched with the responses that echo their sequence number.
+// A response echoes the last request the client received, which was sent less than two send periods ago.
+#define CM_LINK_REQUEST_HISTORY_LEN 4
+// The round trip time histogram and the loss counters are halved when they reach these counts,
+// so that they cover the last few minutes.
+#define CM_LINK_RTT_HISTOGRAM_LEN 16
+#define CM_LINK_RTT_WINDOW 200
+#define CM_LINK_LOSS_WINDOW 100
+// The loss is reported as 0 until this many responses were expected:
+// A single lost response right after the start would otherwise be a loss of 33 % or more.
+#define CM_LINK_LOSS_MIN_EXPECTED 20
+
+struct cm_link_quality {
+    uint8_t request_seq_num[CM_LINK_REQUEST_HISTORY_LEN];
+    uint32_t request_sent_at[CM_LINK_REQUEST_HISTORY_LEN];
+
+    bool rtt_measured;
+    uint8_t rtt_histogram[CM_LINK_RTT_HISTOGRAM_LEN];
+    uint8_t rtt_samples;
+    // Minimum of the current and the previous histogram window
+    uint16_t rtt_min[2];
+    uint16_t last_rtt;
+    // Fixed point with 3 and 4 fractional bits like the smoothed RTT of TCP and the jitter of RTP.
+    uint32_t rtt_avg_8;
+    uint32_t jitter_16;
+
+    bool response_seen;
+    uint8_t last_response_seq_num;
+    uint8_t responses_expected;
+    uint8_t responses_lost;
+};
+
+void cm_link_quality_init(cm_link_quality *q);
+// Times are in ms of any clock that is shared by both calls.
+void cm_link_quality_request_sent(cm_link_quality *q, uint8_t seq_num, uint32_t sent_at);
+// Call with responses that passed cm_check_packet. Only loss is counted for version 3 responses.
+void cm_link_quality_response_received(cm_link_quality *q, const response_packet *response, uint32_t received_at);
+void cm_link_quality_get_stats(const cm_link_quality *q, cm_link_stats *stats);
@@ -148,7 +148,7 @@ void Meter::setupMeter(uint8_t meter_type)
         api.addFeature("meter_all_values");
     }
 
-    power_hist.setup();
+    power_hist.setup("meter_power");
 
     for (int i = all_values.count(); i < METER_ALL_VALUES_COUNT; ++i) {
         all_values.add();
@@ -19,106 +19,237 @@
 
 #include "value_history.h"
 
-void ValueHistory::setup()
+#include "tools.h"
+
+void ValueHistory::setup(const char *persist_name)
+{
+    series.setup(1, {
+        {0, 3 * 60 * HISTORY_MINUTE_INTERVAL - 1, false},
+        {1000 * 60 * HISTORY_MINUTE_INTERVAL, RING_BUF_SIZE - 1, true},
+#if defined(BOARD_HAS_PSRAM)
+        {1000 * 60 * 60 * 24, HISTORY_DAYS, true},
+#endif
+    }, persist_name);
+}
+
+float ValueHistory::samples_per_second()
+{
+    uint32_t last_interval_count = series.last_closed_count(VALUE_HISTORY_TIER_HISTORY, 0);
+    if (series.buckets_closed(VALUE_HISTORY_TIER_HISTORY) > 0 && last_interval_count > 0)
+        return ((float)last_interval_count) / (60 * HISTORY_MINUTE_INTERVAL);
+
+    return (float)series.get_open(VALUE_HISTORY_TIER_HISTORY, 0).count / millis() * 1000;
+}
+
+void ValueHistory::send_samples(WebServerRequest &request, size_t tier, bool binary, uint32_t period_ms, uint32_t start_s, const char *json_prefix, const char *json_suffix)
 {
-    history.setup();
-    live.setup();
-    history.clear();
-    live.clear();
-
-    for (int i = 0; i < history.size(); ++i) {
-        //float f = 5000.0 * sin(PI/120.0 * i) + 5000.0;
-        // Use negative state to mark that these are pre-filled.
-        history.push(-1);
+    size_t used = series.used(tier);
+    BufferedChunkWriter writer(request);
+
+    request.beginChunkedResponse(200, binary ? "application/octet-stream" : "application/json; charset=utf-8");
+
+    if (binary) {
+        ValueHistoryBinaryHeader header{VALUE_HISTORY_BINARY_VERSION, 0, (uint16_t)used, period_ms, start_s};
+        writer.write((const char *)&header, sizeof(header));
+    } else {
+        writer.write(json_prefix, strlen(json_prefix));
     }
 
-    task_scheduler.scheduleWithFixedDelay([this](){
-        if (samples_last_interval == 0) {
-            history.push(-1); //TODO push 0 or -1 here? -1 will be translated into null when sending as json. However we document that there is only at most one block of null values at the start of the array indicating a reboot
-            samples_per_interval = 0;
-            samples_last_interval = 0;
-            return;
+    int16_t last_value = 0;
+    uint32_t empty_run = 0;
+    char varint[5];
+
+    TimeSeriesBucket bucket;
+    for (size_t i = 0; i < used && series.get(tier, 0, i, &bucket); ++i) {
+        if (!binary) {
+            // Empty buckets are written as null, for example because the ESP was booted less than 48 hours ago.
+            if (bucket.count == 0)
+                writer.printf("%s%s", i == 0 ? "" : ",", "null");
+            else
+                writer.printf("%s%d", i == 0 ? "" : ",", (int)bucket.avg);
+            continue;
+        }
+
+        if (bucket.count == 0) {
+            ++empty_run;
+            continue;
         }
 
-        float live_sum = 0;
-        int16_t val;
-        for(int i = 0; i < samples_last_interval; ++i) {
-            live.peek_offset(&val, live.used() - 1 - i);
-            live_sum += val;
+        if (empty_run > 0) {
+            writer.write(varint, varint_encode((empty_run << 1) | 1, varint));
+            empty_run = 0;
         }
 
-        history.push((int16_t)(live_sum / samples_last_interval));
-        samples_per_interval = samples_last_interval;
-        samples_last_interval = 0;
-    }, 1000 * 60 * HISTORY_MINUTE_INTERVAL, 1000 * 60 * HISTORY_MINUTE_INTERVAL);
+        writer.write(varint, varint_encode(zigzag_encode((int32_t)bucket.avg - last_value) << 1, varint));
+        last_value = bucket.avg;
+    }
+
+    if (binary && empty_run > 0)
+        writer.write(varint, varint_encode((empty_run << 1) | 1, varint));
+
+    if (!binary)
+        writer.write(json_suffix, strlen(json_suffix));
+
+    writer.flush();
 }
 
-void ValueHistory::register_urls(String base_url)
+void ValueHistory::send_points(WebServerRequest &request, size_t tier, bool binary, size_t first, size_t count, size_t target_points, TimeSeriesDownsampling mode)
 {
-    server.on(("/" + base_url + "history").c_str(), HTTP_GET, [this](WebServerRequest request) {
-        /*if (!initialized) {
-            request.send(400, "text/html", "not initialized");
+    uint32_t period_ms = series.tier_config(tier).interval_ms;
+    uint32_t start_s = 0;
+    if (series.oldest_start(tier, &start_s))
+        start_s += first * (period_ms / 1000);
+
+    BufferedChunkWriter writer(request);
+
+    request.beginChunkedResponse(200, binary ? "application/octet-stream" : "application/json; charset=utf-8");
+
+    if (binary) {
+        // The header needs the number of points. Selecting them twice is cheaper than buffering them.
+        size_t point_count = 0;
+        series.downsample(tier, 0, first, count, target_points, mode, [&point_count](size_t, int16_t) {
+            ++point_count;
+        });
+
+        ValueHistoryBinaryHeader header{VALUE_HISTORY_BINARY_VERSION, VALUE_HISTORY_BINARY_FLAG_OFFSETS, (uint16_t)point_count, period_ms, start_s};
+        writer.write((const char *)&header, sizeof(header));
+    } else {
+        writer.printf("{\"start_time\":%u,\"sample_period_ms\":%u,\"points\":[", start_s, period_ms);
+    }
+
+    size_t last_offset = 0;
+    int16_t last_value = 0;
+    bool first_point = true;
+
+    series.downsample(tier, 0, first, count, target_points, mode, [&](size_t offset, int16_t value) {
+        offset -= first;
+
+        if (!binary) {
+            writer.printf("%s[%u,%d]", first_point ? "" : ",", (unsigned)offset, (int)value);
+            first_point = false;
             return;
-        }*/
-
-        const size_t buf_size = RING_BUF_SIZE * 6 + 100;
-        char buf[buf_size] = {0};
-        size_t buf_written = 0;
-
-        int16_t val;
-        history.peek(&val);
-        // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-        if (val < 0)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", "[null");
-        else
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "[%d", (int)val);
-
-        for (int i = 1; i < history.used() && history.peek_offset(&val, i) && buf_written < buf_size; ++i) {
-            // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-            if (val < 0)
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", ",null");
-            else
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, ",%d", (int)val);
         }
 
-        if (buf_written < buf_size)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%c", ']');
+        char varint[5];
+        writer.write(varint, varint_encode(offset - last_offset, varint));
+        writer.write(varint, varint_encode(zigzag_encode((int32_t)value - last_value) << 1, varint));
+        last_offset = offset;
+        last_value = value;
+    });
+
+    if (!binary)
+        writer.write("]}", 2);
+
+    writer.flush();
+}
+
+void ValueHistory::register_series_urls(String url, size_t tier)
+{
+    auto handler = [this, tier](WebServerRequest request, bool binary) {
+        String points = request.queryParam("points");
+        String mode = request.queryParam("mode");
+        String last = request.queryParam("last");
+        String from = request.queryParam("from");
+        String to = request.queryParam("to");
+
+        uint32_t start_s = 0;
+        bool start_known = series.oldest_start(tier, &start_s);
+
+        if (points.length() == 0 && mode.length() == 0 && last.length() == 0 && from.length() == 0 && to.length() == 0) {
+            send_samples(request, tier, binary, series.tier_config(tier).interval_ms, start_s, "[", "]");
+            return request.endChunkedResponse();
+        }
+
+        if (mode.length() != 0 && mode != "lttb" && mode != "minmax")
+            return request.send(400, "text/plain", "Unknown mode. Use lttb or minmax.");
+
+        if ((from.length() != 0 || to.length() != 0) && !start_known)
+            return request.send(400, "text/plain", "Clock not synced yet. Use last instead of from and to.");
+
+        uint32_t interval_s = series.tier_config(tier).interval_ms / 1000;
+        size_t first = 0;
+        size_t end = series.used(tier);
+
+        // last is the length of the window in seconds, ending with the newest bucket.
+        if (last.length() != 0) {
+            size_t buckets = (last.toInt() + interval_s - 1) / interval_s;
+            first = end > buckets ? end - buckets : 0;
+        }
 
-        return request.send(200, "application/json; charset=utf-8", buf, buf_written);
+        // from and to are in seconds since the epoch. Buckets overlapping the window are included.
+        if (from.length() != 0) {
+            uint32_t from_s = strtoul(from.c_str(), nullptr, 10);
+            if (from_s > start_s)
+                first = MAX(first, (size_t)((from_s - start_s) / interval_s));
+        }
+
+        if (to.length() != 0) {
+            uint32_t to_s = strtoul(to.c_str(), nullptr, 10);
+            end = to_s < start_s ? 0 : MIN(end, (size_t)((to_s - start_s) / interval_s + 1));
+        }
+
+        send_points(request, tier, binary, first, end > first ? end - first : 0, points.toInt() < 0 ? 0 : points.toInt(),
+                    mode == "minmax" ? TimeSeriesDownsampling::MinMax : TimeSeriesDownsampling::LTTB);
+        return request.endChunkedResponse();
+    };
+
+    server.on(url.c_str(), HTTP_GET, [handler](WebServerRequest request) {
+        return handler(request, false);
     });
 
-    server.on(("/" + base_url + "live").c_str(), HTTP_GET, [this](WebServerRequest request) {
-        /*if (!initialized) {
-            request.send(400, "text/html", "not initialized");
-            return;
-        }*/
+    server.on((url + "_bin").c_str(), HTTP_GET, [handler](WebServerRequest request) {
+        return handler(request, true);
+    });
+}
+
+void ValueHistory::register_urls(String base_url)
+{
+    register_series_urls("/" + base_url + "history", VALUE_HISTORY_TIER_HISTORY);
+#if defined(BOARD_HAS_PSRAM)
+    // Days are aligned to midnight UTC as soon as the clock is synced.
+    register_series_urls("/" + base_url + "history_daily", VALUE_HISTORY_TIER_DAILY);
+#endif
 
-        const size_t buf_size = RING_BUF_SIZE * 6 + 100;
-        char buf[buf_size] = {0};
-        size_t buf_written = 0;
+    auto live_handler = [this](WebServerRequest request, bool binary) {
+        float sps = samples_per_second();
 
-        int16_t val;
-        live.peek(&val);
-        float samples_per_second = 0;
-        if (this->samples_per_interval > 0) {
-            samples_per_second = ((float)this->samples_per_interval) / (60 * HISTORY_MINUTE_INTERVAL);
+        if (binary) {
+            uint32_t period_ms = sps > 0 ? (uint32_t)(1000 / sps + 0.5f) : 0;
+            uint32_t start_s = 0;
+
+            struct timeval tv_now;
+            if (clock_synced(&tv_now))
+                start_s = tv_now.tv_sec - series.used(VALUE_HISTORY_TIER_LIVE) * period_ms / 1000;
+
+            send_samples(request, VALUE_HISTORY_TIER_LIVE, true, period_ms, start_s, nullptr, nullptr);
         } else {
-            samples_per_second = (float)this->samples_last_interval / millis() * 1000;
+            char prefix[64];
+            snprintf(prefix, sizeof(prefix), "{\"samples_per_second\":%f,\"samples\":[", sps);
+            send_samples(request, VALUE_HISTORY_TIER_LIVE, false, 0, 0, prefix, "]}");
         }
-        buf_written += snprintf(buf + buf_written, buf_size - buf_written, "{\"samples_per_second\":%f,\"samples\":[%d", samples_per_second, val);
 
-        for (int i = 1; (i < live.used() - 1) && live.peek_offset(&val, i) && buf_written < buf_size; ++i) {
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, ",%d", val);
-        }
-        if (buf_written < buf_size)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", "]}");
-        return request.send(200, "application/json; charset=utf-8", buf, buf_written);
+        return request.endChunkedResponse();
+    };
+
+    server.on(("/" + base_url + "live").c_str(), HTTP_GET, [live_handler](WebServerRequest request) {
+        return live_handler(request, false);
+    });
+
+    server.on(("/" + base_url + "live_bin").c_str(), HTTP_GET, [live_handler](WebServerRequest request) {
+        return live_handler(request, true);
     });
 }
 
 void ValueHistory::add_sample(float sample)
 {
     int16_t val = (int16_t)min((float)INT16_MAX, sample);
-    live.push(val);
-    ++samples_last_interval;
+    series.add_sample(0, val);
+
+    for (auto &cb : sample_callbacks)
+        cb(val);
+}
+
+void ValueHistory::register_sample_callback(std::function<void(int16_t sample)> &&cb)
+{
+    sample_callbacks.push_back(std::move(cb));
 }
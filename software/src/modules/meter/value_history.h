@@ -19,9 +19,7 @@
 
 #pragma once
 
-#include "ringbuffer.h"
-#include "malloc_tools.h"
-#include "esp_heap_caps.h"
+#include "time_series.h"
 
 #include "task_scheduler.h"
 #include "web_server.h"
@@ -42,6 +40,37 @@ extern WebServer server;
 
 #define RING_BUF_SIZE (HISTORY_HOURS * (60 / HISTORY_MINUTE_INTERVAL) + 1)
 
+// How many days to keep the daily history for.
+// Both the coarse and the daily history are persisted to flash.
+// Boards without PSRAM don't keep a daily history.
+#define HISTORY_DAYS 366
+
+#define VALUE_HISTORY_TIER_LIVE 0
+#define VALUE_HISTORY_TIER_HISTORY 1
+#define VALUE_HISTORY_TIER_DAILY 2
+
+#define VALUE_HISTORY_BINARY_VERSION 1
+// Set if every sample token is preceded by a varint with the distance in buckets to the
+// previous sample (to the start of the window for the first one). Empty buckets are skipped then.
+#define VALUE_HISTORY_BINARY_FLAG_OFFSETS 0x01
+
+// The _bin variants of the history endpoints send this header followed by one
+// unsigned LEB128 varint per token. Even tokens are zigzag(sample - previous sample) << 1,
+// the previous sample starts at 0. Odd tokens (n << 1) | 1 stand for n empty buckets.
+//
+// The history endpoints accept the query parameters points (target number of points),
+// mode (lttb or minmax), last (window length in seconds) and from/to (window in seconds since the epoch).
+// With any of them, the JSON variant sends {"start_time", "sample_period_ms", "points": [[offset, value], ...]}
+// and the binary variant sets VALUE_HISTORY_BINARY_FLAG_OFFSETS.
+struct ValueHistoryBinaryHeader {
+    uint8_t version;
+    uint8_t flags;
+    uint16_t sample_count;
+    uint32_t sample_period_ms;
+    // Start of the oldest sample in seconds since the epoch. 0 if the clock was not synced yet.
+    uint32_t start_time;
+} __attribute__((packed));
+
 class ValueHistory
 {
 public:
@@ -49,29 +78,25 @@ public:
     {
     }
 
-    void setup();
+    // persist_name is used to name the flash files of the coarse and daily history.
+    void setup(const char *persist_name);
     void register_urls(String base_url);
     void add_sample(float sample);
 
-    int samples_last_interval = 0;
-    int samples_per_interval = -1;
-    TF_Ringbuffer<int16_t,
-                  3 * 60 * HISTORY_MINUTE_INTERVAL,
-                  uint32_t,
-#if defined(BOARD_HAS_PSRAM)
-                  malloc_psram,
-#else
-                  malloc_32bit_addressed,
-#endif
-                  heap_caps_free> live;
-
-    TF_Ringbuffer<int16_t,
-                  HISTORY_HOURS *(60 / HISTORY_MINUTE_INTERVAL) + 1,
-                  uint32_t,
-#if defined(BOARD_HAS_PSRAM)
-                  malloc_psram,
-#else
-                  malloc_32bit_addressed,
-#endif
-                  heap_caps_free> history;
+    // cb is called with every sample, after it was clamped to int16.
+    void register_sample_callback(std::function<void(int16_t sample)> &&cb);
+
+    float samples_per_second();
+
+    // Tier 0 stores the raw samples of the last HISTORY_MINUTE_INTERVAL minutes,
+    // tier 1 the HISTORY_MINUTE_INTERVAL minute buckets of the last HISTORY_HOURS hours,
+    // tier 2 the daily buckets of the last HISTORY_DAYS days (only with PSRAM).
+    TimeSeries series;
+
+private:
+    void register_series_urls(String url, size_t tier);
+    void send_points(WebServerRequest &request, size_t tier, bool binary, size_t first, size_t count, size_t target_points, TimeSeriesDownsampling mode);
+    void send_samples(WebServerRequest &request, size_t tier, bool binary, uint32_t period_ms, uint32_t start_s, const char *json_prefix, const char *json_suffix);
+
+    std::vector<std::function<void(int16_t sample)>> sample_callbacks;
 };
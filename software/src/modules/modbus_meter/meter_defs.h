@@ -11,6 +11,109 @@ struct RegRead {
     uint16_t len;
 };
 
+// All values read from the supported meters are 32 bit floats, i.e. two registers each.
+#define METER_VALUE_REGISTERS 2
+
+// Limit of a single read input registers request.
+#define MODBUS_MAX_READ_REGISTERS 125
+
+// Every register costs two bytes on the bus, about 2 ms at 9600 baud. An additional request costs
+// its own frame, the response header and CRC, the inter-frame gaps, the meter's response delay
+// and a round trip to the RS485 bricklet; together about as long as reading 40 registers.
+// Holes of up to this many unused registers between two values are read through.
+#define MODBUS_READ_THROUGH_HOLE_REGISTERS 40
+
+// The following functions merge a list of value registers into as few reads as possible.
+// They are evaluated at compile time; see RegReadBlocks. The list does not have to be sorted.
+// A meter answers a read that includes an undefined register with an exception,
+// so unused registers are only read within the spans that are known to be readable.
+
+// Smallest register in regs that is greater than after, or UINT16_MAX if there is none.
+constexpr uint16_t regread_next_register(const uint16_t *regs, size_t count, uint32_t after, size_t i = 0, uint16_t best = UINT16_MAX)
+{
+    return i == count ? best
+                      : regread_next_register(regs, count, after, i + 1, (regs[i] > after && regs[i] < best) ? regs[i] : best);
+}
+
+// Whether the registers from first to end (exclusive) lie within one of the spans.
+constexpr bool regread_readable(const RegRead *spans, size_t span_count, uint32_t first, uint32_t end, size_t i = 0)
+{
+    return i != span_count
+        && ((spans[i].start <= first && end <= (uint32_t)spans[i].start + spans[i].len)
+            || regread_readable(spans, span_count, first, end, i + 1));
+}
+
+constexpr bool regread_block_extends(const RegRead *spans, size_t span_count, uint16_t first, uint16_t last, uint16_t next)
+{
+    return next != UINT16_MAX
+        && (int32_t)next - (int32_t)(last + METER_VALUE_REGISTERS) <= MODBUS_READ_THROUGH_HOLE_REGISTERS
+        && next + METER_VALUE_REGISTERS - first <= MODBUS_MAX_READ_REGISTERS
+        && regread_readable(spans, span_count, first, next + METER_VALUE_REGISTERS);
+}
+
+// Register of the last value read by the block that starts with first and currently ends with last.
+constexpr uint16_t regread_block_last(const uint16_t *regs, size_t count, const RegRead *spans, size_t span_count, uint16_t first, uint16_t last)
+{
+    return regread_block_extends(spans, span_count, first, last, regread_next_register(regs, count, last))
+         ? regread_block_last(regs, count, spans, span_count, first, regread_next_register(regs, count, last))
+         : last;
+}
+
+constexpr uint16_t regread_next_block(const uint16_t *regs, size_t count, const RegRead *spans, size_t span_count, uint16_t first)
+{
+    return regread_next_register(regs, count, regread_block_last(regs, count, spans, span_count, first, first));
+}
+
+constexpr size_t regread_block_count(const uint16_t *regs, size_t count, const RegRead *spans, size_t span_count, uint16_t first)
+{
+    return first == UINT16_MAX ? 0 : 1 + regread_block_count(regs, count, spans, span_count, regread_next_block(regs, count, spans, span_count, first));
+}
+
+constexpr uint16_t regread_block_start(const uint16_t *regs, size_t count, const RegRead *spans, size_t span_count, size_t n, uint16_t first)
+{
+    return n == 0 ? first : regread_block_start(regs, count, spans, span_count, n - 1, regread_next_block(regs, count, spans, span_count, first));
+}
+
+constexpr RegRead regread_block_at(const uint16_t *regs, size_t count, const RegRead *spans, size_t span_count, uint16_t start)
+{
+    return RegRead{start, (uint16_t)(regread_block_last(regs, count, spans, span_count, start, start) + METER_VALUE_REGISTERS - start)};
+}
+
+constexpr RegRead regread_block(const uint16_t *regs, size_t count, const RegRead *spans, size_t span_count, size_t n)
+{
+    return regread_block_at(regs, count, spans, span_count, regread_block_start(regs, count, spans, span_count, n, regread_next_register(regs, count, 0)));
+}
+
+template<size_t... Is>
+struct regread_index_list {};
+
+template<size_t N, size_t... Is>
+struct regread_make_index_list : regread_make_index_list<N - 1, N - 1, Is...> {};
+
+template<size_t... Is>
+struct regread_make_index_list<0, Is...> {
+    typedef regread_index_list<Is...> type;
+};
+
+// Reads covering all values in regs. Holes between values are only read within one of the readable spans. Usage:
+//     static constexpr uint16_t xyz_registers[] = {1, 3, 5, 53};
+//     static constexpr RegRead xyz_readable[] = {{1, 6}, {53, 2}};
+//     using xyz_reads = RegReadBlocks<xyz_registers, sizeof(xyz_registers) / sizeof(xyz_registers[0]),
+//                                     xyz_readable, sizeof(xyz_readable) / sizeof(xyz_readable[0])>;
+// then pass xyz_reads::blocks and xyz_reads::len to the MeterInfo.
+template<const uint16_t *regs, size_t count, const RegRead *spans, size_t span_count,
+         typename Indices = typename regread_make_index_list<regread_block_count(regs, count, spans, span_count, regread_next_register(regs, count, 0))>::type>
+struct RegReadBlocks;
+
+template<const uint16_t *regs, size_t count, const RegRead *spans, size_t span_count, size_t... Is>
+struct RegReadBlocks<regs, count, spans, span_count, regread_index_list<Is...>> {
+    static constexpr size_t len = sizeof...(Is);
+    static constexpr RegRead blocks[sizeof...(Is)] = {regread_block(regs, count, spans, span_count, Is)...};
+};
+
+template<const uint16_t *regs, size_t count, const RegRead *spans, size_t span_count, size_t... Is>
+constexpr RegRead RegReadBlocks<regs, count, spans, span_count, regread_index_list<Is...>>::blocks[sizeof...(Is)];
+
 struct MeterInfo {
     uint16_t meter_id; // read from holding register 64515
     uint8_t meter_type; // will be written into meter/state["type"] if holding register 64515 contains the meter_id
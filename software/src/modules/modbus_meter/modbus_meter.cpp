@@ -34,12 +34,14 @@
 
 extern EventLog logger;
 
+static EventLogTag modbus_meter_log{"modbus_meter"};
+
 extern WebServer server;
 extern TaskScheduler task_scheduler;
 
 extern API api;
 
-static uint16_t write_buf[100];
+static uint16_t write_buf[MODBUS_MAX_READ_REGISTERS];
 static uint16_t registers[400];
 
 static MeterInfo *supported_meters[] = {
@@ -67,13 +69,13 @@ void read_meter_type_handler(struct TF_RS485 *rs485, uint8_t request_id, int8_t
     ModbusMeter::UserData *ud = (ModbusMeter::UserData *) user_data;
 
     if (request_id != ud->expected_request_id || ud->expected_request_id == 0) {
-        logger.printfln("Unexpected request id %u, expected %u", request_id, ud->expected_request_id);
+        log_warning(modbus_meter_log, "Unexpected request id %u, expected %u", request_id, ud->expected_request_id);
         ud->done = ModbusMeter::UserDataDone::ERROR;
         return;
     }
 
     if (exception_code != 0) {
-        logger.printfln("Request %u: Exception code %d", request_id, exception_code);
+        log_warning(modbus_meter_log, "Request %u: Exception code %d", request_id, exception_code);
         ud->done = ModbusMeter::UserDataDone::ERROR;
         return;
     }
@@ -109,13 +111,13 @@ void read_input_registers_handler(struct TF_RS485 *rs485, uint8_t request_id, in
     ModbusMeter::UserData *ud = (ModbusMeter::UserData *)user_data;
 
     if (request_id != ud->expected_request_id || ud->expected_request_id == 0) {
-        logger.printfln("Unexpected request id %u, expected %u", request_id, ud->expected_request_id);
+        log_warning(modbus_meter_log, "Unexpected request id %u, expected %u", request_id, ud->expected_request_id);
         ud->done = ModbusMeter::UserDataDone::ERROR;
         return;
     }
 
     if (exception_code != 0) {
-        logger.printfln("Request %u: Exception code %d", request_id, exception_code);
+        log_warning(modbus_meter_log, "Request %u: Exception code %d", request_id, exception_code);
         ud->done = ModbusMeter::UserDataDone::ERROR;
         return;
     }
@@ -142,7 +144,7 @@ void write_multiple_registers_handler(struct TF_RS485 *device, uint8_t request_i
     ModbusMeter::UserData *ud = (ModbusMeter::UserData *)user_data;
 
     if (request_id != ud->expected_request_id || ud->expected_request_id == 0) {
-        logger.printfln("Unexpected request id %u, expected %u", request_id, ud->expected_request_id);
+        log_warning(modbus_meter_log, "Unexpected request id %u, expected %u", request_id, ud->expected_request_id);
         ud->done = ModbusMeter::UserDataDone::ERROR;
         return;
     }
@@ -157,7 +159,7 @@ void write_multiple_registers_handler(struct TF_RS485 *device, uint8_t request_i
     // In the future we should check that the reset worked by re-reading the energy value,
     // making sure that it is a small enough value and retrying the reset if not.
     if (exception_code != 0 && exception_code != TF_RS485_EXCEPTION_CODE_TIMEOUT) {
-        logger.printfln("Exception code %d", exception_code);
+        log_warning(modbus_meter_log, "Exception code %d", exception_code);
         ud->done = ModbusMeter::UserDataDone::ERROR;
         return;
     }
@@ -2,22 +2,27 @@
 
 static const RegRead sdm72dm_slow[]{};
 
-static const RegRead sdm72dm_fast[]{
-    {53, 2},  // power
-    {343, 2}, // energy_abs
-    {385, 2}  // energy_rel
-};
-
 enum FastValues {
     Power,
     EnergyAbs,
     EnergyRel
 };
 
-static const uint16_t sdm72dm_registers_fast_to_read[] = {
+static constexpr uint16_t sdm72dm_registers_fast_to_read[] = {
 	53, 343, 385 // power, energy_abs, energy_rel
 };
 
+// Spans the firmware read before the reads were merged. Holes between values are only read within them:
+// It's not known whether the meter answers reads of the undefined registers between these spans.
+static constexpr RegRead sdm72dm_readable[] = {
+    {53, 2},
+    {343, 2},
+    {385, 2}
+};
+
+using sdm72dm_fast = RegReadBlocks<sdm72dm_registers_fast_to_read, sizeof(sdm72dm_registers_fast_to_read) / sizeof(sdm72dm_registers_fast_to_read[0]),
+                                   sdm72dm_readable, sizeof(sdm72dm_readable) / sizeof(sdm72dm_readable[0])>;
+
 static void sdm72dm_fast_read_done(const uint16_t *all_regs)
 {
     float fast_values[3];
@@ -35,8 +40,8 @@ MeterInfo sdm72dm {
     1,
     sdm72dm_slow,
     sizeof(sdm72dm_slow) / sizeof(sdm72dm_slow[0]),
-    sdm72dm_fast,
-    sizeof(sdm72dm_fast) / sizeof(sdm72dm_fast[0]),
+    sdm72dm_fast::blocks,
+    sdm72dm_fast::len,
     sdm72dm_slow_read_done,
     sdm72dm_fast_read_done,
     "SDM72DM",
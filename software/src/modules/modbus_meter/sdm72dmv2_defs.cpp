@@ -1,19 +1,6 @@
 #include "sdm72dmv2_defs.h"
 
-static const RegRead sdm72dmv2_slow[] {
-    {1, 76},
-    {201, 46},
-    {343, 4}
-};
-
-static const RegRead sdm72dmv2_fast[]{
-    {1, 12},  // current per phase
-    {53, 2},  // power
-    {343, 2}, // energy_abs
-    {385, 2}  // energy_rel
-};
-
-static const uint16_t sdm72dmv2_registers_to_read[] = {
+static constexpr uint16_t sdm72dmv2_registers_to_read[] = {
 	1,3,5,7,9,11,13,15,17,19,21,23,25,27,29,31,33,35,47,49,53,57,61,63,71,73,75,201,203,205,207,225,243,245,343,345
 };
 
@@ -33,10 +20,24 @@ enum FastValues {
     CurrentPhase2,
 };
 
-static const uint16_t sdm72dmv2_registers_fast_to_read[] = {
+static constexpr uint16_t sdm72dmv2_registers_fast_to_read[] = {
 	53, 343, 385, 1, 3, 5, 7, 9, 11 // power, energy_abs, energy_rel, voltage per phase, current per phase
 };
 
+// Spans the firmware read before the reads were merged. Holes between values are only read within them:
+// It's not known whether the meter answers reads of the undefined registers between these spans.
+static constexpr RegRead sdm72dmv2_readable[] = {
+    {1, 76},
+    {201, 46},
+    {343, 4},
+    {385, 2}
+};
+
+using sdm72dmv2_slow = RegReadBlocks<sdm72dmv2_registers_to_read, sizeof(sdm72dmv2_registers_to_read) / sizeof(sdm72dmv2_registers_to_read[0]),
+                                     sdm72dmv2_readable, sizeof(sdm72dmv2_readable) / sizeof(sdm72dmv2_readable[0])>;
+using sdm72dmv2_fast = RegReadBlocks<sdm72dmv2_registers_fast_to_read, sizeof(sdm72dmv2_registers_fast_to_read) / sizeof(sdm72dmv2_registers_fast_to_read[0]),
+                                     sdm72dmv2_readable, sizeof(sdm72dmv2_readable) / sizeof(sdm72dmv2_readable[0])>;
+
 static void sdm72dmv2_fast_read_done(const uint16_t *all_regs)
 {
     float fast_values[sizeof(sdm72dmv2_registers_fast_to_read)/sizeof(sdm72dmv2_registers_fast_to_read[0])];
@@ -82,10 +83,10 @@ static void sdm72dmv2_slow_read_done(const uint16_t *all_regs)
 MeterInfo sdm72dmv2 {
     0x0089,
     3,
-    sdm72dmv2_slow,
-    sizeof(sdm72dmv2_slow) / sizeof(sdm72dmv2_slow[0]),
-    sdm72dmv2_fast,
-    sizeof(sdm72dmv2_fast) / sizeof(sdm72dmv2_fast[0]),
+    sdm72dmv2_slow::blocks,
+    sdm72dmv2_slow::len,
+    sdm72dmv2_fast::blocks,
+    sdm72dmv2_fast::len,
     sdm72dmv2_slow_read_done,
     sdm72dmv2_fast_read_done,
     "SDM72DM-V2",
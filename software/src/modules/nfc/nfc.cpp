@@ -46,6 +46,7 @@
 
 #define TOKEN_LIFETIME_MS 30000
 #define DETECTION_THRESHOLD_MS 1000
+#define POLL_INTERVAL_MS 100
 
 extern EventLog logger;
 
@@ -84,6 +85,15 @@ NFC::NFC() : DeviceModule("nfc", "NFC", "NFC", std::bind(&NFC::setup_nfc, this))
             id_copy.toUpperCase();
             tags->get(tag)->get("tag_id")->updateString(id_copy);
 
+            if (id_copy.length() != 0 && id_copy.length() % 3 != 2) {
+                // Earlier firmwares stored incomplete IDs like "AB:C". They never matched a tag and still don't,
+                // but must not prevent the other authorized tags from being restored.
+                if (!restoring_config)
+                    return "Tag ID is incomplete. Expected format is hex bytes separated by colons. For example \"01:23:ab:3d\".";
+
+                logger.printfln("Authorized tag %d has the incomplete ID %s. It can't match any tag.", tag, id_copy.c_str());
+            }
+
             for(int i = 0; i < id_copy.length(); ++i) {
                 char c = id_copy.charAt(i);
                 if ((i % 3 != 2) && ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F')))
@@ -105,6 +115,9 @@ NFC::NFC() : DeviceModule("nfc", "NFC", "NFC", std::bind(&NFC::setup_nfc, this))
         id_copy.toUpperCase();
         cfg.get("tag_id")->updateString(id_copy);
 
+        if (id_copy.length() != 0 && id_copy.length() % 3 != 2)
+            return "Tag ID is incomplete. Expected format is hex bytes separated by colons. For example \"01:23:ab:3d\".";
+
         for(int i = 0; i < id_copy.length(); ++i) {
             char c = id_copy.charAt(i);
             if ((i % 3 != 2) && ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'F')))
@@ -161,20 +174,86 @@ void NFC::check_nfc_state()
     }
 }
 
-uint8_t NFC::get_user_id(tag_info_t *tag, uint8_t *tag_idx)
+// FNV-1a
+static uint32_t hash_tag_id(const NFC::tag_id_t &id)
 {
-    if (tag->last_seen >= TOKEN_LIFETIME_MS)
+    const uint8_t *bytes = (const uint8_t *)&id;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(id); ++i) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool tag_ids_equal(const NFC::tag_id_t &a, const NFC::tag_id_t &b)
+{
+    return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+// Parses hex bytes separated by colons, as accepted by the config validators.
+static bool tag_id_string_to_bytes(uint8_t tag_type, const char *str, NFC::tag_id_t *id)
+{
+    memset(id, 0, sizeof(*id));
+    id->tag_type = tag_type;
+
+    size_t len = strlen(str);
+    if (len == 0)
+        return true;
+
+    if (len % 3 != 2 || (len + 1) / 3 > NFC_TAG_ID_LENGTH)
         return false;
 
+    for (size_t i = 0; i < len; i += 3) {
+        char hex[3] = {str[i], str[i + 1], '\0'};
+        id->bytes[id->length++] = (uint8_t)strtoul(hex, nullptr, 16);
+    }
+
+    return true;
+}
+
+void NFC::index_authorized_tags()
+{
     Config *auth_tags = (Config *)config_in_use.get("authorized_tags");
 
+    authorized_tags.clear();
+    memset(authorized_tag_slots, 0xFF, sizeof(authorized_tag_slots));
+
     for (uint8_t auth_tag_idx = 0; auth_tag_idx < auth_tags->count(); ++auth_tag_idx) {
         Config *auth_tag = (Config *)auth_tags->get(auth_tag_idx);
 
-        if (auth_tag->get("tag_type")->asUint() == tag->tag_type && auth_tag->get("tag_id")->asString() == tag->tag_id) {
+        authorized_tag_t tag;
+        tag.user_id = auth_tag->get("user_id")->asUint();
+        // Keep the list index of each tag, it is used as auth token. A malformed ID can't match any tag.
+        if (!tag_id_string_to_bytes(auth_tag->get("tag_type")->asUint(), auth_tag->get("tag_id")->asCStr(), &tag.id))
+            tag.id.length = 0xFF;
+        authorized_tags.push_back(tag);
+
+        // Tags are inserted in list order, so the first of multiple equal tags is found first.
+        size_t slot = hash_tag_id(tag.id) % AUTHORIZED_TAG_HASH_SLOTS;
+        while (authorized_tag_slots[slot] != 0xFF)
+            slot = (slot + 1) % AUTHORIZED_TAG_HASH_SLOTS;
+        authorized_tag_slots[slot] = auth_tag_idx;
+    }
+}
+
+uint8_t NFC::get_user_id(tag_info_t *tag, uint8_t *tag_idx)
+{
+    if (tag->last_seen >= TOKEN_LIFETIME_MS)
+        return false;
+
+    size_t slot = tag->hash % AUTHORIZED_TAG_HASH_SLOTS;
+    for (size_t probes = 0; probes < AUTHORIZED_TAG_HASH_SLOTS; ++probes) {
+        uint8_t auth_tag_idx = authorized_tag_slots[slot];
+        if (auth_tag_idx == 0xFF)
+            break;
+
+        if (tag_ids_equal(authorized_tags[auth_tag_idx].id, tag->id)) {
             *tag_idx = auth_tag_idx;
-            return auth_tag->get("user_id")->asUint();
+            return authorized_tags[auth_tag_idx].user_id;
         }
+
+        slot = (slot + 1) % AUTHORIZED_TAG_HASH_SLOTS;
     }
     return 0;
 }
@@ -216,6 +295,24 @@ void set_led(int16_t mode)
     last_set = millis();
 }
 
+const char *lookup = "0123456789ABCDEF";
+
+void tag_id_bytes_to_string(const uint8_t *tag_id, uint8_t tag_id_len, char buf[NFC_TAG_ID_STRING_LENGTH + 1])
+{
+    for (int i = 0; i < tag_id_len; ++i) {
+        uint8_t b = tag_id[i];
+        uint8_t hi = (b & 0xF0) >> 4;
+        uint8_t lo = b & 0x0F;
+        buf[3 * i] = lookup[hi];
+        buf[3 * i + 1] = lookup[lo];
+        buf[3 * i + 2] = ':';
+    }
+    if (tag_id_len == 0)
+        buf[0] = '\0';
+    else
+        buf[3 * tag_id_len - 1] = '\0';
+}
+
 void NFC::handle_event(tag_info_t *tag, bool found, bool injected)
 {
     uint8_t idx = 0;
@@ -227,9 +324,11 @@ void NFC::handle_event(tag_info_t *tag, bool found, bool injected)
             auth_token = idx;
             auth_token_seen = millis();
             blink_state = IND_ACK;
+            char tag_id[NFC_TAG_ID_STRING_LENGTH + 1];
+            tag_id_bytes_to_string(tag->id.bytes, tag->id.length, tag_id);
             users.trigger_charge_action(user_id, injected ? CHARGE_TRACKER_AUTH_TYPE_NFC_INJECTION : CHARGE_TRACKER_AUTH_TYPE_NFC, Config::Object({
-                    {"tag_type", Config::Uint8(tag->tag_type)},
-                    {"tag_id", Config::Str(tag->tag_id)}}).value,
+                    {"tag_type", Config::Uint8(tag->id.tag_type)},
+                    {"tag_id", Config::Str(tag_id)}}).value,
                     injected ? tag_injection_action : TRIGGER_CHARGE_ANY);
         } else if (auth_token == idx) {
             // Lost an authorized tag. If we still have it's auth token, extend the token's validity.
@@ -262,58 +361,91 @@ void NFC::handle_evse()
         set_led(waiting_for_start ? IND_NAG : -1);
 }
 
-const char *lookup = "0123456789ABCDEF";
-
-void tag_id_bytes_to_string(const uint8_t *tag_id, uint8_t tag_id_len, char buf[NFC_TAG_ID_STRING_LENGTH + 1])
+bool NFC::read_tag(uint8_t index, tag_info_t *tag)
 {
-    for (int i = 0; i < tag_id_len; ++i) {
-        uint8_t b = tag_id[i];
-        uint8_t hi = (b & 0xF0) >> 4;
-        uint8_t lo = b & 0x0F;
-        buf[3 * i] = lookup[hi];
-        buf[3 * i + 1] = lookup[lo];
-        buf[3 * i + 2] = ':';
+    memset(&tag->id, 0, sizeof(tag->id));
+    int result = tf_nfc_simple_get_tag_id(&device, index, &tag->id.tag_type, tag->id.bytes, &tag->id.length, &tag->last_seen);
+    if (result != TF_E_OK) {
+        if (!is_in_bootloader(result)) {
+            logger.printfln("Failed to get tag id %d, rc: %d", index, result);
+        }
+        return false;
     }
-    if (tag_id_len == 0)
-        buf[0] = '\0';
-    else
-        buf[3 * tag_id_len - 1] = '\0';
+
+    tag->hash = hash_tag_id(tag->id);
+    return true;
 }
 
 void NFC::update_seen_tags()
 {
-    for (int i = 0; i < TAG_LIST_LENGTH - 1; ++i) {
-        uint8_t buf[10] = {0};
-        uint8_t tag_id_len = 0;
-        int result = tf_nfc_simple_get_tag_id(&device, i, &new_tags[i].tag_type, buf, &tag_id_len, &new_tags[i].last_seen);
-        if (result != TF_E_OK) {
-            if (!is_in_bootloader(result)) {
-                logger.printfln("Failed to get tag id %d, rc: %d", i, result);
-            }
-            continue;
-        }
+    uint32_t now = millis();
+    uint32_t elapsed = now - last_poll;
+    last_poll = now;
+
+    // The bricklet has no callback for the simple mode, but it sorts the tags by the time
+    // they were last seen. If the newest tag did not change, the others only aged since the
+    // last poll, so only the other tags have to be read if a different tag was seen.
+    tag_info_t newest;
+    if (!read_tag(0, &newest))
+        return;
 
-        tag_id_bytes_to_string(buf, tag_id_len, new_tags[i].tag_id);
+    bool list_changed = !tag_ids_equal(newest.id, old_tags[0].id);
 
-        seen_tags.get(i)->get("tag_type")->updateUint(new_tags[i].tag_type);
-        seen_tags.get(i)->get("tag_id")->updateString(new_tags[i].tag_id);
+    if (list_changed) {
+        new_tags[0] = newest;
+        for (int i = 1; i < TAG_LIST_LENGTH - 1; ++i) {
+            if (!read_tag(i, &new_tags[i]))
+                new_tags[i] = old_tags[i];
+        }
+    } else {
+        new_tags[0] = newest;
+        for (int i = 1; i < TAG_LIST_LENGTH - 1; ++i) {
+            new_tags[i] = old_tags[i];
+            // last_seen 0 marks an empty slot.
+            if (new_tags[i].last_seen != 0)
+                new_tags[i].last_seen += elapsed;
+        }
+    }
+
+    for (int i = 0; i < TAG_LIST_LENGTH - 1; ++i) {
+        if (list_changed) {
+            char tag_id[NFC_TAG_ID_STRING_LENGTH + 1];
+            tag_id_bytes_to_string(new_tags[i].id.bytes, new_tags[i].id.length, tag_id);
+            seen_tags.get(i)->get("tag_type")->updateUint(new_tags[i].id.tag_type);
+            seen_tags.get(i)->get("tag_id")->updateString(tag_id);
+        }
         seen_tags.get(i)->get("last_seen")->updateUint(new_tags[i].last_seen);
     }
 
+    tag_info_t *injected = &new_tags[TAG_LIST_LENGTH - 1];
     if (last_tag_injection == 0 || deadline_elapsed(last_tag_injection + 1000 * 60 * 60 * 24)) {
         last_tag_injection = 0;
-        new_tags[TAG_LIST_LENGTH - 1].tag_type = 0;
-        new_tags[TAG_LIST_LENGTH - 1].tag_id[0] = '\0';
-        new_tags[TAG_LIST_LENGTH - 1].last_seen = 0;
+        memset(&injected->id, 0, sizeof(injected->id));
+        injected->last_seen = 0;
     } else {
-        new_tags[TAG_LIST_LENGTH - 1].tag_type = inject_tag.get("tag_type")->asUint();
-        strncpy(new_tags[TAG_LIST_LENGTH - 1].tag_id, inject_tag.get("tag_id")->asCStr(), sizeof(new_tags[TAG_LIST_LENGTH - 1].tag_id));
-        new_tags[TAG_LIST_LENGTH - 1].last_seen = millis() - last_tag_injection;
+        injected->id = injected_tag;
+        injected->last_seen = millis() - last_tag_injection;
+    }
+    injected->hash = hash_tag_id(injected->id);
+
+    seen_tags.get(TAG_LIST_LENGTH - 1)->get("last_seen")->updateUint(injected->last_seen);
+    seen_tags.get(TAG_LIST_LENGTH - 1)->get("tag_type")->updateUint(injected->id.tag_type);
+    seen_tags.get(TAG_LIST_LENGTH - 1)->get("tag_id")->updateString(last_tag_injection == 0 ? "" : inject_tag.get("tag_id")->asCStr());
+
+    // Index the old list by hash. Slots contain the index into old_tags or 0xFF if they are empty.
+    uint8_t old_slots[SEEN_TAG_HASH_SLOTS];
+    memset(old_slots, 0xFF, sizeof(old_slots));
+    for (int old_idx = 0; old_idx < TAG_LIST_LENGTH; ++old_idx) {
+        if (old_tags[old_idx].last_seen == 0)
+            continue;
+
+        size_t slot = old_tags[old_idx].hash % SEEN_TAG_HASH_SLOTS;
+        while (old_slots[slot] != 0xFF)
+            slot = (slot + 1) % SEEN_TAG_HASH_SLOTS;
+        old_slots[slot] = old_idx;
     }
 
-    seen_tags.get(TAG_LIST_LENGTH - 1)->get("last_seen")->updateUint(new_tags[TAG_LIST_LENGTH - 1].last_seen);
-    seen_tags.get(TAG_LIST_LENGTH - 1)->get("tag_type")->updateUint(new_tags[TAG_LIST_LENGTH - 1].tag_type);
-    seen_tags.get(TAG_LIST_LENGTH - 1)->get("tag_id")->updateString(new_tags[TAG_LIST_LENGTH - 1].tag_id);
+    bool old_matched[TAG_LIST_LENGTH] = {};
 
     // compare new list with old
     // tags that are not seen anymore are lost
@@ -322,31 +454,26 @@ void NFC::update_seen_tags()
         if (new_tags[new_idx].last_seen == 0)
             continue;
 
-        bool found = false;
-        int old_idx;
-        for (old_idx = 0; old_idx < TAG_LIST_LENGTH; ++old_idx) {
-            if (old_tags[old_idx].last_seen == 0)
-                continue;
-
-            if(strncmp(old_tags[old_idx].tag_id,
-                       new_tags[new_idx].tag_id,
-                       NFC_TAG_ID_STRING_LENGTH) != 0)
-                continue;
-
-            found = true;
-            break;
+        int old_idx = -1;
+        for (size_t slot = new_tags[new_idx].hash % SEEN_TAG_HASH_SLOTS; old_slots[slot] != 0xFF; slot = (slot + 1) % SEEN_TAG_HASH_SLOTS) {
+            if (tag_ids_equal(old_tags[old_slots[slot]].id, new_tags[new_idx].id)) {
+                old_idx = old_slots[slot];
+                break;
+            }
         }
 
         bool new_seen = new_tags[new_idx].last_seen < DETECTION_THRESHOLD_MS;
 
-        if (!found && new_seen) {
-            // found new tag
-            handle_event(&new_tags[new_idx], true, new_idx == TAG_LIST_LENGTH - 1);
+        if (old_idx < 0) {
+            if (new_seen) {
+                // found new tag
+                handle_event(&new_tags[new_idx], true, new_idx == TAG_LIST_LENGTH - 1);
+            }
             continue;
         }
 
         bool old_seen = old_tags[old_idx].last_seen < DETECTION_THRESHOLD_MS;
-        old_tags[old_idx].last_seen = 0;
+        old_matched[old_idx] = true;
 
         if (old_seen && !new_seen) {
             // lost old tag
@@ -360,10 +487,10 @@ void NFC::update_seen_tags()
         }
     }
 
-    // tags that are also in the new list are marked with last_seen = 0
+    // tags that are also in the new list are marked as matched
     // all other tags are displaced i.e. gone
     for (int old_idx = 0; old_idx < TAG_LIST_LENGTH; ++old_idx) {
-        if (old_tags[old_idx].last_seen == 0)
+        if (old_tags[old_idx].last_seen == 0 || old_matched[old_idx])
             continue;
 
         handle_event(&old_tags[old_idx], false, old_idx == TAG_LIST_LENGTH - 1);
@@ -380,8 +507,11 @@ void NFC::setup()
     if (!device_found)
         return;
 
+    restoring_config = true;
     api.restorePersistentConfig("nfc/config", &config);
+    restoring_config = false;
     config_in_use = config;
+    index_authorized_tags();
 
     for (int i = 0; i < TAG_LIST_LENGTH; ++i) {
         seen_tags.add();
@@ -393,7 +523,7 @@ void NFC::setup()
 
     task_scheduler.scheduleWithFixedDelay([this](){
         static uint32_t last_run = 0;
-        if (deadline_elapsed(last_run + 300)) {
+        if (deadline_elapsed(last_run + POLL_INTERVAL_MS)) {
             last_run = millis();
             this->update_seen_tags();
         }
@@ -411,6 +541,7 @@ void NFC::register_urls()
     api.addCommand("nfc/inject_tag", &inject_tag, {}, [this](){
         last_tag_injection = millis();
         tag_injection_action = TRIGGER_CHARGE_ANY;
+        tag_id_string_to_bytes(inject_tag.get("tag_type")->asUint(), inject_tag.get("tag_id")->asCStr(), &injected_tag);
         // 0 is the marker that no injection happened or the last one was handled.
         // Fake that we were one ms faster.
         if (last_tag_injection == 0)
@@ -420,6 +551,7 @@ void NFC::register_urls()
     api.addCommand("nfc/inject_tag_start", &inject_tag, {}, [this](){
         last_tag_injection = millis();
         tag_injection_action = TRIGGER_CHARGE_START;
+        tag_id_string_to_bytes(inject_tag.get("tag_type")->asUint(), inject_tag.get("tag_id")->asCStr(), &injected_tag);
         // 0 is the marker that no injection happened or the last one was handled.
         // Fake that we were one ms faster.
         if (last_tag_injection == 0)
@@ -429,6 +561,7 @@ void NFC::register_urls()
     api.addCommand("nfc/inject_tag_stop", &inject_tag, {}, [this](){
         last_tag_injection = millis();
         tag_injection_action = TRIGGER_CHARGE_STOP;
+        tag_id_string_to_bytes(inject_tag.get("tag_type")->asUint(), inject_tag.get("tag_id")->asCStr(), &injected_tag);
         // 0 is the marker that no injection happened or the last one was handled.
         // Fake that we were one ms faster.
         if (last_tag_injection == 0)
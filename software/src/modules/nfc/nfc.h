@@ -21,6 +21,8 @@
 
 #include "bindings/bricklet_nfc.h"
 
+#include <vector>
+
 #include "config.h"
 #include "device_module.h"
 #include "nfc_bricklet_firmware_bin.embedded.h"
@@ -32,6 +34,10 @@
 
 #define TAG_LIST_LENGTH 9
 
+// Number of slots of the hash indices. Has to be greater than the number of indexed tags.
+#define AUTHORIZED_TAG_HASH_SLOTS 32
+#define SEEN_TAG_HASH_SLOTS 16
+
 class NFC : public DeviceModule<TF_NFC,
                                 nfc_bricklet_firmware_bin_data,
                                 nfc_bricklet_firmware_bin_length,
@@ -46,10 +52,22 @@ public:
     void register_urls();
     void loop();
 
+    // Unused bytes are 0, so that IDs can be compared with memcmp.
+    struct tag_id_t {
+        uint8_t tag_type;
+        uint8_t length;
+        uint8_t bytes[NFC_TAG_ID_LENGTH];
+    } __attribute__((packed));
+
     struct tag_info_t {
         uint32_t last_seen;
-        uint8_t tag_type;
-        char tag_id[NFC_TAG_ID_STRING_LENGTH + 1]; // allow null terminator here
+        uint32_t hash;
+        tag_id_t id;
+    };
+
+    struct authorized_tag_t {
+        tag_id_t id;
+        uint8_t user_id;
     };
 
     void update_seen_tags();
@@ -58,9 +76,13 @@ public:
     void setup_nfc();
     void check_nfc_state();
     uint8_t get_user_id(tag_info_t *tag, uint8_t *tag_idx);
+    void index_authorized_tags();
+    bool read_tag(uint8_t index, tag_info_t *tag);
 
     ConfigRoot config;
     ConfigRoot config_in_use;
+    // Set while the stored config is restored. The validator then accepts the tag IDs of earlier firmwares.
+    bool restoring_config = false;
     ConfigRoot seen_tags;
     ConfigRoot state;
     ConfigRoot inject_tag;
@@ -75,6 +97,14 @@ public:
     tag_info_t new_tag_buffer[TAG_LIST_LENGTH] = {};
     tag_info_t *old_tags = old_tag_buffer;
     tag_info_t *new_tags = new_tag_buffer;
+    uint32_t last_poll = 0;
+
+    // Binary copy of config_in_use's authorized tags with a hash index.
+    // Slots contain the index into authorized_tags or 0xFF if they are empty.
+    std::vector<authorized_tag_t> authorized_tags;
+    uint8_t authorized_tag_slots[AUTHORIZED_TAG_HASH_SLOTS];
+
+    tag_id_t injected_tag = {};
 
     int auth_token = -1;
     uint32_t auth_token_seen = 0;
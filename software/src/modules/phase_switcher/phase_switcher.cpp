@@ -74,29 +74,9 @@ void PhaseSwitcher::setup()
         return;
     }
 
-    requested_power_history.setup();
-    requested_power_history.clear();
-
-    for (int i = 0; i < requested_power_history.size(); ++i) {
-        // Use negative values to mark that these are pre-filled.
-        requested_power_history.push(-1);
-    }
-
-    charging_power_history.setup();
-    charging_power_history.clear();
-
-    for (int i = 0; i < charging_power_history.size(); ++i) {
-        // Use negative values to mark that these are pre-filled.
-        charging_power_history.push(-1);
-    }
-
-    active_phases_history.setup();
-    active_phases_history.clear();
-
-    for (int i = 0; i < active_phases_history.size(); ++i) {
-        // Use negative values to mark that these are pre-filled.
-        active_phases_history.push(-1);
-    }
+    history.setup(3, {
+        {PHASE_SWITCHER_HISTORY_MINUTE_INTERVAL * 60 * 1000, PHASE_SWITCHER_RING_BUF_SIZE - 1, false}
+    });
 
     api.restorePersistentConfig("phase_switcher/config", &phase_switcher_config);
     phase_switcher_config_in_use = phase_switcher_config;
@@ -113,13 +93,11 @@ void PhaseSwitcher::setup()
         this->contactor_check();
     }, 0, 250);
 
+    // The history averages all samples of a PHASE_SWITCHER_HISTORY_MINUTE_INTERVAL.
     task_scheduler.scheduleWithFixedDelay([this](){
         update_all_data();
-    }, 10, 250);
-
-    task_scheduler.scheduleWithFixedDelay([this](){
         update_history();
-    }, 20, PHASE_SWITCHER_HISTORY_MINUTE_INTERVAL * 60 * 1000);
+    }, 10, 250);
 
     initialized = true;
 }
@@ -176,31 +154,13 @@ void PhaseSwitcher::register_urls()
         if (!initialized) {
             return request.send(400, "text/html", "not initialized");
         }
-        
+
         const size_t buf_size = PHASE_SWITCHER_RING_BUF_SIZE * 6 + 100;
         char buf[buf_size] = {0};
-        size_t buf_written = 0;
 
-        int16_t val;
-        
-        requested_power_history.peek(&val);
-        // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-        if (val < 0)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", "[null");
-        else
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "[%d", (int)val);
-
-        for (int i = 1; i < requested_power_history.used() && requested_power_history.peek_offset(&val, i) && buf_written < buf_size; ++i) {
-            // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-            if (val < 0)
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", ",null");
-            else
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, ",%d", (int)val);
-        }
+        // Empty buckets are written as null, because the ESP was booted less than 12 hours ago.
+        size_t buf_written = history.format_json(0, PHASE_SWITCHER_HISTORY_CHANNEL_REQUESTED_POWER, buf, buf_size);
 
-        if (buf_written < buf_size)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%c", ']');
-        
         return request.send(200, "application/json; charset=utf-8", buf, buf_written);
     });
 
@@ -211,26 +171,9 @@ void PhaseSwitcher::register_urls()
 
         const size_t buf_size = PHASE_SWITCHER_RING_BUF_SIZE * 6 + 100;
         char buf[buf_size] = {0};
-        size_t buf_written = 0;
 
-        int16_t val;
-        charging_power_history.peek(&val);
-        // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-        if (val < 0)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", "[null");
-        else
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "[%d", (int)val);
-
-        for (int i = 1; i < charging_power_history.used() && charging_power_history.peek_offset(&val, i) && buf_written < buf_size; ++i) {
-            // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-            if (val < 0)
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", ",null");
-            else
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, ",%d", (int)val);
-        }
-
-        if (buf_written < buf_size)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%c", ']');
+        // Empty buckets are written as null, because the ESP was booted less than 12 hours ago.
+        size_t buf_written = history.format_json(0, PHASE_SWITCHER_HISTORY_CHANNEL_CHARGING_POWER, buf, buf_size);
 
         return request.send(200, "application/json; charset=utf-8", buf, buf_written);
     });
@@ -242,26 +185,9 @@ void PhaseSwitcher::register_urls()
 
         const size_t buf_size = PHASE_SWITCHER_RING_BUF_SIZE * 6 + 100;
         char buf[buf_size] = {0};
-        size_t buf_written = 0;
-
-        int16_t val;
-        active_phases_history.peek(&val);
-        // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-        if (val < 0)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", "[null");
-        else
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "[%d", (int)val);
-
-        for (int i = 1; i < active_phases_history.used() && active_phases_history.peek_offset(&val, i) && buf_written < buf_size; ++i) {
-            // Negative values are prefilled, because the ESP was booted less than 48 hours ago.
-            if (val < 0)
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s", ",null");
-            else
-                buf_written += snprintf(buf + buf_written, buf_size - buf_written, ",%d", (int)val);
-        }
 
-        if (buf_written < buf_size)
-            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%c", ']');
+        // Empty buckets are written as null, because the ESP was booted less than 12 hours ago.
+        size_t buf_written = history.format_json(0, PHASE_SWITCHER_HISTORY_CHANNEL_REQUESTED_PHASES, buf, buf_size);
 
         return request.send(200, "application/json; charset=utf-8", buf, buf_written);
     });
@@ -818,15 +744,15 @@ void PhaseSwitcher::update_all_data()
 
 void PhaseSwitcher::update_history()
 {
-    int16_t actual_charging_power = -1;
+    history.add_sample(PHASE_SWITCHER_HISTORY_CHANNEL_REQUESTED_POWER, (int16_t)available_charging_power);
+
+    // Leave the charging power bucket empty if there is no meter value.
     if (modbus_meter.initialized){
         static Config *meter_values = api.getState("meter/values", false);
 
         if (meter_values != nullptr)
-            actual_charging_power = meter_values->get("power")->asFloat();
+            history.add_sample(PHASE_SWITCHER_HISTORY_CHANNEL_CHARGING_POWER, (int16_t)meter_values->get("power")->asFloat());
     }
 
-    requested_power_history.push((int16_t)available_charging_power);
-    charging_power_history.push((int16_t)(actual_charging_power));
-    active_phases_history.push((int16_t)(requested_phases * 230 * 6));
+    history.add_sample(PHASE_SWITCHER_HISTORY_CHANNEL_REQUESTED_PHASES, (int16_t)(requested_phases * 230 * 6));
 }
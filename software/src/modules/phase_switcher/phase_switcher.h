@@ -21,6 +21,7 @@
 #include "bindings/bricklet_industrial_digital_in_4_v2.h"
 
 #include "config.h"
+#include "time_series.h"
 #include "bricklet.h"
 #include "device_module.h"
 
@@ -37,6 +38,10 @@
 #define PHASE_SWITCHER_HISTORY_MINUTE_INTERVAL 1
 #define PHASE_SWITCHER_RING_BUF_SIZE (PHASE_SWITCHER_HISTORY_HOURS * (60 / PHASE_SWITCHER_HISTORY_MINUTE_INTERVAL) + 1)
 
+#define PHASE_SWITCHER_HISTORY_CHANNEL_REQUESTED_POWER 0
+#define PHASE_SWITCHER_HISTORY_CHANNEL_CHARGING_POWER 1
+#define PHASE_SWITCHER_HISTORY_CHANNEL_REQUESTED_PHASES 2
+
 typedef Bricklet<TF_IndustrialQuadRelayV2, 
                 tf_industrial_quad_relay_v2_create> QuadRelayBricklet;
 
@@ -158,37 +163,8 @@ private:
     uint8_t auto_start_charging;
     bool contactor_error;
 
-    TF_Ringbuffer<int16_t,
-                  PHASE_SWITCHER_RING_BUF_SIZE,
-                  uint32_t,
-#if defined(BOARD_HAS_PSRAM)
-                  malloc_psram,
-#else
-                  malloc_32bit_addressed,
-#endif
-                  heap_caps_free> requested_power_history;
-
-
-    TF_Ringbuffer<int16_t,
-                  PHASE_SWITCHER_RING_BUF_SIZE,
-                  uint32_t,
-#if defined(BOARD_HAS_PSRAM)
-                  malloc_psram,
-#else
-                  malloc_32bit_addressed,
-#endif
-                  heap_caps_free> charging_power_history;
-
-
-    TF_Ringbuffer<int16_t,
-                  PHASE_SWITCHER_RING_BUF_SIZE,
-                  uint32_t,
-#if defined(BOARD_HAS_PSRAM)
-                  malloc_psram,
-#else
-                  malloc_32bit_addressed,
-#endif
-                  heap_caps_free> active_phases_history;
+    // Channels: requested power, charging power, requested phases (as minimum power)
+    TimeSeries history;
 
 
 };
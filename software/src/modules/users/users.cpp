@@ -26,6 +26,8 @@
 #include "tools.h"
 
 #include "digest_auth.h"
+#include "malloc_tools.h"
+#include <esp_system.h>
 #include <cmath>
 
 #include <memory>
@@ -35,6 +37,17 @@
 #define USERNAME_ENTRY_LENGTH (USERNAME_LENGTH + DISPLAY_NAME_LENGTH)
 #define MAX_PASSIVE_USERS 256
 #define USERNAME_FILE "/users/all_usernames"
+#define USERNAME_FILE_SIZE (MAX_PASSIVE_USERS * USERNAME_ENTRY_LENGTH)
+// Renames are collected for this long before they are written to flash.
+#define USERNAME_WRITE_BACK_DELAY_MS 1000
+
+// Without PSRAM the 16 KiB table would permanently occupy internal RAM.
+// These boards keep only the used user ID bitmap and work on the file.
+#if defined(BOARD_HAS_PSRAM)
+#define USERNAME_TABLE_IN_RAM 1
+#else
+#define USERNAME_TABLE_IN_RAM 0
+#endif
 
 #if MODULE_ESP32_ETHERNET_BRICK_AVAILABLE()
 #define MAX_ACTIVE_USERS 16
@@ -252,16 +265,8 @@ Users::Users()
             if (user_config.get("users")->get(i)->get("username")->asString() == add.get("username")->asString())
                 return "Can't add user. A user with this username already exists.";
 
-        {
-            char username[33] = {0};
-            File f = LittleFS.open(USERNAME_FILE, "r");
-            for(size_t i = 0; i < f.size(); i += USERNAME_ENTRY_LENGTH) {
-                f.seek(i);
-                f.read((uint8_t *) username, USERNAME_LENGTH);
-                if (add.get("username")->asString() == username)
-                    return "Can't add user. A user with this username already has tracked charges.";
-            }
-        }
+        if (is_username_known(add.get("username")->asCStr()))
+            return "Can't add user. A user with this username already has tracked charges.";
 
         user_api_blocked = true;
         return "";
@@ -309,23 +314,128 @@ Users::Users()
     });
 }
 
-void create_username_file()
+#if USERNAME_TABLE_IN_RAM
+static void shutdown_handler()
+{
+    // Don't lose renames that are still waiting for the write-back.
+    users.write_back_usernames();
+}
+#else
+static void create_username_file()
 {
     logger.printfln("Recreating users file");
     File f = LittleFS.open(USERNAME_FILE, "w", true);
     const uint8_t buf[512] = {};
 
-    for (int i = 0; i < MAX_PASSIVE_USERS * USERNAME_ENTRY_LENGTH; i += sizeof(buf))
+    for (int i = 0; i < USERNAME_FILE_SIZE; i += sizeof(buf))
         f.write(buf, sizeof(buf));
 }
+#endif
+
+// Called on first use, as the charge tracker may remove usernames before Users::setup runs.
+// Requires usernames_mutex to be locked.
+bool Users::load_usernames()
+{
+    if (usernames_loaded)
+        return true;
+
+#if USERNAME_TABLE_IN_RAM
+    usernames = (char *)malloc_psram(USERNAME_FILE_SIZE);
+    if (usernames == nullptr) {
+        logger.printfln("Failed to allocate username table!");
+        return false;
+    }
+
+    memset(usernames, 0, USERNAME_FILE_SIZE);
+
+    if (LittleFS.exists(USERNAME_FILE)) {
+        File f = LittleFS.open(USERNAME_FILE, "r");
+        f.read((uint8_t *)usernames, USERNAME_FILE_SIZE);
+    }
+
+    for (int user_id = 0; user_id < MAX_PASSIVE_USERS; ++user_id) {
+        if (usernames[user_id * USERNAME_ENTRY_LENGTH] != '\0')
+            used_user_ids[user_id / 32] |= 1u << (user_id % 32);
+    }
+#else
+    if (LittleFS.exists(USERNAME_FILE)) {
+        File f = LittleFS.open(USERNAME_FILE, "r");
+        char entry[USERNAME_ENTRY_LENGTH];
+        for (int user_id = 0; user_id < MAX_PASSIVE_USERS && f.read((uint8_t *)entry, USERNAME_ENTRY_LENGTH) == USERNAME_ENTRY_LENGTH; ++user_id) {
+            if (entry[0] != '\0')
+                used_user_ids[user_id / 32] |= 1u << (user_id % 32);
+        }
+    }
+#endif
+
+    usernames_loaded = true;
+    return true;
+}
+
+void Users::write_back_usernames()
+{
+#if USERNAME_TABLE_IN_RAM
+    std::lock_guard<std::mutex> lock{usernames_mutex};
+    usernames_write_back_scheduled = false;
+
+    if (usernames == nullptr || usernames_dirty_first >= usernames_dirty_end)
+        return;
+
+    if (!LittleFS.exists(USERNAME_FILE)) {
+        logger.printfln("Recreating users file");
+        File f = LittleFS.open(USERNAME_FILE, "w", true);
+        f.write((const uint8_t *)usernames, USERNAME_FILE_SIZE);
+    } else {
+        File f = LittleFS.open(USERNAME_FILE, "r+");
+        f.seek(usernames_dirty_first * USERNAME_ENTRY_LENGTH, SeekMode::SeekSet);
+        f.write((const uint8_t *)usernames + usernames_dirty_first * USERNAME_ENTRY_LENGTH,
+                (usernames_dirty_end - usernames_dirty_first) * USERNAME_ENTRY_LENGTH);
+    }
+
+    usernames_dirty_first = UINT16_MAX;
+    usernames_dirty_end = 0;
+#endif
+}
+
+bool Users::is_username_known(const char *username, int except_user_id)
+{
+    std::lock_guard<std::mutex> lock{usernames_mutex};
+    if (!load_usernames())
+        return false;
+
+#if !USERNAME_TABLE_IN_RAM
+    char entry_username[USERNAME_LENGTH + 1] = {0};
+    File f = LittleFS.open(USERNAME_FILE, "r");
+#endif
+    for (int user_id = 0; user_id < MAX_PASSIVE_USERS; ++user_id) {
+        // IDs without username can't match a username that is being added or modified.
+        if (user_id == except_user_id || (used_user_ids[user_id / 32] & (1u << (user_id % 32))) == 0)
+            continue;
+
+#if USERNAME_TABLE_IN_RAM
+        const char *entry_username = usernames + user_id * USERNAME_ENTRY_LENGTH;
+#else
+        f.seek(user_id * USERNAME_ENTRY_LENGTH, SeekMode::SeekSet);
+        f.read((uint8_t *)entry_username, USERNAME_LENGTH);
+#endif
+        if (strncmp(entry_username, username, USERNAME_LENGTH) == 0)
+            return true;
+    }
+
+    return false;
+}
 
 void Users::setup()
 {
     api.restorePersistentConfig("users/config", &user_config);
 
+#if USERNAME_TABLE_IN_RAM
+    esp_register_shutdown_handler(shutdown_handler);
+#endif
+
     if (!LittleFS.exists(USERNAME_FILE)) {
         logger.printfln("Username list does not exist! Recreating now.");
-        create_username_file();
+        // The file is written with the first rename.
         for (int i = 0; i < user_config.get("users")->count(); ++i) {
             Config *user = (Config *)user_config.get("users")->get(i);
             this->rename_user(user->get("id")->asUint(), user->get("username")->asCStr(), user->get("display_name")->asCStr());
@@ -434,24 +544,35 @@ void Users::setup()
 }
 
 void Users::search_next_free_user() {
-    uint8_t user_id = user_config.get("next_user_id")->asUint();
-    uint8_t start_uid = user_id;
-    user_id++;
+    uint8_t start_uid = user_config.get("next_user_id")->asUint();
+    uint8_t user_id = 0;
+
     {
-        File f = LittleFS.open(USERNAME_FILE, "r+");
-        while(start_uid != user_id) {
-            if (user_id == 0)
-                user_id++;
-            f.seek(user_id * USERNAME_ENTRY_LENGTH, SeekMode::SeekSet);
-            char user_name_byte = 0;
-            f.readBytes(&user_name_byte, 1);
-            if (user_name_byte == '\0')
-                break;
-            user_id++;
-        };
+        std::lock_guard<std::mutex> lock{usernames_mutex};
+        if (load_usernames()) {
+            // The anonymous user and the current next user ID are never free.
+            uint32_t used[ARRAY_SIZE(used_user_ids)];
+            memcpy(used, used_user_ids, sizeof(used));
+            used[0] |= 1;
+            used[start_uid / 32] |= 1u << (start_uid % 32);
+
+            // Search word by word, starting after start_uid and wrapping around.
+            size_t first = start_uid + 1;
+            for (size_t i = 0; i <= ARRAY_SIZE(used); ++i) {
+                size_t word = (first / 32 + i) % ARRAY_SIZE(used);
+                uint32_t free_ids = ~used[word];
+                if (i == 0)
+                    free_ids &= UINT32_MAX << (first % 32);
+                else if (i == ARRAY_SIZE(used))
+                    free_ids &= ~(UINT32_MAX << (first % 32));
+
+                if (free_ids != 0) {
+                    user_id = word * 32 + __builtin_ctz(free_ids);
+                    break;
+                }
+            }
+        }
     }
-    if (user_id == start_uid)
-        user_id = 0;
 
     user_config.get("next_user_id")->updateUint(user_id);
 }
@@ -514,17 +635,8 @@ void Users::register_urls()
             }
         }
 
-        char username[33] = {0};
-        File f = LittleFS.open(USERNAME_FILE, "r");
-        for(size_t i = 0; i < f.size(); i += USERNAME_ENTRY_LENGTH) {
-            if ((i / USERNAME_ENTRY_LENGTH) == id)
-                continue;
-
-            f.seek(i);
-            f.read((uint8_t *) username, USERNAME_LENGTH);
-            if (doc["username"].as<String>() == username)
-                return "Can't modify user. A user with this username already has tracked charges.";
-        }
+        if (is_username_known(doc["username"].as<String>().c_str(), id))
+            return "Can't modify user. A user with this username already has tracked charges.";
 
         if (doc["roles"] != nullptr)
             user->get("roles")->updateUint((uint32_t) doc["roles"]);
@@ -627,17 +739,26 @@ void Users::register_urls()
     }, false);
 
     server.on("/users/all_usernames", HTTP_GET, [this](WebServerRequest request) {
-        //std::lock_guard<std::mutex> lock{records_mutex};
-        size_t len = MAX_PASSIVE_USERS * USERNAME_ENTRY_LENGTH;
-        auto buf = std::unique_ptr<char[]>(new char[len]);
-        if (buf == nullptr) {
+#if USERNAME_TABLE_IN_RAM
+        std::lock_guard<std::mutex> lock{usernames_mutex};
+        if (!load_usernames())
             return request.send(507);
-        }
 
+        return request.send(200, "application/octet-stream", usernames, USERNAME_FILE_SIZE);
+#else
+        // Don't lock usernames_mutex here: Renames would wait for a slow client.
+        // A rename while streaming can only affect the renamed entry.
         File f = LittleFS.open(USERNAME_FILE, "r");
-
-        size_t read = f.read((uint8_t *)buf.get(), len);
-        return request.send(200, "application/octet-stream", buf.get(), read);
+        if (!f || f.size() == 0)
+            return request.send(200, "application/octet-stream", "", 0);
+
+        request.beginChunkedResponse(200, "application/octet-stream");
+        char buf[512];
+        size_t read;
+        while ((read = f.read((uint8_t *)buf, sizeof(buf))) > 0)
+            request.sendChunk(buf, read);
+        return request.endChunkedResponse();
+#endif
     });
 }
 
@@ -652,13 +773,42 @@ uint8_t Users::next_user_id()
 
 void Users::rename_user(uint8_t user_id, const char *username, const char *display_name)
 {
-    char buf[USERNAME_ENTRY_LENGTH] = {0};
-    snprintf(buf, USERNAME_LENGTH, "%s", username);
-    snprintf(buf + USERNAME_LENGTH, DISPLAY_NAME_LENGTH, "%s", display_name);
+    std::lock_guard<std::mutex> lock{usernames_mutex};
+    if (!load_usernames())
+        return;
+
+#if USERNAME_TABLE_IN_RAM
+    char *entry = usernames + user_id * USERNAME_ENTRY_LENGTH;
+#else
+    char entry[USERNAME_ENTRY_LENGTH];
+#endif
+    memset(entry, 0, USERNAME_ENTRY_LENGTH);
+    snprintf(entry, USERNAME_LENGTH, "%s", username);
+    snprintf(entry + USERNAME_LENGTH, DISPLAY_NAME_LENGTH, "%s", display_name);
+
+    if (entry[0] != '\0')
+        used_user_ids[user_id / 32] |= 1u << (user_id % 32);
+    else
+        used_user_ids[user_id / 32] &= ~(1u << (user_id % 32));
+
+#if !USERNAME_TABLE_IN_RAM
+    if (!LittleFS.exists(USERNAME_FILE))
+        create_username_file();
 
     File f = LittleFS.open(USERNAME_FILE, "r+");
     f.seek(user_id * USERNAME_ENTRY_LENGTH, SeekMode::SeekSet);
-    f.write((const uint8_t *)buf, USERNAME_ENTRY_LENGTH);
+    f.write((const uint8_t *)entry, USERNAME_ENTRY_LENGTH);
+#else
+    usernames_dirty_first = min(usernames_dirty_first, (uint16_t)user_id);
+    usernames_dirty_end = max(usernames_dirty_end, (uint16_t)(user_id + 1));
+
+    if (!usernames_write_back_scheduled) {
+        usernames_write_back_scheduled = true;
+        task_scheduler.scheduleOnce([this]() {
+            this->write_back_usernames();
+        }, USERNAME_WRITE_BACK_DELAY_MS);
+    }
+#endif
 }
 
 void Users::remove_from_username_file(uint8_t user_id)
@@ -727,8 +877,16 @@ bool Users::trigger_charge_action(uint8_t user_id, uint8_t auth_type, Config::Co
 
 void Users::remove_username_file()
 {
+    std::lock_guard<std::mutex> lock{usernames_mutex};
+
     if (LittleFS.exists(USERNAME_FILE))
         LittleFS.remove(USERNAME_FILE);
+
+    if (usernames != nullptr)
+        memset(usernames, 0, USERNAME_FILE_SIZE);
+    memset(used_user_ids, 0, sizeof(used_user_ids));
+    usernames_dirty_first = UINT16_MAX;
+    usernames_dirty_end = 0;
 }
 
 bool Users::start_charging(uint8_t user_id, uint16_t current_limit, uint8_t auth_type, Config::ConfVariant auth_info)
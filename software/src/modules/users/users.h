@@ -21,6 +21,8 @@
 
 #include "config.h"
 
+#include <mutex>
+
 class Users
 {
 public:
@@ -40,6 +42,8 @@ public:
     bool trigger_charge_action(uint8_t user_id, uint8_t auth_type, Config::ConfVariant auth_info, int action = TRIGGER_CHARGE_ANY);
 
     void remove_username_file();
+    // Returns true if a user ID other than except_user_id has this username in the username file.
+    bool is_username_known(const char *username, int except_user_id = -1);
 
     bool initialized = false;
 
@@ -51,4 +55,21 @@ public:
 
     bool start_charging(uint8_t user_id, uint16_t current_limit, uint8_t auth_type, Config::ConfVariant auth_info);
     bool stop_charging(uint8_t user_id, bool force);
+
+    // Writes renames that are still waiting for the delayed write-back.
+    void write_back_usernames();
+
+private:
+    bool load_usernames();
+
+    bool usernames_loaded = false;
+    // RAM copy of the username file on boards with PSRAM. Changed entries are written back in one batch.
+    char *usernames = nullptr;
+    // Entries [dirty_first, dirty_end) were changed since the last write-back.
+    uint16_t usernames_dirty_first = UINT16_MAX;
+    uint16_t usernames_dirty_end = 0;
+    bool usernames_write_back_scheduled = false;
+    // One bit per user ID that has a username.
+    uint32_t used_user_ids[8] = {0};
+    std::mutex usernames_mutex;
 };
@@ -0,0 +1,591 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#include "time_series.h"
+
+#include "esp_heap_caps.h"
+#include "LittleFS.h"
+
+#include "event_log.h"
+#include "malloc_tools.h"
+#include "task_scheduler.h"
+#include "tools.h"
+
+extern TaskScheduler task_scheduler;
+extern EventLog logger;
+
+#define TIME_SERIES_FOLDER "/history"
+#define TIME_SERIES_FILE_VERSION 1
+#define TIME_SERIES_MAX_CHANNELS 8
+// Marks empty buckets of tiers that only keep the averages.
+#define TIME_SERIES_EMPTY_AVERAGE INT16_MIN
+// Batch closed buckets of fine tiers, so that flash is written about once per hour.
+#define TIME_SERIES_FLUSH_INTERVAL_MS (60 * 60 * 1000)
+
+struct TimeSeriesFileHeader {
+    char magic[2];
+    uint8_t version;
+    uint8_t channels;
+    uint32_t interval_minutes;
+} __attribute__((packed));
+
+// A record is the bucket's start minute (uint32) followed by two words per channel, see pack_bucket.
+static size_t record_size(size_t channels)
+{
+    return sizeof(uint32_t) + channels * 2 * sizeof(uint32_t);
+}
+
+static void pack_bucket(const TimeSeriesBucket &bucket, uint32_t *words)
+{
+    words[0] = ((uint32_t)(uint16_t)bucket.min) | (((uint32_t)(uint16_t)bucket.max) << 16);
+    words[1] = ((uint32_t)(uint16_t)bucket.avg) | (((uint32_t)bucket.count) << 16);
+}
+
+static TimeSeriesBucket unpack_bucket(const uint32_t *words)
+{
+    return TimeSeriesBucket{(int16_t)(words[0] & 0xFFFF), (int16_t)(words[0] >> 16), (int16_t)(words[1] & 0xFFFF), (uint16_t)(words[1] >> 16)};
+}
+
+static void *time_series_malloc(size_t s)
+{
+#if defined(BOARD_HAS_PSRAM)
+    return malloc_psram(s);
+#else
+    return malloc_32bit_addressed(s);
+#endif
+}
+
+void TimeSeries::setup(size_t channel_count, std::initializer_list<TimeSeriesTier> tier_configs, const char *persist_name)
+{
+    channels = channel_count;
+    this->persist_name = persist_name;
+
+    bool any_persistent = false;
+
+    for (const TimeSeriesTier &config : tier_configs) {
+        Tier tier;
+        tier.config = config;
+        tier.head = 0;
+        tier.closed = 0;
+        tier.next_close = millis() + config.interval_ms;
+        tier.aligned = false;
+        tier.newest_start_minute = 0;
+        tier.unsaved = 0;
+
+        if (tier.config.persistent && (persist_name == nullptr || channels > TIME_SERIES_MAX_CHANNELS || config.interval_ms == 0 || config.interval_ms % (60 * 1000) != 0)) {
+            logger.printfln("Can't persist time series tier with interval %u ms.", config.interval_ms);
+            tier.config.persistent = false;
+        }
+
+#if defined(BOARD_HAS_PSRAM)
+        tier.averages_only = false;
+#else
+        // Internal memory is scarce: Don't use more of it than a ring buffer of int16 samples.
+        tier.averages_only = config.interval_ms != 0;
+#endif
+
+        bool two_per_word = config.interval_ms == 0 || tier.averages_only;
+        size_t words_per_channel = two_per_word ? (config.length + 1) / 2 : config.length * 2;
+        size_t buf_size = words_per_channel * channels * sizeof(uint32_t);
+        tier.buffer = (uint32_t *)time_series_malloc(buf_size);
+        if (tier.buffer == nullptr) {
+            // Keep the tier so that the indices of the others don't change.
+            // It stays empty and is skipped when sampling.
+            logger.printfln("Failed to allocate %u bytes for time series tier with interval %u ms. Disabling tier.", buf_size, config.interval_ms);
+            tier.config.persistent = false;
+            tier.used = 0;
+        } else {
+            // Zeroed buckets have a count of 0, i.e. are marked as empty.
+            // Tiers that only keep the averages mark empty buckets with TIME_SERIES_EMPTY_AVERAGE instead.
+            uint32_t empty = tier.averages_only ? (uint32_t)(uint16_t)TIME_SERIES_EMPTY_AVERAGE * 0x10001u : 0;
+            for (size_t i = 0; i < words_per_channel * channels; ++i)
+                tier.buffer[i] = empty;
+
+            tier.used = config.interval_ms == 0 ? 0 : config.length;
+        }
+        any_persistent |= tier.config.persistent;
+
+        tier.open.resize(channels);
+        for (OpenBucket &open : tier.open) {
+            open.reset();
+            open.last_count = 0;
+        }
+
+        tiers.push_back(std::move(tier));
+    }
+
+    // mkdir also returns true if the directory already exists and is a directory.
+    if (any_persistent && !LittleFS.mkdir(TIME_SERIES_FOLDER))
+        logger.printfln("Failed to create time series folder.");
+
+    task_scheduler.scheduleWithFixedDelay([this](){
+        tick();
+    }, 1000, 1000);
+}
+
+void TimeSeries::tick()
+{
+    struct timeval tv_now;
+    bool synced = clock_synced(&tv_now);
+
+    if (synced && !clock_was_synced) {
+        clock_was_synced = true;
+
+        for (size_t i = 0; i < tiers.size(); ++i) {
+            if (tiers[i].config.interval_ms == 0)
+                continue;
+
+            align_to_clock(tiers[i], tv_now.tv_sec);
+
+            if (tiers[i].config.persistent)
+                restore_tier(i);
+        }
+    }
+
+    for (size_t i = 0; i < tiers.size(); ++i) {
+        Tier &tier = tiers[i];
+        if (tier.buffer == nullptr || tier.config.interval_ms == 0 || !deadline_elapsed(tier.next_close))
+            continue;
+
+        close_buckets(tier);
+
+        if (synced) {
+            align_to_clock(tier, tv_now.tv_sec);
+        } else {
+            tier.next_close += tier.config.interval_ms;
+        }
+
+        if (!tier.config.persistent || !tier.aligned)
+            continue;
+
+        tier.unsaved = MIN(tier.unsaved + 1, tier.config.length);
+        if (tier.unsaved * tier.config.interval_ms >= TIME_SERIES_FLUSH_INTERVAL_MS)
+            flush_tier(i);
+    }
+}
+
+void TimeSeries::align_to_clock(Tier &tier, uint32_t now_s)
+{
+    uint32_t interval_s = tier.config.interval_ms / 1000;
+    uint32_t open_start_s = now_s - now_s % interval_s;
+
+    tier.next_close = millis() + (open_start_s + interval_s - now_s) * 1000;
+    tier.newest_start_minute = (open_start_s - interval_s) / 60;
+    tier.aligned = true;
+}
+
+void TimeSeries::add_sample(size_t channel, int16_t sample)
+{
+    for (Tier &tier : tiers) {
+        if (tier.buffer == nullptr)
+            continue;
+
+        if (tier.config.interval_ms == 0) {
+            write_bucket(tier, channel, tier.head, TimeSeriesBucket{sample, sample, sample, 1});
+
+            if (channel == channels - 1) {
+                tier.head = (tier.head + 1) % tier.config.length;
+                tier.used = MIN(tier.used + 1, tier.config.length);
+                ++tier.closed;
+            }
+            continue;
+        }
+
+        OpenBucket &open = tier.open[channel];
+        open.min = MIN(open.min, sample);
+        open.max = MAX(open.max, sample);
+        open.sum += sample;
+        ++open.count;
+    }
+}
+
+void TimeSeries::close_buckets(Tier &tier)
+{
+    for (size_t channel = 0; channel < channels; ++channel) {
+        OpenBucket &open = tier.open[channel];
+
+        TimeSeriesBucket bucket{0, 0, 0, 0};
+        if (open.count > 0) {
+            bucket.min = open.min;
+            bucket.max = open.max;
+            bucket.avg = (int16_t)(open.sum / (int64_t)open.count);
+            bucket.count = (uint16_t)MIN(open.count, (uint32_t)UINT16_MAX);
+        }
+
+        write_bucket(tier, channel, tier.head, bucket);
+        open.last_count = open.count;
+        open.reset();
+    }
+
+    tier.head = (tier.head + 1) % tier.config.length;
+    tier.used = MIN(tier.used + 1, tier.config.length);
+    ++tier.closed;
+}
+
+void TimeSeries::write_bucket(Tier &tier, size_t channel, size_t idx, const TimeSeriesBucket &bucket)
+{
+    if (tier.config.interval_ms == 0 || tier.averages_only) {
+        int16_t val = bucket.avg;
+        if (tier.averages_only)
+            val = bucket.count == 0 ? TIME_SERIES_EMPTY_AVERAGE : MAX(val, (int16_t)(TIME_SERIES_EMPTY_AVERAGE + 1));
+
+        size_t word = channel * ((tier.config.length + 1) / 2) + idx / 2;
+        uint32_t shift = (idx % 2) * 16;
+        tier.buffer[word] = (tier.buffer[word] & ~(0xFFFFu << shift)) | (((uint32_t)(uint16_t)val) << shift);
+        return;
+    }
+
+    pack_bucket(bucket, &tier.buffer[(channel * tier.config.length + idx) * 2]);
+}
+
+void TimeSeries::read_bucket(Tier &tier, size_t channel, size_t idx, TimeSeriesBucket *out)
+{
+    if (tier.config.interval_ms == 0 || tier.averages_only) {
+        size_t word = channel * ((tier.config.length + 1) / 2) + idx / 2;
+        int16_t val = (int16_t)(tier.buffer[word] >> ((idx % 2) * 16));
+        if (tier.averages_only && val == TIME_SERIES_EMPTY_AVERAGE)
+            *out = TimeSeriesBucket{0, 0, 0, 0};
+        else
+            *out = TimeSeriesBucket{val, val, val, 1};
+        return;
+    }
+
+    *out = unpack_bucket(&tier.buffer[(channel * tier.config.length + idx) * 2]);
+}
+
+bool TimeSeries::get(size_t tier_idx, size_t channel, size_t offset, TimeSeriesBucket *out)
+{
+    Tier &tier = tiers[tier_idx];
+    if (offset >= tier.used || channel >= channels)
+        return false;
+
+    // head is the next bucket to write, so the oldest bucket is at head - used.
+    size_t idx = (tier.head + tier.config.length - tier.used + offset) % tier.config.length;
+    read_bucket(tier, channel, idx, out);
+    return true;
+}
+
+bool TimeSeries::oldest_start(size_t tier_idx, uint32_t *start_s)
+{
+    Tier &tier = tiers[tier_idx];
+    if (tier.config.interval_ms == 0 || !tier.aligned || tier.used == 0)
+        return false;
+
+    *start_s = tier.newest_start_minute * 60 - (tier.used - 1) * (tier.config.interval_ms / 1000);
+    return true;
+}
+
+TimeSeriesBucket TimeSeries::get_open(size_t tier_idx, size_t channel)
+{
+    OpenBucket &open = tiers[tier_idx].open[channel];
+    if (open.count == 0)
+        return TimeSeriesBucket{0, 0, 0, 0};
+
+    return TimeSeriesBucket{open.min, open.max, (int16_t)(open.sum / (int64_t)open.count), (uint16_t)MIN(open.count, (uint32_t)UINT16_MAX)};
+}
+
+void TimeSeries::downsample(size_t tier, size_t channel, size_t first, size_t count, size_t target_points, TimeSeriesDownsampling mode,
+                            std::function<void(size_t offset, int16_t value)> &&cb)
+{
+    size_t end = MIN(first + count, used(tier));
+    if (first >= end)
+        return;
+
+    if (target_points == 0 || target_points >= end - first) {
+        TimeSeriesBucket bucket;
+        for (size_t i = first; i < end; ++i)
+            if (get(tier, channel, i, &bucket) && bucket.count > 0)
+                cb(i, bucket.avg);
+        return;
+    }
+
+    if (mode == TimeSeriesDownsampling::MinMax)
+        downsample_min_max(tier, channel, first, end, target_points, cb);
+    else
+        downsample_lttb(tier, channel, first, end, target_points, cb);
+}
+
+// Emits the smallest minimum and the largest maximum of each group in the order they occurred.
+void TimeSeries::downsample_min_max(size_t tier, size_t channel, size_t first, size_t end, size_t target_points,
+                                    std::function<void(size_t offset, int16_t value)> &cb)
+{
+    size_t count = end - first;
+    size_t groups = MAX(target_points / 2, (size_t)1);
+
+    TimeSeriesBucket bucket;
+    for (size_t group = 0; group < groups; ++group) {
+        size_t group_end = first + (group + 1) * count / groups;
+
+        bool found = false;
+        size_t min_offset = 0, max_offset = 0;
+        int16_t min_value = 0, max_value = 0;
+
+        for (size_t i = first + group * count / groups; i < group_end; ++i) {
+            if (!get(tier, channel, i, &bucket) || bucket.count == 0)
+                continue;
+
+            if (!found || bucket.min < min_value) {
+                min_value = bucket.min;
+                min_offset = i;
+            }
+            if (!found || bucket.max > max_value) {
+                max_value = bucket.max;
+                max_offset = i;
+            }
+            found = true;
+        }
+
+        if (!found)
+            continue;
+
+        if (max_offset < min_offset) {
+            cb(max_offset, max_value);
+            cb(min_offset, min_value);
+        } else {
+            cb(min_offset, min_value);
+            if (max_offset != min_offset || max_value != min_value)
+                cb(max_offset, max_value);
+        }
+    }
+}
+
+void TimeSeries::downsample_lttb(size_t tier, size_t channel, size_t first, size_t end, size_t target_points,
+                                 std::function<void(size_t offset, int16_t value)> &cb)
+{
+    TimeSeriesBucket bucket;
+
+    // The first and last non-empty buckets are always selected.
+    size_t a = first;
+    while (a < end && (!get(tier, channel, a, &bucket) || bucket.count == 0))
+        ++a;
+    if (a == end)
+        return;
+    int16_t a_value = bucket.avg;
+
+    size_t z = end - 1;
+    while (z > a && (!get(tier, channel, z, &bucket) || bucket.count == 0))
+        --z;
+    int16_t z_value = bucket.avg;
+
+    cb(a, a_value);
+    if (z == a)
+        return;
+
+    size_t inner = z - a - 1;
+    size_t groups = MAX(target_points, (size_t)3) - 2;
+
+    float prev_x = a;
+    float prev_y = a_value;
+
+    for (size_t group = 0; group < groups && inner > 0; ++group) {
+        size_t group_start = a + 1 + group * inner / groups;
+        size_t group_end = a + 1 + (group + 1) * inner / groups;
+        size_t next_end = group + 1 < groups ? a + 1 + (group + 2) * inner / groups : z + 1;
+
+        // The third point of the triangle is the average of the next group.
+        float next_x = 0;
+        float next_y = 0;
+        size_t next_count = 0;
+        for (size_t i = group_end; i < next_end; ++i) {
+            if (!get(tier, channel, i, &bucket) || bucket.count == 0)
+                continue;
+            next_x += i;
+            next_y += bucket.avg;
+            ++next_count;
+        }
+
+        if (next_count == 0) {
+            next_x = z;
+            next_y = z_value;
+        } else {
+            next_x /= next_count;
+            next_y /= next_count;
+        }
+
+        bool found = false;
+        float max_area = -1;
+        size_t selected = 0;
+        int16_t selected_value = 0;
+
+        for (size_t i = group_start; i < group_end; ++i) {
+            if (!get(tier, channel, i, &bucket) || bucket.count == 0)
+                continue;
+
+            // Twice the triangle area; the factor does not matter for the comparison.
+            float area = fabsf((prev_x - next_x) * (bucket.avg - prev_y) - (prev_x - i) * (next_y - prev_y));
+            if (area > max_area) {
+                max_area = area;
+                selected = i;
+                selected_value = bucket.avg;
+                found = true;
+            }
+        }
+
+        if (!found)
+            continue;
+
+        cb(selected, selected_value);
+        prev_x = selected;
+        prev_y = selected_value;
+    }
+
+    cb(z, z_value);
+}
+
+size_t TimeSeries::format_json(size_t tier, size_t channel, char *buf, size_t buf_size)
+{
+    size_t buf_written = 0;
+    size_t used = this->used(tier);
+
+    buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%c", '[');
+
+    TimeSeriesBucket bucket;
+    for (size_t i = 0; i < used && get(tier, channel, i, &bucket) && buf_written < buf_size; ++i) {
+        if (bucket.count == 0)
+            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s%s", i == 0 ? "" : ",", "null");
+        else
+            buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%s%d", i == 0 ? "" : ",", (int)bucket.avg);
+    }
+
+    if (buf_written < buf_size)
+        buf_written += snprintf(buf + buf_written, buf_size - buf_written, "%c", ']');
+
+    return MIN(buf_written, buf_size - 1);
+}
+
+String TimeSeries::tier_filename(size_t tier_idx, int file_idx)
+{
+    return String(TIME_SERIES_FOLDER "/") + persist_name + "_" + String(tier_idx) + "_" + String(file_idx);
+}
+
+// Places the records of one file into the ring buffer relative to the current open bucket.
+// Buckets closed since boot are newer than anything in flash and are not overwritten.
+void TimeSeries::restore_file(size_t tier_idx, int file_idx)
+{
+    Tier &tier = tiers[tier_idx];
+    String name = tier_filename(tier_idx, file_idx);
+
+    if (!LittleFS.exists(name))
+        return;
+
+    File f = LittleFS.open(name, "r");
+
+    TimeSeriesFileHeader header;
+    uint32_t interval_minutes = tier.config.interval_ms / (60 * 1000);
+    if (f.read((uint8_t *)&header, sizeof(header)) != sizeof(header) ||
+        header.magic[0] != 'T' || header.magic[1] != 'S' ||
+        header.version != TIME_SERIES_FILE_VERSION ||
+        header.channels != channels ||
+        header.interval_minutes != interval_minutes) {
+        logger.printfln("Ignoring incompatible time series file %s.", name.c_str());
+        f.close();
+        LittleFS.remove(name);
+        return;
+    }
+
+    uint32_t record[1 + 2 * TIME_SERIES_MAX_CHANNELS];
+    size_t rec_size = record_size(channels);
+    uint32_t open_start_minute = tier.newest_start_minute + interval_minutes;
+
+    while (f.read((uint8_t *)record, rec_size) == rec_size) {
+        uint32_t start_minute = record[0];
+        if (start_minute >= open_start_minute || (open_start_minute - start_minute) % interval_minutes != 0)
+            continue;
+
+        // 1 is the newest closed bucket.
+        size_t buckets_ago = (open_start_minute - start_minute) / interval_minutes;
+        if (buckets_ago <= tier.closed || buckets_ago > tier.config.length)
+            continue;
+
+        size_t idx = (tier.head + tier.config.length - buckets_ago) % tier.config.length;
+        for (size_t channel = 0; channel < channels; ++channel)
+            write_bucket(tier, channel, idx, unpack_bucket(&record[1 + channel * 2]));
+    }
+
+    f.close();
+}
+
+void TimeSeries::restore_tier(size_t tier_idx)
+{
+    Tier &tier = tiers[tier_idx];
+
+    // The older file first: Newer records win.
+    restore_file(tier_idx, 1);
+    restore_file(tier_idx, 0);
+
+    // Buckets closed before the clock was synced are not in flash yet.
+    tier.unsaved = MIN(tier.closed, tier.config.length);
+    if (tier.unsaved > 0)
+        flush_tier(tier_idx);
+}
+
+// Appends the unsaved buckets. The current file is rotated once it holds length
+// records, so at most 2 * length records are stored and every record is written once.
+void TimeSeries::flush_tier(size_t tier_idx)
+{
+    Tier &tier = tiers[tier_idx];
+    if (tier.unsaved == 0)
+        return;
+
+    String name = tier_filename(tier_idx, 0);
+    size_t rec_size = record_size(channels);
+
+    File f = LittleFS.open(name, "a");
+    size_t records_in_file = f.size() < sizeof(TimeSeriesFileHeader) ? 0 : (f.size() - sizeof(TimeSeriesFileHeader)) / rec_size;
+
+    if (records_in_file + tier.unsaved > tier.config.length) {
+        f.close();
+        String old_name = tier_filename(tier_idx, 1);
+        if (LittleFS.exists(old_name))
+            LittleFS.remove(old_name);
+        LittleFS.rename(name, old_name);
+
+        f = LittleFS.open(name, "w");
+        records_in_file = 0;
+    }
+
+    if (f.size() == 0) {
+        TimeSeriesFileHeader header{{'T', 'S'}, TIME_SERIES_FILE_VERSION, (uint8_t)channels, tier.config.interval_ms / (60 * 1000)};
+        f.write((const uint8_t *)&header, sizeof(header));
+    }
+
+    uint32_t record[1 + 2 * TIME_SERIES_MAX_CHANNELS];
+    uint32_t interval_minutes = tier.config.interval_ms / (60 * 1000);
+
+    // Oldest unsaved bucket first.
+    for (size_t i = tier.unsaved; i > 0; --i) {
+        size_t idx = (tier.head + tier.config.length - i) % tier.config.length;
+        record[0] = tier.newest_start_minute - (i - 1) * interval_minutes;
+
+        TimeSeriesBucket bucket;
+        for (size_t channel = 0; channel < channels; ++channel) {
+            read_bucket(tier, channel, idx, &bucket);
+            pack_bucket(bucket, &record[1 + channel * 2]);
+        }
+
+        if (f.write((const uint8_t *)record, rec_size) != rec_size) {
+            logger.printfln("Failed to write time series file %s.", name.c_str());
+            break;
+        }
+    }
+
+    f.close();
+    tier.unsaved = 0;
+}
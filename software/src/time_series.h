@@ -0,0 +1,195 @@
+/* esp32-firmware
+ * Copyright (C) 2022 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include <initializer_list>
+#include <vector>
+
+#include <Arduino.h>
+
+struct TimeSeriesBucket {
+    int16_t min;
+    int16_t max;
+    int16_t avg;
+    // 0 marks a bucket without any samples, for example because the ESP was not running yet.
+    uint16_t count;
+};
+
+enum class TimeSeriesDownsampling {
+    // Largest-Triangle-Three-Buckets on the averages. Keeps the shape of the series.
+    LTTB,
+    // Minimum and maximum of each group of buckets. Keeps every peak.
+    MinMax
+};
+
+struct TimeSeriesTier {
+    // Length of a bucket. 0 stores every sample as is.
+    uint32_t interval_ms;
+    // Number of buckets to keep.
+    size_t length;
+    // Append closed buckets to flash and restore them after a reboot.
+    // Requires an interval that is a multiple of one minute.
+    bool persistent;
+};
+
+// Stores N channels of int16 samples in multiple tiers with decreasing resolution.
+// Every sample updates the open bucket of each tier in O(1). Tiers with an interval
+// close their open bucket periodically and push it into their ring buffer.
+// Closed buckets are stored as two 32 bit words, so that they can live in PSRAM
+// or in 32 bit addressable memory on boards without PSRAM. On boards without PSRAM,
+// tiers with an interval only keep the average of each bucket, two per word.
+//
+// As soon as the clock is synced, bucket boundaries are aligned to multiples
+// of the interval in wall-clock time. Persistent tiers are then restored from
+// flash. Newly closed buckets are batched and appended roughly once per hour.
+class TimeSeries
+{
+public:
+    TimeSeries()
+    {
+    }
+
+    // persist_name is used to name the files of persistent tiers.
+    void setup(size_t channel_count, std::initializer_list<TimeSeriesTier> tiers, const char *persist_name = nullptr);
+
+    // Raw tiers advance when the last channel is sampled,
+    // so add samples of all channels in channel order.
+    void add_sample(size_t channel, int16_t sample);
+
+    size_t tier_count()
+    {
+        return tiers.size();
+    }
+
+    size_t channel_count()
+    {
+        return channels;
+    }
+
+    const TimeSeriesTier &tier_config(size_t tier)
+    {
+        return tiers[tier].config;
+    }
+
+    // Number of closed buckets in the tier. Tiers with an interval are pre-filled with
+    // empty buckets, so this is always the tier's length for them.
+    size_t used(size_t tier)
+    {
+        return tiers[tier].used;
+    }
+
+    // Number of buckets closed since boot.
+    uint32_t buckets_closed(size_t tier)
+    {
+        return tiers[tier].closed;
+    }
+
+    // Number of samples in the newest bucket closed since boot.
+    // Known even if the tier only keeps the averages.
+    uint32_t last_closed_count(size_t tier, size_t channel)
+    {
+        return tiers[tier].open[channel].last_count;
+    }
+
+    // offset 0 is the oldest closed bucket.
+    bool get(size_t tier, size_t channel, size_t offset, TimeSeriesBucket *out);
+
+    // Start of the oldest closed bucket in seconds since the epoch.
+    // Only known for tiers with an interval after the clock was synced.
+    bool oldest_start(size_t tier, uint32_t *start_s);
+
+    // The bucket that is currently accumulating samples.
+    TimeSeriesBucket get_open(size_t tier, size_t channel);
+
+    // Calls cb for up to target_points points selected from the buckets [first, first + count) in order.
+    // offset is relative to the oldest closed bucket, as for get. Empty buckets are skipped.
+    // target_points 0 selects all buckets of the range.
+    void downsample(size_t tier, size_t channel, size_t first, size_t count, size_t target_points, TimeSeriesDownsampling mode,
+                    std::function<void(size_t offset, int16_t value)> &&cb);
+
+    // Writes the averages of the tier's buckets as JSON array. Empty buckets are written as null.
+    // Returns the number of bytes written. The output is truncated if buf is too small.
+    size_t format_json(size_t tier, size_t channel, char *buf, size_t buf_size);
+
+private:
+    struct OpenBucket {
+        int16_t min;
+        int16_t max;
+        // A daily bucket holds about 250000 samples. Their sum exceeds the int32 range above about 8.5 kW.
+        int64_t sum;
+        uint32_t count;
+        // Samples of the last closed bucket. Kept by reset.
+        uint32_t last_count;
+
+        void reset()
+        {
+            min = INT16_MAX;
+            max = INT16_MIN;
+            sum = 0;
+            count = 0;
+        }
+    };
+
+    struct Tier {
+        TimeSeriesTier config;
+        // Raw tiers and tiers that only keep the averages store two int16 per word,
+        // other tiers one bucket per two words. Layout is [channel][bucket].
+        uint32_t *buffer;
+        bool averages_only;
+        size_t head;
+        size_t used;
+        uint32_t closed;
+        std::vector<OpenBucket> open;
+
+        uint32_t next_close;
+        // Set if the bucket boundaries are aligned to wall-clock time.
+        bool aligned;
+        // Start of the newest closed bucket in minutes since the epoch. Only valid if aligned.
+        uint32_t newest_start_minute;
+        // Number of the newest closed buckets not yet written to flash.
+        size_t unsaved;
+    };
+
+    void downsample_min_max(size_t tier, size_t channel, size_t first, size_t end, size_t target_points,
+                            std::function<void(size_t offset, int16_t value)> &cb);
+    void downsample_lttb(size_t tier, size_t channel, size_t first, size_t end, size_t target_points,
+                         std::function<void(size_t offset, int16_t value)> &cb);
+
+    void tick();
+    void align_to_clock(Tier &tier, uint32_t now_s);
+    void close_buckets(Tier &tier);
+
+    String tier_filename(size_t tier_idx, int file_idx);
+    void restore_tier(size_t tier_idx);
+    void restore_file(size_t tier_idx, int file_idx);
+    void flush_tier(size_t tier_idx);
+    void write_bucket(Tier &tier, size_t channel, size_t idx, const TimeSeriesBucket &bucket);
+    void read_bucket(Tier &tier, size_t channel, size_t idx, TimeSeriesBucket *out);
+
+    size_t channels = 0;
+    std::vector<Tier> tiers;
+
+    const char *persist_name = nullptr;
+    bool clock_was_synced = false;
+};
@@ -37,6 +37,7 @@
 #include "build.h"
 
 #include <arpa/inet.h>
+#include <memory>
 
 extern EventLog logger;
 
@@ -694,6 +695,29 @@ void remove_directory(const char *path)
     ::rmdir((String("/spiffs/") + path).c_str());
 }
 
+bool truncate_file(const String &path, size_t size)
+{
+    // Arduino's File has no truncate.
+    auto buf = std::unique_ptr<uint8_t[]>(new uint8_t[size]);
+    if (buf == nullptr)
+        return false;
+
+    {
+        File f = LittleFS.open(path);
+        if (f.read(buf.get(), size) != size)
+            return false;
+    }
+
+    String tmp_path = path + ".tmp";
+    {
+        File f = LittleFS.open(tmp_path, "w");
+        if (f.write(buf.get(), size) != size)
+            return false;
+    }
+
+    return LittleFS.rename(tmp_path, path);
+}
+
 
 bool is_in_subnet(IPAddress ip, IPAddress subnet, IPAddress to_check) {
     return (((uint32_t)ip) & ((uint32_t)subnet)) == (((uint32_t)to_check) & ((uint32_t)subnet));
@@ -743,3 +767,38 @@ uint16_t internet_checksum(const uint8_t* data, size_t length) {
     checksum = ~checksum;
     return checksum;
 }
+
+uint32_t zigzag_encode(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+int32_t zigzag_decode(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+size_t varint_encode(uint32_t value, char *buf)
+{
+    size_t len = 0;
+    do {
+        uint8_t b = value & 0x7F;
+        value >>= 7;
+        buf[len++] = (char)(value != 0 ? (b | 0x80) : b);
+    } while (value != 0);
+    return len;
+}
+
+bool varint_decode(const uint8_t *buf, size_t len, size_t *pos, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (int shift = 0; shift < 35 && *pos < len; shift += 7) {
+        uint8_t b = buf[(*pos)++];
+        result |= (uint32_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
@@ -54,6 +54,10 @@ bool for_file_in(const char *dir, bool (*callback)(File *open_file), bool skip_d
 
 void remove_directory(const char *path);
 
+// Replaces the file with its first size bytes. The remainder is copied
+// to path + ".tmp" first, which is then renamed.
+bool truncate_file(const String &path, size_t size);
+
 bool is_in_subnet(IPAddress ip, IPAddress subnet, IPAddress to_check);
 bool is_valid_subnet_mask(IPAddress subnet);
 
@@ -61,6 +65,14 @@ void led_blink(int8_t led_pin, int interval, int blinks_per_interval, int off_ti
 
 uint16_t internet_checksum(const uint8_t* data, size_t length);
 
+uint32_t zigzag_encode(int32_t value);
+int32_t zigzag_decode(uint32_t value);
+
+// Unsigned LEB128. buf needs space for 5 bytes. Returns the number of bytes written.
+size_t varint_encode(uint32_t value, char *buf);
+// Reads one varint starting at *pos and advances *pos. Returns false if buf ends before the varint.
+bool varint_decode(const uint8_t *buf, size_t len, size_t *pos, uint32_t *value);
+
 class LogSilencer
 {
 public:
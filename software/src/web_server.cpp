@@ -364,6 +364,56 @@ WebServerRequestReturnProtect WebServerRequest::endChunkedResponse()
     return WebServerRequestReturnProtect{};
 }
 
+void BufferedChunkWriter::write(const char *data, size_t len)
+{
+    while (len > 0) {
+        if (buf_used == sizeof(buf))
+            flush();
+
+        size_t to_copy = MIN(len, sizeof(buf) - buf_used);
+        memcpy(buf + buf_used, data, to_copy);
+        buf_used += to_copy;
+        data += to_copy;
+        len -= to_copy;
+    }
+}
+
+void BufferedChunkWriter::printf(const char *fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    int written = vsnprintf(buf + buf_used, sizeof(buf) - buf_used, fmt, args);
+    va_end(args);
+
+    if (written < 0)
+        return;
+
+    if ((size_t)written < sizeof(buf) - buf_used) {
+        buf_used += written;
+        return;
+    }
+
+    // Did not fit: Send what we have and format again into the empty buffer.
+    flush();
+
+    va_start(args, fmt);
+    written = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (written > 0)
+        buf_used = MIN((size_t)written, sizeof(buf) - 1);
+}
+
+void BufferedChunkWriter::flush()
+{
+    if (buf_used == 0)
+        return;
+
+    request.sendChunk(buf, buf_used);
+    buf_used = 0;
+}
+
 void WebServerRequest::addResponseHeader(const char *field, const char *value)
 {
     auto result = httpd_resp_set_hdr(req, field, value);
@@ -398,6 +448,28 @@ String WebServerRequest::header(const char *header_name)
     return result;
 }
 
+String WebServerRequest::queryParam(const char *param_name)
+{
+    auto query_len = httpd_req_get_url_query_len(req) + 1;
+    if (query_len == 1)
+        return String("");
+
+    std::unique_ptr<char[]> query{new char[query_len]};
+    if (httpd_req_get_url_query_str(req, query.get(), query_len) != ESP_OK) {
+        return String("");
+    }
+
+    // A parameter value can't be longer than the whole query string.
+    StringWithSettableLength result;
+    result.reserve(query_len);
+    char *buf = result.begin();
+    if (httpd_query_key_value(query.get(), param_name, buf, query_len) != ESP_OK) {
+        return String("");
+    }
+    result.setLength(strlen(buf));
+    return result;
+}
+
 size_t WebServerRequest::contentLength()
 {
     return req->content_len;
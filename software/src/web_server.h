@@ -51,6 +51,8 @@ public:
 
     String header(const char *header_name);
 
+    String queryParam(const char *param_name);
+
     size_t contentLength();
 
     char *receive();
@@ -90,6 +92,25 @@ private:
     httpd_req_t *req;
 };
 
+// Collects small writes into a fixed buffer and sends them as chunks
+// of a chunked response. Call flush() before endChunkedResponse().
+class BufferedChunkWriter
+{
+public:
+    BufferedChunkWriter(WebServerRequest &request) : request(request) {}
+
+    void write(const char *data, size_t len);
+
+    void printf(const char *fmt, ...) __attribute__((__format__(__printf__, 2, 3)));
+
+    void flush();
+
+private:
+    WebServerRequest &request;
+    char buf[512];
+    size_t buf_used = 0;
+};
+
 using wshCallback = std::function<WebServerRequestReturnProtect(WebServerRequest)>;
 using wshUploadCallback = std::function<bool(WebServerRequest request, String filename, size_t index, uint8_t *data, size_t len, bool final)>;
 
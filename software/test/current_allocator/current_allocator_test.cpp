@@ -0,0 +1,422 @@
+/* esp32-firmware
+ * Copyright (C) 2020-2021 Erik Fleckstein <erik@tinkerforge.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+// Host test of the charge manager's current allocation. Not part of the firmware build.
+// Checks allocate_current against fixed inputs and expected outputs and replays the distributions
+// recorded with cm_sim.py --record, then measures its run time.
+//
+// Build and run from this directory:
+//     g++ -std=gnu++11 -O2 -Wall -I../../src/modules/charge_manager -o current_allocator_test current_allocator_test.cpp ../../src/modules/charge_manager/current_allocator.cpp
+//     ./current_allocator_test
+//
+// Exits with 1 if any step does not match. Pass --bench-only to skip the checks.
+
+#include "current_allocator.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+struct Charger {
+    uint8_t phases;
+    uint8_t distribution;
+    uint16_t supported_current;
+    bool is_charging;
+    bool wants_to_charge;
+    bool wants_to_charge_low_priority;
+    bool link_degraded;
+    uint16_t reserved_current;
+};
+
+// One call of allocate_current. The allocated current of the previous step is kept.
+struct Step {
+    uint32_t available_current;
+    bool may_unthrottle;
+    std::vector<Charger> chargers;
+
+    std::vector<uint16_t> expected_target;
+    std::vector<uint16_t> expected_allocated;
+    CurrentAllocatorResult expected_result;
+};
+
+struct Scenario {
+    const char *name;
+    uint16_t minimum_current;
+    uint16_t unthrottle_hysteresis;
+    std::vector<uint32_t> distribution_max_current;
+    // Allocated current before the first step.
+    std::vector<uint16_t> allocated_current;
+    std::vector<Step> steps;
+};
+
+#define ALL CURRENT_ALLOCATOR_ALL_PHASES
+#define NONE CURRENT_ALLOCATOR_NO_DISTRIBUTION
+#define NOT_THROTTLED CurrentAllocatorResult::NotThrottled
+#define THROTTLED_IDLE CurrentAllocatorResult::ThrottledIdle
+#define THROTTLED_CHARGING CurrentAllocatorResult::ThrottledCharging
+
+// phases, distribution, supported current, is_charging, wants_to_charge, low priority, link degraded, reserved current
+#define CHARGING(supported) Charger{ALL, NONE, supported, true, false, false, false, 0}
+#define WAITING(supported) Charger{ALL, NONE, supported, false, true, false, false, 0}
+#define IDLE(supported) Charger{ALL, NONE, supported, false, false, false, false, 0}
+
+static const std::vector<Scenario> scenarios = {
+    {"equal shares", 6000, 0, {}, {0, 0},
+        {{32000, true, {CHARGING(32000), CHARGING(32000)}, {16000, 16000}, {16000, 16000}, NOT_THROTTLED}}},
+
+    {"unused current goes to the following chargers", 6000, 0, {}, {0, 0, 0},
+        {{40000, true, {CHARGING(10000), CHARGING(32000), CHARGING(32000)}, {10000, 15000, 15000}, {10000, 15000, 15000}, NOT_THROTTLED}}},
+
+    {"chargers that don't fit are blocked", 6000, 0, {}, {0, 0},
+        {{10000, true, {WAITING(32000), WAITING(32000)}, {10000, 0}, {10000, 0}, NOT_THROTTLED}}},
+
+    {"minimum current not supported", 6000, 0, {}, {0, 0},
+        {{32000, true, {WAITING(5000), WAITING(32000)}, {0, 32000}, {0, 32000}, NOT_THROTTLED}}},
+
+    // Other chargers are unthrottled as soon as the idle charger reports its lower limit.
+    {"idle chargers get nothing", 6000, 0, {}, {16000, 0},
+        {{32000, true, {IDLE(32000), CHARGING(32000)}, {0, 32000}, {0, 0}, THROTTLED_IDLE},
+         {32000, true, {IDLE(32000), CHARGING(32000)}, {0, 32000}, {0, 32000}, NOT_THROTTLED}}},
+
+    {"throttle first, unthrottle in the next step", 6000, 0, {}, {16000, 16000, 0},
+        {{32000, true, {CHARGING(32000), CHARGING(32000), WAITING(32000)}, {10666, 10667, 10667}, {10666, 10667, 0}, THROTTLED_CHARGING},
+         {32000, true, {CHARGING(32000), CHARGING(32000), WAITING(32000)}, {10666, 10667, 10667}, {10666, 10667, 10667}, NOT_THROTTLED}}},
+
+    {"waiting for throttled chargers", 6000, 0, {}, {10000, 0},
+        {{32000, false, {CHARGING(32000), WAITING(32000)}, {16000, 16000}, {10000, 0}, NOT_THROTTLED}}},
+
+    {"unthrottle hysteresis", 6000, 500, {}, {15800, 0},
+        {{32000, true, {CHARGING(16000), WAITING(32000)}, {16000, 16000}, {15800, 16000}, NOT_THROTTLED}}},
+
+    {"single phase chargers on different phases", 6000, 0, {}, {0, 0, 0},
+        {{16000, true, {Charger{1, NONE, 32000, true, false, false, false, 0},
+                        Charger{2, NONE, 32000, true, false, false, false, 0},
+                        Charger{4, NONE, 32000, true, false, false, false, 0}},
+          {16000, 16000, 16000}, {16000, 16000, 16000}, NOT_THROTTLED}}},
+
+    {"single and three phase chargers", 6000, 0, {}, {0, 0},
+        {{20000, true, {Charger{1, NONE, 32000, true, false, false, false, 0}, CHARGING(32000)},
+          {10000, 10000}, {10000, 10000}, NOT_THROTTLED}}},
+
+    {"sub-distribution", 6000, 0, {12000}, {0, 0, 0},
+        {{32000, true, {Charger{ALL, 0, 32000, true, false, false, false, 0},
+                        Charger{ALL, 0, 32000, true, false, false, false, 0},
+                        CHARGING(32000)},
+          {6000, 6000, 20000}, {6000, 6000, 20000}, NOT_THROTTLED}}},
+
+    {"full sub-distribution blocks only its chargers", 6000, 0, {8000}, {0, 0, 0},
+        {{32000, true, {Charger{ALL, 0, 32000, false, true, false, false, 0},
+                        Charger{ALL, 0, 32000, false, true, false, false, 0},
+                        WAITING(32000)},
+          {8000, 0, 24000}, {8000, 0, 24000}, NOT_THROTTLED}}},
+
+    {"low priority chargers are woken up with the current left", 6000, 0, {}, {0, 0},
+        {{20000, true, {CHARGING(10000), Charger{ALL, NONE, 32000, false, false, true, false, 0}},
+          {10000, 6000}, {10000, 6000}, NOT_THROTTLED}}},
+
+    {"degraded links keep their current", 6000, 0, {}, {16000, 0},
+        {{20000, true, {Charger{ALL, NONE, 32000, true, false, false, true, 0}, WAITING(32000)},
+          {16000, 0}, {16000, 0}, NOT_THROTTLED}}},
+
+    {"reserved current that exceeds the limit blocks all chargers", 6000, 0, {}, {16000, 10000},
+        {{20000, true, {Charger{ALL, NONE, 32000, true, false, false, true, 24000}, CHARGING(32000)},
+          {0, 0}, {0, 0}, THROTTLED_CHARGING}}},
+};
+
+template <typename T>
+static bool equal_currents(const T &actual, const std::vector<uint16_t> &expected)
+{
+    for (size_t i = 0; i < expected.size(); ++i)
+        if (actual[i] != expected[i])
+            return false;
+    return true;
+}
+
+template <typename T>
+static void print_currents(const char *label, const T &values, size_t count)
+{
+    printf("      %s:", label);
+    for (size_t i = 0; i < count; ++i)
+        printf(" %u", values[i]);
+    printf("\n");
+}
+
+static void print_trace(const CurrentAllocatorConfig *cfg, const CurrentAllocatorTrace *trace)
+{
+    char line[256];
+    for (uint32_t i = 0; i < trace->written && i < trace->capacity; ++i) {
+        current_allocator_render_trace_entry(cfg, &trace->entries[i], line, sizeof(line));
+        printf("      %s\n", line);
+    }
+}
+
+static bool run_scenario(const Scenario &s)
+{
+    size_t charger_count = s.allocated_current.size();
+
+    CurrentAllocatorState state;
+    current_allocator_init(&state, charger_count, s.distribution_max_current.size());
+    for (size_t i = 0; i < charger_count; ++i)
+        state.allocated_current[i] = s.allocated_current[i];
+
+    std::vector<uint8_t> phases(charger_count);
+    std::vector<uint8_t> distribution(charger_count);
+    std::vector<const char *> names(charger_count, "charger");
+    std::vector<const char *> distribution_names(s.distribution_max_current.size(), "distribution");
+
+    CurrentAllocatorTraceEntry entries[256];
+    CurrentAllocatorTrace trace{entries, sizeof(entries) / sizeof(entries[0]), 0, true};
+
+    bool ok = true;
+    for (size_t step_idx = 0; step_idx < s.steps.size(); ++step_idx) {
+        const Step &step = s.steps[step_idx];
+
+        for (size_t i = 0; i < charger_count; ++i) {
+            const Charger &c = step.chargers[i];
+            phases[i] = c.phases;
+            distribution[i] = c.distribution;
+            state.supported_current[i] = c.supported_current;
+            state.allowed_current[i] = state.allocated_current[i];
+            state.is_charging[i] = c.is_charging;
+            state.wants_to_charge[i] = c.wants_to_charge;
+            state.wants_to_charge_low_priority[i] = c.wants_to_charge_low_priority;
+            state.link_degraded[i] = c.link_degraded;
+            state.reserved_current[i] = c.reserved_current;
+        }
+
+        CurrentAllocatorConfig cfg{s.minimum_current, s.unthrottle_hysteresis, charger_count,
+                                   phases.data(), distribution.data(),
+                                   s.distribution_max_current.size(), s.distribution_max_current.data(),
+                                   names.data(), names.data(), distribution_names.data()};
+
+        trace.written = 0;
+        CurrentAllocatorResult result = allocate_current(&cfg, step.available_current, step.may_unthrottle, &state, &trace);
+
+        if (equal_currents(state.target_current, step.expected_target) && equal_currents(state.allocated_current, step.expected_allocated) && result == step.expected_result)
+            continue;
+
+        ok = false;
+        printf("FAIL %s, step %zu\n", s.name, step_idx);
+        print_currents("expected target   ", step.expected_target, charger_count);
+        print_currents("actual target     ", state.target_current, charger_count);
+        print_currents("expected allocated", step.expected_allocated, charger_count);
+        print_currents("actual allocated  ", state.allocated_current, charger_count);
+        printf("      result: expected %d, actual %d\n", (int)step.expected_result, (int)result);
+        print_trace(&cfg, &trace);
+    }
+
+    return ok;
+}
+
+// Distributions recorded with cm_sim.py --record. Paths are relative to this directory.
+// Unlike the scenarios above, these contain the allowed currents and delays of (simulated) chargers.
+static const char *const recordings[] = {
+    "recordings/cm_sim.txt",
+};
+
+// Whitespace separated numbers. Lines starting with # are comments.
+static bool read_numbers(const char *path, std::vector<long> *numbers)
+{
+    FILE *f = fopen(path, "r");
+    if (f == nullptr)
+        return false;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != nullptr) {
+        if (line[0] == '#')
+            continue;
+
+        char *pos = line;
+        char *end;
+        for (long n = strtol(pos, &end, 10); end != pos; n = strtol(pos, &end, 10)) {
+            numbers->push_back(n);
+            pos = end;
+        }
+    }
+
+    fclose(f);
+    return true;
+}
+
+// Format:
+//     charger count, minimum current, unthrottle hysteresis, sub-distribution count, their maximum currents
+//     per charger: phases, sub-distribution
+//     per distribution: available current, may_unthrottle, result
+//         per charger: supported current, allowed current, is_charging, wants_to_charge, low priority, link degraded, reserved current, allocated current before, expected target, expected allocated current
+static bool run_recording(const char *path)
+{
+    std::vector<long> n;
+    if (!read_numbers(path, &n) || n.size() < 2) {
+        printf("FAIL %s: can't read recording\n", path);
+        return false;
+    }
+
+    size_t pos = 0;
+    size_t charger_count = n[pos++];
+    uint16_t minimum_current = n[pos++];
+    uint16_t unthrottle_hysteresis = n[pos++];
+    size_t distribution_count = n[pos++];
+    std::vector<uint32_t> distribution_max_current;
+    for (size_t i = 0; i < distribution_count; ++i)
+        distribution_max_current.push_back(n[pos++]);
+
+    std::vector<uint8_t> phases(charger_count);
+    std::vector<uint8_t> distribution(charger_count);
+    for (size_t i = 0; i < charger_count; ++i) {
+        phases[i] = n[pos++];
+        distribution[i] = n[pos++];
+    }
+
+    std::vector<const char *> names(charger_count, "charger");
+    std::vector<const char *> distribution_names(distribution_count, "distribution");
+    CurrentAllocatorConfig cfg{minimum_current, unthrottle_hysteresis, charger_count,
+                               phases.data(), distribution.data(),
+                               distribution_count, distribution_max_current.data(),
+                               names.data(), names.data(), distribution_names.data()};
+
+    CurrentAllocatorState state;
+    current_allocator_init(&state, charger_count, distribution_count);
+
+    CurrentAllocatorTraceEntry entries[1024];
+    CurrentAllocatorTrace trace{entries, sizeof(entries) / sizeof(entries[0]), 0, true};
+
+    std::vector<uint16_t> expected_target(charger_count);
+    std::vector<uint16_t> expected_allocated(charger_count);
+
+    size_t step_idx = 0;
+    for (; pos + 3 + charger_count * 10 <= n.size(); ++step_idx) {
+        uint32_t available_current = n[pos++];
+        bool may_unthrottle = n[pos++] != 0;
+        CurrentAllocatorResult expected_result = (CurrentAllocatorResult)n[pos++];
+
+        for (size_t i = 0; i < charger_count; ++i) {
+            state.supported_current[i] = n[pos++];
+            state.allowed_current[i] = n[pos++];
+            state.is_charging[i] = n[pos++] != 0;
+            state.wants_to_charge[i] = n[pos++] != 0;
+            state.wants_to_charge_low_priority[i] = n[pos++] != 0;
+            state.link_degraded[i] = n[pos++] != 0;
+            state.reserved_current[i] = n[pos++];
+            state.allocated_current[i] = n[pos++];
+            expected_target[i] = n[pos++];
+            expected_allocated[i] = n[pos++];
+        }
+
+        trace.written = 0;
+        CurrentAllocatorResult result = allocate_current(&cfg, available_current, may_unthrottle, &state, &trace);
+
+        if (equal_currents(state.target_current, expected_target) && equal_currents(state.allocated_current, expected_allocated) && result == expected_result)
+            continue;
+
+        printf("FAIL %s, distribution %zu\n", path, step_idx);
+        print_currents("expected target   ", expected_target, charger_count);
+        print_currents("actual target     ", state.target_current, charger_count);
+        print_currents("expected allocated", expected_allocated, charger_count);
+        print_currents("actual allocated  ", state.allocated_current, charger_count);
+        printf("      result: expected %d, actual %d\n", (int)expected_result, (int)result);
+        print_trace(&cfg, &trace);
+        // The following distributions depend on this one.
+        return false;
+    }
+
+    if (pos != n.size()) {
+        printf("FAIL %s: %zu numbers left after %zu distributions\n", path, n.size() - pos, step_idx);
+        return false;
+    }
+
+    printf("%s: %zu distributions\n", path, step_idx);
+    return true;
+}
+
+// 64 chargers, a third of them single phase, spread over the site and four sub-distributions.
+static void benchmark()
+{
+    const size_t charger_count = 64;
+    const size_t iterations = 100000;
+    const uint32_t distribution_max_current[] = {63000, 63000, 32000, 32000};
+    const size_t distribution_count = sizeof(distribution_max_current) / sizeof(distribution_max_current[0]);
+
+    CurrentAllocatorState state;
+    current_allocator_init(&state, charger_count, distribution_count);
+
+    std::vector<uint8_t> phases(charger_count);
+    std::vector<uint8_t> distribution(charger_count);
+    std::vector<const char *> names(charger_count, "charger");
+    std::vector<const char *> distribution_names(distribution_count, "distribution");
+
+    for (size_t i = 0; i < charger_count; ++i) {
+        phases[i] = i % 3 == 0 ? (1 << (i / 3 % 3)) : CURRENT_ALLOCATOR_ALL_PHASES;
+        distribution[i] = i % 5 == 4 ? CURRENT_ALLOCATOR_NO_DISTRIBUTION : i % 5;
+        state.supported_current[i] = i % 4 == 0 ? 16000 : 32000;
+        state.is_charging[i] = i % 2 == 0;
+        state.wants_to_charge[i] = i % 2 == 1;
+    }
+
+    CurrentAllocatorConfig cfg{6000, 500, charger_count,
+                               phases.data(), distribution.data(),
+                               distribution_count, distribution_max_current,
+                               names.data(), names.data(), distribution_names.data()};
+
+    CurrentAllocatorTraceEntry entries[1024];
+    CurrentAllocatorTrace trace{entries, sizeof(entries) / sizeof(entries[0]), 0, false};
+
+    uint32_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        // Alternate the available current, so that every other allocation throttles and unthrottles.
+        allocate_current(&cfg, i % 2 == 0 ? 200000 : 120000, true, &state, &trace);
+        checksum += state.allocated_current[i % charger_count];
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    printf("benchmark: %zu chargers, %.0f ns per allocation (checksum %u)\n", charger_count, ns, checksum);
+
+    trace.enabled = true;
+    auto trace_start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        allocate_current(&cfg, i % 2 == 0 ? 200000 : 120000, true, &state, &trace);
+    auto trace_end = std::chrono::steady_clock::now();
+
+    ns = std::chrono::duration<double, std::nano>(trace_end - trace_start).count() / iterations;
+    printf("benchmark: %zu chargers, %.0f ns per allocation with trace\n", charger_count, ns);
+}
+
+int main(int argc, char **argv)
+{
+    bool bench_only = argc > 1 && strcmp(argv[1], "--bench-only") == 0;
+
+    int failed = 0;
+    if (!bench_only) {
+        for (const Scenario &s : scenarios)
+            if (!run_scenario(s))
+                ++failed;
+
+        printf("%zu scenarios, %d failed\n", scenarios.size(), failed);
+
+        for (const char *path : recordings)
+            if (!run_recording(path))
+                ++failed;
+    }
+
+    benchmark();
+    return failed == 0 ? 0 : 1;
+}
@@ -10,17 +10,25 @@ interface Charger {
     last_sent_config: number,
     allocated_current: number,
     state: number,
-    error: number
+    error: number,
+    rtt_min: number,
+    rtt_avg: number,
+    rtt_p99: number,
+    jitter: number,
+    loss: number,
+    link_degraded: boolean
 }
 
 interface ServCharger {
     hostname: string;
     ip: string;
     display_name: string;
+    version: string;
+    enabled: boolean;
     error: number;
 }
 
-export type scan_result = ServCharger[] | string;
+export type scan_result = ServCharger[];
 
 export interface state {
     state: number,
@@ -43,6 +51,22 @@ export interface config {
     chargers: ChargerConfig[]
 }
 
+interface Distribution {
+    name: string,
+    max_current: number
+}
+
+interface ChargerDistribution {
+    host: string,
+    phases: number,
+    distribution: number
+}
+
+export interface distribution_config {
+    distributions: Distribution[],
+    chargers: ChargerDistribution[]
+}
+
 export interface available_current {
     current: number
 }
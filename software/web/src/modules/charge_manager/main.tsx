@@ -31,11 +31,11 @@ import { FixedScaleAxis } from "chartist";
 
 render(<ConfigPageHeader prefix="charge_manager" title={__("charge_manager.content.charge_manager")} />, $('#charge_manager_header')[0]);
 
-type ServCharger = Exclude<API.getType['charge_manager/scan_result'], string>[0];
+type ServCharger = API.getType['charge_manager/scan_result'][0];
 
 let charger_state_count = -1;
 
-const MAX_CONTROLLED_CHARGERS = 10;
+const MAX_CONTROLLED_CHARGERS = 64; // Keep in sync with MAX_CLIENTS in cm_networking.h
 
 let charger_add_symbol = '<svg xmlns="http://www.w3.org/2000/svg" width="24" height="24" viewBox="0 0 24 24" fill="none" stroke="currentColor" stroke-width="2" stroke-linecap="round" stroke-linejoin="round" class="feather feather-server" style=""><rect x="2" y="14" width="20" height="8" rx="2" ry="2"></rect><line y1="18" y2="18" x1="18" x2="18.01"></line><line x1="19" x2="19" y1="3" y2="9"></line><line x1="22" x2="16" y1="6" y2="6"></line></svg>'
 let charger_delete_symbol = '<svg xmlns="http://www.w3.org/2000/svg" width="24" height="24" viewBox="0 0 24 24" fill="none" stroke="currentColor" stroke-width="2" stroke-linecap="round" stroke-linejoin="round" class="feather feather-server mr-2" style=""><rect x="2" y="14" width="20" height="8" rx="2" ry="2"></rect><line y1="18" y2="18" x1="18" x2="18.01"></line><line x1="17" x2="22" y1="4" y2="9"></line><line x1="22" x2="17" y1="4" y2="9"></line></svg>'
@@ -103,6 +103,12 @@ function update_charge_manager_state() {
 
         if (last_update >= 10)
             status_text += "; " + __("charge_manager.script.last_update_prefix") + util.format_timespan(last_update) + (__("charge_manager.script.last_update_suffix"));
+        else if (s.link_degraded)
+            status_text += "; " + __("charge_manager.script.link_degraded");
+
+        // 65535 means not measured yet.
+        if (s.rtt_avg != 65535)
+            status_text += "; " + s.rtt_avg + " " + __("charge_manager.script.round_trip_time") + ", " + util.toLocaleFixed(s.loss / 10.0, 1) + " " + __("charge_manager.script.loss");
         $(`#charge_manager_status_charger_${i}_details`).text(status_text);
     }
 
@@ -124,7 +130,8 @@ function update_available_current(current: number = API.get('charge_manager/avai
     }
 }
 
-function insert_local_host(config: ChargeManagerConfig = API.get('charge_manager/config'))
+function insert_local_host(config: ChargeManagerConfig = API.get('charge_manager/config'),
+                           distribution_config: DistributionConfig = API.get('charge_manager/distribution_config'))
 {
     let name = API.get("info/display_name");
 
@@ -145,11 +152,13 @@ function insert_local_host(config: ChargeManagerConfig = API.get('charge_manager
             name: name.display_name,
         }
         config.chargers.unshift(c);
+        distribution_config.chargers.unshift({host: "127.0.0.1", phases: ALL_PHASES, distribution: -1});
     }
-    update_charge_manager_config(config, true);
+    update_charge_manager_config(config, true, distribution_config);
 }
 
-function update_charge_manager_config(config: ChargeManagerConfig = API.get('charge_manager/config'), force: boolean) {
+function update_charge_manager_config(config: ChargeManagerConfig = API.get('charge_manager/config'), force: boolean,
+                                      distribution_config: DistributionConfig = API.get('charge_manager/distribution_config')) {
     $('#charge_manager_status_available_current').prop("max", config.maximum_available_current / 1000.0);
     $("#charge_manager_status_available_current_maximum").on("click", () => set_available_current(config.default_available_current));
     $('#charge_manager_status_available_current_maximum').html(util.toLocaleFixed(config.default_available_current / 1000.0, 0) + " A");
@@ -189,6 +198,22 @@ function update_charge_manager_config(config: ChargeManagerConfig = API.get('cha
                                 <label class="form-label" for="charge_manager_config_charger_${i}_host">${__("charge_manager.script.host")}</label>
                                 <input type="text" class="form-control" id="charge_manager_config_charger_${i}_host">
                             </div>
+                            <div class="form-group">
+                                <label class="form-label" for="charge_manager_config_charger_${i}_phases">${__("charge_manager.script.phases")}</label>
+                                <select class="custom-select" id="charge_manager_config_charger_${i}_phases">
+                                    <option value="7">${__("charge_manager.script.phases_all")}</option>
+                                    <option value="1">${__("charge_manager.script.phases_l1")}</option>
+                                    <option value="2">${__("charge_manager.script.phases_l2")}</option>
+                                    <option value="4">${__("charge_manager.script.phases_l3")}</option>
+                                </select>
+                            </div>
+                            <div class="form-group">
+                                <label class="form-label" for="charge_manager_config_charger_${i}_distribution">${__("charge_manager.script.distribution")}</label>
+                                <select class="custom-select" id="charge_manager_config_charger_${i}_distribution">
+                                    <option value="-1">${__("charge_manager.script.distribution_site")}</option>
+                                    ${distribution_config.distributions.map((d, d_idx) => `<option value="${d_idx}">${d.name}</option>`).join("")}
+                                </select>
+                            </div>
                         </div>
                     </div>
                 </div>`;
@@ -213,7 +238,7 @@ function update_charge_manager_config(config: ChargeManagerConfig = API.get('cha
         for (let i = 0; i < config.chargers.length; i++) {
             $(`#charge_manager_content_${i}_remove`).on("click", () => {
                 $('#charge_manager_config_save_button').prop("disabled", false);
-                update_charge_manager_config(collect_charge_manager_config(null, i), true);
+                update_charge_manager_config(collect_charge_manager_config(null, i), true, collect_distribution_config(null, i));
             });
         }
     }
@@ -225,6 +250,10 @@ function update_charge_manager_config(config: ChargeManagerConfig = API.get('cha
         const s = config.chargers[i];
         $(`#charge_manager_config_charger_${i}_name`).val(s.name);
         $(`#charge_manager_config_charger_${i}_host`).val(s.host);
+
+        const d = find_charger_distribution(distribution_config, s.host, i);
+        $(`#charge_manager_config_charger_${i}_phases`).val(d.phases.toString());
+        $(`#charge_manager_config_charger_${i}_distribution`).val(d.distribution.toString());
         if (s.host == "127.0.0.1")
         {
             $(`#charge_manager_content_${i}_remove`).css("visibility","hidden");
@@ -235,6 +264,40 @@ function update_charge_manager_config(config: ChargeManagerConfig = API.get('cha
 
 type ChargeManagerConfig = API.getType['charge_manager/config'];
 type ChargerConfig = ChargeManagerConfig["chargers"][0];
+type DistributionConfig = API.getType['charge_manager/distribution_config'];
+type ChargerDistributionConfig = DistributionConfig["chargers"][0];
+
+const ALL_PHASES = 7;
+
+// The chargers of the distribution config are matched with the chargers of the charge manager config by their host.
+// Entries without a host are matched by their index, like the firmware does.
+// Chargers without an entry are connected to the site directly with all phases.
+function find_charger_distribution(distribution_config: DistributionConfig, host: string, idx: number) : ChargerDistributionConfig {
+    let d = distribution_config.chargers.find(c => c.host == host);
+    if (d === undefined && idx < distribution_config.chargers.length && distribution_config.chargers[idx].host == "")
+        d = distribution_config.chargers[idx];
+    return d !== undefined ? d : {host: host, phases: ALL_PHASES, distribution: -1};
+}
+
+function collect_distribution_config(add_charger: string = null, remove_charger: number = null) : DistributionConfig {
+    let chargers: ChargerDistributionConfig[] = [];
+    for (let i = 0; i < charger_config_count; ++i) {
+        if (remove_charger !== null && i == remove_charger)
+            continue;
+        chargers.push({
+            host: $(`#charge_manager_config_charger_${i}_host`).val().toString(),
+            phases: parseInt($(`#charge_manager_config_charger_${i}_phases`).val().toString()),
+            distribution: parseInt($(`#charge_manager_config_charger_${i}_distribution`).val().toString()),
+        });
+    }
+    if (add_charger !== null)
+        chargers.push({host: add_charger, phases: ALL_PHASES, distribution: -1});
+
+    return {
+        distributions: API.get('charge_manager/distribution_config').distributions,
+        chargers: chargers
+    };
+}
 
 function collect_charge_manager_config(new_charger: ChargerConfig = null, remove_charger: number = null) : ChargeManagerConfig {
     let chargers: ChargerConfig[] = [];
@@ -281,6 +344,7 @@ async function save_charge_manager_config() {
     if ($('#charge_manager_mode_dropdown').val() == "1" || $('#charge_manager_mode_dropdown').val() == "2")
         evse_enabled = true;
     await API.save_maybe('evse/management_enabled', {"enabled": evse_enabled}, translate_unchecked("evse.script.save_failed"));
+    await API.save('charge_manager/distribution_config', collect_distribution_config(), __("charge_manager.script.save_failed"));
     await API.save('charge_manager/config', payload, __("charge_manager.script.save_failed"), __("charge_manager.script.reboot_content_changed"))
        .then(() => $('#charge_manager_config_save_button').prop("disabled", true));
 }
@@ -370,21 +434,15 @@ function update_scan_results(data: Readonly<ServCharger[]>)
     })
 }
 
-let scan_timeout: number = null;
 function scan_services()
 {
+    // The charger keeps a table of discovered chargers and rate limits scans itself.
+    // New results are pushed via the event source.
     API.call('charge_manager/scan', {}, __("charge_manager.script.scan_failed"))
         .then(() => {
-            if (scan_timeout != null)
-                window.clearTimeout(scan_timeout);
-
-            scan_timeout = window.setTimeout(function () {
-                scan_timeout = null;
-
-                $.get("/network/scan_result").done(function (data: ServCharger[]) {
-                    update_scan_results(data);
-                    });
-            }, 3000);
+            $.get("/charge_manager/scan_result").done(function (data: ServCharger[]) {
+                update_scan_results(data);
+            });
         })
 }
 
@@ -456,12 +514,13 @@ export function init() {
         $('#charge_manager_add_charger_modal').modal('hide');
         $('#charge_manager_config_save_button').prop("disabled", false);
 
+        let new_host = $(`#charge_manager_config_charger_new_host`).val().toString();
         let new_config = collect_charge_manager_config({
-            host: $(`#charge_manager_config_charger_new_host`).val().toString(),
+            host: new_host,
             name: $(`#charge_manager_config_charger_new_name`).val().toString(),
         }, null);
 
-        update_charge_manager_config(new_config, true);
+        update_charge_manager_config(new_config, true, collect_distribution_config(new_host, null));
     });
 
     $("#charge_manager_status_available_current_minimum").on("click", () => set_available_current(0));
@@ -501,16 +560,13 @@ export function add_event_listeners(source: API.APIEventTarget) {
         show_cfg_body();
         update_charge_manager_config(undefined, false);
     });
+    source.addEventListener('charge_manager/distribution_config', () => update_charge_manager_config(undefined, false));
     source.addEventListener('charge_manager/available_current', () => update_available_current());
     source.addEventListener('evse/management_enabled' as any,() => {
         set_dropdown();
     });
     source.addEventListener('charge_manager/scan_result', (e) => {
-        window.clearTimeout(scan_timeout);
-        scan_timeout = null;
-
-        if (typeof e.data !== "string")
-            update_scan_results(e.data);
+        update_scan_results(e.data);
     }, false);
 }
 
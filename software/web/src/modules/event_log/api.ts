@@ -0,0 +1,14 @@
+export interface message {
+    start: number,
+    next: number,
+    text: string
+}
+
+interface TagLevel {
+    tag: string,
+    level: number
+}
+
+export interface levels {
+    tags: TagLevel[]
+}
@@ -28,10 +28,34 @@ import { PageHeader } from "../../ts/components/page_header";
 
 render(<PageHeader title={__("event_log.content.event_log")} />, $('#event_log_header')[0]);
 
+// Byte cursor after the last line shown. Used to only fetch new lines.
+let event_log_cursor: number = null;
+
+function set_event_log(text: string, start: number, next: number) {
+    let content = $('#event_log_content');
+
+    if (event_log_cursor != null && start == event_log_cursor) {
+        if (text.length > 0)
+            content.val(content.val() + text);
+    } else {
+        // First load, lines were dropped in the meantime or the ESP rebooted: replace everything.
+        content.val(text);
+    }
+
+    event_log_cursor = next;
+}
+
 function load_event_log() {
-    $.get("/event_log")
-               .done((result) => {
-                   $('#event_log_content').val(result);
+    $.get({url: "/event_log" + (event_log_cursor == null ? "" : "?since=" + event_log_cursor), dataType: "text"})
+               .done((result, status, xhr) => {
+                   let start = parseInt(xhr.getResponseHeader("X-Event-Log-Start"));
+                   let next = parseInt(xhr.getResponseHeader("X-Event-Log-Cursor"));
+                   if (isNaN(start) || isNaN(next)) {
+                       event_log_cursor = null;
+                       $('#event_log_content').val(result);
+                   } else {
+                       set_event_log(result, start, next);
+                   }
                    util.remove_alert("event_log_load_failed");
                 })
                .fail((xhr, status, error) => util.add_alert("event_log_load_failed", "alert-danger", __("event_log.script.load_event_log_error"), error + ": " + xhr.responseText))
@@ -87,7 +111,14 @@ export function init() {
 }
 
 export function add_event_listeners(source: API.APIEventTarget) {
+    source.addEventListener("event_log/message", (e) => {
+        // Only append pushed lines if they continue the currently shown log.
+        // Otherwise the next poll will resync via /event_log?since=
+        if (event_log_cursor == null || e.data.start != event_log_cursor)
+            return;
 
+        set_event_log(e.data.text, e.data.start, e.data.next);
+    }, false);
 }
 
 export function update_sidebar_state(module_init: any) {
@@ -51,10 +51,78 @@ function update_meter_phases() {
 let graph_update_interval: number = null;
 let status_interval: number = null;
 
+interface MeterHistory {
+    sample_period_ms: number,
+    start_time: number,
+    values: number[]
+}
+
+// See ValueHistoryBinaryHeader in value_history.h for the format.
+function decode_history(buffer: ArrayBuffer): MeterHistory {
+    let view = new DataView(buffer);
+    let has_offsets = (view.getUint8(1) & 0x01) != 0;
+    let sample_count = view.getUint16(2, true);
+    let result: MeterHistory = {
+        sample_period_ms: view.getUint32(4, true),
+        start_time: view.getUint32(8, true),
+        values: []
+    };
+
+    let offset = 12;
+    let read_varint = () => {
+        let value = 0;
+        let shift = 0;
+        let b = 0;
+        do {
+            b = view.getUint8(offset++);
+            value += (b & 0x7F) * Math.pow(2, shift);
+            shift += 7;
+        } while ((b & 0x80) != 0 && offset < buffer.byteLength);
+        return value;
+    };
+
+    let last_value = 0;
+    let samples = 0;
+    while (offset < buffer.byteLength && samples < sample_count) {
+        // Downsampled series skip buckets. Those are left empty.
+        if (has_offsets) {
+            let distance = read_varint();
+            for (let i = samples == 0 ? 0 : 1; i < distance; ++i)
+                result.values.push(null);
+        }
+
+        let token = read_varint();
+
+        if (token % 2 == 1) {
+            for (let i = 0; i < (token - 1) / 2; ++i)
+                result.values.push(null);
+            samples += (token - 1) / 2;
+            continue;
+        }
+
+        let zigzag = token / 2;
+        last_value += zigzag % 2 == 0 ? zigzag / 2 : -(zigzag + 1) / 2;
+        result.values.push(last_value);
+        ++samples;
+    }
+
+    return result;
+}
+
+function get_history(url: string) {
+    return fetch(url)
+        .then(response => {
+            if (!response.ok)
+                throw new Error(response.statusText);
+            return response.arrayBuffer();
+        })
+        .then(decode_history);
+}
+
 function update_live_meter() {
-    $.get("/meter/live").done(function (result) {
-        let values = result["samples"];
-        let sps = result["samples_per_second"];
+    get_history("/meter/live_bin").then(function (result) {
+        let values = result.values;
+        let sps = result.sample_period_ms > 0 ? 1000 / result.sample_period_ms : 0;
         let labels = [];
 
         let now = Date.now();
@@ -82,7 +150,8 @@ function update_live_meter() {
 }
 
 function update_history_meter() {
-    $.get("/meter/history").done(function (values: Number[]) {
+    get_history("/meter/history_bin").then(function (result) {
+        let values = result.values;
         const HISTORY_MINUTE_INTERVAL = 4;
         const VALUE_COUNT = 48 * (60 / HISTORY_MINUTE_INTERVAL);
         const LABEL_COUNT = window.innerWidth < 500 ? 5 : 9;
@@ -96,7 +165,7 @@ function update_history_meter() {
         let labels = [];
 
         let now = Date.now();
-        let start = now - 1000 * 60 * 60 * 48;
+        let start = result.start_time != 0 ? result.start_time * 1000 : now - 1000 * 60 * 60 * 48;
         for(let i = 0; i < values.length + 1; ++i) {
             if (i % VALUES_PER_LABEL == 0) {
                 let d = new Date(start + i * (1000 * 60 * HISTORY_MINUTE_INTERVAL));
@@ -185,7 +254,8 @@ function init_chart() {
 }
 
 function update_status_chart() {
-    $.get("/meter/history").done(function (values: number[]) {
+    get_history("/meter/history_bin").then(function (result) {
+        let values = result.values;
         const HISTORY_MINUTE_INTERVAL = 4;
         const VALUE_COUNT = 48 * (60 / HISTORY_MINUTE_INTERVAL);
         const LABEL_COUNT = 5;
@@ -199,7 +269,7 @@ function update_status_chart() {
         let labels = [];
 
         let now = Date.now();
-        let start = now - 1000 * 60 * 60 * 48;
+        let start = result.start_time != 0 ? result.start_time * 1000 : now - 1000 * 60 * 60 * 48;
         for(let i = 0; i < values.length + 1; ++i) {
             if (i % VALUES_PER_LABEL == 0) {
                 let d = new Date(start + i * (1000 * 60 * HISTORY_MINUTE_INTERVAL));